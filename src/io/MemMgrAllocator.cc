@@ -37,6 +37,9 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #include <algorithm>
 #include <cstdint>
 #include "DecoderPlatform.hh"
@@ -231,6 +234,29 @@ void memmgr_tally_external_bytes(ptrdiff_t bytes) {
     bytes_ever_allocated += bytes;
     bytes_currently_used += bytes;
 }
+bool memmgr_prefer_numa_node(int node) {
+#if defined(USE_MMAP) && defined(__linux__) && defined(SYS_mbind)
+    if (!memmgrs || memmgrs->used_calloc || node < 0) {
+        return false;
+    }
+    enum {
+        MPOL_PREFERRED_ = 1, // values from <linux/mempolicy.h>
+        MPOL_MF_MOVE_ = 1 << 1
+    };
+    const size_t bits_per_word = sizeof(unsigned long) * 8;
+    unsigned long nodemask[1024 / (sizeof(unsigned long) * 8)] = {0};
+    if ((size_t)node >= sizeof(nodemask) * 8) {
+        return false;
+    }
+    nodemask[node / bits_per_word] = 1UL << (node % bits_per_word);
+    return syscall(SYS_mbind, (void*)memmgrs, memmgr_bytes_allocated,
+                   (int)MPOL_PREFERRED_, nodemask, sizeof(nodemask) * 8 + 1,
+                   (unsigned int)MPOL_MF_MOVE_) == 0;
+#else
+    (void)node;
+    return false;
+#endif
+}
 void memmgr_print_stats()
 {
     MemMgrState& memmgr = get_local_memmgr();
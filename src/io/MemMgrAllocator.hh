@@ -64,6 +64,11 @@ SIRIKATA_FUNCTION_EXPORT size_t memmgr_size_allocated();
 SIRIKATA_FUNCTION_EXPORT size_t memmgr_total_size_ever_allocated();
 SIRIKATA_FUNCTION_EXPORT size_t memmgr_size_left();
 SIRIKATA_FUNCTION_EXPORT void memmgr_tally_external_bytes(ptrdiff_t bytes);
+// Ask the kernel to back the arena with pages from the given NUMA node,
+// migrating pages that were already faulted in elsewhere. In a forked child
+// the pages still shared copy-on-write with the parent are not migrated; only
+// the pages the child writes afterwards are copied onto the node.
+SIRIKATA_FUNCTION_EXPORT bool memmgr_prefer_numa_node(int node);
 }
 namespace Sirikata {
 SIRIKATA_FUNCTION_EXPORT void *MemMgrAllocatorMalloc(void *opaque, size_t nmemb, size_t size);
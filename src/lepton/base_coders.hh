@@ -55,6 +55,8 @@ class BaseEncoder {
  public:
     virtual ~BaseEncoder(){}
     virtual void registerWorkers(GenericWorker * workers, unsigned int num_workers) = 0;
+    virtual GenericWorker* getWorker(unsigned int i) = 0;
+    virtual unsigned int getNumWorkers()const = 0;
 
     virtual CodingReturnValue encode_chunk(const UncompressedComponents *input,
                                            IOUtil::FileWriter *,
@@ -19,6 +19,7 @@
 #include "../../dependencies/md5/md5.h"
 #endif
 #include "../../vp8/util/generic_worker.hh"
+#include "../../vp8/util/perf_counters.hh"
 extern int app_main(int argc, char ** argv);
 static const char cb64[]="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 namespace {
@@ -263,7 +264,8 @@ struct TestOptions {
 double do_benchmark(TestOptions test,
                     unsigned char * file,
                     size_t file_size,
-                    const char ** enc_options, const char ** dec_options = NULL) {
+                    const char ** enc_options, const char ** dec_options = NULL,
+                    PerfCounters *counters = NULL) {
     Sirikata::MuxReader::ResizableByteBuffer encoded_file;
     auto file_md5 = do_first_encode(file, file_size, enc_options, &encoded_file);
     g_start_time.store(TimingHarness::get_time_us(true));
@@ -295,6 +297,10 @@ double do_benchmark(TestOptions test,
         dec_options = enc_options;
     }
     std::vector<std::thread *>workers;
+    if (counters) {
+        // started after the reference encode so only the timed codings are counted
+        counters->reset_and_start();
+    }
     double start = TimingHarness::get_time_us(true);
     for (int b_rep = 0; b_rep < test.barrier_reps; ++b_rep) {
         if (test.parallel_encodes) {
@@ -327,6 +333,9 @@ double do_benchmark(TestOptions test,
         }
         workers.resize(0);
     }
+    if (counters) {
+        counters->stop();
+    }
     return (end - start) / 1000000. / test.barrier_reps / test.reps;
 }
 std::string itoas(int number) {
@@ -341,6 +350,60 @@ void print_results(int num_ops, const std::string &name, size_t file_size, doubl
             name.c_str());
     fflush(stdout);
 }
+// 8x8 blocks the frame header of a jpeg declares, padded out to whole mcus
+// the way the coder pads them; 0 if there is no frame header to read
+uint64_t count_jpeg_blocks(const unsigned char *file, size_t file_size) {
+    size_t pos = 2;
+    while (pos + 4 <= file_size && file[pos] == 0xff) {
+        unsigned char marker = file[pos + 1];
+        size_t len = (file[pos + 2] << 8) | file[pos + 3];
+        if (marker == 0xda || marker == 0xd9) {
+            break;
+        }
+        if (marker >= 0xc0 && marker <= 0xc2 && pos + 10 <= file_size) {
+            const unsigned char *sof = file + pos + 4;
+            uint32_t height = (sof[1] << 8) | sof[2];
+            uint32_t width = (sof[3] << 8) | sof[4];
+            uint32_t num_components = sof[5];
+            if (pos + 10 + 3 * num_components > file_size) {
+                return 0;
+            }
+            uint32_t hmax = 1, vmax = 1;
+            for (uint32_t i = 0; i < num_components; ++i) {
+                hmax = std::max(hmax, (uint32_t)sof[7 + 3 * i] >> 4);
+                vmax = std::max(vmax, (uint32_t)sof[7 + 3 * i] & 0xf);
+            }
+            uint64_t mcuh = (width + 8 * hmax - 1) / (8 * hmax);
+            uint64_t mcuv = (height + 8 * vmax - 1) / (8 * vmax);
+            uint64_t num_blocks = 0;
+            for (uint32_t i = 0; i < num_components; ++i) {
+                num_blocks += mcuh * (sof[7 + 3 * i] >> 4) * mcuv * (sof[7 + 3 * i] & 0xf);
+            }
+            return num_blocks;
+        }
+        pos += 2 + len;
+    }
+    return 0;
+}
+void print_perf_counters(int num_ops, const std::string &name, size_t file_size,
+                         uint64_t num_blocks, const PerfCounterValues &values) {
+    for (size_t i = 0; i < values.size(); ++i) {
+        if (num_blocks) {
+            fprintf(stdout, "%15.0f %-15s (%9.3f per block) : %s\n",
+                    values[i] / double(num_ops),
+                    PerfCounters::name((PerfCounter)i),
+                    values[i] / double(num_ops) / num_blocks,
+                    name.c_str());
+        } else {
+            fprintf(stdout, "%15.0f %-15s (%9.1f per KiB) : %s\n",
+                    values[i] / double(num_ops),
+                    PerfCounters::name((PerfCounter)i),
+                    values[i] / double(num_ops) / (file_size / 1024.),
+                    name.c_str());
+        }
+    }
+    fflush(stdout);
+}
 int run_benchmark(char * argv0, unsigned char *file, size_t file_size, int default_reps, int max_concurrency=16) {
     const char* options[] = {argv0, "-", "-verify", NULL};
     const char* options_1way[] = {argv0, "-", "-verify", "-singlethread", NULL};
@@ -378,6 +441,15 @@ int run_benchmark(char * argv0, unsigned char *file, size_t file_size, int defau
     test.parallel_decodes = 1;
     total_time = do_benchmark(test,file, file_size, options_1way);
     print_results(1, "Single threaded decode", file_size, total_time);
+    {
+        // hardware counters include every lepton subprocess spawned while they run
+        PerfCounters counters(true);
+        if (counters.any_available()) {
+            do_benchmark(test, file, file_size, options_1way, NULL, &counters);
+            print_perf_counters(test.reps * test.barrier_reps, "Single threaded decode", file_size,
+                                count_jpeg_blocks(file, file_size), counters.read());
+        }
+    }
 
     uint64_t best_verified_encode_backfill = 0;
     int best_verified_encode_num_threads = 0;
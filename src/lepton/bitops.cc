@@ -38,6 +38,7 @@ reading and writing of arrays
 #include <algorithm>
 #include <assert.h>
 #include "bitops.hh"
+#include "crc32c.hh"
 
 #define BUFFER_SIZE 1024 * 1024
 /* -----------------------------------------------
@@ -359,6 +360,8 @@ bounded_iostream::bounded_iostream(Sirikata::DecoderWriter *w,
     byte_position = 0;
     byte_bound = 0x7FFFFFFF;
     num_bytes_attempted_to_write = 0;
+    checksumming = false;
+    checksum = 0;
     set_bound(0);
 }
 void bounded_iostream::call_size_callback(size_t size) {
@@ -392,6 +395,16 @@ void bounded_iostream::close() {
     flush();
     parent->Close();
 }
+void bounded_iostream::start_checksum() {
+    flush();
+    checksumming = true;
+    checksum = 0;
+}
+uint32_t bounded_iostream::finish_checksum() {
+    flush();
+    checksumming = false;
+    return checksum;
+}
 
 uint32_t bounded_iostream::write_no_buffer(const void *from, size_t bytes_to_write) {
     //return iostream::write(from,tpsize,dtsize);
@@ -401,6 +414,9 @@ uint32_t bounded_iostream::write_no_buffer(const void *from, size_t bytes_to_wri
         size_t real_bytes_to_write = byte_bound - byte_position;
         byte_position += real_bytes_to_write;
         retval = parent->Write(reinterpret_cast<const unsigned char*>(from), real_bytes_to_write);
+        if (checksumming) {
+            checksum = crc32c(checksum, reinterpret_cast<const uint8_t*>(from), retval.first);
+        }
         if (retval.first < real_bytes_to_write) {
             err = retval.second;
             return retval.first;
@@ -411,6 +427,9 @@ uint32_t bounded_iostream::write_no_buffer(const void *from, size_t bytes_to_wri
     retval = parent->Write(reinterpret_cast<const unsigned char*>(from), total);
     unsigned int written = retval.first;
     byte_position += written;
+    if (checksumming) {
+        checksum = crc32c(checksum, reinterpret_cast<const uint8_t*>(from), written);
+    }
     if (written < total ) {
         err = retval.second;
         return written;
@@ -330,6 +330,12 @@ public:
 	int getpos( void ) {
         return cbyte2 - 7 + ((64 - cbit2) >> 3);
     }
+    // continue reading at byte pos of the array, skipping data read elsewhere
+    void skip_to( int pos ) {
+        cbyte2 = pos;
+        cbit2 = 0;
+        buf = 0;
+    }
     uint64_t debug_peek(void) {
         uint64_t retval = 0;
         abitreader tmp(*this);
@@ -473,6 +479,8 @@ class bounded_iostream
     uint32_t num_bytes_attempted_to_write;
     Sirikata::JpegError err;
     std::function<void(Sirikata::DecoderWriter*, size_t)> size_callback;
+    bool checksumming;
+    uint32_t checksum;
     uint32_t write_no_buffer( const void* from, size_t bytes_to_write );
 public:
 	bounded_iostream( Sirikata::DecoderWriter * parent,
@@ -537,4 +545,7 @@ public:
     }
     void flush();
     void close();
+    // the crc32c of the bytes that pass the bound between these two calls
+    void start_checksum();
+    uint32_t finish_checksum();
 };
@@ -0,0 +1,495 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <thread>
+#ifndef USE_SCALAR
+#include <emmintrin.h>
+#endif
+#include "container.hh"
+#include "../vp8/util/memory.hh"
+#ifndef _WIN32
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__APPLE__) || defined(BSD)
+#include <sys/wait.h>
+#else
+#include <wait.h>
+#endif
+#include "jpgcoder.hh"
+#include "../io/MuxReader.hh"
+#include "validation.hh"
+#endif
+
+bool g_container = false;
+unsigned int g_container_jobs = 0;
+
+namespace {
+// the offset of the first 0xFF in data[pos, size), or size
+size_t find_marker_byte(const uint8_t *data, size_t pos, size_t size) {
+#ifndef USE_SCALAR
+    const __m128i ff = _mm_set1_epi8((char)0xFF);
+    for (; pos + 16 <= size; pos += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(data + pos));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, ff));
+        if (mask) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+#endif
+    const void *found = memchr(data + pos, 0xFF, size - pos);
+    return found ? (const uint8_t*)found - data : size;
+}
+
+// lepton only codes huffman jpegs: baseline, extended sequential and progressive
+bool is_huffman_sof(uint8_t type) {
+    return type == 0xC0 || type == 0xC1 || type == 0xC2;
+}
+
+bool is_other_sof(uint8_t type) {
+    return type >= 0xC3 && type <= 0xCF && type != 0xC4 && type != 0xC8 && type != 0xCC;
+}
+
+// one past the EOI of the jpeg whose SOI is at start, or 0 if there is none
+size_t jpeg_end(const uint8_t *data, size_t start, size_t size) {
+    bool seen_sof = false;
+    bool seen_sos = false;
+    size_t pos = start + 2;
+    while (pos + 2 <= size) {
+        if (data[pos] != 0xFF) {
+            return 0;
+        }
+        uint8_t type = data[pos + 1];
+        if (type == 0xFF) {
+            ++pos; // fill byte
+            continue;
+        }
+        if (type == 0xD9) {
+            return seen_sos ? pos + 2 : 0;
+        }
+        if (type < 0xC0 || (type >= 0xD0 && type <= 0xD8) || is_other_sof(type)) {
+            return 0; // no segment starts with these, or lepton could not code it
+        }
+        if (pos + 4 > size) {
+            return 0;
+        }
+        size_t len = (data[pos + 2] << 8) | data[pos + 3];
+        if (len < 2 || pos + 2 + len > size) {
+            return 0;
+        }
+        pos += 2 + len;
+        if (is_huffman_sof(type)) {
+            seen_sof = true;
+        } else if (type == 0xDA) {
+            if (!seen_sof) {
+                return 0;
+            }
+            seen_sos = true;
+            // the coded data runs to the first marker that is neither a
+            // stuffed zero nor a restart marker
+            while (true) {
+                pos = find_marker_byte(data, pos, size);
+                if (pos + 2 > size) {
+                    return 0;
+                }
+                uint8_t next = data[pos + 1];
+                if (next == 0x00 || (next >= 0xD0 && next <= 0xD7)) {
+                    pos += 2;
+                } else if (next == 0xFF) {
+                    ++pos;
+                } else {
+                    break;
+                }
+            }
+        }
+    }
+    return 0;
+}
+}
+
+std::vector<std::pair<size_t, size_t> > find_embedded_jpegs(const uint8_t *data, size_t size) {
+    std::vector<std::pair<size_t, size_t> > retval;
+    size_t pos = 0;
+    while (true) {
+        pos = find_marker_byte(data, pos, size);
+        if (pos + 3 > size) {
+            break;
+        }
+        if (data[pos + 1] == 0xD8 && data[pos + 2] == 0xFF) {
+            size_t end = jpeg_end(data, pos, size);
+            if (end) {
+                retval.push_back(std::pair<size_t, size_t>(pos, end));
+                pos = end;
+                continue;
+            }
+        }
+        ++pos;
+    }
+    return retval;
+}
+
+#ifndef _WIN32
+extern const char** filelist;
+extern int file_cnt;
+extern int file_no;
+extern FILE *msgout;
+extern int jpgfilesize;
+extern int ujgfilesize;
+extern char g_dash[];
+extern unsigned char ujgversion;
+std::string postfix_uniq(const std::string &filename, const char * ext);
+const char *ExitString(ExitCode ec);
+
+namespace {
+// bytes between jpegs go out in lepton files of at most this much input,
+// which keeps the brotli header that holds them within the memory bounds
+enum { GENERIC_PART_SIZE = 4 * 1024 * 1024 };
+
+typedef std::vector<uint8_t> Buffer;
+
+struct Part {
+    size_t start;
+    size_t end;
+    bool is_jpeg;
+    Part(size_t start, size_t end, bool is_jpeg) : start(start), end(end), is_jpeg(is_jpeg) {}
+};
+
+struct RunningPart {
+    pid_t pid;
+    int output;
+    size_t part;
+};
+
+bool write_all(int fd, const uint8_t *data, size_t size) {
+    while (size) {
+        ssize_t sent = write(fd, data, size);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+void add_generic_parts(size_t start, size_t end, std::vector<Part> *parts) {
+    for (size_t pos = start; pos < end; pos += GENERIC_PART_SIZE) {
+        parts->push_back(Part(pos, std::min(end, pos + (size_t)GENERIC_PART_SIZE), false));
+    }
+}
+
+// Starts encoding data[0, size) in a forked child: a jpeg goes through
+// process_file and anything else through generic_compress. The lepton file
+// comes back over the returned pipe, so nothing of a part that fails
+// reaches the output.
+RunningPart start_part(const uint8_t *data, size_t size, bool is_jpeg) {
+    int in_pipe[2] = {-1, -1};
+    int out_pipe[2] = {-1, -1};
+    while ((is_jpeg && pipe(in_pipe) < 0) || pipe(out_pipe) < 0) {
+        if (errno != EINTR) {
+            custom_exit(ExitCode::OS_ERROR);
+        }
+    }
+    fflush(stdout);
+    RunningPart retval;
+    retval.part = 0;
+    retval.pid = fork();
+    if (retval.pid < 0) {
+        custom_exit(ExitCode::OS_ERROR);
+    }
+    if (retval.pid == 0) {
+        while (close(out_pipe[0]) < 0 && errno == EINTR) {}
+        while (dup2(out_pipe[1], 1) < 0 && errno == EINTR) {}
+        while (close(out_pipe[1]) < 0 && errno == EINTR) {}
+        msgout = stderr;
+        g_container = false;
+        if (is_jpeg) {
+            while (close(in_pipe[1]) < 0 && errno == EINTR) {}
+            while (dup2(in_pipe[0], 0) < 0 && errno == EINTR) {}
+            while (close(in_pipe[0]) < 0 && errno == EINTR) {}
+            filelist[file_no] = g_dash;
+            file_cnt = 1;
+            process_file(nullptr, nullptr, 0, false);
+            custom_exit(ExitCode::SUCCESS); // process_file always exits
+        }
+        std::vector<uint8_t> input(data, data + size);
+        Sirikata::MuxReader::ResizableByteBuffer lepton_data;
+        ExitCode exit_code = ExitCode::UNSUPPORTED_JPEG;
+        if (generic_compress(&input, &lepton_data, &exit_code) != ValidationContinuation::ROUNDTRIP_OK) {
+            custom_exit(exit_code == ExitCode::SUCCESS ? ExitCode::UNSUPPORTED_JPEG : exit_code);
+        }
+        if (!write_all(1, lepton_data.data(), lepton_data.size())) {
+            custom_exit(ExitCode::OS_ERROR);
+        }
+        custom_exit(ExitCode::SUCCESS);
+    }
+    while (close(out_pipe[1]) < 0 && errno == EINTR) {}
+    if (is_jpeg) {
+        // the encoder reads all of its input before it writes anything
+        while (close(in_pipe[0]) < 0 && errno == EINTR) {}
+        write_all(in_pipe[1], data, size); // a child that quit early reports why when it is reaped
+        while (close(in_pipe[1]) < 0 && errno == EINTR) {}
+    }
+    retval.output = out_pipe[0];
+    return retval;
+}
+
+// reads what is waiting on the output of a part, returning false at its end
+bool read_part(int fd, Buffer *lepton) {
+    uint8_t buffer[65536];
+    while (true) {
+        ssize_t data_read = read(fd, buffer, sizeof(buffer));
+        if (data_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (data_read <= 0) {
+            return false;
+        }
+        lepton->insert(lepton->end(), buffer, buffer + data_read);
+        return true;
+    }
+}
+
+ExitCode finish_part(const RunningPart &running, const Buffer &lepton) {
+    while (close(running.output) < 0 && errno == EINTR) {}
+    int status = 0;
+    while (waitpid(running.pid, &status, 0) < 0 && errno == EINTR) {}
+    if (!WIFEXITED(status)) {
+        return ExitCode::ASSERTION_FAILURE;
+    }
+    if (WEXITSTATUS(status) == (int)ExitCode::SUCCESS && lepton.empty()) {
+        return ExitCode::SHORT_READ;
+    }
+    return (ExitCode)WEXITSTATUS(status);
+}
+
+void write_generic(int fdout, const uint8_t *data, size_t size, size_t *output_size) {
+    for (size_t pos = 0; pos < size; pos += GENERIC_PART_SIZE) {
+        size_t part_size = std::min(size - pos, (size_t)GENERIC_PART_SIZE);
+        Buffer lepton;
+        RunningPart running = start_part(data + pos, part_size, false);
+        while (read_part(running.output, &lepton)) {
+        }
+        ExitCode exit_code = finish_part(running, lepton);
+        if (exit_code != ExitCode::SUCCESS) {
+            fprintf(stderr, "Unable to store %lu bytes of the container\n", (unsigned long)part_size);
+            custom_exit(exit_code);
+        }
+        if (!write_all(fdout, lepton.data(), lepton.size())) {
+            custom_exit(ExitCode::OS_ERROR);
+        }
+        *output_size += lepton.size();
+    }
+}
+
+// appends the rest of fdin to input
+void read_all(int fdin, Buffer *input) {
+    while (true) {
+        uint8_t buffer[65536];
+        ssize_t data_read = read(fdin, buffer, sizeof(buffer));
+        if (data_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (data_read < 0) {
+            custom_exit(ExitCode::SHORT_READ);
+        }
+        if (data_read == 0) {
+            break;
+        }
+        input->insert(input->end(), buffer, buffer + data_read);
+    }
+}
+
+// writes the parts of input to the output file as container_compress
+// describes. With primary_required, a jpeg at the start of input that
+// cannot be compressed fails the encode as it would without -container.
+void compress_parts(const Buffer &input, bool primary_required) {
+    const char * ifilename = filelist[file_no];
+    std::string ofilename;
+    if (file_no + 1 < file_cnt) {
+        ofilename = filelist[file_no + 1];
+    } else if (strcmp(ifilename, "-") != 0) {
+        ofilename = postfix_uniq(ifilename, ".lep");
+    } else {
+        ofilename = "-";
+    }
+    int fdout = 1;
+    if (ofilename != "-") {
+        do {
+            fdout = open(ofilename.c_str(), O_WRONLY|O_CREAT|O_TRUNC, S_IWUSR | S_IRUSR);
+        } while (fdout == -1 && errno == EINTR);
+        if (fdout == -1) {
+            fprintf(stderr, "Output file unable to be opened for writing: %s\n", ofilename.c_str());
+            custom_exit(ExitCode::FILE_NOT_FOUND);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    // A jpeg ends at its first EOI, so the pictures an MPO or a motion photo
+    // keeps after the primary one are parts of their own, as are the runs
+    // of other bytes around them.
+    std::vector<std::pair<size_t, size_t> > jpegs = find_embedded_jpegs(input.data(), input.size());
+    std::vector<Part> parts;
+    size_t pos = 0;
+    for (size_t i = 0; i < jpegs.size(); ++i) {
+        add_generic_parts(pos, jpegs[i].first, &parts);
+        parts.push_back(Part(jpegs[i].first, jpegs[i].second, true));
+        pos = jpegs[i].second;
+    }
+    add_generic_parts(pos, input.size(), &parts);
+
+    unsigned int jobs = g_container_jobs ? g_container_jobs : std::thread::hardware_concurrency();
+    if (jobs == 0) {
+        jobs = 1;
+    }
+    std::vector<Buffer> leptons(parts.size());
+    std::vector<bool> done(parts.size());
+    std::vector<ExitCode> status(parts.size(), ExitCode::SUCCESS);
+    std::vector<RunningPart> running;
+    size_t output_size = 0;
+    size_t num_compressed = 0;
+    size_t jpeg_bytes = 0;
+    size_t next_to_start = 0;
+    size_t next_to_write = 0;
+    while (next_to_write < parts.size()) {
+        while (next_to_start < parts.size() && running.size() < jobs) {
+            const Part &part = parts[next_to_start];
+            running.push_back(start_part(&input[part.start], part.end - part.start, part.is_jpeg));
+            running.back().part = next_to_start++;
+        }
+        if (!done[next_to_write]) {
+            std::vector<pollfd> fds(running.size());
+            for (size_t i = 0; i < running.size(); ++i) {
+                fds[i].fd = running[i].output;
+                fds[i].events = POLLIN;
+                fds[i].revents = 0;
+            }
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                custom_exit(ExitCode::OS_ERROR);
+            }
+            for (size_t i = running.size(); i-- > 0; ) {
+                if (!fds[i].revents) {
+                    continue;
+                }
+                size_t part = running[i].part;
+                if (!read_part(running[i].output, &leptons[part])) {
+                    status[part] = finish_part(running[i], leptons[part]);
+                    done[part] = true;
+                    running.erase(running.begin() + i);
+                }
+            }
+        }
+        // the parts go out in the order they hold in the input
+        for (; next_to_write < parts.size() && done[next_to_write]; ++next_to_write) {
+            const Part &part = parts[next_to_write];
+            Buffer &lepton = leptons[next_to_write];
+            if (status[next_to_write] == ExitCode::SUCCESS) {
+                if (!write_all(fdout, lepton.data(), lepton.size())) {
+                    custom_exit(ExitCode::OS_ERROR);
+                }
+                output_size += lepton.size();
+                if (part.is_jpeg) {
+                    ++num_compressed;
+                    jpeg_bytes += part.end - part.start;
+                }
+            } else if (part.is_jpeg && primary_required && part.start == 0) {
+                custom_exit(status[next_to_write]);
+            } else if (part.is_jpeg) {
+                fprintf(stderr, "Jpeg [%lu, %lu) not compressed: %s\n", (unsigned long)part.start,
+                        (unsigned long)part.end, ExitString(status[next_to_write]));
+                write_generic(fdout, &input[part.start], part.end - part.start, &output_size);
+            } else {
+                fprintf(stderr, "Unable to store %lu bytes of the container\n",
+                        (unsigned long)(part.end - part.start));
+                custom_exit(status[next_to_write]);
+            }
+            Buffer().swap(lepton);
+        }
+    }
+    if (fdout != 1) {
+        while (close(fdout) < 0 && errno == EINTR) {}
+    }
+    fprintf(msgout, "%lu of %lu jpegs compressed (%lu of %lu bytes)\n",
+            (unsigned long)num_compressed, (unsigned long)jpegs.size(),
+            (unsigned long)jpeg_bytes, (unsigned long)input.size());
+    jpgfilesize = input.size();
+    ujgfilesize = output_size;
+}
+}
+
+void container_compress() {
+    const char * ifilename = filelist[file_no];
+    int fdin = 0;
+    if (strcmp(ifilename, "-") != 0) {
+        do {
+            fdin = open(ifilename, O_RDONLY);
+        } while (fdin == -1 && errno == EINTR);
+        if (fdin == -1) {
+            fprintf(stderr, "Input file unable to be opened for reading: %s\n", ifilename);
+            custom_exit(ExitCode::FILE_NOT_FOUND);
+        }
+    }
+    Buffer input;
+    read_all(fdin, &input);
+    if (fdin != 0) {
+        while (close(fdin) < 0 && errno == EINTR) {}
+    }
+    if (input.empty()) {
+        fprintf(stderr, "Empty container\n");
+        custom_exit(ExitCode::SHORT_READ);
+    }
+    compress_parts(input, false);
+}
+
+bool compress_if_multi_picture() {
+    const char * ifilename = filelist[file_no];
+    if (strcmp(ifilename, "-") == 0) {
+        return false; // stdin cannot be read twice
+    }
+    int fdin = -1;
+    do {
+        fdin = open(ifilename, O_RDONLY);
+    } while (fdin == -1 && errno == EINTR);
+    if (fdin == -1) {
+        return false; // process_file reports it
+    }
+    // only a jpeg is worth reading in full: a .lep being decoded is not
+    Buffer input(2);
+    size_t soi_read = 0;
+    while (soi_read < input.size()) {
+        ssize_t data_read = read(fdin, &input[soi_read], input.size() - soi_read);
+        if (data_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (data_read <= 0) {
+            break;
+        }
+        soi_read += data_read;
+    }
+    bool multi_picture = false;
+    if (soi_read == 2 && input[0] == 0xFF && input[1] == 0xD8) {
+        read_all(fdin, &input);
+        std::vector<std::pair<size_t, size_t> > jpegs
+            = find_embedded_jpegs(input.data(), input.size());
+        multi_picture = jpegs.size() > 1 && jpegs[0].first == 0;
+    }
+    while (close(fdin) < 0 && errno == EINTR) {}
+    if (!multi_picture) {
+        return false;
+    }
+    if (ujgversion < 2) {
+        ujgversion = 2; // only brotli header files may be concatenated
+    }
+    compress_parts(input, true);
+    return true;
+}
+#endif
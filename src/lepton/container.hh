@@ -0,0 +1,34 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef CONTAINER_HH_
+#define CONTAINER_HH_
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+// set by -container: the input is any file that may hold jpegs
+extern bool g_container;
+// set by -container=<n>: how many parts to encode at once (0 is one per cpu)
+extern unsigned int g_container_jobs;
+
+// The [start, end) byte ranges of data that hold a complete jpeg: SOI, marker
+// segments including a huffman coded SOF and SOS, scan data and EOI. Jpegs
+// nested in the segments of another one (such as EXIF thumbnails) are part
+// of the outer range.
+std::vector<std::pair<size_t, size_t> > find_embedded_jpegs(const uint8_t *data, size_t size);
+
+#ifndef _WIN32
+// -container: reads the whole input and writes one lepton file per jpeg found
+// in it and per run of the bytes between them, which are kept by the generic
+// codec of -permissive, one after the other. Such a concatenation decodes
+// to the original input. A jpeg that lepton cannot compress is stored like
+// the bytes around it. The parts are encoded g_container_jobs at a time.
+void container_compress();
+// The plain encode of a file named on the command line: a jpeg followed by
+// more jpegs, as in an MPO or a motion photo, is encoded like -container
+// does, so the pictures after the first are compressed instead of being
+// kept in its header. The first jpeg must compress, as without them.
+// Returns false, having written nothing, for any other input.
+bool compress_if_multi_picture();
+#endif
+#endif
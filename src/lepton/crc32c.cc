@@ -0,0 +1,51 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include <string.h>
+#include "crc32c.hh"
+#if defined(__SSE4_2__) && !defined(USE_SCALAR)
+#include <nmmintrin.h>
+#define USE_SSE42_CRC32C
+#endif
+
+#ifndef USE_SSE42_CRC32C
+namespace {
+struct Crc32cTable {
+    uint32_t entries[256];
+    Crc32cTable() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+            }
+            entries[i] = crc;
+        }
+    }
+};
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t size) {
+    crc = ~crc;
+#ifdef USE_SSE42_CRC32C
+#ifdef __x86_64__
+    for (; size >= 8; size -= 8, data += 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = (uint32_t)_mm_crc32_u64(crc, word);
+    }
+#endif
+    for (; size >= 4; size -= 4, data += 4) {
+        uint32_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+    }
+    for (; size; --size) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+#else
+    static const Crc32cTable table;
+    for (; size; --size) {
+        crc = table.entries[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+#endif
+    return ~crc;
+}
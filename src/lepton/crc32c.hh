@@ -0,0 +1,10 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef CRC32C_HH_
+#define CRC32C_HH_
+#include <stddef.h>
+#include <stdint.h>
+
+// The Castagnoli crc of size bytes at data, continuing from crc (0 to start).
+// Uses the SSE4.2 crc32 instruction when the build has it.
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t size);
+#endif
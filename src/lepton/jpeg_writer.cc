@@ -0,0 +1,317 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include <stdio.h>
+#include <algorithm>
+#include <string.h>
+#include <vector>
+#include "jpeg_writer.hh"
+#include "jpgcoder.hh"
+#include "bitops.hh"
+#include "component_info.hh"
+#include "recoder.hh"
+#include "../vp8/util/memory.hh"
+#include "../vp8/util/debug.hh"
+#include "../vp8/util/cancellation.hh"
+
+extern Sirikata::Array1d<componentInfo, 4> cmpnfo;
+extern int cmpc; // component count
+extern unsigned char* hdrdata; // header data
+extern uint32_t hdrs; // size of header
+int encode_block_seq(abitwriter* huffw, huffCodes* dctbl, huffCodes* actbl, short* block);
+bool build_huffcodes(unsigned char *clen, uint32_t clenlen, unsigned char *cval, uint32_t cvallen,
+                     huffCodes *hc, huffTree *ht);
+
+namespace {
+// the example tables of ITU T.81 Annex K.3: unlike the file's own tables,
+// which may be optimized for its symbols, they can code any coefficient
+unsigned char std_dc_luma_bits[16] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+unsigned char std_dc_chroma_bits[16] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+unsigned char std_dc_values[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+unsigned char std_ac_luma_bits[16] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+unsigned char std_ac_luma_values[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa};
+unsigned char std_ac_chroma_bits[16] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+unsigned char std_ac_chroma_values[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa};
+
+struct StandardTable {
+    unsigned char *bits;
+    unsigned char *values;
+    uint32_t num_values;
+    unsigned char tc_th; // table class and id, as DHT writes them
+};
+const StandardTable standard_tables[4] = {
+    {std_dc_luma_bits, std_dc_values, sizeof(std_dc_values), 0x00},
+    {std_ac_luma_bits, std_ac_luma_values, sizeof(std_ac_luma_values), 0x10},
+    {std_dc_chroma_bits, std_dc_values, sizeof(std_dc_values), 0x01},
+    {std_ac_chroma_bits, std_ac_chroma_values, sizeof(std_ac_chroma_values), 0x11},
+};
+
+void put_marker(std::vector<uint8_t> *out, uint8_t marker, size_t payload) {
+    out->push_back(0xFF);
+    out->push_back(marker);
+    out->push_back((payload + 2) >> 8);
+    out->push_back((payload + 2) & 0xff);
+}
+
+void put_short(std::vector<uint8_t> *out, int value) {
+    out->push_back(value >> 8);
+    out->push_back(value & 0xff);
+}
+
+// everything up to the scan data, keeping the application segments of the original
+void build_header(int width, int height,
+                  const Sirikata::Array1d<OutputComponent, 4> &components,
+                  const Sirikata::Array1d<int, 4> &table_ids,
+                  std::vector<uint8_t> *out) {
+    out->push_back(0xFF);
+    out->push_back(0xD8);
+    for (uint32_t hpos = 0; hpos + 4 <= hdrs; ) {
+        uint8_t type = hdrdata[hpos + 1];
+        uint32_t len = 2 + ((hdrdata[hpos + 2] << 8) | hdrdata[hpos + 3]);
+        if (type == 0xDA || hpos + len > hdrs) {
+            break;
+        }
+        if ((type >= 0xE0 && type <= 0xEF) || type == 0xFE) {
+            out->insert(out->end(), hdrdata + hpos, hdrdata + hpos + len);
+        }
+        hpos += len;
+    }
+    bool extended = false;
+    for (int cmp = 0; cmp < cmpc; ++cmp) {
+        if (table_ids[cmp] != cmp) {
+            continue; // shares the table of an earlier component
+        }
+        const Sirikata::Array1d<uint16_t, 64> &qtable = components[cmp].qtable;
+        bool wide = false;
+        for (int i = 0; i < 64; ++i) {
+            wide = wide || qtable[i] > 255;
+        }
+        extended = extended || wide;
+        put_marker(out, 0xDB, 1 + 64 * (wide ? 2 : 1));
+        out->push_back((wide ? 0x10 : 0) | cmp);
+        for (int i = 0; i < 64; ++i) {
+            if (wide) {
+                put_short(out, qtable[i]);
+            } else {
+                out->push_back(qtable[i]);
+            }
+        }
+    }
+    put_marker(out, extended ? 0xC1 : 0xC0, 6 + 3 * cmpc);
+    out->push_back(8);
+    put_short(out, height);
+    put_short(out, width);
+    out->push_back(cmpc);
+    for (int cmp = 0; cmp < cmpc; ++cmp) {
+        out->push_back(cmpnfo[cmp].jid);
+        out->push_back((components[cmp].h_factor << 4) | components[cmp].v_factor);
+        out->push_back(table_ids[cmp]);
+    }
+    for (int i = 0; i < (cmpc > 1 ? 4 : 2); ++i) {
+        const StandardTable &table = standard_tables[i];
+        put_marker(out, 0xC4, 1 + 16 + table.num_values);
+        out->push_back(table.tc_th);
+        out->insert(out->end(), table.bits, table.bits + 16);
+        out->insert(out->end(), table.values, table.values + table.num_values);
+    }
+    put_marker(out, 0xDA, 1 + 2 * cmpc + 3);
+    out->push_back(cmpc);
+    for (int cmp = 0; cmp < cmpc; ++cmp) {
+        out->push_back(cmpnfo[cmp].jid);
+        out->push_back(cmp ? 0x11 : 0x00);
+    }
+    out->push_back(0);
+    out->push_back(63);
+    out->push_back(0);
+}
+
+// which DQT each component uses: components with equal tables share one
+Sirikata::Array1d<int, 4> qtable_ids(const Sirikata::Array1d<OutputComponent, 4> &components) {
+    Sirikata::Array1d<int, 4> table_ids;
+    for (int cmp = 0; cmp < cmpc; ++cmp) {
+        table_ids[cmp] = cmp;
+        for (int earlier = 0; earlier < cmp; ++earlier) {
+            if (memcmp(components[earlier].qtable.begin(), components[cmp].qtable.begin(),
+                       sizeof(components[cmp].qtable)) == 0) {
+                table_ids[cmp] = table_ids[earlier];
+                break;
+            }
+        }
+    }
+    return table_ids;
+}
+
+// after each mcu row: its complete bytes, before 0xff stuffing, the coder
+// holding the bits of the byte in progress, and the dc of the last block
+// of each component
+typedef std::function<void(const unsigned char *data, int size, abitwriter *huffw,
+                           const Sirikata::Array1d<int16_t, 4> &lastdc)> RowDone;
+
+// Huffman codes the scan with the standard tables, one mcu row at a time.
+// False if the request was cancelled; the caller pads the last byte.
+bool code_scan(abitwriter *huffw, int width, int height,
+               const Sirikata::Array1d<OutputComponent, 4> &components,
+               const BlockSource &block_source,
+               const RowDone &row_done) {
+    bool interleaved = cmpc > 1;
+    int max_h_factor = 1, max_v_factor = 1;
+    for (int cmp = 0; cmp < cmpc; ++cmp) {
+        max_h_factor = std::max(max_h_factor, components[cmp].h_factor);
+        max_v_factor = std::max(max_v_factor, components[cmp].v_factor);
+    }
+    // a single component is coded without mcus, so its factors do not matter
+    always_assert((interleaved || (max_h_factor == 1 && max_v_factor == 1))
+                  && "a lone component must be written with 1x1 sampling");
+    Sirikata::Array1d<huffCodes, 4> codes; // dc luma, ac luma, dc chroma, ac chroma
+    huffTree scratch_tree;
+    for (int i = 0; i < 4; ++i) {
+        const StandardTable &table = standard_tables[i];
+        build_huffcodes(table.bits, 16, table.values, table.num_values, &codes[i], &scratch_tree);
+    }
+    Sirikata::Aligned256Array1d<int16_t, 64> block;
+    Sirikata::Array1d<int16_t, 4> lastdc;
+    lastdc.memset(0);
+    int mcus_wide = (width + 8 * max_h_factor - 1) / (8 * max_h_factor);
+    int mcus_high = (height + 8 * max_v_factor - 1) / (8 * max_v_factor);
+    for (int mcu_y = 0; mcu_y < mcus_high; ++mcu_y) {
+        if (Cancellation::requested()) {
+            return false;
+        }
+        for (int mcu_x = 0; mcu_x < mcus_wide; ++mcu_x) {
+            for (int cmp = 0; cmp < cmpc; ++cmp) {
+                const OutputComponent &component = components[cmp];
+                for (int sub_y = 0; sub_y < component.v_factor; ++sub_y) {
+                    for (int sub_x = 0; sub_x < component.h_factor; ++sub_x) {
+                        block_source(cmp,
+                                     mcu_x * component.h_factor + sub_x,
+                                     mcu_y * component.v_factor + sub_y,
+                                     block.begin());
+                        int16_t dc = block[0];
+                        block[0] -= lastdc[cmp];
+                        lastdc[cmp] = dc;
+                        huffCodes *dc_codes = &codes[cmp ? 2 : 0];
+                        huffCodes *ac_codes = &codes[cmp ? 3 : 1];
+                        if (encode_block_seq(huffw, dc_codes, ac_codes, block.begin()) < 0) {
+                            custom_exit(ExitCode::CODING_ERROR);
+                        }
+                    }
+                }
+            }
+        }
+        const unsigned char *flushed_data = huffw->partial_bytewise_flush();
+        row_done(flushed_data, huffw->getpos(), huffw, lastdc);
+        huffw->reset_crystallized_bytes();
+    }
+    return true;
+}
+}
+
+void build_baseline_jpeg_header(int width, int height,
+                                const Sirikata::Array1d<OutputComponent, 4> &components,
+                                std::vector<uint8_t> *header) {
+    if (cmpc > 3) {
+        custom_exit(ExitCode::UNSUPPORTED_4_COLORS);
+    }
+    build_header(width, height, components, qtable_ids(components), header);
+}
+
+bool baseline_jpeg_row_handoffs(size_t header_size, int width, int height,
+                                const Sirikata::Array1d<OutputComponent, 4> &components,
+                                const BlockSource &block_source,
+                                std::vector<ThreadHandoff> *row_handoffs,
+                                size_t *jpeg_size) {
+    // a lone component has one block per mcu, whatever its factors
+    int luma_mul = cmpc > 1 ? components[0].v_factor : 1;
+    size_t file_offset = header_size;
+    ThreadHandoff handoff = ThreadHandoff::zero();
+    auto add_handoff = [&](abitwriter *huffw, const Sirikata::Array1d<int16_t, 4> &lastdc) {
+        handoff.luma_y_start = luma_mul * row_handoffs->size();
+        handoff.luma_y_end = handoff.luma_y_start + luma_mul;
+        handoff.segment_size = file_offset + 1;
+        handoff.num_overhang_bits = huffw->get_num_overhang_bits();
+        handoff.overhang_byte = huffw->get_overhang_byte();
+        for (size_t i = 0; i < handoff.last_dc.size(); ++i) {
+            handoff.last_dc[i] = lastdc[i];
+        }
+        row_handoffs->push_back(handoff);
+    };
+    abitwriter *huffw = new abitwriter(65536, 0x7fffff00);
+    huffw->fillbit = 1;
+    Sirikata::Array1d<int16_t, 4> lastdc;
+    lastdc.memset(0);
+    row_handoffs->clear();
+    add_handoff(huffw, lastdc);
+    bool coded = code_scan(huffw, width, height, components, block_source,
+                           [&](const unsigned char *data, int size, abitwriter *huffw,
+                               const Sirikata::Array1d<int16_t, 4> &row_lastdc) {
+                               file_offset += size + std::count(data, data + size, 0xff);
+                               lastdc = row_lastdc;
+                               add_handoff(huffw, lastdc);
+                           });
+    if (!coded) {
+        delete huffw;
+        errorlevel.store(2); // process_file reports the request as timed out
+        return false;
+    }
+    // the last handoff is past the padding, where a parse of the jpeg ends
+    huffw->pad(0xff);
+    const unsigned char *padded = huffw->peekptr();
+    file_offset += huffw->getpos() + std::count(padded, padded + huffw->getpos(), 0xff);
+    row_handoffs->pop_back();
+    add_handoff(huffw, lastdc);
+    delete huffw;
+    *jpeg_size = file_offset + 2; // EOI
+    return true;
+}
+
+bool write_baseline_jpeg(bounded_iostream *str_out, int width, int height,
+                         const Sirikata::Array1d<OutputComponent, 4> &components,
+                         const BlockSource &block_source) {
+    std::vector<uint8_t> header;
+    build_baseline_jpeg_header(width, height, components, &header);
+    str_out->write(&header[0], header.size());
+    // a bound of 0 would count as reached: the scan has no size limit of its own
+    abitwriter *huffw = new abitwriter(65536, 0x7fffff00);
+    huffw->fillbit = 1;
+    bool coded = code_scan(huffw, width, height, components, block_source,
+                           [&](const unsigned char *data, int size, abitwriter *,
+                               const Sirikata::Array1d<int16_t, 4> &) {
+                               escape_0xff_huffman_and_write(str_out, data, size);
+                           });
+    if (!coded) {
+        delete huffw;
+        errorlevel.store(2); // process_file reports the request as timed out
+        return false;
+    }
+    huffw->pad(0xff);
+    escape_0xff_huffman_and_write(str_out, huffw->peekptr(), huffw->getpos());
+    delete huffw;
+    unsigned char eoi[2] = {0xFF, 0xD9};
+    str_out->write(eoi, sizeof(eoi));
+    str_out->flush();
+    if (str_out->chkerr()) {
+        fprintf(stderr, "write error, possibly drive is full");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,43 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef JPEG_WRITER_HH_
+#define JPEG_WRITER_HH_
+#include <functional>
+#include <vector>
+#include "../vp8/util/nd_array.hh"
+#include "thread_handoff.hh"
+
+struct OutputComponent {
+    int h_factor; // sampling factors as SOF writes them; 1x1 for a lone component
+    int v_factor;
+    Sirikata::Array1d<uint16_t, 64> qtable; // zigzag order
+};
+
+// fills zigzag with the quantized coefficients of block (x, y) of a component
+typedef std::function<void(int cmp, int x, int y, int16_t *zigzag)> BlockSource;
+
+class bounded_iostream;
+// Writes a new baseline JPEG with the components of the current file, the
+// given size and tables, and the standard Huffman tables of T.81 Annex K,
+// which can code any coefficient. APPn and COM segments of the original are
+// kept. Blocks are requested in scan order, mcu padding included.
+bool write_baseline_jpeg(bounded_iostream *str_out, int width, int height,
+                         const Sirikata::Array1d<OutputComponent, 4> &components,
+                         const BlockSource &block_source);
+
+// Everything write_baseline_jpeg writes ahead of the scan data, SOI included.
+void build_baseline_jpeg_header(int width, int height,
+                                const Sirikata::Array1d<OutputComponent, 4> &components,
+                                std::vector<uint8_t> *header);
+
+// Huffman codes the scan of write_baseline_jpeg without writing it, for
+// write_ujpg to compress that jpeg from colldata alone. *row_handoffs gets
+// a ThreadHandoff at the start of every mcu row and one past the padding,
+// as decode_jpeg would find them: the file offset of each is one past the
+// byte holding its next bit, counting a header of header_size bytes.
+// *jpeg_size gets the size of the whole file. False if cancelled.
+bool baseline_jpeg_row_handoffs(size_t header_size, int width, int height,
+                                const Sirikata::Array1d<OutputComponent, 4> &components,
+                                const BlockSource &block_source,
+                                std::vector<ThreadHandoff> *row_handoffs,
+                                size_t *jpeg_size);
+#endif
@@ -44,6 +44,7 @@ volatile int volatile1024 = 1024;
 #ifndef _WIN32
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
     #include <unistd.h>
 #else
     #include <io.h>
@@ -75,7 +76,16 @@ volatile int volatile1024 = 1024;
 #include "simple_encoder.hh"
 #include "fork_serve.hh"
 #include "socket_serve.hh"
+#include "server_metrics.hh"
 #include "validation.hh"
+#include "pixel_output.hh"
+#include "scaled_jpeg.hh"
+#include "lossless_transform.hh"
+#include "metadata_rewrite.hh"
+#include "lepton_header.hh"
+#include "verify.hh"
+#include "crc32c.hh"
+#include "container.hh"
 #include "../io/ZlibCompression.hh"
 #include "../io/BrotliCompression.hh"
 #include "../io/MemReadWriter.hh"
@@ -84,6 +94,9 @@ volatile int volatile1024 = 1024;
 #include "../io/Seccomp.hh"
 #include "../vp8/encoder/vpx_bool_writer.hh"
 #include "generic_compress.hh"
+#include "../vp8/util/perf_counters.hh"
+#include "../vp8/util/cache_sim.hh"
+#include "../vp8/util/cancellation.hh"
 #ifdef EMSCRIPTEN
 #include <emscripten.h>
 #endif
@@ -153,6 +166,105 @@ uint64_t get_time_us(bool force) {
     return 0;
 }
 const char * stage_names[] = {FOREACH_TIMING_STAGE(GENERATE_TIMING_STRING) "EOF"};
+namespace {
+struct PerfSample {
+    const PerfCounters *owner; // the thread whose counters were read, NULL if none
+    PerfCounterValues values;
+    uint64_t blocks; // blocks the owner had coded by then
+};
+Sirikata::Array1d<Sirikata::Array1d<PerfSample, NUM_STAGES>, MAX_NUM_THREADS> perf_samples;
+#if defined(__APPLE__) || (__cplusplus <= 199711L && !defined(_WIN32))
+__thread uint64_t thread_blocks_coded = 0;
+#else
+thread_local uint64_t thread_blocks_coded = 0;
+#endif
+bool ends_with(const char *name, const char *suffix) {
+    size_t name_len = strlen(name);
+    size_t suffix_len = strlen(suffix);
+    return name_len >= suffix_len && strcmp(name + name_len - suffix_len, suffix) == 0;
+}
+}
+void stamp(unsigned int thread_id, TimingStages_ stage) {
+    timing[thread_id][stage] = get_time_us();
+    if (g_thread_perf_counters) {
+        PerfSample &sample = perf_samples[thread_id][stage];
+        sample.owner = read_thread_perf_counters(&sample.values);
+        sample.blocks = thread_blocks_coded;
+    }
+}
+void count_blocks(uint32_t num_blocks) {
+    thread_blocks_coded += num_blocks;
+}
+void print_perf_counters(uint64_t num_blocks) {
+    if (!g_thread_perf_counters) {
+        return;
+    }
+    if (num_blocks == 0) {
+        num_blocks = 1;
+    }
+    char line[256];
+    for (int i = 0; i + 1 < NUM_STAGES; ++i) {
+        if (!(ends_with(stage_names[i], "_STARTED") && ends_with(stage_names[i + 1], "_FINISHED"))) {
+            continue;
+        }
+        PerfCounterValues total;
+        total.memset(0);
+        bool any = false;
+        for (unsigned int j = 0; j < MAX_NUM_THREADS && j < NUM_THREADS; ++j) {
+            const PerfSample &begin = perf_samples[j][i];
+            const PerfSample &end = perf_samples[j][i + 1];
+            // a pair stamped from two different threads has nothing to subtract
+            if (begin.owner == NULL || begin.owner != end.owner) {
+                continue;
+            }
+            PerfCounterValues delta;
+            uint64_t thread_blocks = end.blocks - begin.blocks;
+            for (size_t k = 0; k < delta.size(); ++k) {
+                delta[k] = end.values[k] - begin.values[k];
+                total[k] += delta[k];
+            }
+            if (delta[(int)PerfCounter::CYCLES] == 0) {
+                continue; // the kernel or hardware gave us no counters
+            }
+            any = true;
+            if (thread_blocks == 0) {
+                // stages outside the row loops, like the Huffman parse, cover the whole image
+                thread_blocks = num_blocks;
+            }
+            int len = snprintf(line, sizeof(line),
+                               "%s\t(%d)\tcycles %llu\tinstructions %llu\tIPC %.2f"
+                               "\tL1D misses/block %.2f\tL2 misses/block %.2f\tLLC misses/block %.2f"
+                               "\tbranch misses/block %.2f\n",
+                               stage_names[i], j,
+                               (unsigned long long)delta[(int)PerfCounter::CYCLES],
+                               (unsigned long long)delta[(int)PerfCounter::INSTRUCTIONS],
+                               delta[(int)PerfCounter::INSTRUCTIONS] / double(delta[(int)PerfCounter::CYCLES]),
+                               delta[(int)PerfCounter::L1D_READ_MISSES] / double(thread_blocks),
+                               delta[(int)PerfCounter::L2_READ_MISSES] / double(thread_blocks),
+                               delta[(int)PerfCounter::LLC_READ_MISSES] / double(thread_blocks),
+                               delta[(int)PerfCounter::BRANCH_MISSES] / double(thread_blocks));
+            // write rather than fprintf: this may run jailed
+            while (write(2, line, std::min((size_t)len, sizeof(line) - 1)) < 0 && errno == EINTR) {
+            }
+        }
+        if (any) {
+            int len = snprintf(line, sizeof(line),
+                               "%s\t(all)\tcycles %llu\tinstructions %llu\tIPC %.2f"
+                               "\tL1D misses/block %.2f\tL2 misses/block %.2f\tLLC misses/block %.2f"
+                               "\tbranch misses/block %.2f\n",
+                               stage_names[i],
+                               (unsigned long long)total[(int)PerfCounter::CYCLES],
+                               (unsigned long long)total[(int)PerfCounter::INSTRUCTIONS],
+                               total[(int)PerfCounter::INSTRUCTIONS] / double(total[(int)PerfCounter::CYCLES]),
+                               total[(int)PerfCounter::L1D_READ_MISSES] / double(num_blocks),
+                               total[(int)PerfCounter::L2_READ_MISSES] / double(num_blocks),
+                               total[(int)PerfCounter::LLC_READ_MISSES] / double(num_blocks),
+                               total[(int)PerfCounter::BRANCH_MISSES] / double(num_blocks));
+            while (write(2, line, std::min((size_t)len, sizeof(line) - 1)) < 0 && errno == EINTR) {
+            }
+        }
+    }
+}
 void print_results() {
     if (!g_use_seccomp) {
         uint64_t earliest_time = get_time_us();
@@ -189,7 +301,10 @@ enum ACTION {
     forkserve = 2,
     socketserve = 3,
     info = 4,
-    lepton_concatenate = 5
+    lepton_concatenate = 5,
+    lepton_rewrite_metadata = 6,
+    lepton_header_info = 7,
+    lepton_verify = 8
 };
 
 
@@ -220,6 +335,7 @@ void uint32toLE(uint32_t value, uint8_t *retval) {
 int initialize_options( int argc, const char*const* argv );
 void execute(const std::function<bool()> &);
 void show_help( void );
+unsigned int sample_idle_cpus();
 
 
 /* -----------------------------------------------
@@ -229,6 +345,9 @@ void show_help( void );
 bool check_file(int fd_in, int fd_out, uint32_t max_file_size, bool force_zlib0,
                 bool is_embedded_jpeg, Sirikata::Array1d<uint8_t, 2> two_byte_header,
                 bool is_socket);
+#ifndef _WIN32
+void chunked_compress(size_t chunk_size);
+#endif
 
 template <class stream_reader>
 bool read_jpeg(std::vector<std::pair<uint32_t,
@@ -255,13 +374,19 @@ bool read_jpeg_and_copy_to_side_channel(std::vector<std::pair<uint32_t,
 struct MergeJpegProgress;
 bool decode_jpeg(const std::vector<std::pair<uint32_t,
                                    uint32_t> > &huff_input_offset,
-                 std::vector<ThreadHandoff>*row_thread_handoffs);
+                 std::vector<ThreadHandoff>*row_thread_handoffs,
+                 std::vector<uint32_t>*mcu_file_offsets);
 bool recode_jpeg( void );
 
 bool adapt_icos( void );
 bool check_value_range( void );
 bool write_ujpg(std::vector<ThreadHandoff> row_thread_handoffs,
                 std::vector<uint8_t, Sirikata::JpegAllocator<uint8_t> >*jpeg_file_raw_bytes);
+bool write_ujpg_slices(std::vector<ThreadHandoff> row_thread_handoffs,
+                       std::vector<uint32_t> mcu_file_offsets,
+                       std::vector<uint8_t, Sirikata::JpegAllocator<uint8_t> >*jpeg_file_raw_bytes,
+                       size_t chunk_size);
+bool write_transformed_ujpg( void );
 bool read_ujpg( void );
 unsigned char read_fixed_ujpg_header( void );
 bool reset_buffers( void );
@@ -278,6 +403,7 @@ bool is_jpeg_header(Sirikata::Array1d<uint8_t, 2> header) {
 bool setup_imginfo_jpg(bool only_allocate_two_image_rows);
 bool parse_jfif_jpg( unsigned char type, unsigned int len, uint32_t alloc_len, unsigned char* segment );
 bool rebuild_header_jpg( void );
+bool slice_header_jpg( void );
 
 int decode_block_seq( abitreader* huffr, huffTree* dctree, huffTree* actree, short* block );
 int encode_block_seq( abitwriter* huffw, huffCodes* dctbl, huffCodes* actbl, short* block );
@@ -303,7 +429,9 @@ int encode_crbits( abitwriter* huffw, abytewriter* storw );
 int next_huffcode( abitreader *huffw, huffTree *ctree , Billing min_bill, Billing max_bill);
 int next_mcupos( int* mcu, int* cmp, int* csc, int* sub, int* dpos, int* rstw, int cs_cmpc);
 int next_mcuposn( int* cmp, int* dpos, int* rstw );
+int next_mcuposn( int* cmp, int* dpos, int* rstw, int rsti );
 int skip_eobrun( int* cmp, int* dpos, int* rstw, unsigned int* eobrun );
+int skip_eobrun( int* cmp, int* dpos, int* rstw, unsigned int* eobrun, int rsti );
 
 bool build_huffcodes( unsigned char *clen, uint32_t clenlen,  unsigned char *cval, uint32_t cvallen,
                 huffCodes *hc, huffTree *ht );
@@ -349,6 +477,7 @@ unsigned char *prefix_grbgdata = NULL; // if prefix_grb is specified, header is
 
 std::vector<unsigned int>  rstp;   // restart markers positions in huffdata
 std::vector<unsigned int>  scnp;   // scan start positions in huffdata
+std::vector<unsigned int>  scnp_jpg; // scan start positions in huffdata, as read from the jpeg
 int            rstc             =    0  ;   // count of restart markers
 int            scnc             =    0  ;   // count of scans
 int            rsti             =    0  ;   // restart interval
@@ -356,8 +485,10 @@ int8_t         padbit           =    -1 ;   // padbit (for huffman coding)
 std::vector<unsigned char> rst_err;   // number of wrong-set RST markers per scan
 std::vector<unsigned int> rst_cnt;
 bool rst_cnt_set = false;
+std::vector<uint32_t> segment_checksums; // crc32c of the jpeg bytes of each thread segment
 int            max_file_size    =    0  ;   // support for truncated jpegs 0 means full jpeg
 size_t            start_byte       =    0;     // support for producing a slice of jpeg
+size_t         g_chunk_size     =    0;     // if nonzero, emit one slice per <n> jpeg bytes
 size_t         jpeg_embedding_offset = 0;
 unsigned int min_encode_threads = 1;
 size_t max_encode_threads = 
@@ -422,20 +553,28 @@ int cs_sah       =   0  ; // successive approximation bit pos high
 int cs_sal       =   0  ; // successive approximation bit pos low
 void kill_workers(void * workers, uint64_t num_workers);
 BaseDecoder* g_decoder = NULL;
+bool g_pin_threads = false;
 GenericWorker * get_worker_threads(unsigned int num_workers) {
     // in this case decoding is asymmetric to encoding, just forget the assert
     if (NUM_THREADS < 2) {
         return NULL;
     }
+    if (g_pin_threads) {
+        // workers inherit the affinity of this thread, so one image stays on one cache
+        int numa_node = pin_to_shared_cache_domain();
+        if (numa_node >= 0) {
+            Sirikata::memmgr_prefer_numa_node(numa_node);
+        }
+    }
     GenericWorker* retval = GenericWorker::get_n_worker_threads(num_workers);
-    TimingHarness::timing[0][TimingHarness::TS_THREAD_STARTED] = TimingHarness::get_time_us();
+    TimingHarness::stamp(0, TimingHarness::TS_THREAD_STARTED);
 
     return retval;
 }
 
 template <class BoolDecoder>VP8ComponentDecoder<BoolDecoder> *makeBoth(bool threaded, bool start_workers) {
     VP8ComponentDecoder<BoolDecoder> *retval = new VP8ComponentDecoder<BoolDecoder>(threaded);
-    TimingHarness::timing[0][TimingHarness::TS_MODEL_INIT] = TimingHarness::get_time_us();
+    TimingHarness::stamp(0, TimingHarness::TS_MODEL_INIT);
     if (start_workers) {
         retval->registerWorkers(get_worker_threads(
                                     NUM_THREADS
@@ -447,9 +586,9 @@ template <class BoolDecoder>VP8ComponentDecoder<BoolDecoder> *makeBoth(bool thre
 }
 
 template <class BoolDecoder>BaseEncoder *makeEncoder(bool threaded, bool start_workers) {
-    TimingHarness::timing[0][TimingHarness::TS_MODEL_INIT_BEGIN] = TimingHarness::get_time_us();
+    TimingHarness::stamp(0, TimingHarness::TS_MODEL_INIT_BEGIN);
     VP8ComponentEncoder<BoolDecoder> * retval = new VP8ComponentEncoder<BoolDecoder>(threaded, IsDecoderAns<BoolDecoder>::IS_ANS);
-    TimingHarness::timing[0][TimingHarness::TS_MODEL_INIT] = TimingHarness::get_time_us();
+    TimingHarness::stamp(0, TimingHarness::TS_MODEL_INIT);
     if (start_workers) {
         retval->registerWorkers(get_worker_threads(NUM_THREADS - 1), NUM_THREADS - 1);
     }
@@ -488,8 +627,12 @@ bool g_allow_progressive =
     false
 #endif
     ;
+// g_allow_progressive as the options left it, before any file changed it
+bool g_allow_progressive_option = false;
 bool g_unkillable = false;
 uint64_t g_time_bound_ms = 0;
+// how long past the time bound a request may take to notice it before it is killed
+const uint64_t TIME_BOUND_GRACE_MS = 100;
 int g_inject_syscall_test = 0;
 bool g_force_zlib0_out = false;
 
@@ -533,12 +676,23 @@ bool   pipe_on  = false;    // use stdin/stdout instead of filelist
 
 
 void sig_nop(int){}
+#ifndef _WIN32
+// the first time bound alarm asks the coding loops to stop; the handler
+// is one-shot, so if it fires again the default action kills a request
+// that is stuck outside of them, e.g. waiting on its input
+void sig_time_bound(int) {
+    Cancellation::request();
+}
+#endif
 /* -----------------------------------------------
     global variables: info about program
     ----------------------------------------------- */
 
 unsigned char ujgversion   = 1;
 bool g_even_thread_split = false;
+bool g_adaptive_threads = false;
+bool g_segment_checksums = false;
+unsigned int g_idle_cpus = MAX_NUM_THREADS;
 uint8_t get_current_file_lepton_version() {
     return ujgversion;
 }
@@ -549,6 +703,7 @@ static const unsigned char   zlepton_header[] = { 0xce, 0xb6 }; // the zeta symb
 
 
 FILE * timing_log = NULL;
+const char * trace_filename = NULL;
 char current_operation = '\0';
 #ifdef _WIN32
 clock_t current_operation_begin = 0;
@@ -887,6 +1042,8 @@ int app_main( int argc, char** argv )
                           n_threads,
                           256,
                           needs_huge_pages);
+    // until a socket server child has read its header it may need all of this
+    g_socketserve_info.unreported_request_memory = mem_limit + thread_mem_limit * n_threads;
 #endif
     clock_t begin = 0, end = 1;
 
@@ -910,7 +1067,7 @@ int app_main( int argc, char** argv )
     }
     // check if user input is wrong, show help screen if it is
     if ((file_cnt == 0 && action != forkserve && action != socketserve)
-        || ((!developer) && ((action != lepton_concatenate && action != comp && action != forkserve && action != socketserve)))) {
+        || ((!developer) && ((action != lepton_concatenate && action != lepton_rewrite_metadata && action != lepton_header_info && action != lepton_verify && action != comp && action != forkserve && action != socketserve)))) {
         show_help();
         return -1;
     }
@@ -921,11 +1078,20 @@ int app_main( int argc, char** argv )
 
     // process file(s) - this is the main function routine
     begin = clock();
-    if (file_cnt > 2 && action != lepton_concatenate) {
+    if (file_cnt > 2 && action != lepton_concatenate && action != lepton_header_info
+        && action != lepton_verify) {
         show_help();
         custom_exit(ExitCode::FILE_NOT_FOUND);
     }
-    if (action == forkserve) {
+    if (action == lepton_header_info) {
+        print_lepton_info(filelist, file_cnt);
+    } else if (action == lepton_verify) {
+#ifdef _WIN32
+        abort(); // not implemented
+#else
+        verify_files(filelist, file_cnt);
+#endif
+    } else if (action == forkserve) {
 #ifdef _WIN32
         abort(); // not implemented
 #else
@@ -936,6 +1102,15 @@ int app_main( int argc, char** argv )
         abort(); // not implemented
 #else
         socket_serve(&process_file, max_file_size, g_socketserve_info);
+#endif
+#ifndef _WIN32
+    } else if (g_chunk_size && action == comp) {
+        chunked_compress(g_chunk_size);
+    } else if (g_container && action == comp) {
+        container_compress();
+    } else if (action == comp && ofiletype == LEPTON && start_byte == 0 && max_file_size == 0
+               && !embedded_jpeg && !g_force_zlib0_out && compress_if_multi_picture()) {
+        // the pictures after the first were encoded as parts of their own
 #endif
     } else {
         process_file(nullptr, nullptr, max_file_size, g_force_zlib0_out);
@@ -1040,6 +1215,9 @@ int initialize_options( int argc, const char*const * argv )
         else if ( strcmp((*argv), "-singlethread" ) == 0)  {
             g_threaded = false;
         }
+        else if ( strcmp((*argv), "-pinthreads" ) == 0)  {
+            g_pin_threads = true;
+        }
         else if ( strcmp((*argv), "-allowprogressive" ) == 0)  {
             g_allow_progressive = true;
         }
@@ -1056,6 +1234,10 @@ int initialize_options( int argc, const char*const * argv )
             g_threaded = true;
         } else if ( strcmp((*argv), "-evensplit" ) == 0)  {
             g_even_thread_split = true;
+        } else if ( strcmp((*argv), "-segmentchecksums" ) == 0)  {
+            g_segment_checksums = true;
+        } else if ( strcmp((*argv), "-adaptivethreads" ) == 0)  {
+            g_adaptive_threads = true;
         } else if ( strstr((*argv), "-recodememory=") == *argv ) {
             g_decompression_memory_bound
                 = local_atoi(*argv + strlen("-recodememory="));
@@ -1071,11 +1253,52 @@ int initialize_options( int argc, const char*const * argv )
 
         } else if ( strncmp((*argv), "-timing=", strlen("-timing=") ) == 0 ) {
             timing_log = fopen((*argv) + strlen("-timing="), "a");
+        } else if ( strncmp((*argv), "-trace=", strlen("-trace=") ) == 0 ) {
+            trace_filename = (*argv) + strlen("-trace=");
+        } else if ( strcmp((*argv), "-perfcounters" ) == 0 ) {
+            g_thread_perf_counters = true;
+        } else if ( strcmp((*argv), "-pixels=rgb" ) == 0 ) {
+            g_pixel_format = PixelFormat::RGB;
+        } else if ( strcmp((*argv), "-pixels=ycbcr" ) == 0 ) {
+            g_pixel_format = PixelFormat::YCBCR;
+        } else if ( strncmp((*argv), "-pixels=", strlen("-pixels=") ) == 0 ) {
+            fprintf(stderr, "-pixels takes rgb or ycbcr\n");
+            exit(1);
+        } else if ( strncmp((*argv), "-scale=1/", strlen("-scale=1/") ) == 0 ) {
+            g_scale_denominator = local_atoi((*argv) + strlen("-scale=1/"));
+            if (g_scale_denominator != 2 && g_scale_denominator != 4 && g_scale_denominator != 8) {
+                fprintf(stderr, "-scale takes 1/2, 1/4 or 1/8\n");
+                exit(1);
+            }
+        } else if ( strncmp((*argv), "-transform=", strlen("-transform=") ) == 0 ) {
+            g_transform = lossless_transform_from_name((*argv) + strlen("-transform="));
+            if (g_transform == LosslessTransform::NONE) {
+                fprintf(stderr, "-transform takes rot90, rot180, rot270, fliph, flipv, transpose or transverse\n");
+                exit(1);
+            }
         } else if (strncmp((*argv), "-maxencodethreads=", strlen("-maxencodethreads=") ) == 0 ) {
             max_encode_threads = local_atoi((*argv) + strlen("-maxencodethreads="));
             if (max_encode_threads > MAX_NUM_THREADS) {
                 custom_exit(ExitCode::VERSION_UNSUPPORTED);
             }
+        } else if (strcmp((*argv), "-stripmeta") == 0) {
+            action = lepton_rewrite_metadata;
+        } else if (strncmp((*argv), "-metadatafrom=", strlen("-metadatafrom=")) == 0) {
+            action = lepton_rewrite_metadata;
+            g_metadata_source = (*argv) + strlen("-metadatafrom=");
+        } else if (strcmp((*argv), "-verifybatch") == 0
+                   || strncmp((*argv), "-verifybatch=", strlen("-verifybatch=")) == 0) {
+            action = lepton_verify;
+            if ((*argv)[strlen("-verifybatch")] == '=') {
+                g_verify_jobs = local_atoi((*argv) + strlen("-verifybatch="));
+            }
+            // every child decodes from the models set up once here
+            g_do_preload = true;
+            g_skip_validation = true;
+        } else if (strncmp((*argv), "-verifysums=", strlen("-verifysums=")) == 0) {
+            g_verify_sums = (*argv) + strlen("-verifysums=");
+        } else if (strcmp((*argv), "-info") == 0) {
+            action = lepton_header_info;
         } else if (strcmp((*argv), "-lepcat") == 0) {
             action = lepton_concatenate;
         } else if (strncmp((*argv), "-minencodethreads=", strlen("-minencodethreads=") ) == 0 ) {
@@ -1130,6 +1353,19 @@ int initialize_options( int argc, const char*const * argv )
             jpeg_embedding_offset = local_atoi((*argv) + strlen("-embedding="));
             embedded_jpeg = true;
         }
+        else if ( strncmp((*argv), "-chunksize=", strlen("-chunksize=") ) == 0 ) {
+            g_chunk_size = local_atoi((*argv) + strlen("-chunksize="));
+        }
+        else if ( strcmp((*argv), "-container") == 0
+                  || strncmp((*argv), "-container=", strlen("-container=")) == 0 ) {
+            g_container = true;
+            if ((*argv)[strlen("-container")] == '=') {
+                g_container_jobs = local_atoi((*argv) + strlen("-container="));
+            }
+            if (ujgversion < 2) {
+                ujgversion = 2; // only brotli header files may be concatenated
+            }
+        }
         else if ( strncmp((*argv), "-trunc=", strlen("-trunc=") ) == 0 ) {
             max_file_size = local_atoi((*argv) + strlen("-trunc="));
         }
@@ -1178,6 +1414,14 @@ int initialize_options( int argc, const char*const * argv )
             }
         } else if ( strncmp((*argv), "-zliblisten", strlen("-zliblisten")) == 0 ) {
             g_socketserve_info.zlib_port = atoi((*argv) + strlen("-zliblisten="));
+        } else if ( strncmp((*argv), "-statsocket=", strlen("-statsocket=")) == 0 ) {
+            g_socketserve_info.stats_uds = (*argv) + strlen("-statsocket=");
+        } else if (strncmp((*argv), "-resultcache=", strlen("-resultcache=")) == 0) {
+            g_socketserve_info.result_cache_dir = (*argv) + strlen("-resultcache=");
+        } else if (strncmp((*argv), "-resultcachesize=", strlen("-resultcachesize=")) == 0) {
+            g_socketserve_info.result_cache_bytes = strtoull((*argv) + strlen("-resultcachesize="), NULL, 10) * 1024 * 1024;
+        } else if (strncmp((*argv), "-admitmemory=", strlen("-admitmemory=")) == 0) {
+            g_socketserve_info.memory_budget = strtoull((*argv) + strlen("-admitmemory="), NULL, 10) * 1024 * 1024;
 #endif
         } else if ( strcmp((*argv), "-") == 0 ) {    
             msgout = stderr;
@@ -1196,16 +1440,39 @@ int initialize_options( int argc, const char*const * argv )
     }
     for ( file_cnt = 0; filelist[ file_cnt ] != NULL; file_cnt++ ) {
     }
+    if (g_scale_denominator != 1 && g_pixel_format != PixelFormat::JPEG) {
+        fprintf(stderr, "-scale and -pixels cannot be combined\n");
+        exit(1);
+    }
+    if (g_transform != LosslessTransform::NONE
+        && (g_scale_denominator != 1 || g_pixel_format != PixelFormat::JPEG)) {
+        fprintf(stderr, "-transform cannot be combined with -scale or -pixels\n");
+        exit(1);
+    }
     if (start_byte != 0) {
         // Encode of partial progressive images not allowed
         g_allow_progressive = false;
     }
+    g_allow_progressive_option = g_allow_progressive;
+    if (trace_filename) {
+        if (g_use_seccomp) {
+            // a jailed process may not read the clock
+            fprintf(stderr, "-trace requires -unjailed, not tracing\n");
+        } else if (!TraceHarness::open(trace_filename)) {
+            fprintf(stderr, FWR_ERRMSG "\n", trace_filename);
+        }
+    }
     if (g_time_bound_ms && action == forkserve) {
         fprintf(stderr, "Time bound action only supported with UNIX domain sockets\n");
         exit(1);
     }
     if (g_do_preload && g_skip_validation) {
-        VP8ComponentDecoder<VPXBoolReader> *d = makeBoth<VPXBoolReader>(g_threaded, g_threaded && action != forkserve && action != socketserve);
+        bool forks_per_file = action == forkserve || action == socketserve || action == lepton_verify;
+        VP8ComponentDecoder<VPXBoolReader> *d = makeBoth<VPXBoolReader>(g_threaded, g_threaded && !forks_per_file);
+        if (forks_per_file) {
+            // every forked child starts from these models instead of building its own
+            d->prewarm_thread_models();
+        }
         g_encoder.reset(d);
         g_decoder = d;
     }
@@ -1304,6 +1571,26 @@ size_t decompression_memory_bound() {
     return decom_memory_bound;
 }
 
+/* -----------------------------------------------
+    peak memory of the current request, predicted
+    once its header has been read
+    ----------------------------------------------- */
+size_t predicted_request_memory() {
+    if (filetype != JPEG) {
+        return decompression_memory_bound();
+    }
+    // the encoder keeps the whole frame, the jpeg and its output at once
+    size_t frame_buffer_size = 0;
+    for (int i = 0; i < colldata.get_num_components(); ++i) {
+        frame_buffer_size += (size_t)colldata.component_size_in_blocks(i) * 64 * sizeof(int16_t);
+    }
+    size_t models = 0;
+    if (g_encoder) {
+        models = g_encoder->get_decode_model_worker_memory_usage();
+    }
+    return Sirikata::memmgr_size_allocated() + frame_buffer_size + 2 * jpgfilesize + models;
+}
+
 void check_decompression_memory_bound_ok() {
     if (g_decompression_memory_bound) {
         size_t adjustment = 0;
@@ -1324,6 +1611,20 @@ void test_syscall_injection(std::atomic<int>*value) {
     value->store(ret ? 1 : 2);
 #endif
 }
+bool decode_pixels_wrapper() {
+    if (!decode_pixels(str_out, filetype != UJG && !g_allow_progressive)) {
+        errorlevel.store(2);
+        return false;
+    }
+    return true;
+}
+bool write_scaled_jpeg_wrapper() {
+    if (!write_scaled_jpeg(str_out)) {
+        errorlevel.store(2);
+        return false;
+    }
+    return true;
+}
 bool recode_baseline_jpeg_wrapper() {
     bool retval = recode_baseline_jpeg(str_out, max_file_size);
     if (!retval) {
@@ -1468,12 +1769,15 @@ int open_fdout(const char *ifilename,
     } else if ( ( ( fileid[0] == ujg_header[0] ) && ( fileid[1] == ujg_header[1] ) )
                 || ( ( fileid[0] == lepton_header[0] ) && ( fileid[1] == lepton_header[1] ) )
                 || ( ( fileid[0] == zlepton_header[0] ) && ( fileid[1] == zlepton_header[1] ) ) ){
+        std::string extension = g_pixel_format == PixelFormat::JPEG ? ".jpg" : pixel_format_extension();
+        if (action == lepton_rewrite_metadata) {
+            extension = ".lep"; // postfix_uniq picks a name beside the input
+        }
         if ((fileid[0] == zlepton_header[0] && fileid[1] == zlepton_header[1])
             || force_compressed_output) {
-            ofilename = postfix_uniq(ifilename, ".jpg.z");
-        } else {
-            ofilename = postfix_uniq(ifilename, ".jpg");
+            extension += ".z";
         }
+        ofilename = postfix_uniq(ifilename, extension.c_str());
     }
     do {
         retval = open(ofilename.c_str(), O_WRONLY|O_CREAT|O_TRUNC
@@ -1517,6 +1821,258 @@ void prep_for_new_file() {
     str_out->prep_for_new_file();
 }
 
+#ifndef _WIN32
+/* -----------------------------------------------
+    splits one jpeg into independently decodable
+    lepton files, each regenerating exactly chunk_size
+    bytes of the original (the last one regenerates
+    the remainder). One jailed child parses the jpeg
+    once and writes every slice, each bounded like a
+    -startbyte/-trunc encode of its chunk; the parent
+    decodes each slice to check it against its bytes.
+    Chunks go to <output>.000, <output>.001, ...
+    or, when writing to stdout, are concatenated into
+    one lepcat stream.
+    ----------------------------------------------- */
+// true if the frame header before the first scan is SOF2
+static bool jpeg_header_is_progressive(const std::vector<uint8_t> &jpeg) {
+    for (size_t pos = 2; pos + 4 <= jpeg.size();) {
+        if (jpeg[pos] != 0xFF) {
+            return false;
+        }
+        uint8_t type = jpeg[pos + 1];
+        if (type == 0xFF) {
+            ++pos; // fill byte
+            continue;
+        }
+        if (type == 0xC2) {
+            return true;
+        }
+        if (type == 0xDA || type == 0xD9) {
+            return false;
+        }
+        pos += 2 + ((jpeg[pos + 2] << 8) | jpeg[pos + 3]);
+    }
+    return false;
+}
+
+// exits unless lepton decodes to exactly the original bytes of its chunk
+void verify_chunk(unsigned int chunk, const uint8_t *lepton, size_t lepton_size,
+                  const uint8_t *original, size_t original_size) {
+    int lepton_pipe[2] = {-1, -1};
+    int jpeg_pipe[2] = {-1, -1};
+    while (pipe(lepton_pipe) < 0 || pipe(jpeg_pipe) < 0) {
+        if (errno != EINTR) {
+            custom_exit(ExitCode::OS_ERROR);
+        }
+    }
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        while (close(lepton_pipe[1]) < 0 && errno == EINTR) {}
+        while (close(jpeg_pipe[0]) < 0 && errno == EINTR) {}
+        g_chunk_size = 0;
+        IOUtil::FileReader reader(lepton_pipe[0], 0, false);
+        IOUtil::FileWriter writer(jpeg_pipe[1], false, false);
+        process_file(&reader, &writer, 0, false);
+        custom_exit(ExitCode::SUCCESS);
+    }
+    while (close(lepton_pipe[0]) < 0 && errno == EINTR) {}
+    while (close(jpeg_pipe[1]) < 0 && errno == EINTR) {}
+    if (child < 0) {
+        custom_exit(ExitCode::OS_ERROR);
+    }
+    size_t roundtrip_size = 0;
+    Sirikata::Array1d<uint8_t, 16> rtmd5 = IOUtil::send_and_md5_result(lepton, lepton_size,
+                                                                       lepton_pipe[1], jpeg_pipe[0],
+                                                                       &roundtrip_size);
+    int status = 0;
+    while (waitpid(child, &status, 0) < 0 && errno == EINTR) {}
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != (int)ExitCode::SUCCESS) {
+        fprintf(stderr, "Chunk %u failed to decode\n", chunk);
+        custom_exit(WIFEXITED(status) ? (ExitCode)WEXITSTATUS(status) : ExitCode::ROUNDTRIP_FAILURE);
+    }
+    Sirikata::Array1d<uint8_t, 16> md5;
+    MD5_CTX context;
+    MD5_Init(&context);
+    MD5_Update(&context, original, original_size);
+    MD5_Final(&md5[0], &context);
+    if (roundtrip_size != original_size || memcmp(&md5[0], &rtmd5[0], md5.size()) != 0) {
+        fprintf(stderr, "Chunk %u: Input Size %lu != Roundtrip Size %lu\n",
+                chunk, (unsigned long)original_size, (unsigned long)roundtrip_size);
+        custom_exit(ExitCode::ROUNDTRIP_FAILURE);
+    }
+}
+
+void chunked_compress(size_t chunk_size) {
+    const char * ifilename = filelist[file_no];
+    int fdin = 0;
+    if (strcmp(ifilename, "-") != 0) {
+        do {
+            fdin = open(ifilename, O_RDONLY);
+        } while (fdin == -1 && errno == EINTR);
+        if (fdin == -1) {
+            fprintf(stderr, "Input file unable to be opened for reading: %s\n", ifilename);
+            custom_exit(ExitCode::FILE_NOT_FOUND);
+        }
+    }
+    std::vector<uint8_t> jpeg;
+    while (true) {
+        uint8_t buffer[65536];
+        ssize_t data_read = read(fdin, buffer, sizeof(buffer));
+        if (data_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (data_read < 0) {
+            custom_exit(ExitCode::SHORT_READ);
+        }
+        if (data_read == 0) {
+            break;
+        }
+        jpeg.insert(jpeg.end(), buffer, buffer + data_read);
+    }
+    if (fdin != 0) {
+        while (close(fdin) < 0 && errno == EINTR) {}
+    }
+    if (jpeg.size() < 2 || !is_jpeg_header(Sirikata::Array1d<uint8_t, 2>{{jpeg[0], jpeg[1]}})) {
+        fprintf(stderr, "Only jpeg files may be split into chunks\n");
+        custom_exit(ExitCode::UNSUPPORTED_JPEG);
+    }
+    // offsets into the jpeg, and the size field of each slice, are ints
+    if (jpeg.size() > (size_t)INT_MAX) {
+        fprintf(stderr, "Jpegs over %d bytes may not be split into chunks\n", INT_MAX);
+        custom_exit(ExitCode::UNSUPPORTED_JPEG);
+    }
+    std::string obase;
+    bool to_stdout = false;
+    if (file_no + 1 < file_cnt) {
+        obase = filelist[file_no + 1];
+        to_stdout = (obase == "-");
+    } else if (strcmp(ifilename, "-") == 0) {
+        to_stdout = true;
+    } else {
+        obase = postfix_uniq(ifilename, ".lep");
+    }
+    size_t num_chunks = (jpeg.size() + chunk_size - 1) / chunk_size;
+    // only the first slice could carry a progressive scan: the later ones
+    // need the coefficients of scans that began before their start byte
+    if (num_chunks > 1 && jpeg_header_is_progressive(jpeg)) {
+        fprintf(stderr, "Progressive jpegs may not be split into chunks\n");
+        custom_exit(ExitCode::PROGRESSIVE_UNSUPPORTED);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    int jpeg_pipe[2] = {-1, -1};
+    int lepton_pipe[2] = {-1, -1};
+    while (pipe(jpeg_pipe) < 0 || pipe(lepton_pipe) < 0) {
+        if (errno != EINTR) {
+            custom_exit(ExitCode::OS_ERROR);
+        }
+    }
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        // the child parses the whole jpeg once and writes every slice of it
+        while (close(jpeg_pipe[1]) < 0 && errno == EINTR) {}
+        while (close(lepton_pipe[0]) < 0 && errno == EINTR) {}
+        while (dup2(jpeg_pipe[0], 0) < 0 && errno == EINTR) {}
+        while (dup2(lepton_pipe[1], 1) < 0 && errno == EINTR) {}
+        while (close(jpeg_pipe[0]) < 0 && errno == EINTR) {}
+        while (close(lepton_pipe[1]) < 0 && errno == EINTR) {}
+        msgout = stderr;
+        filelist[file_no] = g_dash;
+        file_cnt = 1;
+        g_skip_validation = true; // the parent checks each slice instead
+        g_permissive = false;
+        process_file(nullptr, nullptr, 0, g_force_zlib0_out);
+        custom_exit(ExitCode::SUCCESS); // process_file always exits
+    }
+    while (close(jpeg_pipe[0]) < 0 && errno == EINTR) {}
+    while (close(lepton_pipe[1]) < 0 && errno == EINTR) {}
+    if (child < 0) {
+        custom_exit(ExitCode::OS_ERROR);
+    }
+    // the child reads all of the jpeg before it writes anything
+    for (size_t data_sent = 0; data_sent < jpeg.size();) {
+        ssize_t sent = write(jpeg_pipe[1], &jpeg[data_sent], jpeg.size() - data_sent);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            break; // the child exited early: its status is reported below
+        }
+        data_sent += sent;
+    }
+    while (close(jpeg_pipe[1]) < 0 && errno == EINTR) {}
+    std::vector<uint8_t> leptons;
+    while (true) {
+        uint8_t buffer[65536];
+        ssize_t data_read = read(lepton_pipe[0], buffer, sizeof(buffer));
+        if (data_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (data_read <= 0) {
+            break;
+        }
+        leptons.insert(leptons.end(), buffer, buffer + data_read);
+    }
+    while (close(lepton_pipe[0]) < 0 && errno == EINTR) {}
+    int status = 0;
+    while (waitpid(child, &status, 0) < 0 && errno == EINTR) {}
+    if (!WIFEXITED(status)) {
+        fprintf(stderr, "Chunk encoder terminated abnormally\n");
+        custom_exit(ExitCode::OS_ERROR);
+    }
+    if (WEXITSTATUS(status) != (int)ExitCode::SUCCESS) {
+        custom_exit((ExitCode)WEXITSTATUS(status)); // the child said why
+    }
+    // the slices are followed by their sizes and their count
+    always_assert(leptons.size() >= 4 * (num_chunks + 1)
+                  && LEtoUint32(&leptons[leptons.size() - 4]) == num_chunks);
+    size_t table = leptons.size() - 4 * (num_chunks + 1);
+    size_t offset = 0;
+    for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+        size_t chunk_start = chunk * chunk_size;
+        size_t chunk_end = std::min(chunk_start + chunk_size, jpeg.size());
+        size_t lepton_size = LEtoUint32(&leptons[table + 4 * chunk]);
+        always_assert(offset + lepton_size <= table);
+        if (!g_skip_validation) {
+            verify_chunk((unsigned int)chunk, &leptons[offset], lepton_size,
+                         &jpeg[chunk_start], chunk_end - chunk_start);
+        }
+        int fdout = 1;
+        if (!to_stdout) {
+            char suffix[32];
+            snprintf(suffix, sizeof(suffix), ".%03u", (unsigned int)chunk);
+            std::string ofilename = obase + suffix;
+            do {
+                fdout = open(ofilename.c_str(), O_WRONLY|O_CREAT|O_TRUNC, S_IWUSR | S_IRUSR);
+            } while (fdout == -1 && errno == EINTR);
+            if (fdout == -1) {
+                fprintf(stderr, "Output file unable to be opened for writing: %s\n",
+                        ofilename.c_str());
+                custom_exit(ExitCode::FILE_NOT_FOUND);
+            }
+        }
+        for (size_t data_sent = 0; data_sent < lepton_size;) {
+            ssize_t sent = write(fdout, &leptons[offset + data_sent], lepton_size - data_sent);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent <= 0) {
+                custom_exit(ExitCode::OS_ERROR);
+            }
+            data_sent += sent;
+        }
+        if (fdout != 1) {
+            while (close(fdout) < 0 && errno == EINTR) {}
+        }
+        offset += lepton_size;
+    }
+    ujgfilesize = table;
+    jpgfilesize = jpeg.size();
+}
+#endif
+
 void concatenate_files(int fdint, int fdout);
 
 void process_file(IOUtil::FileReader* reader,
@@ -1561,6 +2117,16 @@ void process_file(IOUtil::FileReader* reader,
     bool is_socket = false;
     ssize_t bytes_read =0 ;
     int fdin = open_fdin(ifilename, reader, header, &bytes_read, &is_socket);
+    if (action == lepton_rewrite_metadata && (embedded_jpeg || is_jpeg_header(header))) {
+        fprintf(stderr, "Unable to rewrite the metadata of a raw JPEG file\n");
+        custom_exit(ExitCode::VERSION_UNSUPPORTED);
+    }
+    if (action == lepton_verify && (embedded_jpeg || is_jpeg_header(header))) {
+        fprintf(stderr, "Unable to verify a raw JPEG file\n");
+        custom_exit(ExitCode::VERSION_UNSUPPORTED);
+    }
+    // validation turns a jpeg request into a lepton one, so note the direction now
+    bool is_decode_request = !(embedded_jpeg || is_jpeg_header(header));
     /*
     if (g_permissive && bytes_read < 2) {
         std::vector<uint8_t> input(bytes_read);
@@ -1594,6 +2160,12 @@ void process_file(IOUtil::FileReader* reader,
         
         }*/
     int fdout = -1;
+    if (embedded_jpeg || is_jpeg_header(header)) {
+        // -pixels, -scale and -transform only change what decodes write: the verify decode has to rebuild the jpeg
+        g_pixel_format = PixelFormat::JPEG;
+        g_scale_denominator = 1;
+        g_transform = LosslessTransform::NONE;
+    }
     if ((embedded_jpeg || is_jpeg_header(header) || g_permissive) && (g_permissive ||  !g_skip_validation)) {
         //fprintf(stderr, "ENTERED VALIDATION...\n");
         ExitCode validation_exit_code = ExitCode::SUCCESS;
@@ -1684,6 +2256,10 @@ void process_file(IOUtil::FileReader* reader,
         concatenate_files(fdin, fdout);
         return;
     }
+    if (action == lepton_rewrite_metadata) {
+        rewrite_metadata(fdin, fdout, header);
+        return;
+    }
     // check input file and determine filetype
     check_file(fdin, fdout, max_file_size, force_zlib0, embedded_jpeg, header, is_socket);
     
@@ -1703,7 +2279,7 @@ void process_file(IOUtil::FileReader* reader,
                 } else {
                     g_encoder.reset(makeEncoder<VPXBoolReader>(g_threaded, g_threaded));
                 }
-                TimingHarness::timing[0][TimingHarness::TS_MODEL_INIT] = TimingHarness::get_time_us();
+                TimingHarness::stamp(0, TimingHarness::TS_MODEL_INIT);
                 g_decoder = NULL;
             } else if (g_threaded && (action == socketserve || action == forkserve)) {
                 g_encoder->registerWorkers(get_worker_threads(NUM_THREADS - 1), NUM_THREADS  - 1);
@@ -1719,9 +2295,10 @@ void process_file(IOUtil::FileReader* reader,
         }
         if (!g_decoder) {
             g_decoder = makeDecoder(g_threaded, g_threaded, ujgversion == 3);
-            TimingHarness::timing[0][TimingHarness::TS_MODEL_INIT] = TimingHarness::get_time_us();
+            TimingHarness::stamp(0, TimingHarness::TS_MODEL_INIT);
             g_reference_to_free.reset(g_decoder);
-        } else if (NUM_THREADS > 1 && g_threaded && (action == socketserve || action == forkserve)) {
+        } else if (NUM_THREADS > 1 && g_threaded
+                   && (action == socketserve || action == forkserve || action == lepton_verify)) {
             g_decoder->registerWorkers(get_worker_threads(NUM_THREADS), NUM_THREADS);
         }
     }else if (filetype == UJG) {
@@ -1729,6 +2306,25 @@ void process_file(IOUtil::FileReader* reader,
         g_decoder = new SimpleComponentDecoder;
         g_reference_to_free.reset(g_decoder);
     }
+    if (filetype != JPEG && g_transform != LosslessTransform::NONE && !g_encoder) {
+        // the transformed image is compressed again by the decoder itself:
+        // it codes both ways, so its threads and models are reused and
+        // nothing new is started after the jail
+        if (filetype == UJG) {
+            g_encoder.reset(makeEncoder<VPXBoolReader>(false, false));
+        } else if (ujgversion == 3) {
+#ifdef ENABLE_ANS_EXPERIMENTAL
+            g_encoder.reset(static_cast<VP8ComponentDecoder<ANSBoolReader>*>(g_decoder));
+#else
+            always_assert(false&&"ANS-encoded file encountered but ANS not selected in build flags");
+#endif
+        } else {
+            g_encoder.reset(static_cast<VP8ComponentDecoder<VPXBoolReader>*>(g_decoder));
+        }
+        if (filetype == LEPTON) {
+            g_reference_to_free.release(); // g_encoder owns it now
+        }
+    }
 #ifndef _WIN32
     //FIXME
     if (g_time_bound_ms) {
@@ -1736,7 +2332,13 @@ void process_file(IOUtil::FileReader* reader,
         bound.it_value.tv_sec = g_time_bound_ms / 1000;
         bound.it_value.tv_usec = (g_time_bound_ms % 1000) * 1000;
         bound.it_interval.tv_sec = 0;
-        bound.it_interval.tv_usec = 0;
+        bound.it_interval.tv_usec = TIME_BOUND_GRACE_MS * 1000;
+        struct sigaction on_bound;
+        memset(&on_bound, 0, sizeof(on_bound));
+        on_bound.sa_handler = &sig_time_bound;
+        on_bound.sa_flags = SA_RESETHAND | SA_RESTART; // no syscall needed once jailed
+        sigemptyset(&on_bound.sa_mask);
+        sigaction(SIGALRM, &on_bound, NULL);
         int ret = setitimer(ITIMER_REAL, &bound, NULL);
 
         dev_assert(ret == 0 && "Timer must be able to be set");
@@ -1756,6 +2358,14 @@ void process_file(IOUtil::FileReader* reader,
 #endif
     }
 
+    if (g_adaptive_threads) {
+        g_idle_cpus = sample_idle_cpus(); // the load average is out of reach once jailed
+    }
+    if (g_thread_perf_counters) {
+        // here rather than at startup, so that -fork and -socket count the child
+        // coding this file; worker threads open theirs in wait_for_work
+        open_thread_perf_counters();
+    }
     if (g_use_seccomp) {
         Sirikata::installStrictSyscallFilter(true);
     }
@@ -1792,16 +2402,21 @@ void process_file(IOUtil::FileReader* reader,
               fprintf(stderr, "Unable to concatenate raw JPEG files together\n");
               custom_exit(ExitCode::VERSION_UNSUPPORTED);
               break;
+            case lepton_rewrite_metadata:
+            case lepton_header_info:
+            case lepton_verify:
+              always_assert(false && "should have been handled above");
             case comp:
             case forkserve:
             case socketserve:
                 timing_operation_start( 'c' );
-                TimingHarness::timing[0][TimingHarness::TS_READ_STARTED] = TimingHarness::get_time_us();
+                TimingHarness::stamp(0, TimingHarness::TS_READ_STARTED);
                 {
                     std::vector<uint8_t,
                                 Sirikata::JpegAllocator<uint8_t> > jpeg_file_raw_bytes;
                     unsigned int jpg_ident_offset = 2;
-                    if (start_byte == 0) {
+                    bool slices = g_chunk_size && action == comp;
+                    if (start_byte == 0 && !g_segment_checksums && !slices) {
                         ibytestream str_jpg_in(str_in,
                                                jpg_ident_offset,
                                                Sirikata::JpegAllocator<uint8_t>());
@@ -1819,16 +2434,29 @@ void process_file(IOUtil::FileReader* reader,
                                           embedded_jpeg));
                         jpeg_file_raw_bytes.swap(str_jpg_in.mutate_read_data());
                     }
-                    TimingHarness::timing[0][TimingHarness::TS_JPEG_DECODE_STARTED] =
-                        TimingHarness::timing[0][TimingHarness::TS_READ_FINISHED] = TimingHarness::get_time_us();
+                    TimingHarness::stamp(0, TimingHarness::TS_READ_FINISHED);
+#ifndef _WIN32
+                    publish_predicted_memory(predicted_request_memory());
+#endif
+                    TimingHarness::stamp(0, TimingHarness::TS_JPEG_DECODE_STARTED);
                     std::vector<ThreadHandoff> luma_row_offsets;
-                    execute(std::bind(&decode_jpeg, huff_input_offset, &luma_row_offsets));
-                    TimingHarness::timing[0][TimingHarness::TS_JPEG_DECODE_FINISHED]
-                        = TimingHarness::get_time_us();
+                    // each slice is bounded at the mcu holding its cut
+                    std::vector<uint32_t> mcu_offsets;
+                    execute(std::bind(&decode_jpeg, huff_input_offset, &luma_row_offsets,
+                                      slices ? &mcu_offsets : NULL));
+                    TimingHarness::stamp(0, TimingHarness::TS_JPEG_DECODE_FINISHED);
                     //execute( check_value_range );
-                    execute(std::bind(&write_ujpg,
-                                      std::move(luma_row_offsets),
-                                      jpeg_file_raw_bytes.empty() ? NULL : &jpeg_file_raw_bytes));
+                    if (slices) {
+                        execute(std::bind(&write_ujpg_slices,
+                                          std::move(luma_row_offsets),
+                                          std::move(mcu_offsets),
+                                          &jpeg_file_raw_bytes,
+                                          g_chunk_size));
+                    } else {
+                        execute(std::bind(&write_ujpg,
+                                          std::move(luma_row_offsets),
+                                          jpeg_file_raw_bytes.empty() ? NULL : &jpeg_file_raw_bytes));
+                    }
                 }
                 timing_operation_complete( 'c' );
                 break;
@@ -1849,7 +2477,10 @@ void process_file(IOUtil::FileReader* reader,
         switch ( action )
         {
             case lepton_concatenate:
+            case lepton_rewrite_metadata:
+            case lepton_header_info:
               always_assert(false && "should have been handled above");
+            case lepton_verify:
             case comp:
             case forkserve:
             case socketserve:
@@ -1857,21 +2488,33 @@ void process_file(IOUtil::FileReader* reader,
                     overall_start = clock();
                 }
                 timing_operation_start( 'd' );
-                TimingHarness::timing[0][TimingHarness::TS_READ_STARTED] = TimingHarness::get_time_us();
+                TimingHarness::stamp(0, TimingHarness::TS_READ_STARTED);
                 while (true) {
                     execute( read_ujpg ); // replace with decompression function!
-                    TimingHarness::timing[0][TimingHarness::TS_READ_FINISHED] = TimingHarness::get_time_us();
+                    TimingHarness::stamp(0, TimingHarness::TS_READ_FINISHED);
+#ifndef _WIN32
+                    publish_predicted_memory(predicted_request_memory());
+#endif
                     if (!g_use_seccomp) {
                         read_done = clock();
                     }
-                    TimingHarness::timing[0][TimingHarness::TS_JPEG_RECODE_STARTED] = TimingHarness::get_time_us();
-                    if (filetype != UJG && !g_allow_progressive) {
+                    TimingHarness::stamp(0, TimingHarness::TS_JPEG_RECODE_STARTED);
+                    if (g_pixel_format != PixelFormat::JPEG) {
+                        execute(decode_pixels_wrapper);
+                    } else if (g_scale_denominator != 1) {
+                        execute(write_scaled_jpeg_wrapper);
+                    } else if (g_transform != LosslessTransform::NONE) {
+                        execute(write_transformed_ujpg);
+                    } else if (filetype != UJG && !g_allow_progressive) {
                         execute(recode_baseline_jpeg_wrapper);
                     } else {
                         execute(recode_jpeg);
                     }
                     timing_operation_complete( 'd' );
-                    TimingHarness::timing[0][TimingHarness::TS_JPEG_RECODE_FINISHED] = TimingHarness::get_time_us();
+                    TimingHarness::stamp(0, TimingHarness::TS_JPEG_RECODE_FINISHED);
+                    if (Cancellation::requested()) {
+                        break; // the rest of the input will not be read
+                    }
                     Sirikata::Array1d<uint8_t, 6> trailer_new_header;
                     std::pair<uint32_t, Sirikata::JpegError> continuity;
                     size_t off = 0;
@@ -1909,8 +2552,24 @@ void process_file(IOUtil::FileReader* reader,
             // FIXME: can't delete broken output--it's gone already
         }
     }
-    TimingHarness::timing[0][TimingHarness::TS_DONE] = TimingHarness::get_time_us();
+    TimingHarness::stamp(0, TimingHarness::TS_DONE);
     TimingHarness::print_results();
+    {
+        uint64_t num_blocks = 0;
+        for (int i = 0; i < colldata.get_num_components(); ++i) {
+            num_blocks += colldata.component_size_in_blocks(i);
+        }
+        TimingHarness::print_perf_counters(num_blocks);
+        print_cache_sim(2, num_blocks);
+    }
+    TraceHarness::flush();
+#ifndef _WIN32
+    if (is_decode_request) {
+        publish_request_metrics(ujgfilesize, jpgfilesize, true);
+    } else {
+        publish_request_metrics(jpgfilesize, ujgfilesize, false);
+    }
+#endif
     if (!g_use_seccomp) {
         end = clock();
     }
@@ -2015,6 +2674,10 @@ void process_file(IOUtil::FileReader* reader,
     if ( ( verbosity > 1 ) && ( action == comp ) )
         fprintf( msgout,  "\n" );
     LeptonDebug::dumpDebugData();
+    if (Cancellation::requested()) {
+        // the coding threads unwound and were joined; only the status is left
+        custom_exit(ExitCode::TIMED_OUT);
+    }
     if (errorlevel.load()) {
         custom_exit(ExitCode::UNSUPPORTED_JPEG); // custom exit will delete generic_workers
     } else {
@@ -2081,17 +2744,43 @@ void show_help( void )
     fprintf(msgout, " [-version]       File format version of lepton codec\n" );
     fprintf(msgout, " [-revision]      GIT Hash of lepton source that built this binary\n");
     fprintf(msgout, " [-zlib0]         Instead of a jpg, return a zlib-compressed jpeg\n");
+    fprintf(msgout, " [-pixels=rgb]    Instead of a jpg, decode to interleaved RGB (binary PPM)\n");
+    fprintf(msgout, " [-pixels=ycbcr]  Instead of a jpg, decode to planar YCbCr (YUV4MPEG2)\n");
+    fprintf(msgout, " [-scale=1/<n>]   Decode to a jpg n = 2, 4 or 8 times smaller on each side\n");
+    fprintf(msgout, " [-transform=<t>] Rotate or flip a lepton file losslessly: rot90, rot180,\n");
+    fprintf(msgout, "                  rot270, fliph, flipv, transpose or transverse\n");
     fprintf(msgout, " [-startbyte=<n>] Encoded file will only contain data at and after <n>\n");
     fprintf(msgout, " [-trunc=<n>]     Encoded file will be truncated at size <n> - startbyte\n");
+#ifndef _WIN32
+    fprintf(msgout, " [-chunksize=<n>] Emit one independent lepton file per <n> bytes of jpeg\n");
+    fprintf(msgout, "                  (not progressive; every slice must hold the start of an MCU row)\n");
+    fprintf(msgout, " [-container]     Compress the jpegs found anywhere in the input file\n");
+    fprintf(msgout, " [-container=<n>] Likewise, encoding <n> jpegs or other parts at a time\n");
+    fprintf(msgout, "                  (a jpeg followed by more jpegs, as in an MPO, is always encoded so)\n");
+#endif
 //    fprintf(msgout, " [-avx2upgrade]   Try to exec <binaryname>-avx if avx is available\n");
 //    fprintf(msgout, " [-injectsyscall={1..4}]  Inject a \"chdir\" syscall & check SECCOMP crashes\n");
     fprintf(msgout, " [-unjailed]      Do not jail this process (use only with trusted data)\n" );
     fprintf(msgout, " [-singlethread]  Do not clone threads to operate on the input file\n" );
+#ifdef __linux__
+    fprintf(msgout, " [-pinthreads]    Keep the threads of each image on one shared cache/node\n" );
+#endif
     fprintf(msgout, " [-maxencodethreads=<n>] Can use <n> threads to decode: higher=bigger file\n");
+    fprintf(msgout, " [-adaptivethreads] Pick threads per image from its coding cost and idle cores\n");
+    fprintf(msgout, " [-segmentchecksums] Store a crc32c of each thread segment so decodes fail early\n");
     fprintf(msgout, " [-allowprogressive] Allow progressive jpegs through the compressor\n");
     fprintf(msgout, " [-rejectprogressive] Reject encoding of progressive jpegs\n");
     fprintf(msgout, " [-timebound=<>ms]For -socket, enforce a timeout since first byte received\n");
     fprintf(msgout, " [-lepcat] Concatenate lepton files together into a file that contains multiple substrings\n");
+    fprintf(msgout, " [-stripmeta]     Drop the EXIF, XMP and other APPn/COM segments of a lepton file\n");
+    fprintf(msgout, "                  without recoding it; APP0 (JFIF) and APP14 (Adobe) stay\n");
+    fprintf(msgout, " [-metadatafrom=<jpg>] Like -stripmeta, then add the APPn/COM segments of <jpg>\n");
+    fprintf(msgout, " [-info]          Print the header fields of each lepton file as a line of JSON\n");
+#ifndef _WIN32
+    fprintf(msgout, " [-verifybatch=<n>] Decode each lepton file, <n> at a time, printing the md5 of each jpeg\n");
+    fprintf(msgout, " [-verifysums=<file>] With -verifybatch, fail files whose md5 differs from <file>\n");
+    fprintf(msgout, "                  (md5sum format; x.lep and x.jpg.lep match the sum of x.jpg)\n");
+#endif
     fprintf(msgout, " [-memory=<>M]    Upper bound on the amount of memory allocated by main\n");
     fprintf(msgout, " [-threadmemory=<>M] Bound on the amount of memory allocated by threads\n");
     fprintf(msgout, " [-recodememory=<>M] Check that a singlethreaded recode only uses <>M mem\n");
@@ -2102,7 +2791,15 @@ void show_help( void )
     fprintf(msgout, " [-listenbacklog=<n>] n clients queued for encoding if maxchildren reached\n" );
     fprintf(msgout, " [-zliblisten=<port>] Serve requests on a TCP socket on <port> (def 2403)\n" );
     fprintf(msgout, " [-maxchildren]   Max codes to ever spawn at the same time in socket mode\n");
+    fprintf(msgout, " [-statsocket=<name>] In socket mode, serve Prometheus text metrics at <name>\n");
+    fprintf(msgout, "                  (per stage timings only with -unjailed: jailed workers can't read the clock)\n");
+    fprintf(msgout, " [-resultcache=<dir>] In socket mode, answer repeated inputs from results kept in <dir>\n");
+    fprintf(msgout, " [-resultcachesize=<>M] Bound on the bytes kept by -resultcache (default 256M)\n");
+    fprintf(msgout, " [-admitmemory=<>M] In socket mode, admit clients while the memory predicted\n");
+    fprintf(msgout, "                  for the requests in flight stays under <>M\n");
 #endif
+    fprintf(msgout, " [-trace=<file>]  Append Chrome trace-event spans per thread to <file> (needs -unjailed)\n");
+    fprintf(msgout, " [-perfcounters]  Report IPC and cache/branch misses per block for each stage and thread\n");
     fprintf(msgout, " [-benchmark]     Run a benchmark on optional [<input_file>] (or included file)\n");
     fprintf(msgout, " [-verbose]       Run the benchmark in verbose mode (more output to stderr)\n");
     fprintf(msgout, " [-benchreps=<n>] Number of trials to run the benchmark for each category\n");
@@ -2147,6 +2844,8 @@ unsigned char read_fixed_ujpg_header() {
     }
     ujgversion = header[0];
     if (header[1] == 'X') {
+        // an earlier file of a concatenation may have turned it off
+        g_allow_progressive = g_allow_progressive_option;
     } else if (header[1] != 'Z' && header[1] != 'Y') {
         char err[] = "?: Unknown Item in header instead of Z";
         err[0] = header[1];
@@ -2154,7 +2853,10 @@ unsigned char read_fixed_ujpg_header() {
         }
     }
     if (header[1] == 'Z' || (header[1] & 1) == ('Y' & 1)) {
-        if (!g_force_progressive) {
+        if (g_scale_denominator != 1 || g_transform != LosslessTransform::NONE) {
+            // scaling and transforms read blocks of the full frame out of decode order
+            g_allow_progressive = true;
+        } else if (!g_force_progressive) {
             g_allow_progressive = false;
         }
     }
@@ -2212,6 +2914,12 @@ bool check_file(int fd_in, int fd_out, uint32_t max_file_size, bool force_zlib0,
             known_size_callback = &nop;
             write_target = zwriter;
         }
+        if (action == lepton_verify) {
+            write_target = new Md5Writer(write_target);
+        }
+        if (g_transform != LosslessTransform::NONE) {
+            ujg_out = writer; // the output is a lepton file again
+        }
         str_out = new bounded_iostream( write_target,
                                         known_size_callback,
                                         Sirikata::JpegAllocator<uint8_t>());
@@ -2301,6 +3009,7 @@ bool read_jpeg(std::vector<std::pair<uint32_t,
             // switch to huffman data reading mode
             cpos = 0;
             crst = 0;
+            scnp_jpg.push_back(huffw->getpos());
             while ( true ) {
                 huff_input_offsets->push_back(std::pair<uint32_t, uint32_t>(huffw->getpos(),
                                                                             jpg_in->getsize()));
@@ -2511,21 +3220,29 @@ bool rst_cnt_ok(int scan, unsigned int num_rst_markers_this_scan) {
 }
 
 
-ThreadHandoff crystallize_thread_handoff(abitreader *reader,
-                                         const std::vector<std::pair<uint32_t, uint32_t> >&huff_input_offsets,
-                                         int mcu_y,
-                                         int lastdc[4],
-                                         int luma_mul) {
+// maps a position in huffdata back to the jpeg file, in the units of
+// ThreadHandoff::segment_size
+uint32_t huff_to_file_offset(const std::vector<std::pair<uint32_t, uint32_t> >&huff_input_offsets,
+                             uint32_t pos) {
     auto iter = std::lower_bound(huff_input_offsets.begin(), huff_input_offsets.end(),
-                                 std::pair<uint32_t, uint32_t>(reader->getpos(), reader->getpos()));
+                                 std::pair<uint32_t, uint32_t>(pos, pos));
     uint32_t mapped_item = 0;
     if (iter != huff_input_offsets.begin()) {
         --iter;
     }
     if (iter != huff_input_offsets.end()) {
         mapped_item = iter->second;
-        mapped_item += reader->getpos() - iter->first;
+        mapped_item += pos - iter->first;
     }
+    return mapped_item;
+}
+
+ThreadHandoff crystallize_thread_handoff(abitreader *reader,
+                                         const std::vector<std::pair<uint32_t, uint32_t> >&huff_input_offsets,
+                                         int mcu_y,
+                                         int lastdc[4],
+                                         int luma_mul) {
+    uint32_t mapped_item = huff_to_file_offset(huff_input_offsets, reader->getpos());
     //fprintf(stderr, "ROWx (%08lx): %x -> %x\n", reader->debug_peek(), reader->getpos(), mapped_item);
     ThreadHandoff retval = ThreadHandoff::zero();
     retval.segment_size = mapped_item; // the caller will need to take the difference of the chosen items
@@ -2786,12 +3503,338 @@ MergeJpegStreamingStatus merge_jpeg_streaming(MergeJpegProgress *stored_progress
 
 
 
+/* -----------------------------------------------
+    progressive AC scans on worker threads
+    ----------------------------------------------- */
+
+// A non interleaved progressive AC scan only touches the bands from..to of
+// one component, and it starts byte aligned with its own eobrun and huffman
+// table. So the scans of each component form a lane that a worker can decode
+// (or recode) in order, while the main thread goes through the DC scans.
+struct BandScan {
+    int scan; // index of the scan
+    int cmp;
+    int from;
+    int to;
+    int sah;
+    int sal;
+    int rsti; // restart interval of the scan
+    huffTree tree;
+    huffCodes codes;
+    unsigned int start; // decode_jpeg: first byte of the scan in huffdata
+    unsigned int end; // decode_jpeg: byte after the scan
+    bool eof;
+    bool non_optimal;
+    bool padbit_mismatch;
+    int sta; // -1 for an error, also if the lane stopped before this scan
+    int dpos;
+    int out_start; // recode_jpeg: coded bytes in the writer of the lane
+    int out_end;
+    std::vector<int> rst_ends; // recode_jpeg: last byte of each restart interval
+    int num_rst;
+};
+
+/* -----------------------------------------------
+    lists the scans that can go on a lane, false if
+    the lanes cannot be used for this image
+    ----------------------------------------------- */
+bool collect_band_scans(std::vector<BandScan> *band_scans, unsigned int *num_scans)
+{
+    // parse_jfif_jpg sets the tables of the current scan, so keep them
+    Sirikata::Array1d<Sirikata::Array1d<huffCodes, 4>, 2> saved_hcodes = hcodes;
+    Sirikata::Array1d<Sirikata::Array1d<huffTree, 4>, 2> saved_htrees = htrees;
+    Sirikata::Array1d<Sirikata::Array1d<unsigned char, 4>, 2> saved_htset = htset;
+    Sirikata::Array1d<componentInfo, 4> saved_cmpnfo = cmpnfo;
+    Sirikata::Array1d<int, 4> saved_cs_cmp = cs_cmp;
+    int saved_cs[] = {cs_cmpc, cs_from, cs_to, cs_sah, cs_sal, rsti, errorlevel.load()};
+    bool retval = true;
+    *num_scans = 0;
+    for ( uint32_t hpos = 0; retval && 3 + ( uint64_t ) hpos < hdrs; ) {
+        unsigned char type = hdrdata[ hpos + 1 ];
+        unsigned int len = 2 + B_SHORT( hdrdata[ hpos + 2 ], hdrdata[ hpos + 3 ] );
+        if ( ( uint64_t ) hpos + len > hdrs ) {
+            retval = false;
+        } else if ( ( type == 0xC4 ) || ( type == 0xDA ) || ( type == 0xDD ) ) {
+            retval = parse_jfif_jpg( type, len, len, &( hdrdata[ hpos ] ) );
+        }
+        if ( retval && type == 0xDA ) {
+            if ( cs_cmpc == 1 && cs_to > 0 ) {
+                int cmp = cs_cmp[ 0 ];
+                if ( cs_from == 0 || !htset[ 1 ][ cmpnfo[ cmp ].huffac ] ) {
+                    retval = false; // leave it to the main thread to complain
+                } else {
+                    band_scans->push_back(BandScan());
+                    BandScan &band_scan = band_scans->back();
+                    band_scan.scan = *num_scans;
+                    band_scan.cmp = cmp;
+                    band_scan.from = cs_from;
+                    band_scan.to = cs_to;
+                    band_scan.sah = cs_sah;
+                    band_scan.sal = cs_sal;
+                    band_scan.rsti = rsti;
+                    band_scan.tree = htrees[ 1 ][ cmpnfo[ cmp ].huffac ];
+                    band_scan.codes = hcodes[ 1 ][ cmpnfo[ cmp ].huffac ];
+                    band_scan.start = 0;
+                    band_scan.end = 0;
+                    band_scan.eof = false;
+                    band_scan.non_optimal = false;
+                    band_scan.padbit_mismatch = false;
+                    band_scan.sta = -1;
+                    band_scan.dpos = 0;
+                    band_scan.out_start = 0;
+                    band_scan.out_end = 0;
+                    band_scan.num_rst = 0;
+                }
+            }
+            ++*num_scans;
+        }
+        hpos += len;
+    }
+    hcodes = saved_hcodes;
+    htrees = saved_htrees;
+    htset = saved_htset;
+    cmpnfo = saved_cmpnfo;
+    cs_cmp = saved_cs_cmp;
+    cs_cmpc = saved_cs[ 0 ];
+    cs_from = saved_cs[ 1 ];
+    cs_to = saved_cs[ 2 ];
+    cs_sah = saved_cs[ 3 ];
+    cs_sal = saved_cs[ 4 ];
+    rsti = saved_cs[ 5 ];
+    errorlevel.store(saved_cs[ 6 ]);
+    return retval && !band_scans->empty();
+}
+
+/* -----------------------------------------------
+    decodes a band scan like decode_jpeg does
+    ----------------------------------------------- */
+void decode_band_scan(BandScan *scan, int8_t *padbit)
+{
+    abitreader huffr( huffdata + scan->start, hufs - scan->start );
+    Sirikata::Aligned256Array1d<int16_t,64> block;
+    int peobrun;
+    unsigned int eobrun;
+    int rstw;
+    int cmp = scan->cmp;
+    int dpos = 0;
+    int bpos, eob, sta;
+
+    while ( true ) {
+        sta = 0;
+        eobrun = 0;
+        peobrun = 0;
+        rstw = scan->rsti;
+        if ( scan->sah == 0 ) {
+            // ---> succesive approximation first stage <---
+            while ( sta == 0 ) {
+                eob = decode_ac_prg_fs( &huffr, &scan->tree, block.begin(), &eobrun,
+                                        scan->from, scan->to );
+                AlignedBlock &aligned_block = colldata.mutable_block((BlockType)cmp, dpos);
+                for ( bpos = scan->from; bpos < eob; bpos++ ) {
+                    uint16_t block_bpos = block[ bpos ];
+                    block_bpos <<= scan->sal; // prevents UB since block_bpos could be negative
+                    aligned_block.mutable_coefficients_zigzag(bpos) = block_bpos;
+                }
+                if ( eob < 0 ) sta = -1;
+                else sta = skip_eobrun( &cmp, &dpos, &rstw, &eobrun, scan->rsti );
+                if ( sta == 0 )
+                    sta = next_mcuposn( &cmp, &dpos, &rstw, scan->rsti );
+                if ( huffr.eof ) {
+                    sta = 2;
+                    break;
+                }
+            }
+        }
+        else {
+            // ---> succesive approximation later stage <---
+            while ( sta == 0 ) {
+                AlignedBlock &aligned_block = colldata.mutable_block((BlockType)cmp, dpos);
+                for ( bpos = scan->from; bpos <= scan->to; bpos++ ) {
+                    block[ bpos ] = aligned_block.coefficients_zigzag(bpos);
+                }
+                if ( eobrun == 0 ) {
+                    eob = decode_ac_prg_sa( &huffr, &scan->tree, block.begin(), &eobrun,
+                                            scan->from, scan->to );
+                    if ( ( eob == scan->from ) && ( eobrun > 0 ) &&
+                         ( peobrun > 0 ) && ( peobrun < scan->codes.max_eobrun - 1 ) ) {
+                        scan->non_optimal = true;
+                    }
+                }
+                else {
+                    eob = decode_eobrun_sa( &huffr, block.begin(), &eobrun, scan->from, scan->to );
+                }
+                peobrun = eobrun;
+                for ( bpos = scan->from; bpos <= scan->to; bpos++ ) {
+                    uint16_t block_bpos = block[ bpos ];
+                    block_bpos <<= scan->sal;
+                    aligned_block.mutable_coefficients_zigzag(bpos) += block_bpos;
+                }
+                if ( eob < 0 ) sta = -1;
+                else sta = next_mcuposn( &cmp, &dpos, &rstw, scan->rsti );
+                if ( huffr.eof ) {
+                    sta = 2;
+                    break;
+                }
+            }
+        }
+        // the main thread reports the mismatch
+        if ( *padbit != huffr.unpad( *padbit ) ) {
+            scan->padbit_mismatch = true;
+            *padbit = 1;
+        }
+        if ( sta == -1 || sta == 2 ) break;
+    }
+    scan->sta = sta;
+    scan->dpos = dpos;
+    scan->eof = huffr.eof;
+    scan->end = scan->start + huffr.getpos() - 1;
+}
+
+void decode_band_lane(std::vector<BandScan> *band_scans, unsigned int lane, unsigned int num_lanes,
+                      int8_t padbit)
+{
+    for (size_t i = 0; i < band_scans->size(); ++i) {
+        BandScan &scan = (*band_scans)[i];
+        if (scan.cmp % num_lanes != lane) {
+            continue;
+        }
+        decode_band_scan(&scan, &padbit);
+        if (scan.sta == -1) {
+            break; // the rest of the lane keeps sta -1
+        }
+    }
+}
+
+// decode_jpeg runs its lanes on the workers of the encoder
+void wait_for_band_lanes(unsigned int band_lanes)
+{
+    for (unsigned int lane = 0; lane < band_lanes; ++lane) {
+        g_encoder->getWorker(lane)->main_wait_for_done();
+    }
+}
+
+/* -----------------------------------------------
+    recodes a band scan like recode_jpeg does, to
+    its own bytes
+    ----------------------------------------------- */
+void encode_band_scan(BandScan *scan, abitwriter *huffw, abytewriter *storw)
+{
+    Sirikata::Aligned256Array1d<int16_t,64> block;
+    unsigned int eobrun;
+    int rstw;
+    int cmp = scan->cmp;
+    int dpos = 0;
+    int bpos, eob, sta;
+
+    scan->out_start = huffw->getpos();
+    while ( true ) {
+        sta = 0;
+        eobrun = 0;
+        rstw = scan->rsti;
+        while ( sta == 0 ) {
+            const AlignedBlock& aligned_block = colldata.block_nosync((BlockType)cmp, dpos);
+            for ( bpos = scan->from; bpos <= scan->to; bpos++ ) {
+                block[ bpos ] = FDIV2( aligned_block.coefficients_zigzag(bpos), scan->sal );
+            }
+            if ( scan->sah == 0 ) {
+                eob = encode_ac_prg_fs( huffw, &scan->codes, block.begin(), &eobrun,
+                                        scan->from, scan->to );
+            } else {
+                eob = encode_ac_prg_sa( huffw, storw, &scan->codes, block.begin(), &eobrun,
+                                        scan->from, scan->to );
+            }
+            if ( eob < 0 ) sta = -1;
+            else sta = next_mcuposn( &cmp, &dpos, &rstw, scan->rsti );
+        }
+        encode_eobrun( huffw, &scan->codes, &eobrun );
+        if ( scan->sah != 0 ) {
+            encode_crbits( huffw, storw );
+        }
+        huffw->pad( padbit );
+        if ( sta == -1 || sta == 2 ) break;
+        if ( scan->num_rst == (int)scan->rst_ends.size() ) {
+            sta = -1;
+            break;
+        }
+        scan->rst_ends[ scan->num_rst++ ] = huffw->getpos() - 1 - scan->out_start;
+        huffw->flush_no_pad();
+    }
+    if ( huffw->bound_reached() ) {
+        sta = -1; // the main thread will hit the bound of the output the same way
+    }
+    scan->sta = sta;
+    scan->dpos = dpos;
+    scan->out_end = huffw->getpos();
+}
+
+void encode_band_lane(std::vector<BandScan> *band_scans, unsigned int lane, unsigned int num_lanes,
+                      abitwriter *huffw, abytewriter *storw)
+{
+    for (size_t i = 0; i < band_scans->size(); ++i) {
+        BandScan &scan = (*band_scans)[i];
+        if (scan.cmp % num_lanes != lane) {
+            continue;
+        }
+        encode_band_scan(&scan, huffw, storw);
+        if (scan.sta == -1) {
+            break; // recode_jpeg codes the rest of the lane itself
+        }
+    }
+}
+
+// recode_jpeg runs its lanes on the workers of the decoder, each with writers
+// that can hold the whole jpeg so that the workers never allocate
+struct BandRecodeLanes {
+    unsigned int num_lanes;
+    Sirikata::Array1d<abitwriter*, MAX_NUM_THREADS> huffw;
+    Sirikata::Array1d<abytewriter*, MAX_NUM_THREADS> storw;
+    Sirikata::Array1d<bool, MAX_NUM_THREADS> done;
+    BandRecodeLanes() {
+        num_lanes = 0;
+    }
+    static size_t memory_per_lane() {
+        return (size_t)max_file_size + 64 + ABIT_WRITER_PRELOAD;
+    }
+    void start(std::vector<BandScan> *band_scans, unsigned int lanes) {
+        num_lanes = lanes;
+        for (size_t i = 0; i < band_scans->size(); ++i) {
+            BandScan &scan = (*band_scans)[i];
+            scan.rst_ends.resize(scan.rsti > 0 ? cmpnfo[scan.cmp].bc / scan.rsti + 1 : 0);
+        }
+        for (unsigned int lane = 0; lane < num_lanes; ++lane) {
+            huffw[lane] = new abitwriter(max_file_size + 64, max_file_size);
+            huffw[lane]->fillbit = padbit;
+            storw[lane] = new abytewriter(ABIT_WRITER_PRELOAD);
+            done[lane] = false;
+            GenericWorker *worker = g_decoder->getWorker(lane);
+            worker->work = std::bind(&encode_band_lane, band_scans, lane, num_lanes,
+                                     huffw[lane], storw[lane]);
+            worker->activate_work();
+        }
+    }
+    void wait(unsigned int lane) {
+        if (!done[lane]) {
+            g_decoder->getWorker(lane)->main_wait_for_done();
+            done[lane] = true;
+        }
+    }
+    ~BandRecodeLanes() {
+        for (unsigned int lane = 0; lane < num_lanes; ++lane) {
+            wait(lane);
+            delete huffw[lane];
+            delete storw[lane];
+        }
+    }
+};
+
+
 /* -----------------------------------------------
     JPEG decoding routine
     ----------------------------------------------- */
 
 bool decode_jpeg(const std::vector<std::pair<uint32_t, uint32_t> > & huff_input_offsets,
-                 std::vector<ThreadHandoff>*luma_row_offset_return)
+                 std::vector<ThreadHandoff>*luma_row_offset_return,
+                 std::vector<uint32_t>*mcu_file_offsets)
 {
     abitreader* huffr; // bitwise reader for image data
 
@@ -2819,6 +3862,16 @@ bool decode_jpeg(const std::vector<std::pair<uint32_t, uint32_t> > & huff_input_
     // preset count of scans
     scnc = 0;
 
+    // the AC scans of each component may go to a worker
+    std::vector<BandScan> band_scans;
+    unsigned int num_scans = 0;
+    unsigned int band_lanes = 0; // lanes started, 0 if the main thread decodes every scan
+    size_t next_band_scan = 0;
+    bool use_band_lanes = jpegtype == 2 && g_threaded && g_allow_progressive
+        && g_encoder && g_encoder->getNumWorkers() > 0
+        && !early_eof_encountered && start_byte == 0
+        && collect_band_scans(&band_scans, &num_scans) && num_scans == scnp_jpg.size();
+
     // JPEG decompression loop
     while ( true )
     {
@@ -2838,6 +3891,7 @@ bool decode_jpeg(const std::vector<std::pair<uint32_t, uint32_t> > & huff_input_
                     hdr_seg_data = &( hdrdata[ hpos ] );
                 }
                 if ( !parse_jfif_jpg( type, len, len, hdr_seg_data ) ) {
+                    wait_for_band_lanes(band_lanes);
                     delete huffr;
                     return false;
                 }
@@ -2855,6 +3909,7 @@ bool decode_jpeg(const std::vector<std::pair<uint32_t, uint32_t> > & huff_input_
                  ( jpegtype == 1 && htset[ 1 ][ cmpnfo[cmp].huffdc ] == 0 ) ||
                  ( cs_cmpc == 1 && cs_to > 0 && cs_sah == 0 && htset[ 1 ][ cmpnfo[cmp].huffac ] == 0 ) ) {
                 fprintf( stderr, "huffman table missing in scan%i", scnc );
+                wait_for_band_lanes(band_lanes);
                 delete huffr;
                 errorlevel.store(2);
                 return false;
@@ -2876,6 +3931,41 @@ bool decode_jpeg(const std::vector<std::pair<uint32_t, uint32_t> > & huff_input_
                 max_cmp = std::max(max_cmp, cs_cmp[i]);
             }
         }
+        if ( use_band_lanes && next_band_scan < band_scans.size()
+             && band_scans[ next_band_scan ].scan == scnc ) {
+            // start the lanes at the first AC scan, once the padbit is known
+            if ( !band_lanes ) {
+                if ( padbit == -1 || huffr->getpos() - 1 != (int)scnp_jpg[ scnc ] ) {
+                    use_band_lanes = false;
+                } else {
+                    band_lanes = std::min((unsigned int)cmpc, g_encoder->getNumWorkers());
+                    for ( size_t i = 0; i < band_scans.size(); i++ ) {
+                        band_scans[ i ].start = scnp_jpg[ band_scans[ i ].scan ];
+                    }
+                    for ( unsigned int lane = 0; lane < band_lanes; lane++ ) {
+                        GenericWorker *worker = g_encoder->getWorker(lane);
+                        worker->work = std::bind(&decode_band_lane, &band_scans, lane, band_lanes, padbit);
+                        worker->activate_work();
+                    }
+                }
+            }
+            if ( band_lanes ) {
+                if ( huffr->getpos() - 1 != (int)scnp_jpg[ scnc ] ) {
+                    fprintf( stderr, "decode error in scan%i / mcu%i", scnc, 0 );
+                    wait_for_band_lanes(band_lanes);
+                    delete huffr;
+                    errorlevel.store(2);
+                    return false;
+                }
+                // the lane decodes this scan, go on with the next one
+                next_band_scan++;
+                scnc++;
+                if ( (size_t)scnc < scnp_jpg.size() ) {
+                    huffr->skip_to( scnp_jpg[ scnc ] );
+                }
+                continue;
+            }
+        }
 /*
         // startup
         luma_row_offset_return->push_back(crystallize_thread_handoff(huffr,
@@ -2932,6 +4022,11 @@ bool decode_jpeg(const std::vector<std::pair<uint32_t, uint32_t> > & huff_input_
                                                                                          cmpnfo[0].bcv / mcuv));
                             do_handoff_print = false;
                         }
+                        if (mcu_file_offsets && cs_cmpc == cmpc && csc == 0 && sub == 0
+                            && (size_t)mcu == mcu_file_offsets->size()) {
+                            mcu_file_offsets->push_back(huff_to_file_offset(huff_input_offsets,
+                                                                            huffr->getpos()));
+                        }
 
                         if(!huffr->eof) {
                             max_dpos[cmp] = std::max(dpos, max_dpos[cmp]); // record the max block read
@@ -3052,6 +4147,11 @@ bool decode_jpeg(const std::vector<std::pair<uint32_t, uint32_t> > & huff_input_
                                                                                          cmpnfo[0].bcv / mcuv));
                             do_handoff_print = false;
                         }
+                        if (mcu_file_offsets && cmpc == 1
+                            && (size_t)dpos == mcu_file_offsets->size()) {
+                            mcu_file_offsets->push_back(huff_to_file_offset(huff_input_offsets,
+                                                                            huffr->getpos()));
+                        }
                         if(!huffr->eof) max_dpos[cmp] = std::max(dpos, max_dpos[cmp]); // record the max block serialized
                         // decode block
                         eob = decode_block_seq( huffr,
@@ -3259,6 +4359,7 @@ bool decode_jpeg(const std::vector<std::pair<uint32_t, uint32_t> > & huff_input_
             if ( sta == -1 ) { // status -1 means error
                 fprintf( stderr, "decode error in scan%i / mcu%i",
                     scnc, ( cs_cmpc > 1 ) ? mcu : dpos );
+                wait_for_band_lanes(band_lanes);
                 delete huffr;
                 errorlevel.store(2);
                 return false;
@@ -3270,6 +4371,35 @@ bool decode_jpeg(const std::vector<std::pair<uint32_t, uint32_t> > & huff_input_
             // else if ( sta == 1 ); // status 1 means restart - so stay in the loop
         }
     }
+    if ( band_lanes ) {
+        wait_for_band_lanes(band_lanes);
+        for ( size_t i = 0; i < band_scans.size(); i++ ) {
+            const BandScan &band_scan = band_scans[ i ];
+            if ( band_scan.non_optimal ) {
+                fprintf( stderr,
+                    "reconstruction of non optimal coding not supported" );
+                errorlevel.store(1);
+            }
+            if ( band_scan.padbit_mismatch ) {
+                fprintf( stderr, "inconsistent use of padbits" );
+                padbit = 1;
+                errorlevel.store(1);
+            }
+            // the scan has to end where the jpeg had the next one
+            if ( band_scan.sta == -1 || ( (size_t)band_scan.scan + 1 < scnp_jpg.size()
+                                          && band_scan.end != scnp_jpg[ band_scan.scan + 1 ] ) ) {
+                fprintf( stderr, "decode error in scan%i / mcu%i",
+                    band_scan.scan, band_scan.dpos );
+                delete huffr;
+                errorlevel.store(2);
+                return false;
+            }
+        }
+        if ( band_scans.back().scan + 1 == scnc ) {
+            huffr->skip_to( band_scans.back().end );
+            huffr->eof = band_scans.back().eof;
+        }
+    }
     if (early_eof_encountered) {
         colldata.set_truncation_bounds(max_cmp, max_bpos, max_dpos, max_sah);
     }
@@ -3334,6 +4464,18 @@ bool recode_jpeg( void )
     rstc = 0;
     MergeJpegProgress streaming_progress;
 
+    // the AC scans of each component may be recoded by a worker
+    std::vector<BandScan> band_scans;
+    unsigned int num_scans = 0;
+    BandRecodeLanes band_lanes;
+    size_t next_band_scan = 0;
+    bool use_band_lanes = jpegtype == 2 && g_threaded && g_allow_progressive && NUM_THREADS > 1
+        && g_decoder && g_decoder->getNumWorkers() > 0 && max_file_size > 0;
+    for ( cmp = 0; use_band_lanes && cmp < cmpc; cmp++ ) {
+        use_band_lanes = !colldata.is_memory_optimized(cmp);
+    }
+    use_band_lanes = use_band_lanes && collect_band_scans(&band_scans, &num_scans);
+
     // JPEG decompression loop
     while ( true )
     {
@@ -3391,6 +4533,47 @@ bool recode_jpeg( void )
         // store scan position
         scnp.at(scnc) = huffw->getpos();
         scnp.at(scnc + 1) = 0; // danielrh@ avoid uninitialized memory when doing progressive writeout
+        if ( use_band_lanes && next_band_scan < band_scans.size()
+             && band_scans[ next_band_scan ].scan == scnc ) {
+            // start the lanes at the first AC scan, once the decoder has the coefficients
+            if ( !band_lanes.num_lanes ) {
+                unsigned int lanes = std::min((unsigned int)cmpc, g_decoder->getNumWorkers());
+                lanes = std::min(lanes, (unsigned int)MAX_NUM_THREADS);
+                if ( Sirikata::memmgr_size_left() < lanes * BandRecodeLanes::memory_per_lane()
+                     + 2 * (size_t)max_file_size + ABIT_WRITER_PRELOAD ) {
+                    use_band_lanes = false;
+                } else {
+                    // the workers read the coefficients without syncing
+                    for ( cmp = 0; cmp < cmpc; cmp++ ) {
+                        colldata.wait_for_worker_on_dpos(cmp, cmpnfo[ cmp ].bc - 1);
+                    }
+                    band_lanes.start(&band_scans, lanes);
+                }
+            }
+        }
+        if ( band_lanes.num_lanes && next_band_scan < band_scans.size()
+             && band_scans[ next_band_scan ].scan == scnc ) {
+            const BandScan &band_scan = band_scans[ next_band_scan++ ];
+            unsigned int lane = band_scan.cmp % band_lanes.num_lanes;
+            band_lanes.wait(lane);
+            // a scan the lane could not code is recoded below
+            if ( band_scan.sta == 2 && !str_out->has_exceeded_bound() ) {
+                const unsigned char *lane_data = band_lanes.huffw[ lane ]->peekptr();
+                int scan_start = huffw->getpos();
+                for ( int i = band_scan.out_start; i < band_scan.out_end; i++ ) {
+                    huffw->write( lane_data[ i ], 8 );
+                }
+                huffw->flush_no_pad();
+                for ( int i = 0; i < band_scan.num_rst; i++ ) {
+                    rstp.at(rstc++) = scan_start + band_scan.rst_ends[ i ];
+                }
+                if (huffw->no_remainder()) {
+                    merge_jpeg_streaming(&streaming_progress, huffw->peekptr(), huffw->getpos(), false);
+                }
+                scnc++;
+                continue;
+            }
+        }
         bool first_pass = true;
         // JPEG imagedata encoding routines
         while ( true )
@@ -3767,6 +4950,56 @@ public: bool operator() (const ThreadHandoff &a,
 }
 };
 
+// about 10000 typical blocks: below this a segment's model warmup and
+// thread handoff outweigh what it saves
+static const uint64_t ADAPTIVE_MIN_SEGMENT_COST = 1 << 21;
+
+/* -----------------------------------------------
+    cores not already busy, from the 1 minute load
+    ----------------------------------------------- */
+unsigned int sample_idle_cpus() {
+#if defined(_WIN32) || defined(EMSCRIPTEN)
+    return MAX_NUM_THREADS;
+#else
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    double load = 0;
+    if (num_cpus < 1 || getloadavg(&load, 1) != 1) {
+        return MAX_NUM_THREADS;
+    }
+    long idle = num_cpus - (long)(load + 0.5);
+    return (unsigned int)std::max(1L, std::min(idle, (long)MAX_NUM_THREADS));
+#endif
+}
+
+/* -----------------------------------------------
+    estimated coding cost of the image above each handoff
+    ----------------------------------------------- */
+std::vector<uint64_t> thread_handoff_cost_prefix(const std::vector<ThreadHandoff> &row_thread_handoffs) {
+    Sirikata::Array1d<std::vector<uint64_t>, (uint32_t)ColorChannel::NumBlockTypes> row_cost_prefix;
+    for (int cmp = 0; cmp < colldata.get_num_components(); ++cmp) {
+        int width = colldata.block_width(cmp);
+        int height = colldata.block_height(cmp);
+        row_cost_prefix[cmp].resize(height + 1);
+        for (int y = 0; y < height; ++y) {
+            uint64_t row_cost = 0;
+            for (int x = 0; x < width; ++x) {
+                row_cost += aligned_block_cost(colldata.block_nosync((BlockType)cmp, y * width + x));
+            }
+            row_cost_prefix[cmp][y + 1] = row_cost_prefix[cmp][y] + row_cost;
+        }
+    }
+    uint64_t luma_height = std::max(colldata.block_height(0), 1);
+    std::vector<uint64_t> retval(row_thread_handoffs.size());
+    for (size_t i = 0; i < row_thread_handoffs.size(); ++i) {
+        uint64_t luma_y = row_thread_handoffs[i].luma_y_start;
+        for (int cmp = 0; cmp < colldata.get_num_components(); ++cmp) {
+            uint64_t height = colldata.block_height(cmp);
+            retval[i] += row_cost_prefix[cmp][std::min(height, luma_y * height / luma_height)];
+        }
+    }
+    return retval;
+}
+
 /* -----------------------------------------------
     write uncompressed JPEG file
     ----------------------------------------------- */
@@ -3859,7 +5092,18 @@ bool write_ujpg(std::vector<ThreadHandoff> row_thread_handoffs,
                                               (unsigned int)min_encode_threads);
         NUM_THREADS = std::min(std::max(desired_count, 1U), (unsigned int)NUM_THREADS);
     }
-    if (framebuffer_byte_size < 125000) {
+    std::vector<uint64_t> cost_prefix;
+    if (g_adaptive_threads && start_byte == 0 && max_file_size == 0
+        && !colldata.is_memory_optimized(0)) {
+        // every segment should carry enough work to pay for waking its thread
+        // and initializing its model, and there is no use in more segments
+        // than cores that are idle right now
+        cost_prefix = thread_handoff_cost_prefix(row_thread_handoffs);
+        uint64_t segments_by_cost = cost_prefix.back() / ADAPTIVE_MIN_SEGMENT_COST;
+        unsigned int desired_count = (unsigned int)std::min(segments_by_cost, (uint64_t)g_idle_cpus);
+        NUM_THREADS = std::min(std::max(std::max(desired_count, min_encode_threads), 1U),
+                               (unsigned int)NUM_THREADS);
+    } else if (framebuffer_byte_size < 125000) {
         NUM_THREADS = std::min(std::max(min_encode_threads, 1U), (unsigned int)NUM_THREADS);
     } else if (framebuffer_byte_size < 250000) {
         NUM_THREADS = std::min(std::max(min_encode_threads, 2U), (unsigned int)NUM_THREADS);
@@ -3869,7 +5113,23 @@ bool write_ujpg(std::vector<ThreadHandoff> row_thread_handoffs,
     //fprintf(stderr, "Byte size %d num_rows %d Using num threads %u\n", framebuffer_byte_size, num_rows, NUM_THREADS);
     std::vector<ThreadHandoff> selected_splits(NUM_THREADS);
     std::vector<int> split_indices(NUM_THREADS);
-    for (uint32_t i = 0; g_even_thread_split == false && i < NUM_THREADS - 1 ; ++ i) {
+    // whole-file encodes balance the estimated decode work of each thread;
+    // slices of a file fall back to balancing the jpeg bytes
+    bool cost_split = g_even_thread_split == false && NUM_THREADS > 1
+        && start_byte == 0 && max_file_size == 0 && !colldata.is_memory_optimized(0);
+    if (cost_split && cost_prefix.empty()) {
+        cost_prefix = thread_handoff_cost_prefix(row_thread_handoffs);
+    }
+    for (uint32_t i = 0; cost_split && i < NUM_THREADS - 1 ; ++ i) {
+        uint64_t desired_cost = cost_prefix.back() * (i + 1) / NUM_THREADS;
+        auto split = std::lower_bound(cost_prefix.begin() + 1, cost_prefix.end(), desired_cost);
+        if (split == cost_prefix.end()
+            || (split != cost_prefix.begin() + 1 && desired_cost - *(split - 1) < *split - desired_cost)) {
+            --split; // the row boundary just before the target is closer
+        }
+        split_indices[i] = split - cost_prefix.begin();
+    }
+    for (uint32_t i = 0; g_even_thread_split == false && !cost_split && i < NUM_THREADS - 1 ; ++ i) {
         ThreadHandoff desired_handoff = row_thread_handoffs.back();
         if(max_file_size && max_file_size + start_byte < desired_handoff.segment_size) {
             desired_handoff.segment_size += row_thread_handoffs.front().segment_size;
@@ -3901,6 +5161,13 @@ bool write_ujpg(std::vector<ThreadHandoff> row_thread_handoffs,
         }
     }
     split_indices[NUM_THREADS - 1] = row_thread_handoffs.size() - 1;
+    // the decoder writes each segment of a sequential jpeg as exactly these
+    // bytes of the original, so it can check them as soon as its thread is done.
+    // Stray RST markers past the last row are only written after all segments.
+    std::vector<uint32_t> split_checksums;
+    bool write_checksums = g_segment_checksums && jpeg_file_raw_bytes && jpegtype == 1
+        && start_byte == 0 && max_file_size == 0 && !early_eof_encountered
+        && std::count(rst_err.begin(), rst_err.end(), 0) == (std::ptrdiff_t)rst_err.size();
     size_t last_split_index = 0;
     for (size_t i = 0; i < selected_splits.size(); ++i) {
         size_t beginning_of_range = last_split_index;
@@ -3912,6 +5179,13 @@ bool write_ujpg(std::vector<ThreadHandoff> row_thread_handoffs,
         if (i + 1 == selected_splits.size() && row_thread_handoffs[ end_of_range ].num_overhang_bits) {
             ++selected_splits[i].segment_size; // need room for that last byte to hold the overhang byte
         }
+        if (write_checksums) {
+            // the handoff offsets run one past the file offset, as with prefix_grbs above
+            size_t begin = std::min((size_t)row_thread_handoffs[ beginning_of_range ].segment_size - 1,
+                                    jpeg_file_raw_bytes->size());
+            size_t end = std::min(begin + selected_splits[i].segment_size, jpeg_file_raw_bytes->size());
+            split_checksums.push_back(crc32c(0, jpeg_file_raw_bytes->data() + begin, end - begin));
+        }
 #if 0
         fprintf(stderr, "%d->%d) %d - %d {%ld}\n", selected_splits[i].luma_y_start,
                 selected_splits[i].luma_y_end, 
@@ -3967,6 +5241,17 @@ bool write_ujpg(std::vector<ThreadHandoff> row_thread_handoffs,
     auto serialized_splits = ThreadHandoff::serialize(&selected_splits[0], selected_splits.size());
     err = mrw.Write(&serialized_splits[0], serialized_splits.size()).second;
 
+    if (!split_checksums.empty()) {
+        // marker: "CRC" + [number of thread segments]
+        unsigned char crc_mrk[] = {'C', 'R', 'C'};
+        err = mrw.Write( crc_mrk, 3 ).second;
+        uint32toLE((uint32_t)split_checksums.size(), ujpg_mrk);
+        err = mrw.Write( ujpg_mrk, 4).second;
+        for (size_t i = 0; i < split_checksums.size(); ++i) {
+            uint32toLE(split_checksums[i], ujpg_mrk);
+            err = mrw.Write( ujpg_mrk, 4).second;
+        }
+    }
     if (!rst_cnt.empty()) {
         unsigned char frs_mrk[] = {'C', 'R', 'S'};
         err = mrw.Write( frs_mrk, 3 ).second;
@@ -4070,8 +5355,13 @@ bool write_ujpg(std::vector<ThreadHandoff> row_thread_handoffs,
     unsigned char cmp_mrk[] = {'C', 'M', 'P'};
     err = ujg_out->Write( cmp_mrk, sizeof(cmp_mrk) ).second;
     write_byte_bill(Billing::HEADER, true, 3);
-    while (g_encoder->encode_chunk(&colldata, ujg_out,
-                                   &selected_splits[0], selected_splits.size()) == CODING_PARTIAL) {
+    CodingReturnValue coded;
+    while ((coded = g_encoder->encode_chunk(&colldata, ujg_out,
+                                            &selected_splits[0], selected_splits.size())) == CODING_PARTIAL) {
+    }
+    if (coded == CODING_ERROR) { // cancelled; process_file reports it
+        errorlevel.store(2);
+        return false;
     }
     
     // errormessage if write error
@@ -4090,6 +5380,208 @@ bool write_ujpg(std::vector<ThreadHandoff> row_thread_handoffs,
     return true;
 }
 
+/* -----------------------------------------------
+    -transform: rebuilds the header and colldata as
+    those of the rotated or flipped image, coded as
+    a baseline jpeg, and compresses them with the
+    row handoffs that jpeg would have
+    ----------------------------------------------- */
+bool write_transformed_ujpg( void )
+{
+    TransformedImage image;
+    if (!transform_decoded_image(&image)) {
+        return false;
+    }
+    for (int cmp = 0; cmp < colldata.get_num_components(); ++cmp) {
+        colldata.full_component_write((BlockType)cmp).reset();
+    }
+    if (prefix_grbgdata) {
+        aligned_dealloc(prefix_grbgdata);
+        prefix_grbgdata = NULL;
+    }
+    prefix_grbs = 0;
+    reset_buffers();
+    rst_cnt.clear();
+    early_eof_encountered = false;
+    hdrs = image.header.size() - 2; // without SOI, as read_jpeg keeps it
+    hdrdata = (unsigned char*) aligned_alloc(hdrs);
+    memcpy(hdrdata, &image.header[2], hdrs);
+    if ( !setup_imginfo_jpg(false) ) {
+        return false;
+    }
+    for (int cmp = 0; cmp < cmpc; ++cmp) {
+        always_assert(image.blocks_wide[cmp] == cmpnfo[cmp].bch
+                      && image.coefficients[cmp].size() == (size_t)cmpnfo[cmp].bc * 64);
+        BlockBasedImage &component = colldata.full_component_write((BlockType)cmp);
+        for (int dpos = 0; dpos < cmpnfo[cmp].bc; ++dpos) {
+            AlignedBlock &block = component.raster(dpos);
+            const int16_t *zigzag = &image.coefficients[cmp][(size_t)dpos * 64];
+            for (int zz = 0; zz < 64; ++zz) {
+                block.mutable_coefficients_zigzag(zz) = zigzag[zz];
+            }
+        }
+        std::vector<int16_t>().swap(image.coefficients[cmp]);
+    }
+    padbit = 0x7f; // the scan is padded with ones
+    if (grbgdata && grbgdata != &EOI[0]) {
+        aligned_dealloc(grbgdata);
+    }
+    grbs = 0; // a bare EOI, as read_jpeg stores it
+    grbgdata = NULL;
+    rst_err.assign(1, 0); // one scan without false restart markers
+    jpgfilesize = image.jpeg_size;
+    g_allow_progressive = false; // as read_jpeg leaves it for a baseline jpeg
+    return write_ujpg(std::move(image.row_handoffs), NULL);
+}
+
+/* -----------------------------------------------
+    writes one lepton file per chunk_size bytes of the
+    jpeg parsed into colldata, back to back, then the
+    size of each (uint32 LE) and their count. Each
+    keeps the rows that start in its chunk plus the
+    first one past it and is bounded like a truncated
+    parse, so no slice reparses the bytes before it
+    ----------------------------------------------- */
+bool write_ujpg_slices(std::vector<ThreadHandoff> row_thread_handoffs,
+                       std::vector<uint32_t> mcu_file_offsets,
+                       std::vector<uint8_t, Sirikata::JpegAllocator<uint8_t> >*jpeg_file_raw_bytes,
+                       size_t chunk_size)
+{
+    size_t jpeg_size = jpeg_file_raw_bytes->size();
+    always_assert(jpeg_size == (size_t)jpgfilesize);
+    unsigned int full_num_threads = NUM_THREADS;
+    bool full_early_eof = early_eof_encountered;
+    int full_max_dpos[4];
+    memcpy(full_max_dpos, max_dpos, sizeof(max_dpos));
+    unsigned char *full_grbgdata = grbgdata;
+    int full_grbs = grbs;
+    IOUtil::FileWriter *stream_out = ujg_out;
+    std::vector<uint32_t> slice_sizes;
+    size_t num_chunks = (jpeg_size + chunk_size - 1) / chunk_size;
+    for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+        size_t chunk_start = chunk * chunk_size;
+        size_t chunk_end = std::min(chunk_start + chunk_size, jpeg_size);
+        // segment_size runs one past the offset where its row starts
+        size_t first = 0;
+        while (first + 1 < row_thread_handoffs.size()
+               && row_thread_handoffs[first].segment_size <= chunk_start) {
+            ++first;
+        }
+        // past the last row start only the end of the scan is left, which
+        // a slice can carry as garbage before and after its empty scan
+        if (row_thread_handoffs[first].segment_size > chunk_end
+            || row_thread_handoffs[first].segment_size < chunk_start) {
+            fprintf(stderr, "Chunk %u [%lu, %lu) holds no start of an MCU row\n",
+                    (unsigned int)chunk, (unsigned long)chunk_start, (unsigned long)chunk_end);
+            custom_exit(ExitCode::UNSUPPORTED_JPEG);
+        }
+        size_t last = first;
+        while (last + 1 < row_thread_handoffs.size()
+               && row_thread_handoffs[last].segment_size <= chunk_end) {
+            ++last;
+        }
+        std::vector<ThreadHandoff> slice_handoffs(row_thread_handoffs.begin() + first,
+                                                  row_thread_handoffs.begin() + last + 1);
+        if (chunk == 1) {
+            slice_header_jpg();
+        }
+        start_byte = chunk_start;
+        jpgfilesize = chunk_end;
+        NUM_THREADS = full_num_threads;
+        bool bounded = last + 1 < row_thread_handoffs.size();
+        // blocks after the cut in the row of the mcu holding it, blanked
+        // while this slice is written
+        std::vector<std::pair<std::pair<int, int>, AlignedBlock> > blanked;
+        if (bounded) {
+            // only code the rows before the first one past the chunk
+            early_eof_encountered = true;
+            for (int cmp = 0; cmp < cmpc; ++cmp) {
+                int rows = row_thread_handoffs[last].luma_y_start * cmpnfo[cmp].bcv / cmpnfo[0].bcv;
+                max_dpos[cmp] = std::min(rows * cmpnfo[cmp].bch, cmpnfo[cmp].bc) - 1;
+            }
+            // or, when the single scan recorded where each mcu starts, only
+            // up to the last block of the mcu holding the cut (a lone
+            // component is not interleaved: every block is an mcu)
+            int mcus = std::upper_bound(mcu_file_offsets.begin(), mcu_file_offsets.end(),
+                                        (uint32_t)chunk_end) - mcu_file_offsets.begin();
+            if (mcus > 0 && cmpc == 1) {
+                max_dpos[0] = std::min(max_dpos[0], mcus - 1);
+            } else if (mcus > 0) {
+                int mcu = mcus - 1;
+                for (int cmp = 0; cmp < cmpc; ++cmp) {
+                    const componentInfo &info = cmpnfo[cmp];
+                    int first_row = (mcu / mcuh) * info.sfh;
+                    int last_row = first_row + info.sfh - 1;
+                    int last_col = (mcu % mcuh) * info.sfv + info.sfv - 1;
+                    int dpos = std::min(last_row * info.bch + last_col, info.bc - 1);
+                    if (dpos >= max_dpos[cmp]) {
+                        continue;
+                    }
+                    max_dpos[cmp] = dpos;
+                    for (int row = first_row; row < last_row; ++row) {
+                        for (int col = last_col + 1; col < info.bch; ++col) {
+                            AlignedBlock &block = colldata.mutable_block((BlockType)cmp,
+                                                                         row * info.bch + col);
+                            blanked.push_back(std::make_pair(std::make_pair(cmp, row * info.bch + col),
+                                                             block));
+                            memset(block.raw_data(), 0, sizeof(int16_t) * 64);
+                        }
+                    }
+                }
+            }
+            colldata.set_truncation_bounds(max_cmp, max_bpos, max_dpos, max_sah);
+        }
+        grbgdata = full_grbgdata;
+        grbs = full_grbs;
+        if (chunk_end != jpeg_size) {
+            // as a truncated parse would, end on the last two bytes read
+            grbs = 2;
+            grbgdata = aligned_alloc(grbs);
+            memcpy(grbgdata, &(*jpeg_file_raw_bytes)[chunk_end - grbs], grbs);
+        }
+        IOUtil::FileWriter slice_out(stream_out->get_fd(), false, false);
+        ujg_out = &slice_out;
+        bool ok = write_ujpg(slice_handoffs, jpeg_file_raw_bytes);
+        ujg_out = stream_out;
+        if (grbgdata != full_grbgdata) {
+            aligned_dealloc(grbgdata);
+        }
+        grbgdata = full_grbgdata;
+        grbs = full_grbs;
+        if (prefix_grbgdata) {
+            aligned_dealloc(prefix_grbgdata);
+            prefix_grbgdata = NULL;
+        }
+        prefix_grbs = 0;
+        if (bounded) {
+            early_eof_encountered = full_early_eof;
+            for (int cmp = 0; cmp < cmpc; ++cmp) {
+                max_dpos[cmp] = full_early_eof ? full_max_dpos[cmp] : cmpnfo[cmp].bc - 1;
+            }
+            colldata.set_truncation_bounds(max_cmp, max_bpos, max_dpos, max_sah);
+            memcpy(max_dpos, full_max_dpos, sizeof(max_dpos));
+            for (size_t i = 0; i < blanked.size(); ++i) {
+                colldata.mutable_block((BlockType)blanked[i].first.first,
+                                       blanked[i].first.second) = blanked[i].second;
+            }
+        }
+        if (!ok) {
+            return false;
+        }
+        slice_sizes.push_back((uint32_t)slice_out.getsize());
+    }
+    unsigned char ujpg_mrk[4];
+    for (size_t i = 0; i < slice_sizes.size(); ++i) {
+        uint32toLE(slice_sizes[i], ujpg_mrk);
+        ujg_out->Write(ujpg_mrk, sizeof(ujpg_mrk));
+    }
+    uint32toLE((uint32_t)slice_sizes.size(), ujpg_mrk);
+    ujg_out->Write(ujpg_mrk, sizeof(ujpg_mrk));
+    jpgfilesize = jpeg_size;
+    start_byte = 0;
+    return true;
+}
+
 
 /* -----------------------------------------------
     read uncompressed JPEG file
@@ -4301,6 +5793,15 @@ bool read_ujpg( void )
             // read garbage data
             ReadFull(header_reader, prefix_grbgdata, prefix_grbs );
         }
+        else if ( memcmp( ujpg_mrk, "CRC", 3 ) == 0 ) {
+            // crc32c of the jpeg bytes of each thread segment
+            ReadFull(header_reader, ujpg_mrk, 4);
+            segment_checksums.resize(LEtoUint32(ujpg_mrk));
+            for (size_t i = 0; i < segment_checksums.size(); ++i) {
+                ReadFull(header_reader, ujpg_mrk, 4);
+                segment_checksums[i] = LEtoUint32(ujpg_mrk);
+            }
+        }
         else if ( memcmp( ujpg_mrk, "SIZ", 3 ) == 0 ) {
             // full size of the original file
             ReadFull(header_reader, ujpg_mrk, 4);
@@ -4373,8 +5874,10 @@ bool reset_buffers( void )
     if ( huffdata != NULL ) aligned_dealloc ( huffdata );
     if ( grbgdata != NULL && grbgdata != EOI ) aligned_dealloc ( grbgdata );
     rst_err.clear();
+    segment_checksums.clear();
     rstp.resize(0);
     scnp.resize(0);
+    scnp_jpg.resize(0);
     hdrdata   = NULL;
     huffdata  = NULL;
     grbgdata  = NULL;
@@ -4881,6 +6384,30 @@ bool rebuild_header_jpg( void )
     return true;
 }
 
+/* -----------------------------------------------
+    keeps only the header segments read_jpeg would
+    have kept had it started past byte 0
+    ----------------------------------------------- */
+bool slice_header_jpg( void )
+{
+    abytewriter* hdrw = new abytewriter( 4096 );
+    uint32_t hpos = 0;
+    while ( (uint64_t)hpos + 3 < (uint64_t)hdrs ) {
+        uint32_t len = 2 + B_SHORT( hdrdata[ hpos + 2 ], hdrdata[ hpos + 3 ] );
+        uint32_t to_copy = hpos + len < hdrs ? len : hdrs - hpos;
+        std::vector<unsigned char> segment(&hdrdata[ hpos ], &hdrdata[ hpos ] + to_copy);
+        if ( is_needed_for_second_block( segment ) ) {
+            hdrw->write_n( segment.data(), to_copy );
+        }
+        hpos += len;
+    }
+    aligned_dealloc( hdrdata );
+    hdrdata = hdrw->getptr_aligned();
+    hdrs    = hdrw->getpos();
+    delete( hdrw );
+    return true;
+}
+
 /* -----------------------------------------------
     sequential block decoding routine
     ----------------------------------------------- */
@@ -5424,6 +6951,11 @@ int next_huffcode( abitreader *huffw, huffTree *ctree, Billing min_bill, Billing
     calculates next position (non interleaved)
     ----------------------------------------------- */
 int next_mcuposn( int* cmp, int* dpos, int* rstw )
+{
+    return next_mcuposn( cmp, dpos, rstw, rsti );
+}
+
+int next_mcuposn( int* cmp, int* dpos, int* rstw, int rsti )
 {
     // increment position
     (*dpos)++;
@@ -5454,6 +6986,11 @@ int next_mcuposn( int* cmp, int* dpos, int* rstw )
     skips the eobrun, calculates next position
     ----------------------------------------------- */
 int skip_eobrun( int* cmp, int* dpos, int* rstw, unsigned int* eobrun )
+{
+    return skip_eobrun( cmp, dpos, rstw, eobrun, rsti );
+}
+
+int skip_eobrun( int* cmp, int* dpos, int* rstw, unsigned int* eobrun, int rsti )
 {
     if ( (*eobrun) > 0 ) // error check for eobrun
     {
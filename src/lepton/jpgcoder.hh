@@ -6,6 +6,7 @@
 #include "../vp8/util/nd_array.hh"
 #include "../vp8/util/options.hh"
 #include "../io/Reader.hh"
+#include "trace_events.hh"
 //extern int cmpc;
 extern uint8_t get_current_file_lepton_version();
 extern std::atomic<int> errorlevel;
@@ -52,6 +53,14 @@ enum TimingStages_ {
 };
 extern Sirikata::Array1d<Sirikata::Array1d<uint64_t, NUM_STAGES>, MAX_NUM_THREADS> timing;
 extern uint64_t get_time_us(bool force=false);
+extern const char * stage_names[];
+// records when thread_id reached stage and, with -perfcounters,
+// what the calling thread's hardware counters read at that point
+void stamp(unsigned int thread_id, TimingStages_ stage);
+// adds to the blocks the calling thread has coded, so its stages are
+// reported per block of its own rows rather than of the whole image
+void count_blocks(uint32_t num_blocks);
 void print_results();
+void print_perf_counters(uint64_t num_blocks);
 }
 #endif
@@ -1,6 +1,7 @@
 #include "lepton_codec.hh"
 #include "uncompressed_components.hh"
 #include "../vp8/decoder/decoder.hh"
+#include "../vp8/util/cancellation.hh"
 
 
 
@@ -135,6 +136,14 @@ void LeptonCodec<BoolDecoder>::ThreadState::decode_row_internal(BlockBasedImageP
                                        num_nonzeros_.at(component).begin());
     
     int block_width = image_data[component]->block_width();
+#ifndef USE_SCALAR
+    if (!is_top_row_.at(component)) {
+        ProbabilityTablesBase::compute_row_lak_above(component,
+                                                     context_.at(component).above,
+                                                     context_.at(component).num_nonzeros_above,
+                                                     block_width);
+    }
+#endif
     if (is_top_row_.at(component)) {
         is_top_row_.at(component) = false;
         switch((BlockType)component) {
@@ -295,10 +304,18 @@ CodingReturnValue LeptonCodec<BoolDecoder>::ThreadState::vp8_decode_thread(unsig
         if (cur_row.luma_y < min_y) {
             continue;
         }
-        decode_rowf(image_data,
-                   component_size_in_blocks,
-                   cur_row.component,
-                   cur_row.curr_y);
+        if (Cancellation::requested()) {
+            return CODING_ERROR;
+        }
+        {
+            TraceHarness::Span row_span(thread_id, TraceHarness::ROW_DECODE,
+                                        cur_row.component, cur_row.curr_y);
+            decode_rowf(image_data,
+                        component_size_in_blocks,
+                        cur_row.component,
+                        cur_row.curr_y);
+        }
+        TimingHarness::count_blocks(image_data[cur_row.component]->block_width());
         if (thread_id == 0) {
             colldata->worker_update_cmp_progress((BlockType)cur_row.component,
                                                  image_data[cur_row.component]->block_width() );
@@ -313,15 +330,15 @@ template<class BoolDecoder> void LeptonCodec<BoolDecoder>::worker_thread(ThreadS
                                         int8_t thread_target[Sirikata::MuxReader::MAX_STREAM_ID],
                                         GenericWorker *worker,
                                         VP8ComponentDecoder_SendToActualThread *send_to_actual_thread_state) {
-    TimingHarness::timing[thread_id][TimingHarness::TS_ARITH_STARTED] = TimingHarness::get_time_us();
+    TimingHarness::stamp(thread_id, TimingHarness::TS_ARITH_STARTED);
     for (uint8_t i = 0; i < Sirikata::MuxReader::MAX_STREAM_ID; ++i) {
         if (thread_target[i] == int8_t(thread_id)) {
-            ts->bool_decoder_.init(new ActualThreadPacketReader(i,worker, send_to_actual_thread_state));
+            ts->bool_decoder_.init(new ActualThreadPacketReader(i, thread_id, worker, send_to_actual_thread_state));
         }
     }
     while (ts->vp8_decode_thread(thread_id, colldata) == CODING_PARTIAL) {
     }
-    TimingHarness::timing[thread_id][TimingHarness::TS_ARITH_FINISHED] = TimingHarness::get_time_us();
+    TimingHarness::stamp(thread_id, TimingHarness::TS_ARITH_FINISHED);
 }
 template class LeptonCodec<VPXBoolReader>;
 #ifdef ENABLE_ANS_EXPERIMENTAL
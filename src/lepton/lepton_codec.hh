@@ -112,6 +112,8 @@ protected:
         Sirikata::Array1d<std::vector<NeighborSummary>, (size_t)ColorChannel::NumBlockTypes> num_nonzeros_;
         uint32_t decode_index_;
         bool is_valid_range_;
+        // set while model_ still holds untouched identity tables
+        bool model_is_pristine_ = false;
         template<class Left, class Middle, class Right, bool should_force_memory_optimization>
         void decode_row(Left & left_model,
                         Middle& middle_model,
@@ -170,14 +172,43 @@ protected:
     unsigned int num_registered_workers_;
     Sirikata::Array1d<ThreadState*, MAX_NUM_THREADS> thread_state_;
 
+    ThreadState *allocate_thread_state() {
+        ThreadState *retval = new ThreadState;
+#ifdef USE_STANDARD_MEMORY_ALLOCATORS
+        retval->model_.model().set_tables_identity();
+#endif
+        // otherwise memmgr returned zeroed memory (untouched pages when fresh
+        // from the pool) and the identity Branch is all zeros, so the model is
+        // ready without writing a byte of it
+        retval->model_is_pristine_ = true;
+        return retval;
+    }
     void reset_thread_model_state(int thread_id) {
-        TimingHarness::timing[thread_id][TimingHarness::TS_MODEL_INIT_BEGIN] = TimingHarness::get_time_us();
+        TimingHarness::stamp(thread_id, TimingHarness::TS_MODEL_INIT_BEGIN);
 
         if (!thread_state_[thread_id]) {
-            thread_state_[thread_id] = new ThreadState;
+            thread_state_[thread_id] = allocate_thread_state();
+        }
+        if (thread_state_[thread_id]->model_is_pristine_) {
+            thread_state_[thread_id]->model_is_pristine_ = false;
+        } else {
+            thread_state_[thread_id]->model_.model().set_tables_identity();
+        }
+        TimingHarness::stamp(thread_id, TimingHarness::TS_MODEL_INIT);
+    }
+    // Builds every thread's identity model up front. A server calls this once
+    // before it starts forking so that each child inherits ready-to-use models
+    // copy-on-write instead of allocating and initializing them per request.
+    void prewarm_thread_models() {
+        unsigned int num_threads = do_threading_ ? NUM_THREADS : 1;
+        for (unsigned int thread_id = 0; thread_id < num_threads; ++thread_id) {
+            if (!thread_state_[thread_id]) {
+                thread_state_[thread_id] = allocate_thread_state();
+            } else if (!thread_state_[thread_id]->model_is_pristine_) {
+                thread_state_[thread_id]->model_.model().set_tables_identity();
+                thread_state_[thread_id]->model_is_pristine_ = true;
+            }
         }
-        thread_state_[thread_id]->model_.model().set_tables_identity();
-        TimingHarness::timing[thread_id][TimingHarness::TS_MODEL_INIT] = TimingHarness::get_time_us();
     }
     void registerWorkers(GenericWorker* workers, unsigned int num_workers) {
         num_registered_workers_ = num_workers;
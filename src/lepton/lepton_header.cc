@@ -0,0 +1,326 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include <fcntl.h>
+#include <string.h>
+#include "lepton_header.hh"
+#include "../io/BrotliCompression.hh"
+#include "../io/ZlibCompression.hh"
+#include "../io/ioutil.hh"
+#include "../io/Seccomp.hh"
+
+const char *ExitString(ExitCode ec);
+
+uint32_t lepton_read_le32(const uint8_t *data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+void lepton_write_le32(uint32_t value, uint8_t *data) {
+    data[0] = uint8_t(value & 0xff);
+    data[1] = uint8_t((value >> 8) & 0xff);
+    data[2] = uint8_t((value >> 16) & 0xff);
+    data[3] = uint8_t((value >> 24) & 0xff);
+}
+
+bool decompress_lepton_header(const uint8_t *preamble,
+                              const uint8_t *compressed,
+                              size_t compressed_size,
+                              LeptonHeaderBuffer *records) {
+    using namespace Sirikata;
+    // the same bound a decode applies
+    size_t max_size = (size_t)lepton_read_le32(preamble + LEPTON_JPEG_SIZE_OFFSET) * 2
+        + 128 * 1024 * 1024;
+    std::pair<LeptonHeaderBuffer, JpegError> uncompressed = preamble[LEPTON_VERSION_OFFSET] == 1
+        ? ZlibDecoderDecompressionReader::Decompress(compressed, compressed_size,
+                                                     JpegAllocator<uint8_t>(), max_size)
+        : BrotliCodec::Decompress(compressed, compressed_size,
+                                  JpegAllocator<uint8_t>(), max_size);
+    if (uncompressed.second != JpegError::nil()) {
+        return false;
+    }
+    records->swap(uncompressed.first);
+    return records->size() >= LEPTON_HDR_RECORD_PREFIX
+        && memcmp(records->data(), "HDR", 3) == 0
+        && lepton_read_le32(&(*records)[3]) <= records->size() - LEPTON_HDR_RECORD_PREFIX;
+}
+
+LeptonHeaderBuffer compress_lepton_header(const uint8_t *preamble, const LeptonHeaderBuffer &records) {
+    using namespace Sirikata;
+    if (preamble[LEPTON_VERSION_OFFSET] == 1) {
+        return ZlibDecoderCompressionWriter::Compress(records.data(), records.size(),
+                                                      JpegAllocator<uint8_t>());
+    }
+    return BrotliCodec::Compress(records.data(), records.size(), JpegAllocator<uint8_t>());
+}
+
+bool for_each_recovery_record(uint8_t *data, size_t size, const RecoveryRecordVisitor &visit) {
+    size_t pos = 0;
+    while (pos < size) {
+        if (pos + 3 > size) {
+            return false;
+        }
+        const uint8_t *marker = data + pos;
+        pos += 3;
+        size_t payload_size = 0;
+        bool last = false;
+        if (memcmp(marker, "P0D", 3) == 0 || memcmp(marker, "PAD", 3) == 0) {
+            payload_size = 1;
+        } else if (memcmp(marker, "HH", 2) == 0) {
+            payload_size = marker[2] * ThreadHandoff::BYTES_PER_HANDOFF;
+        } else if (memcmp(marker, "SIZ", 3) == 0) {
+            payload_size = 4;
+        } else if (memcmp(marker, "EEE", 3) == 0) {
+            payload_size = 28;
+        } else if (memcmp(marker, "CMP", 3) == 0 || memcmp(marker, "CNT", 3) == 0) {
+            last = true;
+        } else if (memcmp(marker, "CRS", 3) == 0 || memcmp(marker, "CRC", 3) == 0
+                   || memcmp(marker, "FRS", 3) == 0
+                   || memcmp(marker, "GRB", 3) == 0 || memcmp(marker, "PGR", 3) == 0
+                   || memcmp(marker, "PGE", 3) == 0) {
+            if (pos + 4 > size) {
+                return false;
+            }
+            uint64_t count = lepton_read_le32(data + pos);
+            bool words = memcmp(marker, "CRS", 3) == 0 || memcmp(marker, "CRC", 3) == 0;
+            payload_size = 4 + (words ? 4 * count : count);
+        } else {
+            return false;
+        }
+        if (payload_size > size - pos) {
+            return false;
+        }
+        visit(marker, data + pos, payload_size);
+        pos += payload_size;
+        if (last) {
+            return true;
+        }
+    }
+    return true;
+}
+
+namespace {
+int big_endian_short(const uint8_t *data) {
+    return (data[0] << 8) | data[1];
+}
+
+bool is_sof_marker(uint8_t type) {
+    return type >= 0xC0 && type <= 0xCF && type != 0xC4 && type != 0xC8 && type != 0xCC;
+}
+
+// counts the tables in DQT and DHT segments and reads SOF, DRI and SOS
+bool parse_jpeg_header(const uint8_t *data, size_t size, LeptonInfo *info) {
+    size_t pos = 0;
+    while (pos + 4 <= size && data[pos] == 0xFF) {
+        uint8_t type = data[pos + 1];
+        size_t end = pos + 2 + big_endian_short(data + pos + 2);
+        if (end > size) {
+            return info->sof_marker != 0; // the tail of a truncated header
+        }
+        const uint8_t *segment = data + pos + 4;
+        size_t segment_size = end - pos - 4;
+        if (type == 0xDB) {
+            for (size_t i = 0; i < segment_size; i += 1 + ((segment[i] >> 4) ? 128 : 64)) {
+                ++info->quantization_tables;
+            }
+        } else if (type == 0xC4) {
+            for (size_t i = 0; i + 17 <= segment_size; ) {
+                size_t num_values = 0;
+                for (int bits = 1; bits <= 16; ++bits) {
+                    num_values += segment[i + bits];
+                }
+                i += 17 + num_values;
+                ++info->huffman_tables;
+            }
+        } else if (type == 0xDD && segment_size >= 2) {
+            info->restart_interval = big_endian_short(segment);
+        } else if (type == 0xDA) {
+            ++info->scans;
+        } else if (is_sof_marker(type) && segment_size >= 6) {
+            info->sof_marker = type;
+            info->precision = segment[0];
+            info->height = big_endian_short(segment + 1);
+            info->width = big_endian_short(segment + 3);
+            info->components.clear();
+            for (size_t i = 6; i + 3 <= segment_size && (int)info->components.size() < segment[5]; i += 3) {
+                LeptonComponentInfo component;
+                component.id = segment[i];
+                component.h_factor = segment[i + 1] >> 4;
+                component.v_factor = segment[i + 1] & 0xf;
+                component.quantization_table = segment[i + 2];
+                info->components.push_back(component);
+            }
+        }
+        pos = end;
+    }
+    return info->sof_marker != 0;
+}
+
+void write_json_string(const char *value, FILE *out) {
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char*)value; *c; ++c) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(out, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+}
+
+size_t lepton_info_bytes_needed(const uint8_t *preamble) {
+    return LEPTON_PREAMBLE_SIZE + (size_t)lepton_read_le32(preamble + LEPTON_HEADER_SIZE_OFFSET);
+}
+
+ExitCode read_lepton_info(const uint8_t *data, size_t size, LeptonInfo *info) {
+    *info = LeptonInfo();
+    if (size < LEPTON_PREAMBLE_SIZE || size < lepton_info_bytes_needed(data)) {
+        return ExitCode::SHORT_READ;
+    }
+    if (data[0] != 0xcf || data[1] != 0x84) {
+        return ExitCode::VERSION_UNSUPPORTED;
+    }
+    info->version = data[LEPTON_VERSION_OFFSET];
+    info->kind = data[LEPTON_KIND_OFFSET];
+    info->encoder_threads = data[LEPTON_THREADS_OFFSET];
+    for (int i = 0; i < 12; ++i) {
+        snprintf(info->git_revision + 2 * i, 3, "%02x", data[LEPTON_REVISION_OFFSET + i]);
+    }
+    info->jpeg_size = lepton_read_le32(data + LEPTON_JPEG_SIZE_OFFSET);
+    info->compressed_header_size = lepton_read_le32(data + LEPTON_HEADER_SIZE_OFFSET);
+    LeptonHeaderBuffer records;
+    if (!decompress_lepton_header(data, data + LEPTON_PREAMBLE_SIZE,
+                                  info->compressed_header_size, &records)) {
+        return ExitCode::STREAM_INCONSISTENT;
+    }
+    info->jpeg_header_size = lepton_read_le32(&records[3]);
+    if (!parse_jpeg_header(&records[LEPTON_HDR_RECORD_PREFIX], info->jpeg_header_size, info)) {
+        return ExitCode::UNSUPPORTED_JPEG;
+    }
+    info->trailing_data_size = 2; // a bare EOI unless a GRB record says otherwise
+    size_t recovery_start = LEPTON_HDR_RECORD_PREFIX + info->jpeg_header_size;
+    bool well_formed = for_each_recovery_record(
+        &records[recovery_start], records.size() - recovery_start,
+        [info](const uint8_t *marker, uint8_t *payload, size_t payload_size) {
+            if (memcmp(marker, "HH", 2) == 0) {
+                info->thread_segments = ThreadHandoff::deserialize(marker + 1, payload_size + 2);
+            } else if (memcmp(marker, "GRB", 3) == 0) {
+                info->trailing_data_size = payload_size - 4;
+            } else if (memcmp(marker, "PGR", 3) == 0 || memcmp(marker, "PGE", 3) == 0) {
+                info->prefix_garbage_size = payload_size - 4;
+                info->embedded = marker[2] == 'E';
+            } else if (memcmp(marker, "CRC", 3) == 0) {
+                for (size_t i = 4; i + 4 <= payload_size; i += 4) {
+                    info->segment_checksums.push_back(lepton_read_le32(payload + i));
+                }
+            } else if (memcmp(marker, "EEE", 3) == 0) {
+                info->truncated = true;
+            } else if (memcmp(marker, "CNT", 3) == 0) {
+                info->concatenated = true;
+            }
+        });
+    return well_formed ? ExitCode::SUCCESS : ExitCode::STREAM_INCONSISTENT;
+}
+
+void write_lepton_info_json(const char *filename, const LeptonInfo &info, FILE *out) {
+    fputc('{', out);
+    if (filename) {
+        fprintf(out, "\"file\":");
+        write_json_string(filename, out);
+        fputc(',', out);
+    }
+    fprintf(out, "\"version\":%d,\"kind\":\"%c\",\"encoder_threads\":%d,\"git_revision\":\"%s\","
+            "\"jpeg_size\":%u,\"compressed_header_size\":%u,\"jpeg_header_size\":%u,",
+            info.version, info.kind, info.encoder_threads, info.git_revision,
+            info.jpeg_size, info.compressed_header_size, info.jpeg_header_size);
+    fprintf(out, "\"width\":%d,\"height\":%d,\"precision\":%d,\"sof\":\"0x%02x\",\"progressive\":%s,"
+            "\"restart_interval\":%d,\"quantization_tables\":%d,\"huffman_tables\":%d,\"scans\":%d,",
+            info.width, info.height, info.precision, info.sof_marker,
+            info.sof_marker == 0xC2 ? "true" : "false", info.restart_interval,
+            info.quantization_tables, info.huffman_tables, info.scans);
+    fprintf(out, "\"components\":[");
+    for (size_t i = 0; i < info.components.size(); ++i) {
+        const LeptonComponentInfo &component = info.components[i];
+        fprintf(out, "%s{\"id\":%d,\"h\":%d,\"v\":%d,\"quantization_table\":%d}",
+                i ? "," : "", component.id, component.h_factor, component.v_factor,
+                component.quantization_table);
+    }
+    fprintf(out, "],\"thread_segments\":[");
+    for (size_t i = 0; i < info.thread_segments.size(); ++i) {
+        const ThreadHandoff &segment = info.thread_segments[i];
+        fprintf(out, "%s{\"luma_y_start\":%d,\"segment_size\":%u",
+                i ? "," : "", segment.luma_y_start, segment.segment_size);
+        if (info.segment_checksums.size() == info.thread_segments.size()) {
+            fprintf(out, ",\"crc32c\":\"%08x\"", info.segment_checksums[i]);
+        }
+        fputc('}', out);
+    }
+    fprintf(out, "],\"prefix_garbage_size\":%u,\"trailing_data_size\":%u,"
+            "\"embedded\":%s,\"truncated\":%s,\"concatenated\":%s}\n",
+            info.prefix_garbage_size, info.trailing_data_size,
+            info.embedded ? "true" : "false", info.truncated ? "true" : "false",
+            info.concatenated ? "true" : "false");
+}
+
+void write_lepton_info_error_json(const char *filename, ExitCode error, FILE *out) {
+    fputc('{', out);
+    if (filename) {
+        fprintf(out, "\"file\":");
+        write_json_string(filename, out);
+        fputc(',', out);
+    }
+    fprintf(out, "\"error\":\"%s\"}\n", ExitString(error));
+}
+
+namespace {
+ExitCode read_lepton_info_from(int fd, LeptonInfo *info) {
+    IOUtil::FileReader reader(fd, 0x7fffffff, false);
+    LeptonHeaderBuffer data(LEPTON_PREAMBLE_SIZE);
+    if (IOUtil::ReadFull(&reader, data.data(), data.size()) != data.size()) {
+        return ExitCode::SHORT_READ;
+    }
+    if (data[0] != 0xcf || data[1] != 0x84) {
+        return ExitCode::VERSION_UNSUPPORTED;
+    }
+    size_t needed = lepton_info_bytes_needed(data.data());
+    data.resize(needed);
+    size_t remaining = needed - LEPTON_PREAMBLE_SIZE;
+    if (IOUtil::ReadFull(&reader, data.data() + LEPTON_PREAMBLE_SIZE, remaining) != remaining) {
+        return ExitCode::SHORT_READ;
+    }
+    return read_lepton_info(data.data(), data.size(), info);
+}
+}
+
+void print_lepton_info(const char **files, int file_cnt) {
+    std::vector<int> fds(file_cnt);
+    for (int i = 0; i < file_cnt; ++i) {
+        fds[i] = strcmp(files[i], "-") == 0 ? 0 : open(files[i], O_RDONLY
+#ifdef _WIN32
+                                                           |O_BINARY
+#endif
+            );
+    }
+    // stdio would fstat stdout to size its own buffer, which the jail forbids
+    static char stdout_buffer[65536];
+    setvbuf(stdout, stdout_buffer, _IOLBF, sizeof(stdout_buffer));
+    if (g_use_seccomp) {
+        Sirikata::installStrictSyscallFilter(true);
+    }
+    ExitCode first_error = ExitCode::SUCCESS;
+    for (int i = 0; i < file_cnt; ++i) {
+        LeptonInfo info;
+        ExitCode status = fds[i] == -1 ? ExitCode::FILE_NOT_FOUND
+            : read_lepton_info_from(fds[i], &info);
+        if (status == ExitCode::SUCCESS) {
+            write_lepton_info_json(files[i], info, stdout);
+        } else {
+            write_lepton_info_error_json(files[i], status, stdout);
+            if (first_error == ExitCode::SUCCESS) {
+                first_error = status;
+            }
+        }
+    }
+    fflush(stdout);
+    custom_exit(first_error);
+}
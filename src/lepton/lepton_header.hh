@@ -0,0 +1,96 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef LEPTON_HEADER_HH_
+#define LEPTON_HEADER_HH_
+#include <stdio.h>
+#include <functional>
+#include <vector>
+#include "thread_handoff.hh"
+#include "../vp8/util/memory.hh"
+#include "../io/Allocator.hh"
+
+// Every .lep starts with a fixed preamble: the magic, the format version,
+// 'Z', 'X' (full frame) or 'Y' (slice of a jpeg), the encoder thread count,
+// three zero bytes, 12 bytes of git revision, then as little endian words
+// the size of the jpeg it decodes to and the size of the compressed header
+// that follows. The header holds an HDR record with the jpeg header segments
+// and the recovery records, and is zlib (version 1) or brotli compressed.
+enum {
+    LEPTON_PREAMBLE_SIZE = 28,
+    LEPTON_VERSION_OFFSET = 2,
+    LEPTON_KIND_OFFSET = 3,
+    LEPTON_THREADS_OFFSET = 4,
+    LEPTON_REVISION_OFFSET = 8,
+    LEPTON_JPEG_SIZE_OFFSET = 20,
+    LEPTON_HEADER_SIZE_OFFSET = 24,
+    LEPTON_HDR_RECORD_PREFIX = 7 // "HDR" and the jpeg header size
+};
+
+typedef std::vector<uint8_t, Sirikata::JpegAllocator<uint8_t> > LeptonHeaderBuffer;
+
+uint32_t lepton_read_le32(const uint8_t *data);
+void lepton_write_le32(uint32_t value, uint8_t *data);
+
+// false unless records holds the decompressed header of a well formed HDR record
+bool decompress_lepton_header(const uint8_t *preamble,
+                              const uint8_t *compressed,
+                              size_t compressed_size,
+                              LeptonHeaderBuffer *records);
+LeptonHeaderBuffer compress_lepton_header(const uint8_t *preamble, const LeptonHeaderBuffer &records);
+
+// Calls visit with each 3 byte record marker following the HDR record and
+// the payload after it: 'HH' records keep their thread count in marker[2].
+// Stops after CMP or CNT, which start the coded data or the header of the
+// next concatenated file. False if a record runs past size or is unknown.
+typedef std::function<void(const uint8_t *marker, uint8_t *payload, size_t payload_size)> RecoveryRecordVisitor;
+bool for_each_recovery_record(uint8_t *data, size_t size, const RecoveryRecordVisitor &visit);
+
+struct LeptonComponentInfo {
+    int id;
+    int h_factor;
+    int v_factor;
+    int quantization_table;
+};
+
+struct LeptonInfo {
+    int version;
+    char kind; // 'Z', 'X' or 'Y'
+    int encoder_threads;
+    char git_revision[25];
+    uint32_t jpeg_size;
+    uint32_t compressed_header_size;
+    uint32_t jpeg_header_size;
+    int width;
+    int height;
+    int precision;
+    int sof_marker;
+    int restart_interval;
+    int quantization_tables; // DQT tables defined, counting redefinitions
+    int huffman_tables; // likewise for DHT
+    int scans;
+    std::vector<LeptonComponentInfo> components;
+    std::vector<ThreadHandoff> thread_segments; // empty for legacy single threaded files
+    std::vector<uint32_t> segment_checksums; // from -segmentchecksums, else empty
+    uint32_t prefix_garbage_size;
+    uint32_t trailing_data_size; // the EOI and anything after it
+    bool embedded;
+    bool truncated;
+    bool concatenated;
+};
+
+// the bytes from the start of a .lep that read_lepton_info needs
+size_t lepton_info_bytes_needed(const uint8_t *preamble);
+
+// Fills info from the preamble and header of the .lep starting at data,
+// without looking at the coded coefficients. SHORT_READ when size is below
+// lepton_info_bytes_needed, which then needs the first 28 bytes.
+ExitCode read_lepton_info(const uint8_t *data, size_t size, LeptonInfo *info);
+
+// one line of JSON per file; filename may be NULL
+void write_lepton_info_json(const char *filename, const LeptonInfo &info, FILE *out);
+void write_lepton_info_error_json(const char *filename, ExitCode error, FILE *out);
+
+// -info: prints a line of JSON to stdout for each of files ("-" for stdin),
+// reading only their preamble and header. Exits with the error of the first
+// file that could not be read.
+void print_lepton_info(const char **files, int file_cnt);
+#endif
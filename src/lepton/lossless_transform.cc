@@ -0,0 +1,173 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include <stdio.h>
+#include <string.h>
+#ifndef USE_SCALAR
+#include <smmintrin.h>
+#endif
+#include "lossless_transform.hh"
+#include "jpeg_writer.hh"
+#include "jpgcoder.hh"
+#include "component_info.hh"
+#include "uncompressed_components.hh"
+#include "../vp8/util/memory.hh"
+#include "../vp8/util/debug.hh"
+
+extern UncompressedComponents colldata; // baseline sorted DCT coefficients
+extern Sirikata::Array1d<componentInfo, 4> cmpnfo;
+extern int cmpc; // component count
+extern int imgwidth; // width of image
+extern int imgheight; // height of image
+extern int sfhm; // max vertical sample factor
+extern int sfvm; // max horizontal sample factor
+
+LosslessTransform g_transform = LosslessTransform::NONE;
+
+namespace {
+struct TransformName {
+    const char *name;
+    LosslessTransform transform;
+};
+const TransformName transform_names[] = {
+    {"rot90", LosslessTransform::ROT90},
+    {"rot180", LosslessTransform::ROT180},
+    {"rot270", LosslessTransform::ROT270},
+    {"fliph", LosslessTransform::FLIP_H},
+    {"flipv", LosslessTransform::FLIP_V},
+    {"transpose", LosslessTransform::TRANSPOSE},
+    {"transverse", LosslessTransform::TRANSVERSE},
+};
+
+bool has(LosslessTransform transform, LosslessTransform part) {
+    return ((int)transform & (int)part) != 0;
+}
+
+AlignedBlock zero_block; // stands in for blocks past the end of a truncated image
+
+struct SourceComponent {
+    int blocks_wide; // of the source grid, mcu padding included
+    int blocks_high;
+    int out_blocks_wide; // what the writer asks for, mcu padding included
+    int out_blocks_high;
+};
+
+// Output coefficient (v, u) is source coefficient (u, v) when transposing,
+// and a horizontal flip negates the odd horizontal frequencies, a vertical
+// one the odd vertical frequencies.
+class BlockTransformer {
+    Sirikata::Array1d<uint8_t, 64> source_raster_; // by output zigzag index
+    Sirikata::Aligned256Array1d<int16_t, 64> sign_; // +1 or -1, by output zigzag index
+    bool transpose_;
+    bool flip_h_;
+    bool flip_v_;
+public:
+    BlockTransformer(LosslessTransform transform)
+        : transpose_(has(transform, LosslessTransform::TRANSPOSE)),
+          flip_h_(has(transform, LosslessTransform::FLIP_H)),
+          flip_v_(has(transform, LosslessTransform::FLIP_V)) {
+        for (int zz = 0; zz < 64; ++zz) {
+            int raster = jpeg_zigzag_to_raster[zz];
+            int v = raster / 8, u = raster % 8;
+            source_raster_[zz] = transpose_ ? u * 8 + v : raster;
+            sign_[zz] = ((flip_h_ && (u & 1)) != (flip_v_ && (v & 1))) ? -1 : 1;
+        }
+    }
+    // the zigzag table of the output, given the source one
+    void transform_qtable(const uint16_t *source_zigzag, uint16_t *zigzag) const {
+        for (int zz = 0; zz < 64; ++zz) {
+            zigzag[zz] = source_zigzag[raster_to_jpeg_zigzag[source_raster_[zz]]];
+        }
+    }
+    void transform_block(int cmp, const SourceComponent &component,
+                         int bx, int by, int16_t *zigzag) const {
+        int x = flip_h_ ? component.out_blocks_wide - 1 - bx : bx;
+        int y = flip_v_ ? component.out_blocks_high - 1 - by : by;
+        int source_x = transpose_ ? y : x;
+        int source_y = transpose_ ? x : y;
+        unsigned int dpos = source_y * cmpnfo[cmp].bch + source_x;
+        const AlignedBlock &block = source_x < component.blocks_wide
+            && source_y < component.blocks_high
+            && dpos < colldata.component_size_in_blocks(cmp)
+            ? colldata.block((BlockType)cmp, dpos) : zero_block;
+        for (int zz = 0; zz < 64; ++zz) {
+            zigzag[zz] = block.coefficients_raster(source_raster_[zz]);
+        }
+#ifndef USE_SCALAR
+        for (int zz = 0; zz < 64; zz += 8) {
+            __m128i coef = _mm_loadu_si128((const __m128i*)(zigzag + zz));
+            __m128i sign = _mm_load_si128((const __m128i*)(sign_.begin() + zz));
+            _mm_storeu_si128((__m128i*)(zigzag + zz), _mm_sign_epi16(coef, sign));
+        }
+#else
+        for (int zz = 0; zz < 64; ++zz) {
+            zigzag[zz] *= sign_[zz];
+        }
+#endif
+    }
+};
+}
+
+LosslessTransform lossless_transform_from_name(const char *name) {
+    for (size_t i = 0; i < sizeof(transform_names) / sizeof(transform_names[0]); ++i) {
+        if (strcmp(name, transform_names[i].name) == 0) {
+            return transform_names[i].transform;
+        }
+    }
+    return LosslessTransform::NONE;
+}
+
+bool transform_decoded_image(TransformedImage *image) {
+    bool transpose = has(g_transform, LosslessTransform::TRANSPOSE);
+    bool interleaved = cmpc > 1;
+    int width = transpose ? imgheight : imgwidth;
+    int height = transpose ? imgwidth : imgheight;
+    // sfv is the horizontal factor, sfh the vertical one
+    int mcu_width = 8 * (interleaved ? (transpose ? sfhm : sfvm) : 1);
+    int mcu_height = 8 * (interleaved ? (transpose ? sfvm : sfhm) : 1);
+    // the partial mcu at the far edge would land at the near one, where no
+    // padding can hide it
+    if ((has(g_transform, LosslessTransform::FLIP_H) && width % mcu_width)
+        || (has(g_transform, LosslessTransform::FLIP_V) && height % mcu_height)) {
+        fprintf(stderr, "-transform needs the flipped edges of the %dx%d image to end on the %dx%d mcu grid\n",
+                width, height, mcu_width, mcu_height);
+        custom_exit(ExitCode::UNSUPPORTED_JPEG);
+    }
+    BlockTransformer transformer(g_transform);
+    Sirikata::Array1d<SourceComponent, 4> sources;
+    Sirikata::Array1d<OutputComponent, 4> components;
+    for (int cmp = 0; cmp < cmpc && cmp < 4; ++cmp) {
+        SourceComponent &source = sources[cmp];
+        if (interleaved) {
+            source.blocks_wide = cmpnfo[cmp].bch;
+            source.blocks_high = cmpnfo[cmp].bcv;
+            components[cmp].h_factor = transpose ? cmpnfo[cmp].sfh : cmpnfo[cmp].sfv;
+            components[cmp].v_factor = transpose ? cmpnfo[cmp].sfv : cmpnfo[cmp].sfh;
+        } else {
+            source.blocks_wide = cmpnfo[cmp].nch;
+            source.blocks_high = cmpnfo[cmp].ncv;
+            components[cmp].h_factor = 1;
+            components[cmp].v_factor = 1;
+        }
+        source.out_blocks_wide = transpose ? source.blocks_high : source.blocks_wide;
+        source.out_blocks_high = transpose ? source.blocks_wide : source.blocks_high;
+        transformer.transform_qtable(cmpnfo[cmp].qtable, components[cmp].qtable.begin());
+    }
+    build_baseline_jpeg_header(width, height, components, &image->header);
+    // every block is moved once, so the scan is coded from the copies
+    for (int cmp = 0; cmp < cmpc && cmp < 4; ++cmp) {
+        const SourceComponent &source = sources[cmp];
+        image->blocks_wide[cmp] = source.out_blocks_wide;
+        std::vector<int16_t> &coefficients = image->coefficients[cmp];
+        coefficients.resize((size_t)source.out_blocks_wide * source.out_blocks_high * 64);
+        for (int y = 0; y < source.out_blocks_high; ++y) {
+            for (int x = 0; x < source.out_blocks_wide; ++x) {
+                transformer.transform_block(cmp, source, x, y,
+                                            &coefficients[((size_t)y * source.out_blocks_wide + x) * 64]);
+            }
+        }
+    }
+    return baseline_jpeg_row_handoffs(image->header.size(), width, height, components,
+                                      [&](int cmp, int x, int y, int16_t *zigzag) {
+                                          memcpy(zigzag, image->block(cmp, x, y), 64 * sizeof(int16_t));
+                                      },
+                                      &image->row_handoffs, &image->jpeg_size);
+}
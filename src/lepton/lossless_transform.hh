@@ -0,0 +1,47 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef LOSSLESS_TRANSFORM_HH_
+#define LOSSLESS_TRANSFORM_HH_
+#include <stdint.h>
+#include <vector>
+#include "../vp8/util/nd_array.hh"
+#include "thread_handoff.hh"
+
+// transpose is applied first, then the flips in output coordinates
+enum class LosslessTransform {
+    NONE = 0,
+    FLIP_H = 1,
+    FLIP_V = 2,
+    ROT180 = 3, // FLIP_H | FLIP_V
+    TRANSPOSE = 4,
+    ROT90 = 5, // TRANSPOSE | FLIP_H
+    ROT270 = 6, // TRANSPOSE | FLIP_V
+    TRANSVERSE = 7
+};
+
+// set by -transform=: a .lep decode compresses the image rotated or flipped
+// as a new .lep, without ever writing the jpeg it stands for
+extern LosslessTransform g_transform;
+
+// NONE for names other than rot90, rot180, rot270, fliph, flipv, transpose and transverse
+LosslessTransform lossless_transform_from_name(const char *name);
+
+// The decoded image with every block moved to its transformed position and
+// its coefficients transposed or negated to match, as a baseline JPEG with
+// the standard Huffman tables would hold it. Quantization tables are
+// transposed along with the blocks, so no coefficient is ever requantized.
+struct TransformedImage {
+    std::vector<uint8_t> header; // SOI through SOS
+    std::vector<ThreadHandoff> row_handoffs; // as decode_jpeg would find them
+    size_t jpeg_size;
+    // zigzag coefficients of each component, row after row of blocks,
+    // mcu padding included
+    Sirikata::Array1d<std::vector<int16_t>, 4> coefficients;
+    Sirikata::Array1d<int, 4> blocks_wide;
+    const int16_t *block(int cmp, int x, int y) const {
+        return &coefficients[cmp][((size_t)y * blocks_wide[cmp] + x) * 64];
+    }
+};
+// Fills *image from the full-frame colldata. A flipped edge must end on an
+// mcu boundary. False if the request was cancelled.
+bool transform_decoded_image(TransformedImage *image);
+#endif
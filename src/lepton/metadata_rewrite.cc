@@ -0,0 +1,191 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include <fcntl.h>
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+#include "metadata_rewrite.hh"
+#include "lepton_header.hh"
+#include "../vp8/util/memory.hh"
+#include "../io/ioutil.hh"
+#include "../io/Seccomp.hh"
+
+const char *g_metadata_source = NULL;
+
+namespace {
+typedef LeptonHeaderBuffer Buffer;
+
+bool is_metadata_marker(uint8_t type) {
+    return (type >= 0xE1 && type <= 0xEF && type != 0xEE) || type == 0xFE;
+}
+
+size_t segment_end(const uint8_t *data, size_t pos, size_t end) {
+    return std::min(end, pos + 2 + ((data[pos + 2] << 8) | data[pos + 3]));
+}
+
+// the metadata segments of the -metadatafrom jpeg, read before the jail closes
+Buffer read_metadata_source(const char *filename) {
+    int fd = open(filename, O_RDONLY
+#ifdef _WIN32
+                  |O_BINARY
+#endif
+        );
+    if (fd == -1) {
+        fprintf(stderr, "Unable to open metadata source %s\n", filename);
+        custom_exit(ExitCode::FILE_NOT_FOUND);
+    }
+    IOUtil::FileReader reader(fd, 0x7fffffff, false);
+    Buffer jpeg;
+    unsigned char buffer[65536];
+    while (true) {
+        std::pair<Sirikata::uint32, Sirikata::JpegError> ret = reader.Read(buffer, sizeof(buffer));
+        jpeg.insert(jpeg.end(), buffer, buffer + ret.first);
+        if (ret.first == 0 || ret.second != Sirikata::JpegError::nil()) {
+            break;
+        }
+    }
+    while (close(fd) < 0 && errno == EINTR) {}
+    if (jpeg.size() < 2 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) {
+        fprintf(stderr, "Metadata source %s is not a jpeg\n", filename);
+        custom_exit(ExitCode::UNSUPPORTED_JPEG);
+    }
+    Buffer metadata;
+    for (size_t pos = 2; pos + 4 <= jpeg.size() && jpeg[pos] == 0xFF; ) {
+        uint8_t type = jpeg[pos + 1];
+        size_t end = segment_end(jpeg.data(), pos, jpeg.size());
+        if (is_metadata_marker(type)) {
+            metadata.insert(metadata.end(), jpeg.begin() + pos, jpeg.begin() + end);
+        } else if (type == 0xDA) {
+            break;
+        }
+        pos = end;
+    }
+    return metadata;
+}
+
+// Rejects concatenated files and moves the legacy SIZ record by size_delta.
+void adjust_recovery_records(uint8_t *data, size_t size, int32_t size_delta) {
+    bool well_formed = for_each_recovery_record(
+        data, size,
+        [size_delta](const uint8_t *marker, uint8_t *payload, size_t payload_size) {
+            if (memcmp(marker, "SIZ", 3) == 0) {
+                lepton_write_le32(lepton_read_le32(payload) + size_delta, payload);
+            } else if (memcmp(marker, "CNT", 3) == 0) {
+                fprintf(stderr, "Metadata of concatenated lepton files cannot be rewritten\n");
+                custom_exit(ExitCode::VERSION_UNSUPPORTED);
+            }
+        });
+    if (!well_formed) {
+        custom_exit(ExitCode::STREAM_INCONSISTENT);
+    }
+}
+}
+
+void rewrite_metadata(int fdin, int fdout, const Sirikata::Array1d<uint8_t, 2> &header) {
+    using namespace Sirikata;
+    Buffer new_metadata;
+    if (g_metadata_source) {
+        new_metadata = read_metadata_source(g_metadata_source);
+    }
+    if (fdout == -1) {
+        fdout = 1; // push to stdout
+    }
+    IOUtil::FileReader reader(fdin, 0x7fffffff, false);
+    IOUtil::FileWriter writer(fdout, false, false);
+    if (g_use_seccomp) {
+        Sirikata::installStrictSyscallFilter(true);
+    }
+    Array1d<uint8_t, LEPTON_PREAMBLE_SIZE> preamble;
+    preamble[0] = header[0];
+    preamble[1] = header[1];
+    if (IOUtil::ReadFull(&reader, &preamble[2], 26) != 26) {
+        custom_exit(ExitCode::SHORT_READ);
+    }
+    if (preamble[LEPTON_KIND_OFFSET] == 'Y') {
+        fprintf(stderr, "Metadata of a lepton file holding a slice of a jpeg cannot be rewritten\n");
+        custom_exit(ExitCode::VERSION_UNSUPPORTED);
+    }
+    uint32_t compressed_size = lepton_read_le32(&preamble[LEPTON_HEADER_SIZE_OFFSET]);
+    Buffer compressed(compressed_size);
+    if (IOUtil::ReadFull(&reader, compressed.data(), compressed_size) != compressed_size) {
+        custom_exit(ExitCode::SHORT_READ);
+    }
+    Buffer records;
+    if (!decompress_lepton_header(preamble.begin(), compressed.data(), compressed.size(), &records)) {
+        custom_exit(ExitCode::STREAM_INCONSISTENT);
+    }
+    uint32_t hdrs = lepton_read_le32(&records[3]);
+    // the new metadata goes after the leading APP0 segments, where jpeg
+    // writers put EXIF and XMP
+    const uint8_t *hdrdata = &records[LEPTON_HDR_RECORD_PREFIX];
+    Buffer jpeg_header;
+    bool inserted = false;
+    size_t pos = 0;
+    while (pos + 4 <= hdrs && hdrdata[pos] == 0xFF) {
+        uint8_t type = hdrdata[pos + 1];
+        size_t end = segment_end(hdrdata, pos, hdrs);
+        if (!inserted && type != 0xE0 && !is_metadata_marker(type)) {
+            jpeg_header.insert(jpeg_header.end(), new_metadata.begin(), new_metadata.end());
+            inserted = true;
+        }
+        if (!is_metadata_marker(type)) {
+            jpeg_header.insert(jpeg_header.end(), hdrdata + pos, hdrdata + end);
+        }
+        pos = end;
+    }
+    if (!inserted) {
+        jpeg_header.insert(jpeg_header.end(), new_metadata.begin(), new_metadata.end());
+    }
+    // the tail of a truncated header
+    jpeg_header.insert(jpeg_header.end(), hdrdata + pos, hdrdata + hdrs);
+    int32_t size_delta = (int32_t)jpeg_header.size() - (int32_t)hdrs;
+
+    Buffer new_records(records.begin(), records.begin() + 3);
+    new_records.resize(LEPTON_HDR_RECORD_PREFIX);
+    lepton_write_le32(jpeg_header.size(), &new_records[3]);
+    new_records.insert(new_records.end(), jpeg_header.begin(), jpeg_header.end());
+    size_t recovery_start = new_records.size();
+    new_records.insert(new_records.end(), records.begin() + LEPTON_HDR_RECORD_PREFIX + hdrs, records.end());
+    adjust_recovery_records(&new_records[recovery_start], new_records.size() - recovery_start,
+                            size_delta);
+    Buffer new_compressed = compress_lepton_header(preamble.begin(), new_records);
+    lepton_write_le32(lepton_read_le32(&preamble[LEPTON_JPEG_SIZE_OFFSET]) + size_delta,
+                      &preamble[LEPTON_JPEG_SIZE_OFFSET]);
+    lepton_write_le32(new_compressed.size(), &preamble[LEPTON_HEADER_SIZE_OFFSET]);
+    always_assert(writer.Write(preamble.begin(), preamble.size()).second == JpegError::nil());
+    always_assert(writer.Write(new_compressed.data(), new_compressed.size()).second == JpegError::nil());
+
+    // the coded data goes through as is, but for the trailing size of the whole file
+    uint32_t old_file_size = preamble.size() + compressed_size;
+    uint32_t new_file_size = preamble.size() + new_compressed.size();
+    unsigned char buffer[65536 + 4];
+    size_t held = 0; // the last bytes read, which may be the trailing size
+    while (true) {
+        std::pair<uint32, JpegError> ret = reader.Read(buffer + held, sizeof(buffer) - held);
+        held += ret.first;
+        if (held > 4) {
+            always_assert(writer.Write(buffer, held - 4).second == JpegError::nil());
+            old_file_size += held - 4;
+            new_file_size += held - 4;
+            memmove(buffer, buffer + held - 4, 4);
+            held = 4;
+        }
+        if (ret.first == 0 || ret.second != JpegError::nil()) {
+            break;
+        }
+    }
+    old_file_size += held;
+    new_file_size += held;
+    if (held != 4 || lepton_read_le32(buffer) != old_file_size) {
+        fprintf(stderr, "Lepton file does not end with its own size\n");
+        custom_exit(ExitCode::STREAM_INCONSISTENT);
+    }
+    lepton_write_le32(new_file_size, buffer);
+    always_assert(writer.Write(buffer, 4).second == JpegError::nil());
+    writer.Close();
+    custom_exit(ExitCode::SUCCESS);
+}
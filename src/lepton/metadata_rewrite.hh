@@ -0,0 +1,16 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef METADATA_REWRITE_HH_
+#define METADATA_REWRITE_HH_
+#include "../vp8/util/nd_array.hh"
+
+// set by -metadatafrom=: the jpeg whose metadata segments replace those of
+// the .lep; NULL with -stripmeta
+extern const char *g_metadata_source;
+
+// Copies the .lep on fdin (its two magic bytes already read into header) to
+// fdout with the APPn and COM segments of its jpeg header dropped or
+// replaced. Only the compressed header block and the sizes that depend on it
+// are rebuilt: the coded coefficients are copied through untouched.
+// APP0 (JFIF) and APP14 (Adobe) stay, since they say how to read the pixels.
+void rewrite_metadata(int fdin, int fdout, const Sirikata::Array1d<uint8_t, 2> &header);
+#endif
@@ -0,0 +1,686 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#ifndef USE_SCALAR
+#include <immintrin.h>
+#include <tmmintrin.h>
+#endif
+#include "pixel_output.hh"
+#include "jpgcoder.hh"
+#include "bitops.hh"
+#include "idct.hh"
+#include "component_info.hh"
+#include "uncompressed_components.hh"
+#include "lepton_codec.hh"
+#include "vp8_decoder.hh"
+#include "../io/BoundedMemWriter.hh"
+#include "../vp8/util/memory.hh"
+#include "../vp8/util/debug.hh"
+#include "../vp8/util/cancellation.hh"
+
+extern BaseDecoder *g_decoder;
+extern UncompressedComponents colldata; // baseline sorted DCT coefficients
+extern Sirikata::Array1d<componentInfo, 4> cmpnfo;
+extern int cmpc; // component count
+extern int imgwidth; // width of image
+extern int imgheight; // height of image
+extern int sfhm; // max vertical sample factor (see below)
+extern int sfvm; // max horizontal sample factor
+extern int mcuv; // mcu rows
+std::pair<int, int> logical_thread_range_from_physical_thread_id(int physical_thread_id, int num_logical_threads);
+
+PixelFormat g_pixel_format = PixelFormat::JPEG;
+
+namespace {
+void nop() {}
+
+struct ComponentGeometry {
+    int block_width; // blocks per row, including the mcu padding
+    int block_rows_per_mcu;
+    int h_ratio; // image columns covered by each sample
+    int v_ratio; // image rows covered by each sample
+    int plane_width; // samples that fall inside the image
+    int plane_height;
+    Sirikata::AlignedArray1d<uint16_t, 64> quantization; // raster order, as idct() takes it
+};
+
+struct FrameGeometry {
+    int num_components;
+    int width;
+    int height;
+    int mcu_rows;
+    int mcu_height; // image rows per mcu row
+    Sirikata::Array1d<ComponentGeometry, 4> component;
+    // rows of the image that belong to mcu_row
+    int rows_in_mcu(int mcu_row) const {
+        return std::max(0, std::min(mcu_height, height - mcu_row * mcu_height));
+    }
+};
+
+const char *y4m_chroma_tag(const FrameGeometry &frame) {
+    if (frame.num_components == 1) {
+        return "mono";
+    }
+    const ComponentGeometry &luma = frame.component[0];
+    const ComponentGeometry &cb = frame.component[1];
+    const ComponentGeometry &cr = frame.component[2];
+    if (luma.h_ratio != 1 || luma.v_ratio != 1
+        || cb.h_ratio != cr.h_ratio || cb.v_ratio != cr.v_ratio) {
+        return NULL;
+    }
+    if (cb.h_ratio == 1 && cb.v_ratio == 1) {
+        return "444";
+    }
+    if (cb.h_ratio == 2 && cb.v_ratio == 1) {
+        return "422";
+    }
+    if (cb.h_ratio == 2 && cb.v_ratio == 2) {
+        return "420jpeg";
+    }
+    if (cb.h_ratio == 4 && cb.v_ratio == 1) {
+        return "411";
+    }
+    return NULL;
+}
+
+void setup_frame_geometry(FrameGeometry *frame) {
+    frame->num_components = cmpc;
+    frame->width = imgwidth;
+    frame->height = imgheight;
+    frame->mcu_rows = mcuv;
+    // the header parser keeps the horizontal sampling factor in sfv
+    // and the vertical one in sfh
+    frame->mcu_height = 8 * sfhm;
+    if (cmpc == 4) {
+        fprintf(stderr, "Pixel output of 4 component images is not supported\n");
+        custom_exit(ExitCode::UNSUPPORTED_4_COLORS);
+    }
+    if (cmpc != 1 && cmpc != 3) {
+        fprintf(stderr, "Pixel output needs 1 or 3 components, not %d\n", cmpc);
+        custom_exit(ExitCode::UNSUPPORTED_JPEG);
+    }
+    for (int cmp = 0; cmp < cmpc; ++cmp) {
+        ComponentGeometry &geometry = frame->component[cmp];
+        int h_factor = cmpnfo[cmp].sfv;
+        int v_factor = cmpnfo[cmp].sfh;
+        if (sfvm % h_factor || sfhm % v_factor) {
+            fprintf(stderr, "Pixel output needs integer chroma upsampling\n");
+            custom_exit(ExitCode::UNSUPPORTED_JPEG);
+        }
+        geometry.block_width = colldata.block_width(cmp);
+        geometry.block_rows_per_mcu = v_factor;
+        geometry.h_ratio = sfvm / h_factor;
+        geometry.v_ratio = sfhm / v_factor;
+        geometry.plane_width = (imgwidth + geometry.h_ratio - 1) / geometry.h_ratio;
+        geometry.plane_height = (imgheight + geometry.v_ratio - 1) / geometry.v_ratio;
+        for (int i = 0; i < 64; ++i) {
+            geometry.quantization[i] = cmpnfo[cmp].qtable[raster_to_jpeg_zigzag[i]];
+        }
+    }
+    if (g_pixel_format == PixelFormat::YCBCR && y4m_chroma_tag(*frame) == NULL) {
+        fprintf(stderr, "Chroma subsampling has no YUV4MPEG2 equivalent, use -pixels=rgb\n");
+        custom_exit(ExitCode::UNSUPPORTED_JPEG);
+    }
+}
+
+// idct() leaves 8 * (sample - 128) in each output
+void store_block_samples(const int16_t idct_out[64], uint8_t *dst, size_t stride) {
+#ifndef USE_SCALAR
+    const __m128i bias = _mm_set1_epi16(1024 + 4);
+    for (int row = 0; row < 8; row += 2) {
+        __m128i even = _mm_load_si128((const __m128i*)(idct_out + row * 8));
+        __m128i odd = _mm_load_si128((const __m128i*)(idct_out + row * 8 + 8));
+        even = _mm_srai_epi16(_mm_adds_epi16(even, bias), 3);
+        odd = _mm_srai_epi16(_mm_adds_epi16(odd, bias), 3);
+        __m128i packed = _mm_packus_epi16(even, odd);
+        _mm_storel_epi64((__m128i*)(dst + row * stride), packed);
+        _mm_storel_epi64((__m128i*)(dst + (row + 1) * stride), _mm_srli_si128(packed, 8));
+    }
+#else
+    for (int row = 0; row < 8; ++row) {
+        for (int col = 0; col < 8; ++col) {
+            int sample = (idct_out[row * 8 + col] + 1024 + 4) >> 3;
+            dst[row * stride + col] = (uint8_t)std::max(0, std::min(255, sample));
+        }
+    }
+#endif
+}
+
+// replicates each of the samples of src ratio times; reads and writes may
+// run up to 16 bytes past the end of the row
+void upsample_row(const uint8_t *src, uint8_t *dst, int ratio, int num_samples) {
+    int i = 0;
+#ifndef USE_SCALAR
+    if (ratio == 2) {
+        for (; i < num_samples; i += 16) {
+            __m128i samples = _mm_loadu_si128((const __m128i*)(src + i));
+            _mm_storeu_si128((__m128i*)(dst + 2 * i), _mm_unpacklo_epi8(samples, samples));
+            _mm_storeu_si128((__m128i*)(dst + 2 * i + 16), _mm_unpackhi_epi8(samples, samples));
+        }
+        return;
+    }
+    if (ratio == 4) {
+        for (; i < num_samples; i += 16) {
+            __m128i samples = _mm_loadu_si128((const __m128i*)(src + i));
+            __m128i lo = _mm_unpacklo_epi8(samples, samples);
+            __m128i hi = _mm_unpackhi_epi8(samples, samples);
+            _mm_storeu_si128((__m128i*)(dst + 4 * i), _mm_unpacklo_epi16(lo, lo));
+            _mm_storeu_si128((__m128i*)(dst + 4 * i + 16), _mm_unpackhi_epi16(lo, lo));
+            _mm_storeu_si128((__m128i*)(dst + 4 * i + 32), _mm_unpacklo_epi16(hi, hi));
+            _mm_storeu_si128((__m128i*)(dst + 4 * i + 48), _mm_unpackhi_epi16(hi, hi));
+        }
+        return;
+    }
+#endif
+    for (; i < num_samples; ++i) {
+        memset(dst + i * ratio, src[i], ratio);
+    }
+}
+
+// JFIF YCbCr to RGB in 1.15 fixed point, the integer parts of 1.402 and
+// 1.772 added separately so that every factor fits a signed 16 bit lane
+enum {
+    CR_TO_R = 13173, // 0.402
+    CB_TO_G = 11277, // 0.344136
+    CR_TO_G = 23401, // 0.714136
+    CB_TO_B = 25297, // 0.772
+};
+
+int mulhrs(int a, int b) {
+    return (a * b + (1 << 14)) >> 15;
+}
+
+uint8_t clamp_sample(int value) {
+    return (uint8_t)std::max(0, std::min(255, value));
+}
+
+#ifndef USE_SCALAR
+// interleaves 16 samples each of r, g and b into 48 bytes of RGB
+void store_rgb16(__m128i r, __m128i g, __m128i b, uint8_t *dst) {
+    const __m128i r0 = _mm_setr_epi8(0,-1,-1,1,-1,-1,2,-1,-1,3,-1,-1,4,-1,-1,5);
+    const __m128i g0 = _mm_setr_epi8(-1,0,-1,-1,1,-1,-1,2,-1,-1,3,-1,-1,4,-1,-1);
+    const __m128i b0 = _mm_setr_epi8(-1,-1,0,-1,-1,1,-1,-1,2,-1,-1,3,-1,-1,4,-1);
+    const __m128i r1 = _mm_setr_epi8(-1,-1,6,-1,-1,7,-1,-1,8,-1,-1,9,-1,-1,10,-1);
+    const __m128i g1 = _mm_setr_epi8(5,-1,-1,6,-1,-1,7,-1,-1,8,-1,-1,9,-1,-1,10);
+    const __m128i b1 = _mm_setr_epi8(-1,5,-1,-1,6,-1,-1,7,-1,-1,8,-1,-1,9,-1,-1);
+    const __m128i r2 = _mm_setr_epi8(-1,11,-1,-1,12,-1,-1,13,-1,-1,14,-1,-1,15,-1,-1);
+    const __m128i g2 = _mm_setr_epi8(-1,-1,11,-1,-1,12,-1,-1,13,-1,-1,14,-1,-1,15,-1);
+    const __m128i b2 = _mm_setr_epi8(10,-1,-1,11,-1,-1,12,-1,-1,13,-1,-1,14,-1,-1,15);
+    _mm_storeu_si128((__m128i*)dst,
+                     _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r0), _mm_shuffle_epi8(g, g0)),
+                                  _mm_shuffle_epi8(b, b0)));
+    _mm_storeu_si128((__m128i*)(dst + 16),
+                     _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r1), _mm_shuffle_epi8(g, g1)),
+                                  _mm_shuffle_epi8(b, b1)));
+    _mm_storeu_si128((__m128i*)(dst + 32),
+                     _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r2), _mm_shuffle_epi8(g, g2)),
+                                  _mm_shuffle_epi8(b, b2)));
+}
+
+// r, g and b of 8 pixels as 16 bit lanes
+void ycc_to_rgb8(__m128i y, __m128i cb, __m128i cr, __m128i *r, __m128i *g, __m128i *b) {
+    const __m128i center = _mm_set1_epi16(128);
+    cb = _mm_sub_epi16(cb, center);
+    cr = _mm_sub_epi16(cr, center);
+    *r = _mm_add_epi16(_mm_add_epi16(y, cr), _mm_mulhrs_epi16(cr, _mm_set1_epi16(CR_TO_R)));
+    *g = _mm_sub_epi16(_mm_sub_epi16(y, _mm_mulhrs_epi16(cb, _mm_set1_epi16(CB_TO_G))),
+                       _mm_mulhrs_epi16(cr, _mm_set1_epi16(CR_TO_G)));
+    *b = _mm_add_epi16(_mm_add_epi16(y, cb), _mm_mulhrs_epi16(cb, _mm_set1_epi16(CB_TO_B)));
+}
+#endif
+
+void ycc_to_rgb_row(const uint8_t *y, const uint8_t *cb, const uint8_t *cr,
+                    uint8_t *rgb, int width) {
+    int i = 0;
+#ifndef USE_SCALAR
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= width; i += 16) {
+        __m128i y16 = _mm_loadu_si128((const __m128i*)(y + i));
+        __m128i cb16 = _mm_loadu_si128((const __m128i*)(cb + i));
+        __m128i cr16 = _mm_loadu_si128((const __m128i*)(cr + i));
+        __m128i r_lo, g_lo, b_lo, r_hi, g_hi, b_hi;
+        ycc_to_rgb8(_mm_unpacklo_epi8(y16, zero), _mm_unpacklo_epi8(cb16, zero),
+                    _mm_unpacklo_epi8(cr16, zero), &r_lo, &g_lo, &b_lo);
+        ycc_to_rgb8(_mm_unpackhi_epi8(y16, zero), _mm_unpackhi_epi8(cb16, zero),
+                    _mm_unpackhi_epi8(cr16, zero), &r_hi, &g_hi, &b_hi);
+        store_rgb16(_mm_packus_epi16(r_lo, r_hi),
+                    _mm_packus_epi16(g_lo, g_hi),
+                    _mm_packus_epi16(b_lo, b_hi),
+                    rgb + 3 * i);
+    }
+#endif
+    for (; i < width; ++i) {
+        int luma = y[i];
+        int blue_diff = cb[i] - 128;
+        int red_diff = cr[i] - 128;
+        rgb[3 * i] = clamp_sample(luma + red_diff + mulhrs(red_diff, CR_TO_R));
+        rgb[3 * i + 1] = clamp_sample(luma - mulhrs(blue_diff, CB_TO_G) - mulhrs(red_diff, CR_TO_G));
+        rgb[3 * i + 2] = clamp_sample(luma + blue_diff + mulhrs(blue_diff, CB_TO_B));
+    }
+}
+
+void gray_to_rgb_row(const uint8_t *y, uint8_t *rgb, int width) {
+    int i = 0;
+#ifndef USE_SCALAR
+    for (; i + 16 <= width; i += 16) {
+        __m128i y16 = _mm_loadu_si128((const __m128i*)(y + i));
+        store_rgb16(y16, y16, y16, rgb + 3 * i);
+    }
+#endif
+    for (; i < width; ++i) {
+        rgb[3 * i] = rgb[3 * i + 1] = rgb[3 * i + 2] = y[i];
+    }
+}
+
+AlignedBlock zero_block; // stands in for blocks past the end of a truncated image
+
+// Turns the coefficients of one mcu row into samples and the samples into
+// output rows. Each decoding thread owns one.
+class McuRowConverter {
+    const FrameGeometry &frame_;
+    // one mcu row of each component at its own resolution
+    Sirikata::Array1d<std::vector<uint8_t>, 4> samples_;
+    // the current image row of each component, upsampled to the image width
+    Sirikata::Array1d<std::vector<uint8_t>, 4> upsampled_;
+    std::vector<uint8_t> rgb_;
+    size_t stride(int cmp) const {
+        return frame_.component[cmp].block_width * 8;
+    }
+public:
+    McuRowConverter(const FrameGeometry &frame) : frame_(frame) {
+        for (int cmp = 0; cmp < frame.num_components; ++cmp) {
+            const ComponentGeometry &geometry = frame.component[cmp];
+            samples_[cmp].resize(stride(cmp) * geometry.block_rows_per_mcu * 8 + 16);
+            upsampled_[cmp].resize(stride(cmp) * geometry.h_ratio + 64);
+        }
+        rgb_.resize(frame.width * 3 + 48);
+    }
+    // fetch(cmp, block_y, block_x) returns the decoded block
+    template<class BlockFetcher> void load(int mcu_row, const BlockFetcher &fetch) {
+        Sirikata::AlignedArray1d<int16_t, 64> idct_out;
+        for (int cmp = 0; cmp < frame_.num_components; ++cmp) {
+            const ComponentGeometry &geometry = frame_.component[cmp];
+            for (int row = 0; row < geometry.block_rows_per_mcu; ++row) {
+                int block_y = mcu_row * geometry.block_rows_per_mcu + row;
+                uint8_t *dst = &samples_[cmp][row * 8 * stride(cmp)];
+                for (int block_x = 0; block_x < geometry.block_width; ++block_x) {
+                    idct(fetch(cmp, block_y, block_x), geometry.quantization.begin(),
+                         idct_out.begin(), false);
+                    store_block_samples(idct_out.begin(), dst + block_x * 8, stride(cmp));
+                }
+            }
+        }
+    }
+    template<class Writer> void write_rgb(int mcu_row, Writer *out) {
+        Sirikata::Array1d<int, 4> upsampled_row;
+        upsampled_row.memset(0xff);
+        int rows = frame_.rows_in_mcu(mcu_row);
+        for (int row = 0; row < rows; ++row) {
+            Sirikata::Array1d<const uint8_t *, 4> line;
+            for (int cmp = 0; cmp < frame_.num_components; ++cmp) {
+                const ComponentGeometry &geometry = frame_.component[cmp];
+                int sample_row = row / geometry.v_ratio;
+                const uint8_t *src = &samples_[cmp][sample_row * stride(cmp)];
+                if (geometry.h_ratio == 1) {
+                    line[cmp] = src;
+                    continue;
+                }
+                if (upsampled_row[cmp] != sample_row) { // vertical neighbours share a row
+                    upsample_row(src, &upsampled_[cmp][0], geometry.h_ratio, geometry.plane_width);
+                    upsampled_row[cmp] = sample_row;
+                }
+                line[cmp] = &upsampled_[cmp][0];
+            }
+            if (frame_.num_components == 1) {
+                gray_to_rgb_row(line[0], &rgb_[0], frame_.width);
+            } else {
+                ycc_to_rgb_row(line[0], line[1], line[2], &rgb_[0], frame_.width);
+            }
+            out->write(&rgb_[0], frame_.width * 3);
+        }
+    }
+    void copy_to_planes(int mcu_row, const Sirikata::Array1d<uint8_t *, 4> &planes) {
+        for (int cmp = 0; cmp < frame_.num_components; ++cmp) {
+            const ComponentGeometry &geometry = frame_.component[cmp];
+            int first_row = mcu_row * geometry.block_rows_per_mcu * 8;
+            int rows = std::min(geometry.block_rows_per_mcu * 8, geometry.plane_height - first_row);
+            for (int row = 0; row < rows; ++row) {
+                memcpy(planes[cmp] + (size_t)(first_row + row) * geometry.plane_width,
+                       &samples_[cmp][row * stride(cmp)],
+                       geometry.plane_width);
+            }
+        }
+    }
+    template<class Writer> void emit(int mcu_row, Writer *out, const Sirikata::Array1d<uint8_t *, 4> &planes) {
+        if (planes[0]) {
+            copy_to_planes(mcu_row, planes);
+        } else {
+            write_rgb(mcu_row, out);
+        }
+    }
+};
+
+// the same walk over the rows of a thread's luma range as recode_row_range,
+// and like it CODING_ERROR if the request was cancelled partway
+template<class Writer>
+CodingReturnValue decode_pixel_row_range(Writer *out,
+                            const FrameGeometry &frame,
+                            const Sirikata::Array1d<uint8_t *, 4> &planes,
+                            McuRowConverter *converter,
+                            BlockBasedImagePerChannel<true> &framebuffer,
+                            const ThreadHandoff &thread_handoff,
+                            Sirikata::Array1d<uint32_t, (uint32_t)ColorChannel::NumBlockTypes> max_coded_heights,
+                            Sirikata::Array1d<uint32_t, (uint32_t)ColorChannel::NumBlockTypes> component_size_in_blocks,
+                            int physical_thread_id) {
+    int decode_index = 0;
+    while (true) {
+        LeptonCodec_RowSpec cur_row = LeptonCodec_row_spec_from_index(decode_index++,
+                                                                        framebuffer,
+                                                                        frame.mcu_rows,
+                                                                        max_coded_heights);
+        if (cur_row.done) {
+            break;
+        }
+        if (cur_row.skip) {
+            continue;
+        }
+        if (cur_row.min_row_luma_y < thread_handoff.luma_y_start) {
+            continue;
+        }
+        if (cur_row.next_row_luma_y > thread_handoff.luma_y_end) {
+            break; // we're done here
+        }
+        if (Cancellation::requested()) {
+            return CODING_ERROR;
+        }
+        {
+            TraceHarness::Span row_span(physical_thread_id, TraceHarness::ROW_DECODE,
+                                        cur_row.component, cur_row.curr_y);
+            g_decoder->decode_row(physical_thread_id,
+                                  framebuffer,
+                                  component_size_in_blocks,
+                                  cur_row.component,
+                                  cur_row.curr_y);
+        }
+        TimingHarness::count_blocks(framebuffer[cur_row.component]->block_width());
+        if (cur_row.last_row_to_complete_mcu) {
+            converter->load(cur_row.mcu_row_index,
+                            [&](int cmp, int block_y, int block_x) -> const AlignedBlock& {
+                                // the last coded row of a truncated file ends partway through
+                                unsigned int dpos = block_y * frame.component[cmp].block_width + block_x;
+                                if (dpos >= component_size_in_blocks[cmp]) {
+                                    return zero_block;
+                                }
+                                return framebuffer[cmp]->at(block_y, block_x);
+                            });
+            converter->emit(cur_row.mcu_row_index, out, planes);
+        }
+    }
+    return CODING_DONE;
+}
+
+template<class Writer>
+void decode_pixels_physical_thread(Writer *out,
+                                   const FrameGeometry *frame,
+                                   Sirikata::Array1d<uint8_t *, 4> planes,
+                                   BlockBasedImagePerChannel<true> &framebuffer,
+                                   const std::vector<ThreadHandoff> &thread_handoffs,
+                                   Sirikata::Array1d<uint32_t, (uint32_t)ColorChannel::NumBlockTypes> max_coded_heights,
+                                   Sirikata::Array1d<uint32_t, (uint32_t)ColorChannel::NumBlockTypes> component_size_in_blocks,
+                                   int physical_thread_id) {
+    int logical_thread_start, logical_thread_end;
+    std::tie(logical_thread_start, logical_thread_end)
+        = logical_thread_range_from_physical_thread_id(physical_thread_id, thread_handoffs.size());
+    McuRowConverter converter(*frame);
+    for (int logical_thread_id = logical_thread_start; logical_thread_id < logical_thread_end; ++logical_thread_id) {
+        TimingHarness::stamp(logical_thread_id % MAX_NUM_THREADS, TimingHarness::TS_ARITH_STARTED);
+        g_decoder->clear_thread_state(logical_thread_id, physical_thread_id, framebuffer);
+        if (decode_pixel_row_range(out,
+                                   *frame,
+                                   planes,
+                                   &converter,
+                                   framebuffer,
+                                   thread_handoffs[logical_thread_id],
+                                   max_coded_heights,
+                                   component_size_in_blocks,
+                                   physical_thread_id) != CODING_DONE) {
+            break; // cancelled: decode_pixels fails once every thread is joined
+        }
+        TimingHarness::stamp(logical_thread_id % MAX_NUM_THREADS, TimingHarness::TS_ARITH_FINISHED);
+    }
+}
+
+// bytes of rgb the mcu rows lying wholly inside [luma_y_start, luma_y_end) produce
+size_t rgb_bytes_in_luma_range(const FrameGeometry &frame, int luma_y_start, int luma_y_end) {
+    int luma_rows_per_mcu = frame.component[0].block_rows_per_mcu;
+    size_t retval = 0;
+    for (int mcu_row = (luma_y_start + luma_rows_per_mcu - 1) / luma_rows_per_mcu;
+         (mcu_row + 1) * luma_rows_per_mcu <= luma_y_end && mcu_row < frame.mcu_rows;
+         ++mcu_row) {
+        retval += (size_t)frame.rows_in_mcu(mcu_row) * frame.width * 3;
+    }
+    return retval;
+}
+
+// decodes into the two-row framebuffers, each worker converting its own rows
+void decode_pixels_streaming(bounded_iostream *str_out,
+                             const FrameGeometry &frame,
+                             const Sirikata::Array1d<uint8_t *, 4> &planes) {
+    Sirikata::Array1d<uint32_t, (size_t)ColorChannel::NumBlockTypes> max_coded_heights
+        = colldata.get_max_coded_heights();
+    Sirikata::Array1d<uint32_t, (uint32_t)ColorChannel::NumBlockTypes> component_size_in_blocks
+        = colldata.get_component_size_in_blocks();
+    Sirikata::Array1d<BlockBasedImagePerChannel<true>, MAX_NUM_THREADS> framebuffer;
+    for (size_t thread_id = 0; thread_id < NUM_THREADS; ++thread_id) {
+        for (int cmp = 0; cmp < colldata.get_num_components(); ++cmp) {
+            framebuffer[thread_id][cmp] = new BlockBasedImageBase<true>;
+            colldata.allocate_channel_framebuffer(cmp,
+                                                  framebuffer[thread_id][cmp],
+                                                  true);
+        }
+        if (!g_threaded) {
+            break;
+        }
+    }
+    std::vector<ThreadHandoff> luma_bounds = g_decoder->initialize_baseline_decoder(&colldata,
+                                                                                    framebuffer);
+    if (luma_bounds.size() && luma_bounds[0].is_legacy_mode()) {
+        g_threaded = false;
+    }
+    g_decoder->reset_all_comm_buffers();
+    unsigned int num_physical_threads = (g_threaded ? NUM_THREADS : 1);
+    for (unsigned int physical_thread_id = 0; physical_thread_id < num_physical_threads; ++physical_thread_id) {
+        int logical_thread_start, logical_thread_end;
+        std::tie(logical_thread_start, logical_thread_end)
+            = logical_thread_range_from_physical_thread_id(physical_thread_id, luma_bounds.size());
+        for (int logical_thread_id = logical_thread_start; logical_thread_id < logical_thread_end; ++logical_thread_id) {
+            g_decoder->map_logical_thread_to_physical_thread(logical_thread_id, physical_thread_id);
+        }
+    }
+    if (NUM_THREADS != 1 && g_threaded) {
+        // the first thread streams to str_out; the others hold their rows until it is done
+        Sirikata::Array1d<Sirikata::BoundedMemWriter, MAX_NUM_THREADS - 1> local_buffers;
+        for (unsigned int physical_thread_id = 0; physical_thread_id < g_decoder->getNumWorkers(); ++physical_thread_id) {
+            g_decoder->getWorker(physical_thread_id)->work = nop;
+        }
+        for (unsigned int physical_thread_id = 0; physical_thread_id < num_physical_threads; ++physical_thread_id) {
+            if (physical_thread_id != 0) {
+                int logical_thread_start, logical_thread_end;
+                std::tie(logical_thread_start, logical_thread_end)
+                    = logical_thread_range_from_physical_thread_id(physical_thread_id, luma_bounds.size());
+                size_t work_size = 0;
+                if (!planes[0]) {
+                    for (int logical_thread_id = logical_thread_start; logical_thread_id < logical_thread_end; ++logical_thread_id) {
+                        work_size += rgb_bytes_in_luma_range(frame,
+                                                             luma_bounds[logical_thread_id].luma_y_start,
+                                                             luma_bounds[logical_thread_id].luma_y_end);
+                    }
+                }
+                local_buffers[physical_thread_id - 1].set_bound(work_size);
+                g_decoder->getWorker(physical_thread_id)->work
+                    = std::bind(&decode_pixels_physical_thread<Sirikata::BoundedMemWriter>,
+                                &local_buffers[physical_thread_id - 1],
+                                &frame,
+                                planes,
+                                framebuffer[physical_thread_id],
+                                luma_bounds,
+                                max_coded_heights,
+                                component_size_in_blocks,
+                                physical_thread_id);
+            } else {
+                g_decoder->getWorker(physical_thread_id)->work
+                    = std::bind(&decode_pixels_physical_thread<bounded_iostream>,
+                                str_out,
+                                &frame,
+                                planes,
+                                framebuffer[physical_thread_id],
+                                luma_bounds,
+                                max_coded_heights,
+                                component_size_in_blocks,
+                                physical_thread_id);
+            }
+            g_decoder->getWorker(physical_thread_id)->activate_work();
+        }
+        g_decoder->flush();
+        for (unsigned int physical_thread_id = 0; physical_thread_id < num_physical_threads; ++physical_thread_id) {
+            TimingHarness::stamp(physical_thread_id, TimingHarness::TS_THREAD_WAIT_STARTED);
+            {
+                TraceHarness::Span wait_span(TraceHarness::MAIN_LANE, TraceHarness::THREAD_WAIT,
+                                             physical_thread_id);
+                g_decoder->getWorker(physical_thread_id)->main_wait_for_done();
+            }
+            TimingHarness::stamp(physical_thread_id, TimingHarness::TS_THREAD_WAIT_FINISHED);
+            if (physical_thread_id > 0 && !Cancellation::requested()) {
+                size_t bytes_to_copy = local_buffers[physical_thread_id - 1].bytes_written();
+                if (bytes_to_copy) {
+                    TraceHarness::Span copy_span(TraceHarness::MAIN_LANE, TraceHarness::OUTPUT_COPY,
+                                                 physical_thread_id, bytes_to_copy);
+                    str_out->write(&local_buffers[physical_thread_id - 1].buffer()[0],
+                                   bytes_to_copy);
+                }
+            }
+        }
+    } else {
+        decode_pixels_physical_thread(str_out,
+                                      &frame,
+                                      planes,
+                                      framebuffer[0],
+                                      luma_bounds,
+                                      max_coded_heights,
+                                      component_size_in_blocks,
+                                      0);
+    }
+    // a truncated file stops short of the last mcu rows: pad them in mid grey
+    // so the output is always as large as its header says
+    int first_uncoded_mcu_row = 0;
+    for (int decode_index = 0; ; ++decode_index) {
+        LeptonCodec_RowSpec cur_row = LeptonCodec_row_spec_from_index(decode_index,
+                                                                        framebuffer[0],
+                                                                        frame.mcu_rows,
+                                                                        max_coded_heights);
+        if (cur_row.done) {
+            break;
+        }
+        if (!cur_row.skip && cur_row.last_row_to_complete_mcu) {
+            first_uncoded_mcu_row = cur_row.mcu_row_index + 1;
+        }
+    }
+    if (first_uncoded_mcu_row < frame.mcu_rows && !Cancellation::requested()) {
+        McuRowConverter converter(frame);
+        for (int mcu_row = first_uncoded_mcu_row; mcu_row < frame.mcu_rows; ++mcu_row) {
+            converter.load(mcu_row, [](int, int, int) -> const AlignedBlock& {
+                    return zero_block;
+                });
+            converter.emit(mcu_row, str_out, planes);
+        }
+    }
+    for (size_t thread_id = 0; thread_id < NUM_THREADS; ++thread_id) {
+        for (int cmp = 0; cmp < colldata.get_num_components(); ++cmp) {
+            framebuffer[thread_id][cmp]->reset();
+            delete framebuffer[thread_id][cmp];
+            framebuffer[thread_id][cmp] = NULL;
+        }
+        if (!g_threaded) {
+            break;
+        }
+    }
+}
+
+// converts rows of the full frame as the decoder fills them in
+void decode_pixels_full_frame(bounded_iostream *str_out,
+                              const FrameGeometry &frame,
+                              const Sirikata::Array1d<uint8_t *, 4> &planes) {
+    McuRowConverter converter(frame);
+    for (int mcu_row = 0; mcu_row < frame.mcu_rows && !Cancellation::requested(); ++mcu_row) {
+        converter.load(mcu_row, [&frame](int cmp, int block_y, int block_x) -> const AlignedBlock& {
+                unsigned int dpos = block_y * frame.component[cmp].block_width + block_x;
+                if (dpos >= colldata.component_size_in_blocks(cmp)) {
+                    return zero_block;
+                }
+                return colldata.block((BlockType)cmp, dpos);
+            });
+        converter.emit(mcu_row, str_out, planes);
+    }
+}
+}
+
+const char *pixel_format_extension() {
+    return g_pixel_format == PixelFormat::YCBCR ? ".y4m" : ".ppm";
+}
+
+bool decode_pixels(bounded_iostream *str_out, bool memory_optimized_image) {
+    FrameGeometry frame;
+    setup_frame_geometry(&frame);
+    char header[128];
+    size_t total_size;
+    Sirikata::Array1d<uint8_t *, 4> planes;
+    planes.memset(0);
+    std::vector<uint8_t> plane_storage;
+    if (g_pixel_format == PixelFormat::YCBCR) {
+        // full range, unlike what YUV4MPEG2 readers assume by default
+        snprintf(header, sizeof(header),
+                 "YUV4MPEG2 W%d H%d F1:1 Ip A1:1 C%s XCOLORRANGE=FULL\nFRAME\n",
+                 frame.width, frame.height, y4m_chroma_tag(frame));
+        size_t plane_size = 0;
+        for (int cmp = 0; cmp < frame.num_components; ++cmp) {
+            plane_size += (size_t)frame.component[cmp].plane_width * frame.component[cmp].plane_height;
+        }
+        plane_storage.resize(plane_size);
+        total_size = strlen(header) + plane_size;
+        plane_size = 0;
+        for (int cmp = 0; cmp < frame.num_components; ++cmp) {
+            planes[cmp] = &plane_storage[plane_size];
+            plane_size += (size_t)frame.component[cmp].plane_width * frame.component[cmp].plane_height;
+        }
+    } else {
+        snprintf(header, sizeof(header), "P6\n%d %d\n255\n", frame.width, frame.height);
+        total_size = strlen(header) + (size_t)frame.width * frame.height * 3;
+    }
+    if (total_size >= 0xffffffffU) { // the output stream counts in 32 bits
+        custom_exit(ExitCode::DIMENSIONS_TOO_LARGE);
+    }
+    str_out->set_bound(total_size);
+    if (!planes[0]) {
+        str_out->write(header, strlen(header));
+    }
+    if (memory_optimized_image) {
+        decode_pixels_streaming(str_out, frame, planes);
+    } else {
+        decode_pixels_full_frame(str_out, frame, planes);
+    }
+    if (Cancellation::requested()) {
+        errorlevel.store(2); // process_file reports the request as timed out
+        return false;
+    }
+    if (planes[0]) {
+        str_out->write(header, strlen(header));
+        str_out->write(&plane_storage[0], plane_storage.size());
+    }
+    str_out->flush();
+    if (str_out->chkerr()) {
+        fprintf(stderr, "write error, possibly drive is full");
+        return false;
+    }
+    return true;
+}
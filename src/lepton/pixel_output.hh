@@ -0,0 +1,23 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef PIXEL_OUTPUT_HH_
+#define PIXEL_OUTPUT_HH_
+
+// What a .lep decode writes instead of the original JPEG when -pixels is given.
+enum class PixelFormat {
+    JPEG, // the bit-exact original file
+    RGB, // interleaved 8 bit RGB as a binary PPM, chroma upsampled to full size
+    YCBCR, // planar YCbCr at the file's own chroma resolution, as a YUV4MPEG2 frame
+};
+
+extern PixelFormat g_pixel_format;
+
+class bounded_iostream;
+// Runs the IDCT over the decoded coefficients and writes the image as
+// g_pixel_format, skipping the Huffman recode entirely. When
+// memory_optimized_image, as read_ujpg set it up, the workers decode into
+// two-row framebuffers and convert one MCU row at a time, so only planar
+// output needs a whole frame of memory.
+bool decode_pixels(bounded_iostream *str_out, bool memory_optimized_image);
+// file name suffix for outputs written in g_pixel_format
+const char *pixel_format_extension();
+#endif
@@ -10,8 +10,10 @@
 #include "bitops.hh"
 #include "lepton_codec.hh"
 #include "vp8_decoder.hh"
+#include "crc32c.hh"
 #include "../io/BoundedMemWriter.hh"
 #include "../vp8/util/memory.hh"
+#include "../vp8/util/cancellation.hh"
 #define ENVLI(s,v)        ( ( v > 0 ) ? v : ( v - 1 ) + ( 1 << s ) )
 
 int next_mcuposn(int* cmp, int* dpos, int* rstw );
@@ -44,6 +46,9 @@ extern bool rst_cnt_set;
 extern std::vector<unsigned int> rst_cnt;
 extern int prefix_grbs;   // size of prefix garbage
 extern unsigned char *prefix_grbgdata; // the actual prefix garbage: if present, hdrdata not serialized
+extern bool g_adaptive_threads;
+extern unsigned int g_idle_cpus; // sampled before the process was jailed
+extern std::vector<uint32_t> segment_checksums; // crc32c of the jpeg bytes of each thread segment
 
 static void nop(){}
 
@@ -183,6 +188,9 @@ void escape_0xff_huffman_and_write(OutputWriter* str_out,
         }
     }
 }
+template void escape_0xff_huffman_and_write<bounded_iostream>(bounded_iostream* str_out,
+                                                              const unsigned char * local_huff_data,
+                                                              unsigned int max_byte_coded);
 
 /* -----------------------------------------------
     calculates next position for MCU
@@ -467,9 +475,10 @@ void abitwriter::debug() const
     cerr << "abitwriter: no_remainder=" << no_remainder() << ", getpos=" << getpos() << ", bits="<<cbit2<<", buf="<<std::hex<<buf<<std::dec<<"\n";
 }
 
-//currently returns the overhang byte and num_overhang_bits -- these will be factored out when the encoder serializes them
+//currently returns the overhang byte and num_overhang_bits in handoff_out -- these will be factored out when the encoder serializes them
+//CODING_ERROR if the request was cancelled before the last row of the range
 template<class BoundedWriter>
-ThreadHandoff recode_row_range(BoundedWriter *stream_out,
+CodingReturnValue recode_row_range(BoundedWriter *stream_out,
                                BlockBasedImagePerChannel<true> &framebuffer,
                                int mcuv,
                                const ThreadHandoff &thread_handoff,
@@ -477,7 +486,8 @@ ThreadHandoff recode_row_range(BoundedWriter *stream_out,
                                Sirikata::Array1d<uint32_t, (uint32_t)ColorChannel::NumBlockTypes> component_size_in_blocks,
                                int physical_thread_id,
                                int logical_thread_id,
-                               abitwriter *huffw) {
+                               abitwriter *huffw,
+                               ThreadHandoff *handoff_out) {
     ThreadHandoff retval = thread_handoff;
 
     huffw->fillbit = padbit;
@@ -513,12 +523,23 @@ ThreadHandoff recode_row_range(BoundedWriter *stream_out,
         if (cur_row.next_row_luma_y > thread_handoff.luma_y_end) {
             break; // we're done here
         }
-        g_decoder->decode_row(physical_thread_id,
-                              framebuffer,
-                              component_size_in_blocks,
-                              cur_row.component,
-                              cur_row.curr_y);
+        if (Cancellation::requested()) {
+            *handoff_out = retval;
+            return CODING_ERROR;
+        }
+        {
+            TraceHarness::Span row_span(physical_thread_id, TraceHarness::ROW_DECODE,
+                                        cur_row.component, cur_row.curr_y);
+            g_decoder->decode_row(physical_thread_id,
+                                  framebuffer,
+                                  component_size_in_blocks,
+                                  cur_row.component,
+                                  cur_row.curr_y);
+        }
+        TimingHarness::count_blocks(framebuffer[cur_row.component]->block_width());
         if (cur_row.last_row_to_complete_mcu) {
+            TraceHarness::Span recode_span(physical_thread_id, TraceHarness::ROW_RECODE,
+                                           cur_row.mcu_row_index);
             if ( !recode_one_mcu_row(huffw,
                                      cur_row.mcu_row_index * mcuh,
                                      stream_out,
@@ -541,7 +562,8 @@ ThreadHandoff recode_row_range(BoundedWriter *stream_out,
             }
         }
     }
-    return retval;
+    *handoff_out = retval;
+    return CODING_DONE;
 }
 
 std::pair<int, int> logical_thread_range_from_physical_thread_id(int physical_thread_id, int num_logical_threads) {
@@ -557,6 +579,23 @@ std::pair<int, int> logical_thread_range_from_physical_thread_id(int physical_th
     }
     return std::pair<int, int>(logical_thread_start, logical_thread_end);
 }
+// The first physical thread streams out through its buffer, so it taps the
+// bytes as they pass the bound; the others can read back their own segments.
+void start_segment_checksum(bounded_iostream *stream_out, size_t *segment_start) {
+    stream_out->start_checksum();
+    *segment_start = 0;
+}
+uint32_t finish_segment_checksum(bounded_iostream *stream_out, size_t) {
+    return stream_out->finish_checksum();
+}
+void start_segment_checksum(Sirikata::BoundedMemWriter *stream_out, size_t *segment_start) {
+    *segment_start = stream_out->bytes_written();
+}
+uint32_t finish_segment_checksum(Sirikata::BoundedMemWriter *stream_out, size_t segment_start) {
+    return crc32c(0, stream_out->buffer().data() + segment_start,
+                  stream_out->bytes_written() - segment_start);
+}
+
 template<class BoundedWriter>
 void recode_physical_thread(BoundedWriter *stream_out,
                             BlockBasedImagePerChannel<true> &framebuffer,
@@ -580,7 +619,7 @@ void recode_physical_thread(BoundedWriter *stream_out,
     size_t original_bound = stream_out->get_bound();
     bool changed_bounds = false;
     for (int logical_thread_id = logical_thread_start; logical_thread_id < logical_thread_end; ++logical_thread_id) {
-        TimingHarness::timing[logical_thread_id % MAX_NUM_THREADS][TimingHarness::TS_ARITH_STARTED] = TimingHarness::get_time_us();
+        TimingHarness::stamp(logical_thread_id % MAX_NUM_THREADS, TimingHarness::TS_ARITH_STARTED);
         if (thread_handoffs[logical_thread_id].is_legacy_mode()) {
             if (logical_thread_id == logical_thread_start) {
                 th.num_overhang_bits = 0; // clean start
@@ -617,15 +656,30 @@ void recode_physical_thread(BoundedWriter *stream_out,
         g_decoder->clear_thread_state(logical_thread_id, physical_thread_id, framebuffer);
 
         //}
-        ThreadHandoff outth = recode_row_range(stream_out,
-                                               framebuffer,
-                                               mcuv,
-                                               th,
-                                               max_coded_heights,
-                                               component_size_in_blocks,
-                                               physical_thread_id,
-                                               logical_thread_id,
-                                               huffw);        
+        bool check_segment = segment_checksums.size() == thread_handoffs.size();
+        size_t segment_start = 0;
+        if (check_segment) {
+            start_segment_checksum(stream_out, &segment_start);
+        }
+        ThreadHandoff outth;
+        if (recode_row_range(stream_out,
+                             framebuffer,
+                             mcuv,
+                             th,
+                             max_coded_heights,
+                             component_size_in_blocks,
+                             physical_thread_id,
+                             logical_thread_id,
+                             huffw,
+                             &outth) != CODING_DONE) {
+            break; // cancelled: recode_baseline_jpeg fails once every thread is joined
+        }
+        if (check_segment
+            && finish_segment_checksum(stream_out, segment_start) != segment_checksums[logical_thread_id]) {
+            // no need to wait for the other segments to know the output is wrong
+            fprintf(stderr, "Thread segment %d does not match its checksum\n", logical_thread_id);
+            custom_exit(ExitCode::STREAM_INCONSISTENT);
+        }
         if (logical_thread_id + 1 < num_logical_threads
             && !thread_handoffs[logical_thread_id + 1].is_legacy_mode()) {
             if (thread_handoffs[logical_thread_id+1].luma_y_start !=
@@ -644,7 +698,7 @@ void recode_physical_thread(BoundedWriter *stream_out,
             }
         }
         th = outth;
-        TimingHarness::timing[logical_thread_id % MAX_NUM_THREADS][TimingHarness::TS_ARITH_FINISHED] = TimingHarness::get_time_us();
+        TimingHarness::stamp(logical_thread_id % MAX_NUM_THREADS, TimingHarness::TS_ARITH_FINISHED);
     }
     if (changed_bounds) {
         stream_out->set_bound(original_bound);
@@ -705,6 +759,11 @@ bool recode_baseline_jpeg(bounded_iostream*str_out,
         return false;
     }
     /* step 2: setup multithreaded decoder with framebuffer for each */
+    if (g_adaptive_threads && g_threaded && NUM_THREADS > 2) {
+        // segments are mapped onto the workers below, so there is no need
+        // for more workers than cores that are idle right now
+        NUM_THREADS = std::max(2U, std::min((unsigned int)NUM_THREADS, g_idle_cpus));
+    }
     Sirikata::Array1d<uint32_t,
                       (size_t)ColorChannel::NumBlockTypes> max_coded_heights
         = colldata.get_max_coded_heights();
@@ -808,23 +867,28 @@ bool recode_baseline_jpeg(bounded_iostream*str_out,
         g_decoder->flush();
         for (unsigned int physical_thread_id = 0; physical_thread_id < (g_threaded ? NUM_THREADS : 1); ++physical_thread_id) {
             unsigned int physical_thread_offset = physical_thread_id;
-            TimingHarness::timing[physical_thread_id][TimingHarness::TS_THREAD_WAIT_STARTED] = TimingHarness::get_time_us();
-            
-            g_decoder->getWorker(physical_thread_offset)->main_wait_for_done();
-            TimingHarness::timing[physical_thread_id][TimingHarness::TS_THREAD_WAIT_FINISHED] =
-                TimingHarness::timing[physical_thread_id][TimingHarness::TS_JPEG_RECODE_STARTED] = TimingHarness::get_time_us();
-            if (physical_thread_id > 0) { // the first guy goes right to stdout
+            TimingHarness::stamp(physical_thread_id, TimingHarness::TS_THREAD_WAIT_STARTED);
+            {
+                TraceHarness::Span wait_span(TraceHarness::MAIN_LANE, TraceHarness::THREAD_WAIT,
+                                             physical_thread_id);
+                g_decoder->getWorker(physical_thread_offset)->main_wait_for_done();
+            }
+            TimingHarness::stamp(physical_thread_id, TimingHarness::TS_THREAD_WAIT_FINISHED);
+            TimingHarness::stamp(physical_thread_id, TimingHarness::TS_JPEG_RECODE_STARTED);
+            if (physical_thread_id > 0 && !Cancellation::requested()) { // the first guy goes right to stdout
                 size_t bytes_to_copy = local_buffers[physical_thread_id - 1].bytes_written();
                 if (bytes_to_copy) {
+                    TraceHarness::Span copy_span(TraceHarness::MAIN_LANE, TraceHarness::OUTPUT_COPY,
+                                                 physical_thread_id, bytes_to_copy);
                     local_bound -= bytes_to_copy;
                     str_out->write(&local_buffers[physical_thread_id - 1].buffer()[0],
                                    bytes_to_copy);
                 }
             }
-            TimingHarness::timing[physical_thread_id][TimingHarness::TS_JPEG_RECODE_FINISHED] = TimingHarness::get_time_us();
+            TimingHarness::stamp(physical_thread_id, TimingHarness::TS_JPEG_RECODE_FINISHED);
         }
     } else {
-        TimingHarness::timing[0][TimingHarness::TS_JPEG_RECODE_STARTED] = TimingHarness::get_time_us();
+        TimingHarness::stamp(0, TimingHarness::TS_JPEG_RECODE_STARTED);
         recode_physical_thread(str_out,
                                framebuffer[0],
                                mcu_count_vertical,
@@ -834,8 +898,8 @@ bool recode_baseline_jpeg(bounded_iostream*str_out,
                                0,
                                huffws[0]);
     }
-
-    if (!rst_err.empty()) {
+    bool cancelled = Cancellation::requested();
+    if (!cancelled && !rst_err.empty()) {
         unsigned int cumulative_reset_markers = rsti ? (mcuh * mcuv - 1)/ rsti : 0;
         for (unsigned char i = 0; i < rst_err[0]; ++i) {
             const unsigned char mrk = 0xFF;
@@ -847,7 +911,7 @@ bool recode_baseline_jpeg(bounded_iostream*str_out,
     }
 
     /* step 3: blit any trailing data */
-    if (!str_out->has_reached_bound() ) {
+    if (!cancelled && !str_out->has_reached_bound() ) {
         str_out->write( hdrdata + byte_position, hdrs - byte_position );
     }
     if (ujgversion != 1) {
@@ -866,6 +930,10 @@ bool recode_baseline_jpeg(bounded_iostream*str_out,
             }
         }
     }
+    if (cancelled) {
+        errorlevel.store(2); // process_file reports the request as timed out
+        return false;
+    }
     check_decompression_memory_bound_ok();
 
     // write EOI (now EOI is stored in garbage of at least 2 bytes)
@@ -879,7 +947,7 @@ bool recode_baseline_jpeg(bounded_iostream*str_out,
         str_out->write( grbgdata, grbs );
     check_decompression_memory_bound_ok();
     str_out->flush();
-    TimingHarness::timing[0][TimingHarness::TS_JPEG_RECODE_FINISHED] = TimingHarness::get_time_us();
+    TimingHarness::stamp(0, TimingHarness::TS_JPEG_RECODE_FINISHED);
 
     // errormessage if write error
     if ( str_out->chkerr() ) {
@@ -48,5 +48,10 @@ private:
         MergeJpegProgress& operator=(const MergeJpegProgress&other); // disallow gets
 };
 class bounded_iostream;
+// writes huffman coded bytes, stuffing a zero after every 0xff
+template<class OutputWriter>
+void escape_0xff_huffman_and_write(OutputWriter* str_out,
+                                   const unsigned char * local_huff_data,
+                                   unsigned int max_byte_coded);
 bool recode_baseline_jpeg(bounded_iostream* str_out,
                           int max_file_size);
@@ -0,0 +1,326 @@
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+#include <vector>
+#include "result_cache.hh"
+#include "server_metrics.hh"
+#ifdef USE_SYSTEM_MD5_DEPENDENCY
+#include <openssl/md5.h>
+#else
+#include "../../dependencies/md5/md5.h"
+#endif
+
+extern bool is_jpeg_header(Sirikata::Array1d<uint8_t, 2> header);
+
+namespace {
+const char tmp_prefix[] = ".tmp.";
+
+bool write_all(int fd, const uint8_t *data, size_t size) {
+    while (size) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+// copies from the current offset of from until EOF; false if to went away
+bool copy_fd(int from, int to, uint64_t *copied) {
+    uint8_t buffer[65536];
+    *copied = 0;
+    while (true) {
+        ssize_t nread = read(from, buffer, sizeof(buffer));
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            return nread == 0;
+        }
+        if (!write_all(to, buffer, nread)) {
+            return false;
+        }
+        *copied += nread;
+    }
+}
+
+std::string tmp_path(const std::string &dir, const char *kind) {
+    char name[64];
+    snprintf(name, sizeof(name), "/%s%s.%d", tmp_prefix, kind, (int)getpid());
+    return dir + name;
+}
+
+int open_tmp(const std::string &path) {
+    int fd;
+    do {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    } while (fd < 0 && errno == EINTR);
+    return fd;
+}
+
+void rewind_fd(int fd) {
+    off_t err = lseek(fd, 0, SEEK_SET);
+    always_assert(err == 0);
+}
+
+struct ScannedEntry {
+    time_t mtime;
+    std::string key;
+    uint64_t bytes;
+    bool operator<(const ScannedEntry &other) const {
+        return mtime > other.mtime; // newest first
+    }
+};
+}
+
+ResultCache::ResultCache(const char *dir, uint64_t max_bytes)
+    : dir_(dir) {
+    max_bytes_ = max_bytes;
+    total_bytes_ = 0;
+    hits_ = 0;
+    misses_ = 0;
+    stored_ = 0;
+    rejected_ = 0;
+    evicted_ = 0;
+    DIR *listing = opendir(dir);
+    if (listing == NULL) {
+        fprintf(stderr, "Result cache directory %s cannot be opened: %s\n", dir, strerror(errno));
+        exit(1);
+    }
+    std::vector<ScannedEntry> scanned;
+    while (struct dirent *item = readdir(listing)) {
+        std::string path = dir_ + "/" + item->d_name;
+        if (strncmp(item->d_name, tmp_prefix, strlen(tmp_prefix)) == 0) {
+            unlink(path.c_str()); // left behind by a child that was killed
+            continue;
+        }
+        struct stat info;
+        if (item->d_name[0] == '.' || strlen(item->d_name) >= KEY_SIZE
+            || stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+            continue;
+        }
+        ScannedEntry entry = {info.st_mtime, item->d_name, (uint64_t)info.st_size};
+        scanned.push_back(entry);
+    }
+    closedir(listing);
+    std::sort(scanned.begin(), scanned.end());
+    for (size_t i = 0; i < scanned.size(); ++i) {
+        Entry entry = {scanned[i].key, scanned[i].bytes};
+        lru_.push_back(entry);
+        index_[entry.key] = --lru_.end();
+        total_bytes_ += entry.bytes;
+    }
+    evict_to(max_bytes_);
+}
+
+void ResultCache::evict_to(uint64_t bound) {
+    while (total_bytes_ > bound && !lru_.empty()) {
+        const Entry &victim = lru_.back();
+        std::string path = dir_ + "/" + victim.key;
+        unlink(path.c_str()); // a child still sending it keeps its descriptor
+        total_bytes_ -= victim.bytes;
+        index_.erase(victim.key);
+        lru_.pop_back();
+        ++evicted_;
+    }
+}
+
+void ResultCache::finish_request(const RequestMetricsSlot &slot) {
+    std::string key(slot.cache_key, strnlen(slot.cache_key, sizeof(slot.cache_key)));
+    std::map<std::string, std::list<Entry>::iterator>::iterator where = index_.find(key);
+    switch (slot.cache_event) {
+      case HIT:
+        ++hits_;
+        if (where != index_.end()) {
+            lru_.splice(lru_.begin(), lru_, where->second);
+        }
+        break;
+      case STORED:
+        ++misses_;
+        ++stored_;
+        if (where != index_.end()) { // two children raced to store the same result
+            total_bytes_ -= where->second->bytes;
+            lru_.erase(where->second);
+        }
+        {
+            Entry entry = {key, slot.cache_bytes};
+            lru_.push_front(entry);
+            index_[key] = lru_.begin();
+            total_bytes_ += entry.bytes;
+        }
+        evict_to(max_bytes_);
+        break;
+      case REJECTED:
+        ++misses_;
+        ++rejected_;
+        break;
+      case MISS:
+        ++misses_;
+        break;
+      case NONE:
+      default:
+        break;
+    }
+}
+
+[[noreturn]] void ResultCache::serve(const SocketServeWorkFunction &work,
+                                     IOUtil::FileReader *reader,
+                                     IOUtil::FileWriter *writer,
+                                     uint32_t max_length,
+                                     bool force_zlib,
+                                     RequestMetricsSlot *slot) const {
+    // spool the request to an unlinked file, hashing it on the way
+    std::string input_path = tmp_path(dir_, "in");
+    int input_fd = open_tmp(input_path);
+    if (input_fd < 0) {
+        custom_exit(ExitCode::OS_ERROR);
+    }
+    unlink(input_path.c_str());
+    MD5_CTX context;
+    MD5_Init(&context);
+    Sirikata::Array1d<uint8_t, 2> header = {{0, 0}};
+    uint64_t input_size = 0;
+    uint8_t buffer[65536];
+    while (true) {
+        size_t to_read = sizeof(buffer);
+        if (max_length && input_size + to_read > max_length) {
+            to_read = max_length - input_size; // the codec would stop reading here too
+            if (to_read == 0) {
+                break;
+            }
+        }
+        ssize_t nread = read(reader->get_fd(), buffer, to_read);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            break;
+        }
+        for (ssize_t i = 0; i < nread && input_size + i < header.size(); ++i) {
+            header[input_size + i] = buffer[i];
+        }
+        MD5_Update(&context, buffer, nread);
+        if (!write_all(input_fd, buffer, nread)) {
+            custom_exit(ExitCode::OS_ERROR);
+        }
+        input_size += nread;
+    }
+    Sirikata::Array1d<uint8_t, 16> md5;
+    MD5_Final(&md5[0], &context);
+    bool is_decode = !is_jpeg_header(header);
+    char key[KEY_SIZE];
+    int offset = 0;
+    for (size_t i = 0; i < md5.size(); ++i) {
+        offset += snprintf(key + offset, sizeof(key) - offset, "%02x", md5[i]);
+    }
+    snprintf(key + offset, sizeof(key) - offset, ".%s%s", is_decode ? "jpg" : "lep", force_zlib ? ".z0" : "");
+    std::string entry_path = dir_ + "/" + key;
+    if (slot) {
+        memcpy(slot->cache_key, key, sizeof(key));
+    }
+
+    int cached_fd;
+    do {
+        cached_fd = open(entry_path.c_str(), O_RDONLY);
+    } while (cached_fd < 0 && errno == EINTR);
+    if (cached_fd >= 0) {
+        futimens(cached_fd, NULL); // keeps the LRU order across server restarts
+        uint64_t output_size = 0;
+        if (!copy_fd(cached_fd, writer->get_fd(), &output_size)) {
+            custom_exit(ExitCode::SHORT_READ);
+        }
+        if (slot) {
+            slot->cache_event = HIT;
+            slot->cache_bytes = output_size;
+            publish_request_metrics(input_size, output_size, is_decode);
+        }
+        custom_exit(ExitCode::SUCCESS);
+    }
+
+    std::string output_path = tmp_path(dir_, "out");
+    int output_fd = open_tmp(output_path);
+    if (output_fd < 0) {
+        custom_exit(ExitCode::OS_ERROR);
+    }
+    // the codec writes into a pipe that is relayed to the client and to the
+    // entry as it arrives, so the first bytes go out as soon as a plain run's would
+    int result_pipe[2];
+    while (pipe(result_pipe) < 0) {
+        if (errno != EINTR) {
+            custom_exit(ExitCode::OS_ERROR);
+        }
+    }
+    rewind_fd(input_fd);
+    pid_t codec_pid = fork();
+    if (codec_pid == 0) {
+        while (close(writer->get_fd()) < 0 && errno == EINTR) {
+        }
+        while (close(output_fd) < 0 && errno == EINTR) {
+        }
+        while (close(result_pipe[0]) < 0 && errno == EINTR) {
+        }
+        IOUtil::FileReader spooled_reader(input_fd, max_length, false);
+        IOUtil::FileWriter result_writer(result_pipe[1], false, false);
+        work(&spooled_reader, &result_writer, max_length, force_zlib);
+        custom_exit(ExitCode::SUCCESS);
+    }
+    always_assert(codec_pid > 0 && "unable to fork the codec");
+    while (close(result_pipe[1]) < 0 && errno == EINTR) {
+    }
+    uint64_t output_size = 0;
+    bool sent = true;
+    bool cacheable = slot != NULL; // without a slot the parent could never evict it
+    while (true) {
+        ssize_t nread = read(result_pipe[0], buffer, sizeof(buffer));
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            break;
+        }
+        // a client that went away does not stop the result from being kept
+        sent = sent && write_all(writer->get_fd(), buffer, nread);
+        output_size += nread;
+        // past the admission bound the rest need not go to disk
+        cacheable = cacheable && output_size <= max_entry_bytes()
+            && write_all(output_fd, buffer, nread);
+    }
+    int status = 0;
+    while (waitpid(codec_pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (!(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+        unlink(output_path.c_str());
+        if (WIFSIGNALED(status)) {
+            raise(WTERMSIG(status));
+        }
+        exit(WIFEXITED(status) ? WEXITSTATUS(status) : (int)ExitCode::ASSERTION_FAILURE);
+    }
+    if (slot == NULL) {
+        unlink(output_path.c_str());
+    } else if (output_size == 0 || output_size > max_entry_bytes()) {
+        unlink(output_path.c_str());
+        slot->cache_event = REJECTED;
+    } else if (cacheable && rename(output_path.c_str(), entry_path.c_str()) == 0) {
+        slot->cache_event = STORED;
+        slot->cache_bytes = output_size;
+    } else {
+        unlink(output_path.c_str());
+        slot->cache_event = MISS;
+    }
+    custom_exit(sent ? ExitCode::SUCCESS : ExitCode::SHORT_READ);
+}
+#endif
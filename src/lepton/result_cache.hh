@@ -0,0 +1,78 @@
+#ifndef RESULT_CACHE_HH_
+#define RESULT_CACHE_HH_
+#ifndef _WIN32
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <string>
+#include "socket_serve.hh"
+
+struct RequestMetricsSlot;
+
+// Results of socket server requests kept as files in a local directory,
+// named by the MD5 of the input and the operation, so byte-identical
+// uploads are answered without running the codec. Children look entries up
+// and add them before they are jailed; the parent hears about both through
+// the child's RequestMetricsSlot, keeps the LRU order and evicts.
+// The directory belongs to one server configuration: options that change
+// the output are not part of the key.
+class ResultCache {
+public:
+    enum Event {
+        NONE,
+        HIT,
+        MISS, // not stored because it could not be moved into place
+        STORED,
+        REJECTED, // the result was too large to admit
+    };
+    enum {
+        KEY_SIZE = 48 // 32 hex digits of MD5, the operation and a terminator
+    };
+private:
+    struct Entry {
+        std::string key;
+        uint64_t bytes;
+    };
+    std::string dir_;
+    uint64_t max_bytes_;
+    uint64_t total_bytes_;
+    std::list<Entry> lru_; // most recently used first
+    std::map<std::string, std::list<Entry>::iterator> index_;
+    uint64_t hits_;
+    uint64_t misses_;
+    uint64_t stored_;
+    uint64_t rejected_;
+    uint64_t evicted_;
+    void evict_to(uint64_t bound);
+public:
+    // Indexes what an earlier server left in dir, oldest entries first out.
+    ResultCache(const char *dir, uint64_t max_bytes);
+    // results larger than this are not admitted, so one upload cannot flush the cache
+    uint64_t max_entry_bytes() const {
+        return max_bytes_ / 16;
+    }
+    // Runs in a socket server child in place of work: reads the whole request
+    // while hashing it, answers from the cache on a hit and otherwise runs
+    // work in a grandchild on the spooled input, relaying its output to the
+    // client and to a temporary file as it comes; the file is admitted only
+    // once the codec has exited successfully.
+    // Exits with the codec's status rather than returning.
+    [[noreturn]] void serve(const SocketServeWorkFunction &work,
+               IOUtil::FileReader *reader,
+               IOUtil::FileWriter *writer,
+               uint32_t max_length,
+               bool force_zlib,
+               RequestMetricsSlot *slot) const;
+    // called in the parent for every reaped child that had a slot
+    void finish_request(const RequestMetricsSlot &slot);
+
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+    uint64_t stored() const { return stored_; }
+    uint64_t rejected() const { return rejected_; }
+    uint64_t evicted() const { return evicted_; }
+    uint64_t bytes() const { return total_bytes_; }
+    uint64_t entries() const { return lru_.size(); }
+};
+#endif
+#endif
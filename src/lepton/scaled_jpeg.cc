@@ -0,0 +1,136 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include <math.h>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include "scaled_jpeg.hh"
+#include "jpeg_writer.hh"
+#include "jpgcoder.hh"
+#include "component_info.hh"
+#include "uncompressed_components.hh"
+#include "../vp8/util/memory.hh"
+#include "../vp8/util/debug.hh"
+
+extern UncompressedComponents colldata; // baseline sorted DCT coefficients
+extern Sirikata::Array1d<componentInfo, 4> cmpnfo;
+extern int cmpc; // component count
+extern int imgwidth; // width of image
+extern int imgheight; // height of image
+
+int g_scale_denominator = 1;
+
+namespace {
+// Output coefficients are T G T' / N, where G tiles the top left K x K
+// dequantized coefficients (K = 8 / N) of the N x N input blocks an output
+// block covers. Row a*K+s of T takes input frequency s of block a to the
+// output frequencies: a K point inverse DCT placing the K samples at a*K,
+// followed by the 8 point forward DCT. The 1/N restores the DC gain.
+void build_transfer_matrix(int scale, float transfer[8][8]) {
+    int k = 8 / scale;
+    for (int u = 0; u < 8; ++u) {
+        double cu = u ? sqrt(2. / 8) : sqrt(1. / 8);
+        for (int a = 0; a < scale; ++a) {
+            for (int s = 0; s < k; ++s) {
+                double cs = s ? sqrt(2. / k) : sqrt(1. / k);
+                double sum = 0;
+                for (int i = 0; i < k; ++i) {
+                    int x = a * k + i;
+                    sum += cu * cos((2 * x + 1) * u * M_PI / 16)
+                        * cs * cos((2 * i + 1) * s * M_PI / (2 * k));
+                }
+                transfer[u][a * k + s] = sum;
+            }
+        }
+    }
+}
+
+int16_t round_and_clamp(float value, int min_value, int max_value) {
+    int retval = value >= 0 ? (int)(value + 0.5f) : -(int)(0.5f - value);
+    return std::max(min_value, std::min(max_value, retval));
+}
+
+AlignedBlock zero_block; // stands in for blocks past the end of a truncated image
+
+struct ScaledComponent {
+    int in_blocks_wide; // blocks holding image data, no mcu padding
+    int in_blocks_high;
+    Sirikata::Array1d<float, 64> quantization; // raster order
+};
+
+class ScaledBlockBuilder {
+    int scale_;
+    int k_;
+    float transfer_[8][8];
+public:
+    ScaledBlockBuilder(int scale) : scale_(scale), k_(8 / scale) {
+        build_transfer_matrix(scale, transfer_);
+    }
+    // the zigzag ordered coefficients of output block (bx, by) of cmp
+    void build(int cmp, const ScaledComponent &component, int bx, int by, int16_t *zigzag) {
+        float gathered[8][8];
+        for (int b = 0; b < scale_; ++b) {
+            int in_y = std::min(by * scale_ + b, component.in_blocks_high - 1);
+            for (int a = 0; a < scale_; ++a) {
+                int in_x = std::min(bx * scale_ + a, component.in_blocks_wide - 1);
+                unsigned int dpos = in_y * cmpnfo[cmp].bch + in_x;
+                const AlignedBlock &block = dpos < colldata.component_size_in_blocks(cmp)
+                    ? colldata.block((BlockType)cmp, dpos) : zero_block;
+                for (int t = 0; t < k_; ++t) {
+                    for (int s = 0; s < k_; ++s) {
+                        gathered[b * k_ + t][a * k_ + s] = block.coefficients_raster(t * 8 + s)
+                            * component.quantization[t * 8 + s];
+                    }
+                }
+            }
+        }
+        float half[8][8]; // T G
+        for (int v = 0; v < 8; ++v) {
+            for (int col = 0; col < 8; ++col) {
+                float sum = 0;
+                for (int row = 0; row < 8; ++row) {
+                    sum += transfer_[v][row] * gathered[row][col];
+                }
+                half[v][col] = sum;
+            }
+        }
+        for (int v = 0; v < 8; ++v) {
+            for (int u = 0; u < 8; ++u) {
+                float sum = 0;
+                for (int col = 0; col < 8; ++col) {
+                    sum += half[v][col] * transfer_[u][col];
+                }
+                int raster = v * 8 + u;
+                // the largest magnitudes the baseline Huffman categories can code
+                zigzag[raster_to_jpeg_zigzag[raster]]
+                    = round_and_clamp(sum / (scale_ * component.quantization[raster]),
+                                      raster ? -1023 : -1024, 1023);
+            }
+        }
+    }
+};
+}
+
+bool write_scaled_jpeg(bounded_iostream *str_out) {
+    int scale = g_scale_denominator;
+    bool interleaved = cmpc > 1;
+    Sirikata::Array1d<ScaledComponent, 4> scaled;
+    Sirikata::Array1d<OutputComponent, 4> components;
+    for (int cmp = 0; cmp < cmpc && cmp < 4; ++cmp) {
+        scaled[cmp].in_blocks_wide = cmpnfo[cmp].nch;
+        scaled[cmp].in_blocks_high = cmpnfo[cmp].ncv;
+        components[cmp].h_factor = interleaved ? cmpnfo[cmp].sfv : 1;
+        components[cmp].v_factor = interleaved ? cmpnfo[cmp].sfh : 1;
+        for (int i = 0; i < 64; ++i) {
+            scaled[cmp].quantization[i] = cmpnfo[cmp].qtable[raster_to_jpeg_zigzag[i]];
+            components[cmp].qtable[i] = cmpnfo[cmp].qtable[i];
+        }
+    }
+    ScaledBlockBuilder builder(scale);
+    return write_baseline_jpeg(str_out,
+                               (imgwidth + scale - 1) / scale,
+                               (imgheight + scale - 1) / scale,
+                               components,
+                               [&](int cmp, int x, int y, int16_t *zigzag) {
+                                   builder.build(cmp, scaled[cmp], x, y, zigzag);
+                               });
+}
@@ -0,0 +1,15 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef SCALED_JPEG_HH_
+#define SCALED_JPEG_HH_
+
+// 1, 2, 4 or 8: a .lep decode writes a JPEG this many times smaller on each side
+extern int g_scale_denominator;
+
+class bounded_iostream;
+// Builds every block of the scaled image from the low frequency coefficients
+// of the blocks it covers, requantizes it with the original tables and
+// writes a baseline JPEG with the standard Huffman tables. APPn and COM
+// segments are carried over; nothing is ever decoded to pixels.
+// Reads the full-frame colldata, so the decode must not be memory optimized.
+bool write_scaled_jpeg(bounded_iostream *str_out);
+#endif
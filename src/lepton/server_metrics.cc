@@ -0,0 +1,323 @@
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "server_metrics.hh"
+#include "../vp8/util/memory.hh"
+
+RequestMetricsSlot *g_request_metrics = nullptr;
+
+void publish_request_metrics(uint64_t bytes_in, uint64_t bytes_out, bool is_decode) {
+    RequestMetricsSlot *slot = g_request_metrics;
+    if (slot == nullptr) {
+        return;
+    }
+    static_assert(TimingHarness::NUM_STAGES <= 32, "stages_reached must hold a bit per stage");
+    slot->stages_reached = 0;
+    for (int i = 0; i < TimingHarness::NUM_STAGES; ++i) {
+        uint64_t latest = 0;
+        for (unsigned int j = 0; j < MAX_NUM_THREADS && j < NUM_THREADS; ++j) {
+            // stages stamped in the parent before the fork predate accept_us
+            if (TimingHarness::timing[j][i] >= slot->accept_us
+                && TimingHarness::timing[j][i] > latest) {
+                latest = TimingHarness::timing[j][i];
+            }
+        }
+        if (latest) {
+            slot->stage_us[i] = latest - slot->accept_us;
+            slot->stages_reached |= (1U << i);
+        }
+    }
+    slot->is_decode = is_decode ? 1 : 0;
+    slot->bytes_in = bytes_in;
+    slot->bytes_out = bytes_out;
+    for (int i = 0; i < 2; ++i) {
+        for (uint32_t j = 0; j < (uint32_t)Billing::NUM_BILLING_ELEMENTS; ++j) {
+            slot->billing_bits[i][j] = billing_map[i][j].load();
+        }
+    }
+    slot->published = 1;
+}
+
+void publish_predicted_memory(uint64_t bytes) {
+    // the encode and the verifying decode of one request run in separate
+    // processes sharing the slot, so each adds its own prediction once
+    static bool published = false;
+    if (g_request_metrics && !published) {
+        __atomic_fetch_add(&g_request_metrics->predicted_memory, bytes, __ATOMIC_RELAXED);
+        published = true;
+    }
+}
+
+const double LatencyHistogram::bucket_bounds[NUM_BUCKETS] = {
+    .001, .0025, .005, .01, .025, .05, .1, .25, .5, 1, 2.5, 10
+};
+
+LatencyHistogram::LatencyHistogram() {
+    memset(buckets_, 0, sizeof(buckets_));
+    count_ = 0;
+    sum_ = 0;
+}
+
+void LatencyHistogram::add(double seconds) {
+    int i = 0;
+    while (i < NUM_BUCKETS && seconds > bucket_bounds[i]) {
+        ++i;
+    }
+    ++buckets_[i];
+    ++count_;
+    sum_ += seconds;
+}
+
+namespace {
+void append_line(std::string *out, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void append_line(std::string *out, const char *format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len > 0) {
+        out->append(line, std::min((size_t)len, sizeof(line) - 1));
+    }
+}
+void append_type(std::string *out, const char *name, const char *type, const char *help) {
+    append_line(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+double timeval_seconds(const struct timeval &tv) {
+    return tv.tv_sec + tv.tv_usec * 0.000001;
+}
+}
+
+void LatencyHistogram::print(std::string *out, const char *name, const char *labels) const {
+    const char *sep = labels[0] ? "," : "";
+    uint64_t cumulative = 0;
+    for (int i = 0; i < NUM_BUCKETS; ++i) {
+        cumulative += buckets_[i];
+        append_line(out, "%s_bucket{%s%sle=\"%g\"} %llu\n",
+                    name, labels, sep, bucket_bounds[i], (unsigned long long)cumulative);
+    }
+    append_line(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+                name, labels, sep, (unsigned long long)count_);
+    const char *lbrace = labels[0] ? "{" : "";
+    const char *rbrace = labels[0] ? "}" : "";
+    append_line(out, "%s_sum%s%s%s %f\n", name, lbrace, labels, rbrace, sum_);
+    append_line(out, "%s_count%s%s%s %llu\n",
+                name, lbrace, labels, rbrace, (unsigned long long)count_);
+}
+
+ServerMetrics::ServerMetrics(size_t num_slots, ResultCache *result_cache)
+    : slot_in_use_(num_slots, false) {
+    result_cache_ = result_cache;
+    void *mapping = mmap(nullptr, num_slots * sizeof(RequestMetricsSlot),
+                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    always_assert(mapping != MAP_FAILED && "unable to map request metrics");
+    slots_ = (RequestMetricsSlot*)mapping;
+    requests_ok_ = 0;
+    requests_error_ = 0;
+    requests_signaled_ = 0;
+    requests_timed_out_ = 0;
+    requests_unreported_ = 0;
+    bytes_in_.memset(0);
+    bytes_out_.memset(0);
+    memset(billing_bits_, 0, sizeof(billing_bits_));
+    busy_seconds_ = 0;
+    user_cpu_seconds_ = 0;
+    system_cpu_seconds_ = 0;
+    max_rss_bytes_ = 0;
+    memory_budget_ = 0;
+    unreported_request_memory_ = 0;
+}
+
+void ServerMetrics::set_memory_budget(uint64_t memory_budget, uint64_t unreported_request_memory) {
+    memory_budget_ = memory_budget;
+    unreported_request_memory_ = unreported_request_memory;
+}
+
+uint64_t ServerMetrics::predicted_memory_in_flight() const {
+    uint64_t total = 0;
+    for (std::map<pid_t, InFlight>::const_iterator i = in_flight_.begin(); i != in_flight_.end(); ++i) {
+        uint64_t predicted = 0;
+        if (i->second.slot) {
+            predicted = __atomic_load_n(&i->second.slot->predicted_memory, __ATOMIC_RELAXED);
+        }
+        total += predicted ? predicted : unreported_request_memory_;
+    }
+    return total;
+}
+
+bool ServerMetrics::admits_request() const {
+    if (memory_budget_ == 0 || in_flight_.empty()) {
+        return true; // a single request is never refused
+    }
+    return predicted_memory_in_flight() + unreported_request_memory_ <= memory_budget_;
+}
+
+RequestMetricsSlot *ServerMetrics::reserve_slot() {
+    for (size_t i = 0; i < slot_in_use_.size(); ++i) {
+        if (!slot_in_use_[i]) {
+            slot_in_use_[i] = true;
+            memset(&slots_[i], 0, sizeof(RequestMetricsSlot));
+            return &slots_[i];
+        }
+    }
+    return nullptr;
+}
+
+void ServerMetrics::start_request(pid_t pid, RequestMetricsSlot *slot) {
+    if (pid < 0) { // the fork failed, so nobody will fill the slot
+        if (slot) {
+            slot_in_use_[slot - slots_] = false;
+        }
+        return;
+    }
+    InFlight request = {slot, TimingHarness::get_time_us(true)};
+    in_flight_[pid] = request;
+}
+
+void ServerMetrics::finish_request(pid_t pid, int status, const struct rusage &usage) {
+    std::map<pid_t, InFlight>::iterator where = in_flight_.find(pid);
+    if (where == in_flight_.end()) {
+        return;
+    }
+    InFlight request = where->second;
+    in_flight_.erase(where);
+    double elapsed = (TimingHarness::get_time_us(true) - request.start_us) * 0.000001;
+    request_latency_.add(elapsed);
+    busy_seconds_ += elapsed;
+    user_cpu_seconds_ += timeval_seconds(usage.ru_utime);
+    system_cpu_seconds_ += timeval_seconds(usage.ru_stime);
+#if defined(__APPLE__)
+    uint64_t rss = usage.ru_maxrss;
+#else
+    uint64_t rss = (uint64_t)usage.ru_maxrss * 1024;
+#endif
+    if (rss > max_rss_bytes_) {
+        max_rss_bytes_ = rss;
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        ++requests_ok_;
+    } else if (WIFSIGNALED(status)) {
+        ++requests_signaled_;
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) == (int)ExitCode::TIMED_OUT) {
+        ++requests_timed_out_;
+    } else {
+        ++requests_error_;
+    }
+    RequestMetricsSlot *slot = request.slot;
+    if (slot == nullptr || !slot->published) {
+        ++requests_unreported_;
+    } else {
+        for (int i = 0; i < TimingHarness::NUM_STAGES; ++i) {
+            if (slot->stages_reached & (1U << i)) {
+                stage_latency_[i].add(slot->stage_us[i] * 0.000001);
+            }
+        }
+        bytes_in_[slot->is_decode ? 1 : 0] += slot->bytes_in;
+        bytes_out_[slot->is_decode ? 1 : 0] += slot->bytes_out;
+        for (int i = 0; i < 2; ++i) {
+            for (uint32_t j = 0; j < (uint32_t)Billing::NUM_BILLING_ELEMENTS; ++j) {
+                billing_bits_[i][j] += slot->billing_bits[i][j];
+            }
+        }
+    }
+    if (slot) {
+        if (result_cache_) {
+            result_cache_->finish_request(*slot);
+        }
+        slot_in_use_[slot - slots_] = false;
+    }
+}
+
+void ServerMetrics::print(std::string *out, size_t active_workers, size_t max_workers) const {
+    static const char *const directions[2] = {"encode", "decode"};
+    append_type(out, "lepton_requests_total", "counter",
+                "Requests served, by how the worker exited.");
+    append_line(out, "lepton_requests_total{result=\"ok\"} %llu\n", (unsigned long long)requests_ok_);
+    append_line(out, "lepton_requests_total{result=\"error\"} %llu\n", (unsigned long long)requests_error_);
+    append_line(out, "lepton_requests_total{result=\"signal\"} %llu\n", (unsigned long long)requests_signaled_);
+    append_line(out, "lepton_requests_total{result=\"timeout\"} %llu\n", (unsigned long long)requests_timed_out_);
+    append_type(out, "lepton_requests_unreported_total", "counter",
+                "Requests whose worker exited without publishing stage, byte and billing metrics.");
+    append_line(out, "lepton_requests_unreported_total %llu\n", (unsigned long long)requests_unreported_);
+    append_type(out, "lepton_request_duration_seconds", "histogram",
+                "Wall time from accept until the worker was reaped.");
+    request_latency_.print(out, "lepton_request_duration_seconds", "");
+    // jailed children may not read the clock, so they stamp no stages and
+    // the histograms would only ever be empty
+    if (!g_use_seccomp) {
+        append_type(out, "lepton_stage_seconds", "histogram",
+                    "Time from accept until each TimingHarness stage.");
+        for (int i = 0; i < TimingHarness::NUM_STAGES; ++i) {
+            char labels[64];
+            snprintf(labels, sizeof(labels), "stage=\"%s\"", TimingHarness::stage_names[i]);
+            stage_latency_[i].print(out, "lepton_stage_seconds", labels);
+        }
+    }
+    append_type(out, "lepton_bytes_in_total", "counter", "Bytes read from clients.");
+    for (int i = 0; i < 2; ++i) {
+        append_line(out, "lepton_bytes_in_total{direction=\"%s\"} %llu\n",
+                    directions[i], (unsigned long long)bytes_in_[i]);
+    }
+    append_type(out, "lepton_bytes_out_total", "counter", "Bytes written to clients.");
+    for (int i = 0; i < 2; ++i) {
+        append_line(out, "lepton_bytes_out_total{direction=\"%s\"} %llu\n",
+                    directions[i], (unsigned long long)bytes_out_[i]);
+    }
+    append_type(out, "lepton_billing_bits_total", "counter",
+                "Bits per Billing category; zero unless built with billing.");
+    for (int i = 0; i < 2; ++i) {
+        for (uint32_t j = 0; j < (uint32_t)Billing::NUM_BILLING_ELEMENTS; ++j) {
+            append_line(out, "lepton_billing_bits_total{category=\"%s\",compressed=\"%d\"} %llu\n",
+                        BillingString((Billing)j), i, (unsigned long long)billing_bits_[i][j]);
+        }
+    }
+    append_type(out, "lepton_workers_active", "gauge", "Workers currently serving a request.");
+    append_line(out, "lepton_workers_active %llu\n", (unsigned long long)active_workers);
+    append_type(out, "lepton_workers_max", "gauge", "Worker limit from -maxchildren, 0 if unlimited.");
+    append_line(out, "lepton_workers_max %llu\n", (unsigned long long)max_workers);
+    append_type(out, "lepton_worker_busy_seconds_total", "counter",
+                "Wall time summed over finished workers.");
+    append_line(out, "lepton_worker_busy_seconds_total %f\n", busy_seconds_);
+    append_type(out, "lepton_worker_cpu_seconds_total", "counter",
+                "CPU time summed over finished workers.");
+    append_line(out, "lepton_worker_cpu_seconds_total{mode=\"user\"} %f\n", user_cpu_seconds_);
+    append_line(out, "lepton_worker_cpu_seconds_total{mode=\"system\"} %f\n", system_cpu_seconds_);
+    append_type(out, "lepton_worker_max_rss_bytes", "gauge",
+                "Largest resident set of any finished worker.");
+    append_line(out, "lepton_worker_max_rss_bytes %llu\n", (unsigned long long)max_rss_bytes_);
+    if (memory_budget_) {
+        append_type(out, "lepton_predicted_memory_bytes", "gauge",
+                    "Memory predicted for the requests in flight, from their headers.");
+        append_line(out, "lepton_predicted_memory_bytes %llu\n",
+                    (unsigned long long)predicted_memory_in_flight());
+        append_type(out, "lepton_memory_budget_bytes", "gauge", "Admission budget from -admitmemory.");
+        append_line(out, "lepton_memory_budget_bytes %llu\n", (unsigned long long)memory_budget_);
+    }
+    if (result_cache_) {
+        const ResultCache &cache = *result_cache_;
+        append_type(out, "lepton_result_cache_requests_total", "counter",
+                    "Requests looked up in the result cache.");
+        append_line(out, "lepton_result_cache_requests_total{result=\"hit\"} %llu\n",
+                    (unsigned long long)cache.hits());
+        append_line(out, "lepton_result_cache_requests_total{result=\"miss\"} %llu\n",
+                    (unsigned long long)cache.misses());
+        append_type(out, "lepton_result_cache_stored_total", "counter", "Results added to the cache.");
+        append_line(out, "lepton_result_cache_stored_total %llu\n", (unsigned long long)cache.stored());
+        append_type(out, "lepton_result_cache_rejected_total", "counter",
+                    "Results too large to admit.");
+        append_line(out, "lepton_result_cache_rejected_total %llu\n", (unsigned long long)cache.rejected());
+        append_type(out, "lepton_result_cache_evicted_total", "counter",
+                    "Least recently used results removed to stay within the bound.");
+        append_line(out, "lepton_result_cache_evicted_total %llu\n", (unsigned long long)cache.evicted());
+        append_type(out, "lepton_result_cache_bytes", "gauge", "Bytes of results in the cache.");
+        append_line(out, "lepton_result_cache_bytes %llu\n", (unsigned long long)cache.bytes());
+        append_type(out, "lepton_result_cache_entries", "gauge", "Results in the cache.");
+        append_line(out, "lepton_result_cache_entries %llu\n", (unsigned long long)cache.entries());
+    }
+}
+#endif
@@ -0,0 +1,100 @@
+#ifndef SERVER_METRICS_HH_
+#define SERVER_METRICS_HH_
+#ifndef _WIN32
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <map>
+#include <vector>
+#include <string>
+#include "jpgcoder.hh"
+#include "result_cache.hh"
+#include "../vp8/util/billing.hh"
+
+// What a socket server child reports about the request it served.
+// Slots live in a shared anonymous mapping made before the children fork,
+// so a child fills its slot with plain stores, even once it is jailed.
+struct RequestMetricsSlot {
+    uint64_t accept_us;
+    uint32_t stages_reached; // bit per TimingHarness stage seen after accept
+    uint32_t is_decode;
+    uint64_t stage_us[TimingHarness::NUM_STAGES]; // time from accept until the stage
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t billing_bits[2][(uint32_t)Billing::NUM_BILLING_ELEMENTS];
+    uint32_t published;
+    uint32_t cache_event; // a ResultCache::Event
+    uint64_t cache_bytes;
+    char cache_key[ResultCache::KEY_SIZE];
+    uint64_t predicted_memory; // summed over the child's processes, read while they run
+};
+
+// set in a socket server child when the parent handed it a slot
+extern RequestMetricsSlot *g_request_metrics;
+
+// Fills g_request_metrics, if any, from TimingHarness::timing and billing_map.
+void publish_request_metrics(uint64_t bytes_in, uint64_t bytes_out, bool is_decode);
+// Tells the parent how much memory the request will need once its header is read.
+void publish_predicted_memory(uint64_t bytes);
+
+class LatencyHistogram {
+public:
+    enum {
+        NUM_BUCKETS = 12
+    };
+    static const double bucket_bounds[NUM_BUCKETS];
+private:
+    uint64_t buckets_[NUM_BUCKETS + 1];
+    uint64_t count_;
+    double sum_;
+public:
+    LatencyHistogram();
+    void add(double seconds);
+    void print(std::string *out, const char *name, const char *labels) const;
+};
+
+// Aggregates the socket server's children in the parent and renders the
+// totals in the Prometheus text exposition format.
+class ServerMetrics {
+    struct InFlight {
+        RequestMetricsSlot *slot;
+        uint64_t start_us;
+    };
+    RequestMetricsSlot *slots_;
+    std::vector<bool> slot_in_use_;
+    ResultCache *result_cache_;
+    std::map<pid_t, InFlight> in_flight_;
+
+    uint64_t requests_ok_;
+    uint64_t requests_error_;
+    uint64_t requests_signaled_;
+    uint64_t requests_timed_out_;
+    uint64_t requests_unreported_;
+    LatencyHistogram request_latency_;
+    Sirikata::Array1d<LatencyHistogram, TimingHarness::NUM_STAGES> stage_latency_;
+    Sirikata::Array1d<uint64_t, 2> bytes_in_; // by is_decode
+    Sirikata::Array1d<uint64_t, 2> bytes_out_;
+    uint64_t billing_bits_[2][(uint32_t)Billing::NUM_BILLING_ELEMENTS];
+    double busy_seconds_;
+    double user_cpu_seconds_;
+    double system_cpu_seconds_;
+    uint64_t max_rss_bytes_;
+    uint64_t memory_budget_;
+    uint64_t unreported_request_memory_;
+public:
+    // result_cache, if any, hears about every child's lookup as it is reaped
+    ServerMetrics(size_t num_slots, ResultCache *result_cache);
+    // returns nullptr when every slot is taken; the request is still counted
+    RequestMetricsSlot *reserve_slot();
+    void start_request(pid_t pid, RequestMetricsSlot *slot);
+    void finish_request(pid_t pid, int status, const struct rusage &usage);
+    // Admission control: requests that have not published a prediction yet
+    // count as unreported_request_memory, so the budget is never overrun.
+    void set_memory_budget(uint64_t memory_budget, uint64_t unreported_request_memory);
+    uint64_t predicted_memory_in_flight() const;
+    // true while one more request of unknown size fits in the memory budget
+    bool admits_request() const;
+    void print(std::string *out, size_t active_workers, size_t max_workers) const;
+};
+#endif
+#endif
@@ -11,6 +11,12 @@ public:
                                    unsigned int num_selected_splits) ;
 
     virtual void registerWorkers(GenericWorker*, unsigned int num_workers) {}
+    unsigned int getNumWorkers() const {
+        return 0;
+    }
+    GenericWorker *getWorker(unsigned int i) {
+        return NULL;
+    }
     ~SimpleComponentEncoder();
     size_t get_decode_model_memory_usage() const {
         return 0;
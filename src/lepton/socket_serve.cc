@@ -18,9 +18,12 @@
 #include <wait.h>
 #endif
 #include <poll.h>
+#include <sys/resource.h>
 #include <errno.h>
 #include "../io/Reader.hh"
 #include "socket_serve.hh"
+#include "server_metrics.hh"
+#include "result_cache.hh"
 #include "../../vp8/util/memory.hh"
 #include <set>
 static char hex_nibble(uint8_t val) {
@@ -37,6 +40,7 @@ static char zsocket_name[sizeof((struct sockaddr_un*)0)->sun_path] = {};
 static const char lock_ext[]=".lock";
 bool random_name = false;
 static char socket_lock[sizeof((struct sockaddr_un*)0)->sun_path + sizeof(lock_ext)];
+static const char *stats_socket_name = NULL;
 int lock_file = -1;
 
 bool is_parent_process = true;
@@ -81,6 +85,9 @@ static void cleanup_socket(int) {
         if (socket_lock[0] && random_name) {
             unlink(socket_lock);
         }
+        if (stats_socket_name) {
+            unlink(stats_socket_name);
+        }
         exit(0);
         return;
     }
@@ -92,10 +99,19 @@ pid_t accept_new_connection(int active_connection,
                             const SocketServeWorkFunction& work,
                             uint32_t global_max_length,
                             int lock_fd,
-                            bool force_zlib) {
+                            int stats_fd,
+                            bool force_zlib,
+                            ServerMetrics *metrics,
+                            const ResultCache *result_cache) {
+    RequestMetricsSlot *metrics_slot = metrics ? metrics->reserve_slot() : NULL;
     pid_t serve_file = fork();
     if (serve_file == 0) {
         is_parent_process = false;
+        if (metrics_slot) {
+            metrics_slot->accept_us = TimingHarness::get_time_us(true);
+            TimingHarness::timing[0][TimingHarness::TS_ACCEPT] = metrics_slot->accept_us;
+            g_request_metrics = metrics_slot;
+        }
         while (close(1) < 0 && errno == EINTR){ // close stdout
         }
         if (lock_fd >= 0) {
@@ -103,8 +119,15 @@ pid_t accept_new_connection(int active_connection,
                 // close socket lock so future servers may reacquire the lock
             }
         }
+        if (stats_fd >= 0) {
+            while (close(stats_fd) < 0 && errno == EINTR){
+            }
+        }
         IOUtil::FileReader reader(active_connection, global_max_length, true);
         IOUtil::FileWriter writer(active_connection, false, true);
+        if (result_cache) {
+            result_cache->serve(work, &reader, &writer, global_max_length, force_zlib, metrics_slot);
+        }
         work(&reader,
              &writer,
              global_max_length,
@@ -114,6 +137,9 @@ pid_t accept_new_connection(int active_connection,
         while (close(active_connection) < 0 && errno == EINTR){
             // close the Unix Domain Socket
         }
+        if (metrics) {
+            metrics->start_request(serve_file, metrics_slot);
+        }
     }
     return serve_file;
 }
@@ -157,10 +183,36 @@ void write_num_children(size_t num_children) {
         }
     }
 }
+void write_stats(int stats_connection,
+                 const ServerMetrics &metrics,
+                 size_t num_children,
+                 uint32_t max_children) {
+    // a scraper that stops reading must not stall the accept loop
+    struct timeval timeout = {1, 0};
+    setsockopt(stats_connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    std::string text;
+    metrics.print(&text, num_children, max_children);
+    size_t offset = 0;
+    while (offset < text.size()) {
+        ssize_t written = write(stats_connection, text.data() + offset, text.size() - offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            break;
+        }
+        offset += written;
+    }
+    while (close(stats_connection) < 0 && errno == EINTR){
+    }
+}
 void serving_loop(int unix_domain_socket_server,
                   int unix_domain_socket_server_zlib,
                   int tcp_socket_server,
                   int tcp_socket_server_zlib,
+                  int stats_socket_server,
+                  ServerMetrics *metrics,
+                  const ResultCache *result_cache,
                   const SocketServeWorkFunction& work,
                   uint32_t global_max_length,
                   uint32_t max_children,
@@ -169,7 +221,7 @@ void serving_loop(int unix_domain_socket_server,
     int sigchild_fd = make_sigchld_fd();
 
     int num_fds = 0;
-    struct pollfd fds[5];
+    struct pollfd fds[6];
     if (sigchild_fd != -1) {
         fds[0].fd = sigchild_fd;
         fds[0].events = POLLIN | POLLERR | POLLHUP;
@@ -191,6 +243,10 @@ void serving_loop(int unix_domain_socket_server,
         fds[num_fds].fd = tcp_socket_server;
         ++num_fds;
     }
+    if (stats_socket_server != -1) {
+        fds[num_fds].fd = stats_socket_server;
+        ++num_fds;
+    }
     for (int i = 0; i < num_fds; ++i) {
       int err;
       while ((err = fcntl(fds[i].fd, F_SETFL, O_NONBLOCK)) == -1
@@ -200,12 +256,14 @@ void serving_loop(int unix_domain_socket_server,
     }
     std::set<pid_t> children;
     int status;
+    struct rusage usage;
     while(true) {
         write_num_children(children.size());
         for (pid_t term_pid = 0;
-             (term_pid = waitpid(-1,
-                                 &status,
-                                 should_wait_bitmask(children.size(), max_children))) > 0;) {
+             (term_pid = wait4(-1,
+                               &status,
+                               should_wait_bitmask(children.size(), max_children),
+                               &usage)) > 0;) {
             std::set<pid_t>::iterator where = children.find(term_pid);
             if (where != children.end()) {
                 children.erase(where);
@@ -221,9 +279,25 @@ void serving_loop(int unix_domain_socket_server,
                 fprintf(stderr, "Child %d exited with another cause: %d\n", term_pid, status);
             }
             fflush(stderr);
+            if (metrics) {
+                metrics->finish_request(term_pid, status, usage);
+            }
             write_num_children(children.size());
         }
-        int ret = poll(fds, num_fds, sigchild_fd == -1 ? 60 : -1);
+        // over the memory budget only the stats socket is listened to; the
+        // queued clients wait in the backlog until a worker exits or
+        // publishes a smaller prediction, so poll again soon
+        bool admitting = metrics == NULL || metrics->admits_request();
+        for (int i = 0; i < num_fds; ++i) {
+            if (fds[i].fd != sigchild_fd && fds[i].fd != stats_socket_server) {
+                fds[i].events = admitting ? POLLIN : 0;
+            }
+        }
+        int timeout_ms = sigchild_fd == -1 ? 60 : -1;
+        if (!admitting) {
+            timeout_ms = 10;
+        }
+        int ret = poll(fds, num_fds, timeout_ms);
         // need a timeout (30 ms) in case a SIGCHLD was missed between the waitpid and the poll
         if (ret == 0) { // no events ready, just timed out, check for missed SIGCHLD
             continue;
@@ -257,12 +331,19 @@ void serving_loop(int unix_domain_socket_server,
                         while (fcntl(active_connection, F_SETFL, flags) == -1
                                && errno == EINTR){}
                     }
+                    if (fds[i].fd == stats_socket_server) {
+                        write_stats(active_connection, *metrics, children.size(), max_children);
+                        continue;
+                    }
                     children.insert(accept_new_connection(active_connection,
                                                           work,
                                                           global_max_length,
                                                           lock_fd,
+                                                          stats_socket_server,
                                                           fds[i].fd == unix_domain_socket_server_zlib
-                                                          || fds[i].fd == tcp_socket_server_zlib));
+                                                          || fds[i].fd == tcp_socket_server_zlib,
+                                                          metrics,
+                                                          result_cache));
                 } else {
                     if (errno != EINTR && errno != EWOULDBLOCK && errno != EAGAIN) {
                         fprintf(stderr, "Error accepting connection: %s", strerror(errno));
@@ -382,9 +463,32 @@ void socket_serve(const SocketServeWorkFunction &work_fn,
         zsocket_tcp = setup_tcp_socket(service_info.zlib_port, service_info.listen_backlog);
     }
     
+    int stats_fd = -1;
+    ServerMetrics *metrics = NULL;
+    ResultCache *result_cache = NULL;
+    if (service_info.result_cache_dir != NULL) {
+        result_cache = new ResultCache(service_info.result_cache_dir,
+                                       service_info.result_cache_bytes);
+    }
+    if (service_info.stats_uds != NULL) {
+        stats_socket_name = service_info.stats_uds;
+        int err;
+        do {
+            err = remove(stats_socket_name);
+        } while (err < 0 && errno == EINTR);
+        stats_fd = setup_socket(stats_socket_name, service_info.listen_backlog);
+    }
+    if (service_info.stats_uds != NULL || result_cache != NULL || service_info.memory_budget) {
+        // one slot per concurrent worker; beyond that workers go unreported,
+        // their results are not cached and they count as the largest request
+        metrics = new ServerMetrics(service_info.max_children ? service_info.max_children : 256,
+                                    result_cache);
+        metrics->set_memory_budget(service_info.memory_budget,
+                                   service_info.unreported_request_memory);
+    }
     fprintf(stdout, "%s\n", socket_name);
     fflush(stdout);
-    serving_loop(socket_fd, zsocket_fd, socket_tcp, zsocket_tcp,
+    serving_loop(socket_fd, zsocket_fd, socket_tcp, zsocket_tcp, stats_fd, metrics, result_cache,
                  work_fn, global_max_length, service_info.max_children, do_cleanup_socket, lock_fd);
 }
 #endif
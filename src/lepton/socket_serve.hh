@@ -1,3 +1,5 @@
+#ifndef SOCKET_SERVE_HH_
+#define SOCKET_SERVE_HH_
 #include <functional>
 #include "../io/ioutil.hh"
 
@@ -9,11 +11,21 @@ struct ServiceInfo {
     int listen_backlog;
     int max_children;
     const char * uds;
+    const char * stats_uds;
+    const char * result_cache_dir;
+    uint64_t result_cache_bytes;
+    uint64_t memory_budget; // 0 admits up to max_children regardless of memory
+    uint64_t unreported_request_memory; // the most one request can allocate
     ServiceInfo() {
         listen_tcp = false;
         port = 2402;
         zlib_port = 2403;
         uds = NULL;
+        stats_uds = NULL;
+        result_cache_dir = NULL;
+        result_cache_bytes = 256 * 1024 * 1024;
+        memory_budget = 0;
+        unreported_request_memory = 0;
         listen_uds = true;
         listen_backlog = 16;
 
@@ -31,3 +43,4 @@ void socket_serve(const SocketServeWorkFunction& work_fn,
                   uint32_t max_file_length,
                   const ServiceInfo &service_info);
 #endif
+#endif
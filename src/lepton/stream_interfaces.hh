@@ -87,11 +87,13 @@ class ActualThreadPacketReader : public PacketReader{
     GenericWorker *worker;
     VP8ComponentDecoder_SendToActualThread *base;
     uint8_t stream_id;
+    int trace_lane;
     ResizableByteBufferListNode* last;
 public:
-    ActualThreadPacketReader(uint8_t stream_id, GenericWorker*worker, VP8ComponentDecoder_SendToActualThread*base) {
+    ActualThreadPacketReader(uint8_t stream_id, int trace_lane, GenericWorker*worker, VP8ComponentDecoder_SendToActualThread*base) {
         this->worker = worker;
         this->stream_id = stream_id;
+        this->trace_lane = trace_lane;
         this->base = base;
         this->last = NULL;
     }
@@ -109,6 +111,7 @@ public:
             return {retval->data(), retval->data() + retval->size()};
         }
         while(!isEof) {
+            TraceHarness::Span wait_span(trace_lane, TraceHarness::MUX_WAIT, stream_id);
             auto dat = worker->batch_recv_data();
             for (unsigned int i = 0; i < dat.count; ++i) {
                 ResizableByteBufferListNode* lnode = (ResizableByteBufferListNode*) dat.data[i];
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+#include "trace_events.hh"
+#include "../vp8/util/memory.hh"
+#include "../vp8/util/nd_array.hh"
+
+namespace TraceHarness {
+namespace {
+#define GENERATE_TRACE_SPAN_STRING(VALUE) #VALUE,
+const char * span_names[] = {FOREACH_TRACE_SPAN(GENERATE_TRACE_SPAN_STRING) "EOF"};
+#undef GENERATE_TRACE_SPAN_STRING
+// names of arg0 and arg1 for each span, NULL if unused
+const char * const span_arg_names[NUM_SPANS][2] = {
+    {"component", "row"}, // ROW_ENCODE
+    {"component", "row"}, // ROW_DECODE
+    {"mcu_row", NULL}, // ROW_RECODE
+    {"stream", "bytes"}, // MUX_READ
+    {"stream", NULL}, // MUX_WAIT
+    {NULL, NULL}, // MUX_WRITE
+    {"thread", NULL}, // THREAD_WAIT
+    {"thread", "bytes"}, // OUTPUT_COPY
+};
+enum {
+    MAX_EVENTS_PER_LANE = 1 << 16
+};
+struct Event {
+    uint64_t begin_us;
+    uint32_t duration_us;
+    uint16_t span;
+    int32_t arg0;
+    int32_t arg1;
+};
+struct Lane {
+    Event *events;
+    uint32_t num_events;
+    uint32_t num_dropped;
+};
+// each lane is only appended to by the thread it belongs to
+Sirikata::Array1d<Lane, NUM_LANES> lanes;
+FILE *trace_file = NULL;
+// each process writes its spans with a single fwrite so that socket server
+// children appending to the same file do not interleave mid-line
+char *out_buffer = NULL;
+size_t out_size = 0;
+size_t out_capacity = 0;
+void append(const char *data) {
+    size_t len = strlen(data);
+    if (out_size + len > out_capacity) {
+        out_capacity = (out_size + len) * 2;
+        out_buffer = (char*)realloc(out_buffer, out_capacity);
+        always_assert(out_buffer && "unable to grow trace output");
+    }
+    memcpy(out_buffer + out_size, data, len);
+    out_size += len;
+}
+}
+
+bool enabled = false;
+
+uint64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>
+        (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool open(const char *filename) {
+    trace_file = fopen(filename, "ab");
+    if (trace_file == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < lanes.size(); ++i) {
+        // plain calloc: the spans must not eat into the codec's memory budget
+        lanes[i].events = (Event*)calloc(MAX_EVENTS_PER_LANE, sizeof(Event));
+        always_assert(lanes[i].events && "unable to allocate trace buffers");
+        lanes[i].num_events = 0;
+        lanes[i].num_dropped = 0;
+    }
+    if (ftell(trace_file) == 0) {
+        // the JSON array format allows the closing bracket to be left off,
+        // so every process can keep appending its spans
+        fputs("[\n", trace_file);
+        fflush(trace_file);
+    }
+    enabled = true;
+    return true;
+}
+
+void record(int lane, TraceSpan span, uint64_t begin_us, int32_t arg0, int32_t arg1) {
+    dev_assert(lane >= 0 && lane < NUM_LANES);
+    Lane &l = lanes[lane];
+    if (l.num_events == MAX_EVENTS_PER_LANE) {
+        ++l.num_dropped;
+        return;
+    }
+    Event &e = l.events[l.num_events++];
+    e.begin_us = begin_us;
+    e.duration_us = now_us() - begin_us;
+    e.span = span;
+    e.arg0 = arg0;
+    e.arg1 = arg1;
+}
+
+void flush() {
+    if (!enabled) {
+        return;
+    }
+#ifdef _WIN32
+    int pid = _getpid();
+#else
+    int pid = getpid();
+#endif
+    out_size = 0;
+    char line[320];
+    for (int lane = 0; lane < NUM_LANES; ++lane) {
+        const Lane &l = lanes[lane];
+        if (l.num_events == 0) {
+            continue;
+        }
+        char lane_name[32];
+        if (lane == MAIN_LANE) {
+            snprintf(lane_name, sizeof(lane_name), "main");
+        } else {
+            snprintf(lane_name, sizeof(lane_name), "thread %d", lane);
+        }
+        snprintf(line, sizeof(line),
+                 "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                 "\"args\":{\"name\":\"%s\"}},\n",
+                 pid, lane, lane_name);
+        append(line);
+        for (uint32_t i = 0; i < l.num_events; ++i) {
+            const Event &e = l.events[i];
+            int len = snprintf(line, sizeof(line),
+                               "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                               "\"ts\":%llu,\"dur\":%u,\"args\":{",
+                               span_names[e.span], pid, lane,
+                               (unsigned long long)e.begin_us, e.duration_us);
+            const char * const *arg_names = span_arg_names[e.span];
+            if (arg_names[0]) {
+                len += snprintf(line + len, sizeof(line) - len, "\"%s\":%d", arg_names[0], e.arg0);
+            }
+            if (arg_names[1]) {
+                len += snprintf(line + len, sizeof(line) - len, ",\"%s\":%d", arg_names[1], e.arg1);
+            }
+            snprintf(line + len, sizeof(line) - len, "}},\n");
+            append(line);
+        }
+        if (l.num_dropped) {
+            snprintf(line, sizeof(line),
+                     "{\"name\":\"DROPPED\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%d,"
+                     "\"ts\":%llu,\"args\":{\"spans\":%u}},\n",
+                     pid, lane,
+                     (unsigned long long)l.events[l.num_events - 1].begin_us, l.num_dropped);
+            append(line);
+        }
+        lanes[lane].num_events = 0;
+        lanes[lane].num_dropped = 0;
+    }
+    fwrite(out_buffer, 1, out_size, trace_file);
+    fflush(trace_file);
+}
+}
@@ -0,0 +1,67 @@
+#ifndef TRACE_EVENTS_HH_
+#define TRACE_EVENTS_HH_
+#include <stdint.h>
+#include "../vp8/util/options.hh"
+
+// Optional begin/end spans per codec thread, written as Chrome trace-event
+// JSON (loadable in chrome://tracing or Perfetto). Unlike TimingHarness,
+// which keeps one timestamp per stage, every row and every mux packet gets
+// its own span, so stalls between the mux and the workers become visible.
+namespace TraceHarness {
+#define FOREACH_TRACE_SPAN(CB) \
+    CB(ROW_ENCODE) \
+    CB(ROW_DECODE) \
+    CB(ROW_RECODE) \
+    CB(MUX_READ) \
+    CB(MUX_WAIT) \
+    CB(MUX_WRITE) \
+    CB(THREAD_WAIT) \
+    CB(OUTPUT_COPY)
+#define MAKE_TRACE_SPAN_ENUM(VALUE) VALUE,
+enum TraceSpan {
+    FOREACH_TRACE_SPAN(MAKE_TRACE_SPAN_ENUM)
+    NUM_SPANS
+};
+#undef MAKE_TRACE_SPAN_ENUM
+enum {
+    // codec threads trace into the lane of their thread id
+    MAIN_LANE = MAX_NUM_THREADS,
+    NUM_LANES
+};
+
+extern bool enabled;
+uint64_t now_us();
+// Opens (appending to) the trace file and reserves the span buffers.
+// Must run before the process is jailed.
+bool open(const char *filename);
+void record(int lane, TraceSpan span, uint64_t begin_us, int32_t arg0, int32_t arg1);
+// Appends every recorded span to the trace file and forgets them.
+void flush();
+
+class Span {
+    uint64_t begin_;
+    int lane_;
+    TraceSpan span_;
+    int32_t arg0_;
+    int32_t arg1_;
+public:
+    Span(int lane, TraceSpan span, int32_t arg0 = -1, int32_t arg1 = -1) {
+        begin_ = enabled ? now_us() : 0;
+        lane_ = lane;
+        span_ = span;
+        arg0_ = arg0;
+        arg1_ = arg1;
+    }
+    // for spans whose details are only known once the work is done
+    void set_args(int32_t arg0, int32_t arg1) {
+        arg0_ = arg0;
+        arg1_ = arg1;
+    }
+    ~Span() {
+        if (begin_) {
+            record(lane_, span_, begin_, arg0_, arg1_);
+        }
+    }
+};
+}
+#endif
@@ -15,7 +15,10 @@
 #include "component_info.hh"
 #include "../vp8/model/color_context.hh"
 #include "../vp8/util/block_based_image.hh"
+#include "../vp8/util/cancellation.hh"
+#include "../io/Allocator.hh"
 struct componentInfo;
+struct BandScan;
 
 class Block;
 
@@ -106,6 +109,18 @@ public:
     CodingReturnValue do_more_work() {
         return decoder_->decode_chunk(this);
     }
+    // The progressive recoder pulls rows through these waits from deep
+    // inside its scan loops, so a cancelled decode ends the request here
+    // instead of unwinding through them.
+    static void exit_on_error(CodingReturnValue retval) {
+        if (retval == CODING_ERROR) {
+            if (Cancellation::requested()) {
+                custom_exit(ExitCode::TIMED_OUT);
+            }
+            dev_assert(false && "Incorrectly coded item");
+            custom_exit(ExitCode::CODING_ERROR);
+        }
+    }
     template<bool force_memory_optimized>
     void allocate_channel_framebuffer(int desired_cmp,
                                       BlockBasedImageBase<force_memory_optimized> *framebuffer,
@@ -185,32 +200,20 @@ public:
     }
     void wait_for_worker_on_bit(int bit) {
         while (bit >= (bit_progress_ += 0)) {
-            CodingReturnValue retval = do_more_work();
-            if (retval == CODING_ERROR) {
-                dev_assert(false && "Incorrectly coded item");
-                custom_exit(ExitCode::CODING_ERROR);
-            }
+            exit_on_error(do_more_work());
             //fprintf(stderr, "Waiting for bit %d > %d\n", bit, bit_progress_ += 0);
         }
     }
     void wait_for_worker_on_bpos(int bpos) {
         while (bpos >= (coefficient_position_progress_ += 0)) {
-            CodingReturnValue retval = do_more_work();
-            if (retval == CODING_ERROR) {
-                dev_assert(false && "Incorrectly coded item");
-                custom_exit(ExitCode::CODING_ERROR);
-            }
+            exit_on_error(do_more_work());
             //fprintf(stderr, "Waiting for coefficient_position %d > %d\n", bpos, coefficient_position_progress_ += 0);
         }
     }
     void wait_for_worker_on_dpos(int cmp, int dpos) {
         dpos = std::min(dpos, header_[cmp].trunc_bc_ - 1);
         while (dpos >= (header_[cmp].dpos_block_progress_ += 0)) {
-            CodingReturnValue retval = do_more_work();
-            if (retval == CODING_ERROR) {
-                dev_assert(false && "Incorrectly coded item");
-                custom_exit(ExitCode::CODING_ERROR);
-            }
+            exit_on_error(do_more_work());
         }
     }
     void signal_worker_should_begin() {
@@ -271,6 +274,11 @@ public:
     
     void reset() {
         bit_progress_ -= bit_progress_;
+        // the next file of a concatenation waits on its own decoder
+        coefficient_position_progress_ -= coefficient_position_progress_;
+        for (int cmp = 0; cmp < (int)header_.size(); ++cmp) {
+            header_[cmp].dpos_block_progress_ -= header_[cmp].dpos_block_progress_;
+        }
     }
     ~UncompressedComponents() {
         reset();
@@ -280,11 +288,18 @@ public:
 
     // the following functions are progressive-only functions (recode_jpeg)
     // or decode-only functions (decode_jpeg, check_value_range)
+    // and write_ujpg_slices, which blanks the blocks after each cut
     // these are the only functions able to access the components
     friend bool decode_jpeg(const std::vector<std::pair<uint32_t, uint32_t> >&huff_byte_offsets,
-                            std::vector<ThreadHandoff>*luma_row_offset_return);
+                            std::vector<ThreadHandoff>*luma_row_offset_return,
+                            std::vector<uint32_t>*mcu_file_offsets);
+    friend bool write_ujpg_slices(std::vector<ThreadHandoff> row_thread_handoffs,
+                                  std::vector<uint32_t> mcu_file_offsets,
+                                  std::vector<uint8_t, Sirikata::JpegAllocator<uint8_t> >*jpeg_file_raw_bytes,
+                                  size_t chunk_size);
     friend bool recode_jpeg(void);
     friend bool check_value_range(void);
+    friend void decode_band_scan(BandScan *scan, int8_t *padbit);
 private:
     AlignedBlock& mutable_block(BlockType cmp, int dpos) {
         return header_[(int)cmp].component_.raster(dpos);
@@ -0,0 +1,300 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../vp8/util/memory.hh"
+#include "verify.hh"
+#ifndef _WIN32
+#include <signal.h>
+#include <unistd.h>
+#if defined(__APPLE__) || defined(BSD)
+#include <sys/wait.h>
+#else
+#include <wait.h>
+#endif
+#include "jpgcoder.hh"
+#include "../io/ioutil.hh"
+#endif
+
+unsigned int g_verify_jobs = 0;
+const char *g_verify_sums = NULL;
+
+Md5Writer::Md5Writer(Sirikata::DecoderWriter *base) {
+    mBase = base;
+    mWritten = 0;
+    mClosed = false;
+    MD5_Init(&mContext);
+}
+
+std::pair<Sirikata::uint32, Sirikata::JpegError> Md5Writer::Write(const Sirikata::uint8 *data,
+                                                                  unsigned int size) {
+    MD5_Update(&mContext, data, size);
+    mWritten += size;
+    return std::pair<Sirikata::uint32, Sirikata::JpegError>(size, Sirikata::JpegError::nil());
+}
+
+void Md5Writer::Close() {
+    if (mClosed) {
+        return;
+    }
+    mClosed = true;
+    uint8_t result[16 + 4];
+    MD5_Final(result, &mContext);
+    for (int i = 0; i < 4; ++i) {
+        result[16 + i] = uint8_t((mWritten >> (8 * i)) & 0xff);
+    }
+    mBase->Write(result, sizeof(result));
+    mBase->Close();
+}
+
+#ifndef _WIN32
+extern int file_no;
+const char *ExitString(ExitCode ec);
+
+namespace {
+struct VerifyResult {
+    bool done;
+    ExitCode status;
+    const char *reason; // overrides ExitString(status)
+    char md5[33];
+    uint32_t jpeg_size;
+    uint64_t lepton_size;
+    VerifyResult() : done(false), status(ExitCode::SUCCESS), reason(NULL), jpeg_size(0), lepton_size(0) {
+        md5[0] = '\0';
+    }
+};
+
+struct RunningDecode {
+    pid_t pid;
+    int result_pipe;
+    int file;
+};
+
+// the md5sum style "<hex>  <name>" lines of g_verify_sums, by name and by
+// name without its extension, so the sums of the jpegs can check their .lep
+struct VerifySums {
+    std::map<std::string, std::string> by_name;
+    std::map<std::string, std::string> by_stem;
+};
+
+// name without the extension of its last path component
+std::string strip_extension(const std::string &name) {
+    size_t dot = name.rfind('.');
+    size_t slash = name.rfind('/');
+    if (dot == std::string::npos || dot == 0 || (slash != std::string::npos && dot <= slash + 1)) {
+        return name;
+    }
+    return name.substr(0, dot);
+}
+
+VerifySums read_verify_sums(const char *filename) {
+    VerifySums sums;
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Unable to open %s\n", filename);
+        custom_exit(ExitCode::FILE_NOT_FOUND);
+    }
+    char line[4096 + 64];
+    while (fgets(line, sizeof(line), fp)) {
+        size_t len = strlen(line);
+        while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len < 32 + 2 || line[32] != ' ') {
+            continue;
+        }
+        if (line[33] != ' ' && line[33] != '*') { // '*' marks binary mode
+            continue;
+        }
+        const char *name = line + 34;
+        std::string hex(line, 32);
+        for (size_t i = 0; i < hex.size(); ++i) {
+            if (hex[i] >= 'A' && hex[i] <= 'F') {
+                hex[i] += 'a' - 'A';
+            }
+        }
+        sums.by_name[name] = hex;
+        std::string stem = strip_extension(name);
+        if (stem != name && sums.by_stem.find(stem) == sums.by_stem.end()) {
+            sums.by_stem[stem] = hex;
+        }
+    }
+    fclose(fp);
+    return sums;
+}
+
+// the sum listed for filename itself, for a.jpg when given a.jpg.lep, or
+// for a.jpg (or any other extension) when given a.lep; NULL if none is
+const std::string *find_verify_sum(const VerifySums &sums, const std::string &filename) {
+    std::map<std::string, std::string>::const_iterator sum = sums.by_name.find(filename);
+    if (sum != sums.by_name.end()) {
+        return &sum->second;
+    }
+    const std::string suffix(".lep");
+    if (filename.size() <= suffix.size()
+        || filename.compare(filename.size() - suffix.size(), suffix.size(), suffix) != 0) {
+        return NULL;
+    }
+    std::string original = filename.substr(0, filename.size() - suffix.size());
+    sum = sums.by_name.find(original);
+    if (sum != sums.by_name.end()) {
+        return &sum->second;
+    }
+    sum = sums.by_stem.find(original);
+    if (sum != sums.by_stem.end()) {
+        return &sum->second;
+    }
+    return NULL;
+}
+
+RunningDecode start_decode(int i, int fd) {
+    RunningDecode retval;
+    retval.file = i;
+    int result_pipe[2];
+    while (pipe(result_pipe) < 0) {
+        always_assert(errno == EINTR);
+    }
+    fflush(stdout);
+    retval.pid = fork();
+    always_assert(retval.pid >= 0);
+    if (retval.pid == 0) {
+        while (close(result_pipe[0]) < 0 && errno == EINTR) {}
+        while (close(1) < 0 && errno == EINTR) {} // leave stderr open for complaints
+        file_no = i;
+        IOUtil::FileReader reader(fd, 0, false);
+        IOUtil::FileWriter writer(result_pipe[1], false, false);
+        process_file(&reader, &writer, 0, false);
+        custom_exit(ExitCode::SUCCESS);
+    }
+    while (close(result_pipe[1]) < 0 && errno == EINTR) {}
+    retval.result_pipe = result_pipe[0];
+    return retval;
+}
+
+void finish_decode(const RunningDecode &decode, int status, VerifyResult *result) {
+    uint8_t digest[16 + 4];
+    size_t got = 0;
+    while (got < sizeof(digest)) {
+        ssize_t del = read(decode.result_pipe, digest + got, sizeof(digest) - got);
+        if (del < 0 && errno == EINTR) {
+            continue;
+        }
+        if (del <= 0) {
+            break;
+        }
+        got += del;
+    }
+    while (close(decode.result_pipe) < 0 && errno == EINTR) {}
+    result->done = true;
+    if (WIFSIGNALED(status)) {
+        result->status = ExitCode::ASSERTION_FAILURE;
+        result->reason = "SIGNALED";
+    } else if (WEXITSTATUS(status) != 0) {
+        result->status = (ExitCode)WEXITSTATUS(status);
+    } else if (got != sizeof(digest)) {
+        result->status = ExitCode::SHORT_READ;
+    } else {
+        for (int i = 0; i < 16; ++i) {
+            snprintf(result->md5 + 2 * i, 3, "%02x", digest[i]);
+        }
+        result->jpeg_size = digest[16] | (digest[17] << 8) | (digest[18] << 16)
+            | ((uint32_t)digest[19] << 24);
+    }
+}
+}
+
+void verify_files(const char **files, int file_cnt) {
+    VerifySums sums;
+    if (g_verify_sums) {
+        sums = read_verify_sums(g_verify_sums);
+    }
+    unsigned int jobs = g_verify_jobs ? g_verify_jobs : std::thread::hardware_concurrency();
+    if (jobs == 0) {
+        jobs = 1;
+    }
+    std::vector<VerifyResult> results(file_cnt);
+    std::vector<RunningDecode> running;
+    uint64_t start = TimingHarness::get_time_us(true);
+    uint64_t jpeg_bytes = 0;
+    uint64_t lepton_bytes = 0;
+    int num_failed = 0;
+    ExitCode first_error = ExitCode::SUCCESS;
+    int next_to_start = 0;
+    int next_to_print = 0;
+    while (next_to_print < file_cnt) {
+        while (next_to_start < file_cnt && running.size() < jobs) {
+            int i = next_to_start++;
+            int fd = -1;
+            do {
+                fd = open(files[i], O_RDONLY);
+            } while (fd == -1 && errno == EINTR);
+            if (fd == -1) {
+                results[i].done = true;
+                results[i].status = ExitCode::FILE_NOT_FOUND;
+                continue;
+            }
+            off_t size = lseek(fd, 0, SEEK_END);
+            results[i].lepton_size = size > 0 ? size : 0;
+            lseek(fd, 0, SEEK_SET);
+            running.push_back(start_decode(i, fd));
+            while (close(fd) < 0 && errno == EINTR) {}
+        }
+        if (!results[next_to_print].done) {
+            int status = 0;
+            pid_t pid = waitpid(-1, &status, 0);
+            if (pid < 0) {
+                always_assert(errno == EINTR);
+                continue;
+            }
+            for (size_t j = 0; j < running.size(); ++j) {
+                if (running[j].pid == pid) {
+                    finish_decode(running[j], status, &results[running[j].file]);
+                    running.erase(running.begin() + j);
+                    break;
+                }
+            }
+        }
+        // the lines come out in the order the files were given
+        for (; next_to_print < file_cnt && results[next_to_print].done; ++next_to_print) {
+            VerifyResult &result = results[next_to_print];
+            const char *filename = files[next_to_print];
+            if (result.status == ExitCode::SUCCESS && g_verify_sums) {
+                const std::string *sum = find_verify_sum(sums, filename);
+                if (sum == NULL) {
+                    result.status = ExitCode::FILE_NOT_FOUND;
+                    result.reason = "NO_SUM";
+                } else if (*sum != result.md5) {
+                    result.status = ExitCode::ROUNDTRIP_FAILURE;
+                    result.reason = "MD5_MISMATCH";
+                }
+            }
+            if (result.status == ExitCode::SUCCESS) {
+                fprintf(stdout, "%s: OK %s %u\n", filename, result.md5, result.jpeg_size);
+                jpeg_bytes += result.jpeg_size;
+                lepton_bytes += result.lepton_size;
+            } else {
+                fprintf(stdout, "%s: FAILED %s\n", filename,
+                        result.reason ? result.reason : ExitString(result.status));
+                ++num_failed;
+                if (first_error == ExitCode::SUCCESS) {
+                    first_error = result.status;
+                }
+            }
+            fflush(stdout);
+        }
+    }
+    double seconds = (TimingHarness::get_time_us(true) - start) / 1000000.;
+    if (seconds <= 0) {
+        seconds = 1e-6;
+    }
+    fprintf(stderr, "-> %d file(s) verified, %d failed, %.1f MB/s jpeg, %.1f MB/s lepton, %.2f s\n",
+            file_cnt, num_failed, jpeg_bytes / seconds / 1048576., lepton_bytes / seconds / 1048576.,
+            seconds);
+    custom_exit(first_error);
+}
+#endif
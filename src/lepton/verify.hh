@@ -0,0 +1,40 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef VERIFY_HH_
+#define VERIFY_HH_
+#include "../io/Reader.hh"
+#ifdef USE_SYSTEM_MD5_DEPENDENCY
+#include <openssl/md5.h>
+#else
+#include "../../dependencies/md5/md5.h"
+#endif
+
+// set by -verifybatch=<n>: how many files decode at once (0 for one per core)
+extern unsigned int g_verify_jobs;
+// set by -verifysums=: md5sum style list of the jpegs the files must decode to;
+// x.lep and x.jpg.lep are checked against the sum listed for x.jpg
+extern const char *g_verify_sums;
+
+// The output of a -verifybatch decode: rather than writing the jpeg anywhere it
+// only hashes it. Close writes the 16 byte md5 and the little endian 32 bit
+// byte count to mBase, which is the pipe back to verify_files.
+class Md5Writer : public Sirikata::DecoderWriter {
+    Sirikata::DecoderWriter *mBase;
+    MD5_CTX mContext;
+    uint32_t mWritten;
+    bool mClosed;
+  public:
+    explicit Md5Writer(Sirikata::DecoderWriter *base);
+    virtual std::pair<Sirikata::uint32, Sirikata::JpegError> Write(const Sirikata::uint8 *data,
+                                                                   unsigned int size);
+    virtual void Close();
+};
+
+#ifndef _WIN32
+// -verifybatch: decodes each of files in a child forked from this process, which
+// has already set up the allocator and the decoder models that every child
+// starts from, and prints a line per file in the order given with the md5 and
+// size of the jpeg it decodes to, or why it failed. A summary with the decode
+// throughput goes to stderr. Exits with the error of the first failed file.
+void verify_files(const char **files, int file_cnt);
+#endif
+#endif
@@ -10,6 +10,7 @@
 #include "uncompressed_components.hh"
 #include "jpgcoder.hh"
 #include "vp8_decoder.hh"
+#include "../vp8/util/cancellation.hh"
 
 #include "../io/Reader.hh"
 #include "../vp8/decoder/decoder.hh"
@@ -21,6 +22,9 @@ void VP8ComponentDecoder<BoolEncoder>::initialize( Sirikata::DecoderReader *inpu
     str_in = input;
     mux_reader_.init(input);
     thread_handoff_ = thread_handoff;
+    // the next file of a concatenation starts over with its own threads
+    virtual_thread_id_ = -1;
+    chunk_state_ready_ = false;
 }
 template<class BoolEncoder>
 void VP8ComponentDecoder<BoolEncoder>::decode_row(int target_thread_id,
@@ -44,6 +48,7 @@ VP8ComponentDecoder<BoolDecoder>::VP8ComponentDecoder(bool do_threading)
                   8,
                   0) {
     virtual_thread_id_ = -1;
+    chunk_state_ready_ = false;
 }
 template<class BoolEncoder>
 VP8ComponentDecoder<BoolEncoder>::~VP8ComponentDecoder() {
@@ -122,6 +127,7 @@ template <class BoolDecoder>
 void VP8ComponentDecoder<BoolDecoder>::initialize_bool_decoder(int thread_id, int target_thread_state) {
     if (NUM_THREADS > 1 && g_threaded) {
         this->thread_state_[target_thread_state]->bool_decoder_.init(new ActualThreadPacketReader(thread_id,
+                                                                                            target_thread_state,
                                                                                             getWorker(target_thread_state),
                                                                                             &send_to_actual_thread_state));
     } else {
@@ -135,7 +141,7 @@ void VP8ComponentDecoder<BoolDecoder>::initialize_thread_id(int thread_id, int t
     if (target_thread_state) {
         always_assert(this->spin_workers_);
     }
-    TimingHarness::timing[thread_id%NUM_THREADS][TimingHarness::TS_STREAM_MULTIPLEX_STARTED] = TimingHarness::get_time_us();
+    TimingHarness::stamp(thread_id%NUM_THREADS, TimingHarness::TS_STREAM_MULTIPLEX_STARTED);
     //if (thread_id != target_thread_state) {
         this->reset_thread_model_state(target_thread_state);
     //}
@@ -166,7 +172,7 @@ void VP8ComponentDecoder<BoolDecoder>::initialize_thread_id(int thread_id, int t
     }
     //fprintf(stderr, "tid: %d   %d -> %d\n", thread_id, thread_state_[target_thread_state]->luma_splits_[0],
     //        thread_state_[target_thread_state]->luma_splits_[1]);
-    TimingHarness::timing[thread_id%NUM_THREADS][TimingHarness::TS_STREAM_MULTIPLEX_FINISHED] = TimingHarness::get_time_us();
+    TimingHarness::stamp(thread_id%NUM_THREADS, TimingHarness::TS_STREAM_MULTIPLEX_FINISHED);
 }
 
 template <class BoolDecoder> 
@@ -239,12 +245,14 @@ void VP8ComponentDecoder_SendToVirtualThread::send(ResizableByteBufferListNode *
 void VP8ComponentDecoder_SendToVirtualThread::drain(Sirikata::MuxReader&reader) {
     while (!reader.eof) {
         ResizableByteBufferListNode *data = new ResizableByteBufferListNode;
+        TraceHarness::Span read_span(TraceHarness::MAIN_LANE, TraceHarness::MUX_READ);
         auto ret = reader.nextDataPacket(*data);
         if (ret.second != Sirikata::JpegError::nil()) {
             set_eof();
             break;
         }
         data->stream_id = ret.first;
+        read_span.set_args(ret.first, data->size());
         always_assert(data->size()); // the protocol can't store empty runs
         send(data);
     }
@@ -273,12 +281,14 @@ ResizableByteBufferListNode* VP8ComponentDecoder_SendToVirtualThread::read(Sirik
     }
     while (!eof) {
         ResizableByteBufferListNode *data = new ResizableByteBufferListNode;
+        TraceHarness::Span read_span(TraceHarness::MAIN_LANE, TraceHarness::MUX_READ);
         auto ret = reader.nextDataPacket(*data);
         if (ret.second != JpegError::nil()) {
             set_eof();
             break;
         }
         data->stream_id = ret.first;
+        read_span.set_args(ret.first, data->size());
         bool buffer_it = ret.first != stream_id;
         if (buffer_it) {
             send(data);
@@ -301,12 +311,14 @@ void VP8ComponentDecoder_SendToVirtualThread::read_all(Sirikata::MuxReader&reade
     using namespace Sirikata;
     while (!eof) {
         ResizableByteBufferListNode *data = new ResizableByteBufferListNode;
+        TraceHarness::Span read_span(TraceHarness::MAIN_LANE, TraceHarness::MUX_READ);
         auto ret = reader.nextDataPacket(*data);
         if (ret.second != JpegError::nil()) {
             set_eof();
             break;
         }
         data->stream_id = ret.first;
+        read_span.set_args(ret.first, data->size());
         always_assert(data->size());
         send(data);
     }
@@ -392,8 +404,9 @@ CodingReturnValue VP8ComponentDecoder<BoolDecoder>::decode_chunk(UncompressedCom
 
 
     /* construct 4x4 VP8 blocks to hold 8x8 JPEG blocks */
-    if ( this->thread_state_[0] == nullptr || this->thread_state_[0]->context_[0].isNil() ) {
+    if ( !chunk_state_ready_ ) {
         /* first call */
+        chunk_state_ready_ = true;
         BlockBasedImagePerChannel<false> framebuffer;
         framebuffer.memset(0);
         for (size_t i = 0; i < framebuffer.size() && int( i ) < colldata->get_num_components(); ++i) {
@@ -420,7 +433,8 @@ CodingReturnValue VP8ComponentDecoder<BoolDecoder>::decode_chunk(UncompressedCom
             return CODING_ERROR;
         }
     }
-    if (this->do_threading_) {
+    // a decoder preloaded with threads may still be handed a single threaded file
+    if (this->do_threading_ && g_threaded && NUM_THREADS > 1) {
         reset_all_comm_buffers();
         for (unsigned int physical_thread_id = 0; physical_thread_id < (g_threaded ? getNumWorkers() : 1); ++physical_thread_id) {
             getWorker(physical_thread_id)->work = nop;
@@ -446,19 +460,23 @@ CodingReturnValue VP8ComponentDecoder<BoolDecoder>::decode_chunk(UncompressedCom
         flush();
         for (unsigned int thread_id = 0; thread_id < NUM_THREADS; ++thread_id) {
             unsigned int cur_spin_worker = thread_id;
-            TimingHarness::timing[thread_id][TimingHarness::TS_THREAD_WAIT_STARTED] = TimingHarness::get_time_us();
+            TimingHarness::stamp(thread_id, TimingHarness::TS_THREAD_WAIT_STARTED);
+            TraceHarness::Span wait_span(TraceHarness::MAIN_LANE, TraceHarness::THREAD_WAIT, thread_id);
             this->spin_workers_[cur_spin_worker].main_wait_for_done();
-            TimingHarness::timing[thread_id][TimingHarness::TS_THREAD_WAIT_FINISHED] = TimingHarness::get_time_us();
+            TimingHarness::stamp(thread_id, TimingHarness::TS_THREAD_WAIT_FINISHED);
         }
         // join on all threads
+        if (Cancellation::requested()) {
+            return CODING_ERROR; // the workers stopped short of their rows
+        }
     } else {
         if (virtual_thread_id_ != -1) {
-            TimingHarness::timing[0][TimingHarness::TS_ARITH_STARTED] = TimingHarness::get_time_us();
+            TimingHarness::stamp(0, TimingHarness::TS_ARITH_STARTED);
             CodingReturnValue ret = this->thread_state_[0]->vp8_decode_thread(0, colldata);
-            if (ret == CODING_PARTIAL) {
+            if (ret != CODING_DONE) {
                 return ret;
             }
-            TimingHarness::timing[0][TimingHarness::TS_ARITH_FINISHED] = TimingHarness::get_time_us();
+            TimingHarness::stamp(0, TimingHarness::TS_ARITH_FINISHED);
         }
         // wait for "threads"
         virtual_thread_id_ += 1; // first time's a charm
@@ -471,15 +489,15 @@ CodingReturnValue VP8ComponentDecoder<BoolDecoder>::decode_chunk(UncompressedCom
 
             initialize_thread_id(thread_id, 0, framebuffer);
             this->thread_state_[0]->bool_decoder_.init(new VirtualThreadPacketReader(thread_id, &mux_reader_, &mux_splicer));
-            TimingHarness::timing[thread_id][TimingHarness::TS_ARITH_STARTED] = TimingHarness::get_time_us();
+            TimingHarness::stamp(thread_id, TimingHarness::TS_ARITH_STARTED);
             CodingReturnValue ret;
-            if ((ret = this->thread_state_[0]->vp8_decode_thread(0, colldata)) == CODING_PARTIAL) {
+            if ((ret = this->thread_state_[0]->vp8_decode_thread(0, colldata)) != CODING_DONE) {
                 return ret;
             }
-            TimingHarness::timing[thread_id][TimingHarness::TS_ARITH_FINISHED] = TimingHarness::get_time_us();
+            TimingHarness::stamp(thread_id, TimingHarness::TS_ARITH_FINISHED);
         }
     }
-    TimingHarness::timing[0][TimingHarness::TS_JPEG_RECODE_STARTED] = TimingHarness::get_time_us();
+    TimingHarness::stamp(0, TimingHarness::TS_JPEG_RECODE_STARTED);
     for (int component = 0; component < colldata->get_num_components(); ++component) {
         colldata->worker_mark_cmp_finished((BlockType)component);
     }
@@ -39,6 +39,7 @@ private:
     void initialize_bool_decoder(int thread_id, int target_thread_state);
 
     int virtual_thread_id_;
+    bool chunk_state_ready_; // decode_chunk set up the threads for the current file
 public:
     VP8ComponentDecoder(bool do_threading);
     // reads the threading information and uses mux_reader_ to create the streams_ 
@@ -1,5 +1,6 @@
 /* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 #include "../../vp8/util/memory.hh"
+#include "../../vp8/util/cancellation.hh"
 #include <string>
 #include <cassert>
 #include <iostream>
@@ -164,25 +165,26 @@ uint32_t aligned_block_cost_scalar(const AlignedBlock &block) {
 uint32_t aligned_block_cost(const AlignedBlock &block) {
 #if defined(__SSE2__) && !defined(USE_SCALAR) /* SSE2 or higher instruction set available { */
     const __m128i zero = _mm_setzero_si128();
-     __m128i v_cost;
+    __m128i v_cost = _mm_setzero_si128();
     for (int i = 0; i < 64; i+= 8) {
         __m128i val = _mm_abs_epi16(_mm_load_si128((const __m128i*)(const char*)(block.raw_data() + i)));
-        v_cost = _mm_set1_epi16(0);
 #ifndef __SSE4_1__
         while (_mm_movemask_epi8(_mm_cmpeq_epi32(val, zero)) != 0xFFFF)
 #else
         while (!_mm_test_all_zeros(val, val))
 #endif
         {
-            __m128i mask = _mm_cmpgt_epi16(val, zero);
-            v_cost = _mm_add_epi16(v_cost, _mm_and_si128(mask, _mm_set1_epi16(2)));
+            // unsigned test: abs(-32768) stays 0x8000
+            __m128i is_zero = _mm_cmpeq_epi16(val, zero);
+            v_cost = _mm_add_epi16(v_cost, _mm_andnot_si128(is_zero, _mm_set1_epi16(2)));
             val = _mm_srli_epi16(val, 1);
         }
-        v_cost = _mm_add_epi16(v_cost, _mm_srli_si128(v_cost, 8));
-        v_cost = _mm_add_epi16(v_cost ,_mm_srli_si128(v_cost, 4));
-        v_cost = _mm_add_epi16(v_cost, _mm_srli_si128(v_cost, 2));
     }
-    return 16 + _mm_extract_epi16(v_cost, 0);
+    v_cost = _mm_add_epi16(v_cost, _mm_srli_si128(v_cost, 8));
+    v_cost = _mm_add_epi16(v_cost ,_mm_srli_si128(v_cost, 4));
+    v_cost = _mm_add_epi16(v_cost, _mm_srli_si128(v_cost, 2));
+    dev_assert(64 + _mm_extract_epi16(v_cost, 0) == (int)aligned_block_cost_scalar(block));
+    return 64 + _mm_extract_epi16(v_cost, 0);
 #else /* } No SSE2 instructions { */
     return aligned_block_cost_scalar(block);
 #endif /* } */
@@ -237,7 +239,7 @@ tuple<ProbabilityTablesTuple(true, true, false)> midright(EACH_BLOCK_TYPE(true,
 tuple<ProbabilityTablesTuple(false, true, false)> width_one(EACH_BLOCK_TYPE(false, true, false));
 
 template <class ArithmeticCoder> template <class BoolEncoder>
-void VP8ComponentEncoder<ArithmeticCoder>::process_row_range(unsigned int thread_id,
+CodingReturnValue VP8ComponentEncoder<ArithmeticCoder>::process_row_range(unsigned int thread_id,
                                             const UncompressedComponents * const colldata,
                                             int min_y,
                                             int max_y,
@@ -247,7 +249,7 @@ void VP8ComponentEncoder<ArithmeticCoder>::process_row_range(unsigned int thread
                                                               (uint32_t)ColorChannel::NumBlockTypes
                                                               > *num_nonzeros) {
 
-    TimingHarness::timing[thread_id][TimingHarness::TS_ARITH_STARTED] = TimingHarness::get_time_us();
+    TimingHarness::stamp(thread_id, TimingHarness::TS_ARITH_STARTED);
     using namespace Sirikata;
     Array1d<ConstBlockContext, (uint32_t)ColorChannel::NumBlockTypes> context;
     for (size_t i = 0; i < context.size(); ++i) {
@@ -286,11 +288,25 @@ void VP8ComponentEncoder<ArithmeticCoder>::process_row_range(unsigned int thread
         if (cur_row.luma_y < min_y) {
             continue;
         }
+        if (Cancellation::requested()) {
+            return CODING_ERROR;
+        }
+        TraceHarness::Span row_span(thread_id, TraceHarness::ROW_ENCODE,
+                                    cur_row.component, cur_row.curr_y);
         context[cur_row.component]
             = image_data.at(cur_row.component)->off_y(cur_row.curr_y,
                                                       num_nonzeros->at(cur_row.component).begin());
         // DEBUG only fprintf(stderr, "Thread %d min_y %d - max_y %d cmp[%d] y = %d\n", thread_id, min_y, max_y, (int)component, curr_y);
         int block_width = image_data.at(cur_row.component)->block_width();
+        TimingHarness::count_blocks(block_width);
+#ifndef USE_SCALAR
+        if (!is_top_row[cur_row.component]) {
+            ProbabilityTablesBase::compute_row_lak_above(cur_row.component,
+                                                         context[cur_row.component].above,
+                                                         context[cur_row.component].num_nonzeros_above,
+                                                         block_width);
+        }
+#endif
         if (is_top_row[cur_row.component]) {
             is_top_row[cur_row.component] = false;
             switch((BlockType)cur_row.component) {
@@ -441,7 +457,8 @@ void VP8ComponentEncoder<ArithmeticCoder>::process_row_range(unsigned int thread
         custom_exit(ExitCode::ASSERTION_FAILURE);
     }
     bool_encoder->finish(*stream);
-    TimingHarness::timing[thread_id][TimingHarness::TS_ARITH_FINISHED] = TimingHarness::get_time_us();
+    TimingHarness::stamp(thread_id, TimingHarness::TS_ARITH_FINISHED);
+    return CODING_DONE;
 }
 
 int load_model_file_fd_output() {
@@ -458,7 +475,7 @@ int load_model_file_fd_output() {
 int model_file_fd = load_model_file_fd_output();
 
 template <class BoolDecoder>
-template<class BoolEncoder> void VP8ComponentEncoder<BoolDecoder>::threaded_encode_inner(const UncompressedComponents * const colldata,
+template<class BoolEncoder> CodingReturnValue VP8ComponentEncoder<BoolDecoder>::threaded_encode_inner(const UncompressedComponents * const colldata,
                                                                                IOUtil::FileWriter *str_out,
                                                                                const ThreadHandoff * selected_splits,
                                                                                unsigned int num_selected_splits,
@@ -488,7 +505,7 @@ template<class BoolEncoder> void VP8ComponentEncoder<BoolDecoder>::threaded_enco
             this->spin_workers_[thread_id - 1].activate_work();
         }
     }
-    process_row_range(0,
+    CodingReturnValue retval = process_row_range(0,
                           colldata,
                       selected_splits[0].luma_y_start,
                       selected_splits[0].luma_y_end,
@@ -496,8 +513,8 @@ template<class BoolEncoder> void VP8ComponentEncoder<BoolDecoder>::threaded_enco
                       &bool_encoder[0],
                       &num_nonzeros[0]);
     if(!this->do_threading()) { // single threading
-        for (unsigned int thread_id = 1; thread_id < NUM_THREADS; ++thread_id) {
-            process_row_range(thread_id,
+        for (unsigned int thread_id = 1; thread_id < NUM_THREADS && retval == CODING_DONE; ++thread_id) {
+            retval = process_row_range(thread_id,
                               colldata,
                               selected_splits[thread_id].luma_y_start,
                               selected_splits[thread_id].luma_y_end,
@@ -511,11 +528,18 @@ template<class BoolEncoder> void VP8ComponentEncoder<BoolDecoder>::threaded_enco
     
     if (this->do_threading()) {
         for (unsigned int thread_id = 1; thread_id < NUM_THREADS; ++thread_id) {
-            TimingHarness::timing[thread_id][TimingHarness::TS_THREAD_WAIT_STARTED] = TimingHarness::get_time_us();
+            TimingHarness::stamp(thread_id, TimingHarness::TS_THREAD_WAIT_STARTED);
+            TraceHarness::Span wait_span(TraceHarness::MAIN_LANE, TraceHarness::THREAD_WAIT, thread_id);
             this->spin_workers_[thread_id - 1].main_wait_for_done();
-            TimingHarness::timing[thread_id][TimingHarness::TS_THREAD_WAIT_FINISHED] = TimingHarness::get_time_us();
+            TimingHarness::stamp(thread_id, TimingHarness::TS_THREAD_WAIT_FINISHED);
+        }
+        // the workers' own results are dropped by their std::function; they
+        // only stop short when the request was cancelled
+        if (Cancellation::requested()) {
+            retval = CODING_ERROR;
         }
     }
+    return retval;
 }
 
 template<class BoolDecoder>
@@ -551,30 +575,35 @@ CodingReturnValue VP8ComponentEncoder<BoolDecoder>::vp8_full_encoder(const Uncom
     if (use_ans_encoder) {
 #ifdef ENABLE_ANS_EXPERIMENTAL
         ANSBoolWriter bool_encoder[MAX_NUM_THREADS];
-        this->threaded_encode_inner(colldata,
-                                    str_out,
-                                    selected_splits,
-                                    num_selected_splits,
-                                    bool_encoder,
-                                    stream);
+        if (this->threaded_encode_inner(colldata,
+                                        str_out,
+                                        selected_splits,
+                                        num_selected_splits,
+                                        bool_encoder,
+                                        stream) != CODING_DONE) {
+            return CODING_ERROR;
+        }
 #else
         always_assert(false && "Need to enable ANS compile flag to include ANS");
 #endif
     } else {
     
         VPXBoolWriter bool_encoder[MAX_NUM_THREADS];
-        this->threaded_encode_inner(colldata,
-                                    str_out,
-                                    selected_splits,
-                                    num_selected_splits,
-                                    bool_encoder,
-                                    stream);
+        if (this->threaded_encode_inner(colldata,
+                                        str_out,
+                                        selected_splits,
+                                        num_selected_splits,
+                                        bool_encoder,
+                                        stream) != CODING_DONE) {
+            return CODING_ERROR;
+        }
     }
-    TimingHarness::timing[0][TimingHarness::TS_STREAM_MULTIPLEX_STARTED] = TimingHarness::get_time_us();
+    TimingHarness::stamp(0, TimingHarness::TS_STREAM_MULTIPLEX_STARTED);
 
     Sirikata::MuxWriter mux_writer(str_out, JpegAllocator<uint8_t>(), ujgversion);
     size_t stream_data_offset[MuxReader::MAX_STREAM_ID] = {0};
     bool any_written = true;
+    TraceHarness::Span mux_span(TraceHarness::MAIN_LANE, TraceHarness::MUX_WRITE);
     while (any_written) {
         any_written = false;
         for (int i = 0; i < MuxReader::MAX_STREAM_ID; ++i) {
@@ -594,8 +623,8 @@ CodingReturnValue VP8ComponentEncoder<BoolDecoder>::vp8_full_encoder(const Uncom
     mux_writer.Close();
     write_byte_bill(Billing::DELIMITERS, true, mux_writer.getOverhead());
     // we can probably exit(0) here
-    TimingHarness::timing[0][TimingHarness::TS_STREAM_MULTIPLEX_FINISHED] =
-        TimingHarness::timing[0][TimingHarness::TS_STREAM_FLUSH_STARTED] = TimingHarness::get_time_us();
+    TimingHarness::stamp(0, TimingHarness::TS_STREAM_MULTIPLEX_FINISHED);
+    TimingHarness::stamp(0, TimingHarness::TS_STREAM_FLUSH_STARTED);
     check_decompression_memory_bound_ok(); // this has to happen before last
     // bytes are written
     /* possibly write out new probability model */
@@ -627,7 +656,7 @@ CodingReturnValue VP8ComponentEncoder<BoolDecoder>::vp8_full_encoder(const Uncom
         fclose(fp);
     }
 #endif
-    TimingHarness::timing[0][TimingHarness::TS_STREAM_FLUSH_FINISHED] = TimingHarness::get_time_us();
+    TimingHarness::stamp(0, TimingHarness::TS_STREAM_FLUSH_FINISHED);
     return CODING_DONE;
 }
 template class VP8ComponentEncoder<VPXBoolReader>;
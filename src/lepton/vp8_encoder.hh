@@ -7,6 +7,9 @@
 #include "../io/MuxReader.hh"
 #include "lepton_codec.hh"
 
+// rough number of bits it takes to code a block
+uint32_t aligned_block_cost(const AlignedBlock &block);
+
 template<class BoolDecoder> class VP8ComponentEncoder : protected LeptonCodec<BoolDecoder>, public BaseEncoder {
     template<class Left, class Middle, class Right, class BoolEncoder>
     static void process_row(ProbabilityTablesBase&pt,
@@ -18,7 +21,8 @@ template<class BoolDecoder> class VP8ComponentEncoder : protected LeptonCodec<Bo
                          Sirikata::Array1d<ConstBlockContext,
                                            (uint32_t)ColorChannel::NumBlockTypes> &context,
                          BoolEncoder &bool_encoder);
-    template <class BoolEncoder> void process_row_range(unsigned int thread_id,
+    // CODING_ERROR if the request was cancelled before every row was coded
+    template <class BoolEncoder> CodingReturnValue process_row_range(unsigned int thread_id,
                            const UncompressedComponents * const colldata,
                            int min_y,
                            int max_y,
@@ -27,7 +31,7 @@ template<class BoolDecoder> class VP8ComponentEncoder : protected LeptonCodec<Bo
                            Sirikata::Array1d<std::vector<NeighborSummary>,
                                              (uint32_t)ColorChannel::NumBlockTypes> *num_nonzeros);
     bool mUseAnsEncoder;
-    template<class BoolEncoder> void threaded_encode_inner(const UncompressedComponents * const colldata,
+    template<class BoolEncoder> CodingReturnValue threaded_encode_inner(const UncompressedComponents * const colldata,
                                                            IOUtil::FileWriter *str_out,
                                                            const ThreadHandoff * selected_splits,
                                                            unsigned int num_selected_splits,
@@ -39,6 +43,16 @@ public:
     void registerWorkers(GenericWorker * workers, unsigned int num_workers) {
         this->LeptonCodec<BoolDecoder>::registerWorkers(workers, num_workers);
     }
+    unsigned int getNumWorkers() const {
+        return this->num_registered_workers_;
+    }
+    GenericWorker *getWorker(unsigned int i) {
+        always_assert(i < this->num_registered_workers_);
+        return &this->spin_workers_[i];
+    }
+    void prewarm_thread_models() {
+        this->LeptonCodec<BoolDecoder>::prewarm_thread_models();
+    }
     bool do_threading() const {
         return this->do_threading_;
     }
@@ -5,6 +5,7 @@
 #include "../model/numeric.hh"
 #include "boolreader.hh"
 #include "../../ans/rans64.hh"
+#include "../util/cache_sim.hh"
 class ANSBoolReader {
     Rans64State r0;
     Rans64State r1;
@@ -75,6 +76,7 @@ public:
     __attribute__((always_inline))
 #endif
     bool get(Branch &branch, Billing bill=Billing::RESERVED) {
+        cache_sim_touch(&branch, sizeof(branch));
         Rans64State local_state = r0;
         r0 = r1;
         uint32_t cumulative_freq = Rans64DecGet(&local_state, 8);
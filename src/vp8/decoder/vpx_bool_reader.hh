@@ -1,4 +1,5 @@
 #include "boolreader.hh"
+#include "../util/cache_sim.hh"
 
 
 class VPXBoolReader
@@ -51,6 +52,7 @@ public:
 	       count++;
         }
 #endif
+        cache_sim_touch(&branch, sizeof(branch));
         bool retval = vpx_read(&bit_reader, branch.prob(), bill);
         branch.record_obs_and_update(retval);
         return retval;
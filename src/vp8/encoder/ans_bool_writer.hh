@@ -5,6 +5,7 @@
 #include "../util/options.hh"
 #include "../../ans/rans64.hh"
 #include "../model/branch.hh"
+#include "../util/cache_sim.hh"
 struct Symbol {
     bool val;
     Probability prob;
@@ -45,6 +46,7 @@ class ANSBoolWriter
         
     }
     void put( const bool value, Branch & branch, Billing bill) {
+        cache_sim_touch(&branch, sizeof(branch));
         Symbol sym;
         Probability prob =  branch.prob();
         always_assert(prob);
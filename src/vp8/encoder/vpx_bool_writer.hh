@@ -1,6 +1,7 @@
 #include "../util/options.hh"
 #include "boolwriter.hh"
 #include "../../io/MuxReader.hh"
+#include "../util/cache_sim.hh"
 class VPXBoolWriter
 {
 private:
@@ -49,6 +50,7 @@ public:
 	       ++count;
         }
 #endif
+        cache_sim_touch(&branch, sizeof(branch));
         vpx_write(&boolwriter, value, branch.prob(), bill);
         if (__builtin_expect(boolwriter.pos & SIZE_CHECK, false)) {
             // check if we're out of buffer space
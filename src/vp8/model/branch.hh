@@ -11,35 +11,53 @@ typedef uint8_t Probability;
 class Branch
 {
 private:
+  // Both fields are stored biased so that the identity branch (counts 1,1 and
+  // probability 128) is all zero bytes: counts_ hold count - 1 and
+  // probability_ holds probability ^ 128. Zeroed memory is a fresh model.
   uint8_t counts_[2];
   Probability probability_;
   friend class JpegBoolDecoder;
   friend class JpegBoolEncoder;
 public:
-    static Branch update_lookup[256][256][2];
-  Probability prob() const { return probability_; }
+    // the branch after each observation, indexed by the stored counts;
+    // generated at compile time so it lives in a read-only section
+    static const Branch update_lookup[256][256][2];
+    static constexpr Branch updated_value(unsigned int false_biased, unsigned int true_biased, bool obs) {
+        // mirrors record_obs_and_update, including the 8 bit wrap of a count of 0xff
+        return (obs ? true_biased : false_biased) != 0xfe
+            ? biased_value(obs ? false_biased : (false_biased + 1) & 0xff,
+                           obs ? (true_biased + 1) & 0xff : true_biased,
+                           false_biased + true_biased + 3)
+            : (obs ? false_biased : true_biased) == 0
+            ? Branch(obs ? 0 : 0xfe, obs ? 0xfe : 0, (obs ? 0 : 255) ^ 128)
+            : biased_value(obs ? ((false_biased + 2) >> 1) - 1 : 128,
+                           obs ? 128 : ((true_biased + 2) >> 1) - 1,
+                           (obs ? ((false_biased + 2) >> 1) - 1 : 128)
+                           + (obs ? 128 : ((true_biased + 2) >> 1) - 1) + 2);
+    }
+  Probability prob() const { return probability_ ^ 128; }
     static Branch set_particular_value(int false_count, int true_count) {
         Branch retval;
-        retval.counts_[0] = false_count;
-        retval.counts_[1] = true_count;
-        retval.probability_ = retval.optimize(false_count + true_count + 1);
+        retval.counts_[0] = false_count - 1;
+        retval.counts_[1] = true_count - 1;
+        retval.probability_ = retval.optimize(false_count + true_count + 1) ^ 128;
         return retval;
     }
   void set_identity() {
-    counts_[0] = 1;
-    counts_[1] = 1;
-    probability_ = 128;
+    counts_[0] = 0;
+    counts_[1] = 0;
+    probability_ = 0;
   }
   bool is_identity() const {
-    return counts_[0] == 1 && counts_[1] == 1 && probability_ == 128;
+    return counts_[0] == 0 && counts_[1] == 0 && probability_ == 0;
   }
   static Branch identity() {
     Branch retval;
     retval.set_identity();
     return retval;
   }
-  uint32_t true_count() const { return counts_[1]; }
-  uint32_t false_count() const { return counts_[0]; }
+  uint32_t true_count() const { return counts_[1] + 1; }
+  uint32_t false_count() const { return counts_[0] + 1; }
     struct ProbUpdate {
         struct ProbOutcome {
             uint8_t log_prob;
@@ -67,40 +85,40 @@ public:
         probability_ = optimize(counts_[0] + counts_[1]) | 1;
       */
       unsigned int val = counts_[obs]++;
-      if (__builtin_expect(val == 0xff, 0)) {
+      if (__builtin_expect(val == 0xfe, 0)) {
           unsigned int other_in = counts_[!obs];
-          unsigned int other = (other_in + 1) >> 1;
-          counts_[obs] = 129;
+          unsigned int other = other_in >> 1;
+          counts_[obs] = 128;
           counts_[!obs] = other;
       }
-      probability_ = optimize(counts_[0] + counts_[1]) | 1;        
+      probability_ = (optimize(counts_[0] + counts_[1] + 2) | 1) ^ 128;
   }
   void tbl_record_obs_and_update(bool obs) {
       *this = update_lookup[counts_[0]][counts_[1]][(int)obs];
       this->probability_ |= 1;
   }
     void record_obs_and_update(bool obs) {
-        unsigned int fcount = counts_[0];
-        unsigned int tcount = counts_[1];
-        bool overflow = (counts_[obs]++ == 0xff);
+        unsigned int fcount = counts_[0] + 1;
+        unsigned int tcount = counts_[1] + 1;
+        bool overflow = (counts_[obs]++ == 0xfe);
         if (__builtin_expect(overflow, 0)) { // check less than 512
-            bool neverseen = counts_[!obs] == 1;
+            bool neverseen = counts_[!obs] == 0;
             if (neverseen) {
-                counts_[obs] = 0xff;
-                probability_ = obs ? 0 : 255;
+                counts_[obs] = 0xfe;
+                probability_ = (obs ? 0 : 255) ^ 128;
             } else {
-                counts_[0] = ((1 + (unsigned int)fcount) >> 1);
-                counts_[1] = ((1 + (unsigned int)tcount) >> 1);
-                counts_[obs] = 129;
-                probability_ = optimize(counts_[0] + counts_[1]);
+                counts_[0] = ((1 + fcount) >> 1) - 1;
+                counts_[1] = ((1 + tcount) >> 1) - 1;
+                counts_[obs] = 128;
+                probability_ = optimize(counts_[0] + counts_[1] + 2) ^ 128;
             }
         } else {
-            probability_ = optimize(fcount + tcount + 1);
+            probability_ = optimize(fcount + tcount + 1) ^ 128;
         }
     }
     void normalize() {
-      counts_[0] = ((1 + (unsigned int)counts_[0]) >> 1);
-      counts_[1] = ((1 + (unsigned int)counts_[1]) >> 1);
+      counts_[0] = counts_[0] >> 1;
+      counts_[1] = counts_[1] >> 1;
   }
 #ifndef _WIN32
   __attribute__((always_inline))
@@ -125,5 +143,12 @@ public:
   }
 
   Branch(){}
+private:
+  constexpr Branch(unsigned int false_biased, unsigned int true_biased, unsigned int probability)
+      : counts_{(uint8_t)false_biased, (uint8_t)true_biased}, probability_((Probability)probability) {}
+  static constexpr Branch biased_value(unsigned int false_biased, unsigned int true_biased, unsigned int sum) {
+      return Branch(false_biased, true_biased,
+                    fast_divide18bit_by_10bit((false_biased + 1) << 8, sum) ^ 128);
+  }
 };
 #endif
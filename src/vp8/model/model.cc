@@ -9,7 +9,10 @@
 #include <iostream>
 
 #ifndef USE_SCALAR
-#include <emmintrin.h>
+#include <smmintrin.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #endif
 
 #include "model.hh"
@@ -22,84 +25,8 @@ bool all_branches_identity(const Branch * start, const Branch * end) {
     return true;
 }
 void set_branch_range_identity(Branch * start, Branch * end) {
-    if (__builtin_expect(end - start <= 64, 0)) {
-        for (;start != end; ++start) {
-            start->set_identity();
-        }
-        return;
-    }
-#if defined(__AVX__) && !defined(USE_SCALAR)
-    for (int i = 0;i < 32; ++i) {
-        start[i].set_identity();
-    }
-    for (int i = 1; i <= 32; ++i) {
-        end[-i].set_identity();
-    }
-    char * data = (char *)(void*)start;
-    __m256i r0 = _mm256_loadu_si256((const __m256i*)data);
-    __m256i r1 = _mm256_loadu_si256((const __m256i*)(data + 32));
-    __m256i r2 = _mm256_loadu_si256((const __m256i*)(data + 64));
-    size_t offset = data - (char*)0;
-    size_t align = 32 - (offset % 32);
-    char * dataend = (char*)end;
-    size_t offsetend = dataend - (char*)0;
-    __m256i *write_end = (__m256i*)(dataend - (offsetend % 32));
-    __m256i *write_cursor = (__m256i*)(data + align);
-    switch(align % 3) {
-        case 2:
-            _mm256_store_si256(write_cursor, r1);
-            write_cursor += 1;
-        case 1:
-            _mm256_store_si256(write_cursor, r2);
-            write_cursor += 1;
-        case 0:
-            break;
-    }
-    while(write_cursor + 2 < write_end) {
-        _mm256_store_si256(write_cursor, r0);
-        _mm256_store_si256(write_cursor + 1, r1);
-        _mm256_store_si256(write_cursor + 2, r2);
-        write_cursor += 3;
-    }
-
-#elif defined(__SSE2__) && !defined(USE_SCALAR)
-    for (int i = 0;i < 16; ++i) {
-        start[i].set_identity();
-    }
-    for (int i = 1; i <= 16; ++i) {
-        end[-i].set_identity();
-    }
-    char * data = (char *)(void*)start;
-    __m128i r0 = _mm_loadu_si128((const __m128i*)data);
-    __m128i r1 = _mm_loadu_si128((const __m128i*)(data + 16));
-    __m128i r2 = _mm_loadu_si128((const __m128i*)(data + 32));
-    size_t offset = data - (char*)0;
-    size_t align = 16 - (offset % 16);
-    char * dataend = (char*)end;
-    size_t offsetend = dataend - (char*)0;
-    __m128i *write_end = (__m128i*)(dataend - (offsetend % 16));
-    __m128i *write_cursor = (__m128i*)(data + align);
-    switch(align % 3) {
-        case 1:
-            _mm_store_si128(write_cursor, r1);
-            write_cursor += 1;
-        case 2:
-            _mm_store_si128(write_cursor, r2);
-            write_cursor += 1;
-        case 0:
-            break;
-    }
-    while(write_cursor + 2 < write_end) {
-        _mm_store_si128(write_cursor, r0);
-        _mm_store_si128(write_cursor + 1, r1);
-        _mm_store_si128(write_cursor + 2, r2);
-        write_cursor += 3;
-    }
-#else
-    for (;start != end; ++start) {
-        start->set_identity();
-    }
-#endif
+    // the identity branch is encoded as all zero bytes
+    memset((void*)start, 0, (end - start) * sizeof(Branch));
     dev_assert(all_branches_identity(start, end));
 }
 
@@ -121,6 +48,14 @@ __attribute__((aligned(16)))
 #endif
   = {{0}};
 #ifdef _WIN32
+__declspec(align(32))
+#endif
+int32_t ProbabilityTablesBase::icos_idct_edge_8192_dequantized_x_rows_[(int)ColorChannel::NumBlockTypes][64]
+#ifndef _WIN32
+__attribute__((aligned(32)))
+#endif
+  = {{0}};
+#ifdef _WIN32
 __declspec(align(16))
 #endif
 int32_t ProbabilityTablesBase::icos_idct_linear_8192_dequantized_[(int)ColorChannel::NumBlockTypes][64]
@@ -128,6 +63,52 @@ int32_t ProbabilityTablesBase::icos_idct_linear_8192_dequantized_[(int)ColorChan
 __attribute__((aligned(16)))
 #endif
    = {{0}};
+
+#ifndef USE_SCALAR
+#define RASTER_ROW(block, row) _mm_set_epi16((block).coefficients_raster((row) * 8 + 7), \
+                                             (block).coefficients_raster((row) * 8 + 6), \
+                                             (block).coefficients_raster((row) * 8 + 5), \
+                                             (block).coefficients_raster((row) * 8 + 4), \
+                                             (block).coefficients_raster((row) * 8 + 3), \
+                                             (block).coefficients_raster((row) * 8 + 2), \
+                                             (block).coefficients_raster((row) * 8 + 1), \
+                                             (block).coefficients_raster((row) * 8))
+void ProbabilityTablesBase::compute_row_lak_above(int color,
+                                                  const AlignedBlock *row,
+                                                  std::vector<NeighborSummary>::iterator summary,
+                                                  int block_width) {
+    // every band at once: lane b accumulates row i of the block times the
+    // signed idct weight of row i for column b
+    const int32_t *weights = icos_idct_edge_8192_dequantized_x_rows_[color];
+    for (int x = 0; x < block_width; ++x, ++summary) {
+        const AlignedBlock &block = row[x];
+#if defined(__AVX2__)
+        __m256i sum = _mm256_setzero_si256();
+        for (int i = 0; i < 8; ++i) {
+            __m256i coef = _mm256_cvtepi16_epi32(RASTER_ROW(block, i));
+            __m256i weight = _mm256_load_si256((const __m256i*)(const char*)(weights + i * 8));
+            sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(coef, weight));
+        }
+        _mm256_storeu_si256((__m256i*)(char*)summary->horizontal_lak_above_, sum);
+#else
+        __m128i sum_low = _mm_setzero_si128();
+        __m128i sum_high = _mm_setzero_si128();
+        for (int i = 0; i < 8; ++i) {
+            __m128i coef = RASTER_ROW(block, i);
+            __m128i coef_low = _mm_cvtepi16_epi32(coef);
+            __m128i coef_high = _mm_cvtepi16_epi32(_mm_srli_si128(coef, 8));
+            __m128i weight_low = _mm_load_si128((const __m128i*)(const char*)(weights + i * 8));
+            __m128i weight_high = _mm_load_si128((const __m128i*)(const char*)(weights + i * 8 + 4));
+            sum_low = _mm_add_epi32(sum_low, _mm_mullo_epi32(coef_low, weight_low));
+            sum_high = _mm_add_epi32(sum_high, _mm_mullo_epi32(coef_high, weight_high));
+        }
+        _mm_storeu_si128((__m128i*)(char*)summary->horizontal_lak_above_, sum_low);
+        _mm_storeu_si128((__m128i*)(char*)(summary->horizontal_lak_above_ + 4), sum_high);
+#endif
+    }
+}
+#undef RASTER_ROW
+#endif
 #ifdef ANNOTATION_ENABLED
 Context *gctx = (Context*)memset(calloc(sizeof(Context),1), 0xff, sizeof(Context));
 #endif
@@ -198,9 +198,13 @@ void load_model(Model &model, const char* filename);
 #ifdef _WIN32
 #define WINALIGN16 __declspec(align(16))
 #define UNIXALIGN16
+#define WINALIGN32 __declspec(align(32))
+#define UNIXALIGN32
 #else
 #define WINALIGN16
 #define UNIXALIGN16 __attribute__((aligned(16)))
+#define WINALIGN32
+#define UNIXALIGN32 __attribute__((aligned(32)))
 #endif
 extern volatile int volatile1024;
 class ProbabilityTablesBase {
@@ -210,6 +214,10 @@ protected:
     static WINALIGN16 int32_t icos_idct_edge_8192_dequantized_x_[(int)ColorChannel::NumBlockTypes][64] UNIXALIGN16;
     
     static WINALIGN16 int32_t icos_idct_edge_8192_dequantized_y_[(int)ColorChannel::NumBlockTypes][64] UNIXALIGN16;
+
+    // icos_idct_edge_8192_dequantized_x_ transposed to [row][band], with the
+    // alternating sign of the lakhani prediction folded in
+    static WINALIGN32 int32_t icos_idct_edge_8192_dequantized_x_rows_[(int)ColorChannel::NumBlockTypes][64] UNIXALIGN32;
     
     static WINALIGN16 int32_t icos_idct_linear_8192_dequantized_[(int)ColorChannel::NumBlockTypes][64] UNIXALIGN16;
 
@@ -249,6 +257,8 @@ public:
                 icos_idct_linear_8192_dequantized((int)color)[pixel_row * 8 + i] = icos_idct_linear_8192_scaled[pixel_row * 8 + i] * quantization_table_[(int)color][i];
                 icos_idct_edge_8192_dequantized_x((int)color)[pixel_row * 8 + i] = icos_base_8192_scaled[i * 8] * quantization_table_[(int)color][i * 8 + pixel_row];
                 icos_idct_edge_8192_dequantized_y((int)color)[pixel_row * 8 + i] = icos_base_8192_scaled[i * 8] * quantization_table_[(int)color][pixel_row * 8 + i];
+                icos_idct_edge_8192_dequantized_x_rows_[(int)color][i * 8 + pixel_row]
+                    = ((i & 1) ? -1 : 1) * icos_idct_edge_8192_dequantized_x((int)color)[pixel_row * 8 + i];
             }
             if (filetype != LEPTON && icos_idct_edge_8192_dequantized_x((int)color)[pixel_row * 8] == 0) {
                 custom_exit(ExitCode::UNSUPPORTED_JPEG_WITH_ZERO_IDCT_0);
@@ -293,6 +303,15 @@ public:
     static int32_t *icos_idct_linear_8192_dequantized(int color) {
         return icos_idct_linear_8192_dequantized_[(int)color];
     }
+#ifndef USE_SCALAR
+    // Computes, for every block of a finished row, the part of
+    // compute_lak_horizontal that only depends on the block above, so that
+    // coding the row below only has to combine it with its own coefficients.
+    static void compute_row_lak_above(int color,
+                                      const AlignedBlock *row,
+                                      std::vector<NeighborSummary>::iterator summary,
+                                      int block_width);
+#endif
     struct CoefficientContext {
         int best_prior; //lakhani or aavrg depending on coefficient number
         uint8_t num_nonzeros_bin; // num_nonzeros mapped into a bin
@@ -953,6 +972,28 @@ public:
         return prediction / icos_deq[0];
     }
 
+    // compute_lak_vec where the neighbor's half of the sum was precomputed by
+    // compute_row_lak_above
+    static int32_t compute_lak_vec_above(__m128i coeffs_x_low, __m128i coeffs_x_high,
+                                         int32_t above_sum, const int32_t *icos_deq) {
+        __m128i icos_low = _mm_load_si128((const __m128i*)(const char*)icos_deq);
+        __m128i icos_high = _mm_load_si128((const __m128i*)(const char*)(icos_deq + 4));
+        __m128i deq_low = _mm_mullo_epi32(coeffs_x_low, icos_low);
+        __m128i deq_high = _mm_mullo_epi32(coeffs_x_high, icos_high);
+
+        __m128i sum = _mm_add_epi32(deq_low, deq_high);
+        sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 8));
+        sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 4));
+        // same as compute_lak_vec: the int32 sums wrap identically in either order
+        int32_t prediction = above_sum - _mm_cvtsi128_si32(sum);
+        return prediction / icos_deq[0];
+    }
+#define ITER_HERE(x_var, i, step) \
+        (x_var = _mm_set_epi32(   context.here().coefficients_raster(band + step * ((i) + 3)), \
+                                  context.here().coefficients_raster(band + step * ((i) + 2)), \
+                                  context.here().coefficients_raster(band + step * ((i) + 1)), \
+                                  i == 0 ? 0 : context.here().coefficients_raster(band + step * (i))))
+
 #define ITER(x_var, a_var, i, step) \
         (x_var = _mm_set_epi32(   context.here().coefficients_raster(band + step * ((i) + 3)), \
                                   context.here().coefficients_raster(band + step * ((i) + 2)), \
@@ -978,10 +1019,12 @@ public:
             if(all_present == false && !above_present) {
                 return 0;
             }
-            const auto &neighbor = context.above_unchecked();
-            ITER(coeffs_x_low, coeffs_a_low, 0, 8);
-            ITER(coeffs_x_high, coeffs_a_high, 4, 8);
+            ITER_HERE(coeffs_x_low, 0, 8);
+            ITER_HERE(coeffs_x_high, 4, 8);
             icos = ProbabilityTablesBase::icos_idct_edge_8192_dequantized_x((int)COLOR) + band * 8;
+            return compute_lak_vec_above(coeffs_x_low, coeffs_x_high,
+                                         context.neighbor_context_above_unchecked().horizontal_lak_above(band),
+                                         icos);
         } else {
             if (all_present == false && !left_present) {
                 return 0;
@@ -999,14 +1042,13 @@ public:
         }
         __m128i coeffs_x_low;
         __m128i coeffs_x_high;
-        __m128i coeffs_a_low;
-        __m128i coeffs_a_high;
         dev_assert(band/8 == 0 && "this function only works for the top edge");
-        const auto &neighbor = context.above_unchecked();
-        ITER(coeffs_x_low, coeffs_a_low, 0, 8);
-        ITER(coeffs_x_high, coeffs_a_high, 4, 8);
+        ITER_HERE(coeffs_x_low, 0, 8);
+        ITER_HERE(coeffs_x_high, 4, 8);
         const int32_t * icos = ProbabilityTablesBase::icos_idct_edge_8192_dequantized_x((int)COLOR) + band * 8;
-        return compute_lak_vec(coeffs_x_low, coeffs_x_high, coeffs_a_low, coeffs_a_high, icos);
+        return compute_lak_vec_above(coeffs_x_low, coeffs_x_high,
+                                     context.neighbor_context_above_unchecked().horizontal_lak_above(band),
+                                     icos);
     }
     int32_t compute_lak_vertical(const ConstBlockContext&context, unsigned int band) {
         dev_assert((band & 7) == 0 && "Must be used for veritcal");
@@ -1021,6 +1063,7 @@ public:
         ITER(coeffs_x_low, coeffs_a_low, 0, 1);
         ITER(coeffs_x_high, coeffs_a_high, 4, 1);
 #undef ITER
+#undef ITER_HERE
         const int32_t *icos = ProbabilityTablesBase::icos_idct_edge_8192_dequantized_y((int)COLOR) + band;
         return compute_lak_vec(coeffs_x_low, coeffs_x_high, coeffs_a_low, coeffs_a_high,
                         icos);
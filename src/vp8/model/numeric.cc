@@ -1,17 +1,43 @@
 #include "numeric.hh"
 #include "branch.hh"
 
-Branch Branch::update_lookup[256][256][2];
-int do_set_update_lookup() {
-    for (int i = 0;i < 256; ++i) {
-        for (int j= 0;j< 256;++j) {
-            for (int obs = 0; obs < 2; ++obs) {
-                Branch cur = Branch::set_particular_value(i,j);
-                cur.record_obs_and_update(obs ? true : false);
-                Branch::update_lookup[i][j][obs] = cur;
-            }
-        }
-    }
-    return 1;
-}
-int set_update_lookup = do_set_update_lookup();
+// indexed by the stored (biased) counts, so entry [i][j] holds counts i+1, j+1
+#define UPDATE_LOOKUP_PAIR(I, J) {Branch::updated_value(I, J, false), Branch::updated_value(I, J, true)}
+#define UPDATE_LOOKUP_PAIRS16(I, J) \
+    UPDATE_LOOKUP_PAIR(I, J + 0), UPDATE_LOOKUP_PAIR(I, J + 1), \
+    UPDATE_LOOKUP_PAIR(I, J + 2), UPDATE_LOOKUP_PAIR(I, J + 3), \
+    UPDATE_LOOKUP_PAIR(I, J + 4), UPDATE_LOOKUP_PAIR(I, J + 5), \
+    UPDATE_LOOKUP_PAIR(I, J + 6), UPDATE_LOOKUP_PAIR(I, J + 7), \
+    UPDATE_LOOKUP_PAIR(I, J + 8), UPDATE_LOOKUP_PAIR(I, J + 9), \
+    UPDATE_LOOKUP_PAIR(I, J + 10), UPDATE_LOOKUP_PAIR(I, J + 11), \
+    UPDATE_LOOKUP_PAIR(I, J + 12), UPDATE_LOOKUP_PAIR(I, J + 13), \
+    UPDATE_LOOKUP_PAIR(I, J + 14), UPDATE_LOOKUP_PAIR(I, J + 15)
+#define UPDATE_LOOKUP_ROW(I) { \
+    UPDATE_LOOKUP_PAIRS16(I, 0x00), UPDATE_LOOKUP_PAIRS16(I, 0x10), \
+    UPDATE_LOOKUP_PAIRS16(I, 0x20), UPDATE_LOOKUP_PAIRS16(I, 0x30), \
+    UPDATE_LOOKUP_PAIRS16(I, 0x40), UPDATE_LOOKUP_PAIRS16(I, 0x50), \
+    UPDATE_LOOKUP_PAIRS16(I, 0x60), UPDATE_LOOKUP_PAIRS16(I, 0x70), \
+    UPDATE_LOOKUP_PAIRS16(I, 0x80), UPDATE_LOOKUP_PAIRS16(I, 0x90), \
+    UPDATE_LOOKUP_PAIRS16(I, 0xa0), UPDATE_LOOKUP_PAIRS16(I, 0xb0), \
+    UPDATE_LOOKUP_PAIRS16(I, 0xc0), UPDATE_LOOKUP_PAIRS16(I, 0xd0), \
+    UPDATE_LOOKUP_PAIRS16(I, 0xe0), UPDATE_LOOKUP_PAIRS16(I, 0xf0)}
+#define UPDATE_LOOKUP_ROWS16(I) \
+    UPDATE_LOOKUP_ROW(I + 0), UPDATE_LOOKUP_ROW(I + 1), \
+    UPDATE_LOOKUP_ROW(I + 2), UPDATE_LOOKUP_ROW(I + 3), \
+    UPDATE_LOOKUP_ROW(I + 4), UPDATE_LOOKUP_ROW(I + 5), \
+    UPDATE_LOOKUP_ROW(I + 6), UPDATE_LOOKUP_ROW(I + 7), \
+    UPDATE_LOOKUP_ROW(I + 8), UPDATE_LOOKUP_ROW(I + 9), \
+    UPDATE_LOOKUP_ROW(I + 10), UPDATE_LOOKUP_ROW(I + 11), \
+    UPDATE_LOOKUP_ROW(I + 12), UPDATE_LOOKUP_ROW(I + 13), \
+    UPDATE_LOOKUP_ROW(I + 14), UPDATE_LOOKUP_ROW(I + 15)
+
+const Branch Branch::update_lookup[256][256][2] = {
+    UPDATE_LOOKUP_ROWS16(0x00), UPDATE_LOOKUP_ROWS16(0x10),
+    UPDATE_LOOKUP_ROWS16(0x20), UPDATE_LOOKUP_ROWS16(0x30),
+    UPDATE_LOOKUP_ROWS16(0x40), UPDATE_LOOKUP_ROWS16(0x50),
+    UPDATE_LOOKUP_ROWS16(0x60), UPDATE_LOOKUP_ROWS16(0x70),
+    UPDATE_LOOKUP_ROWS16(0x80), UPDATE_LOOKUP_ROWS16(0x90),
+    UPDATE_LOOKUP_ROWS16(0xa0), UPDATE_LOOKUP_ROWS16(0xb0),
+    UPDATE_LOOKUP_ROWS16(0xc0), UPDATE_LOOKUP_ROWS16(0xd0),
+    UPDATE_LOOKUP_ROWS16(0xe0), UPDATE_LOOKUP_ROWS16(0xf0)
+};
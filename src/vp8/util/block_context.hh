@@ -15,6 +15,9 @@ struct NeighborSummary {
         VERTICAL_LAST_PIXEL_OFFSET_FROM_FIRST_PIXEL = 14
     };
     int16_t edge_pixels[16];
+    // per band, the above-block half of the horizontal edge prediction;
+    // filled for a whole row by ProbabilityTablesBase::compute_row_lak_above
+    int32_t horizontal_lak_above_[8];
     uint8_t num_nonzeros_;
     uint8_t num_nonzeros() const {
         return num_nonzeros_;
@@ -28,6 +31,9 @@ struct NeighborSummary {
     int16_t vertical(int index) const {
         return edge_pixels[index];
     }
+    int32_t horizontal_lak_above(int band) const {
+        return horizontal_lak_above_[band];
+    }
     const int16_t* vertical_ptr_except_7() const {
         return &edge_pixels[0];
     }
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <errno.h>
+#include <atomic>
+#include <algorithm>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "options.hh"
+#include "nd_array.hh"
+#include "cache_sim.hh"
+
+#ifdef ENABLE_CACHE_SIM
+namespace {
+enum {
+    LINE_BITS = 6,
+    L1D_SETS = 64, // 32 KiB, 8 way
+    L1D_WAYS = 8,
+    L2_SETS = 1024, // 512 KiB, 8 way
+    L2_WAYS = 8,
+};
+
+// set associative with true LRU; a tag of 0 is an empty way
+template<uint32_t sets, uint32_t ways> struct SimCache {
+    Sirikata::Array2d<uint64_t, sets, ways> tags;
+    Sirikata::Array2d<uint64_t, sets, ways> last_use;
+    uint64_t clock;
+    // true on a hit; on a miss the least recently used way gets the line
+    bool access(uint64_t line) {
+        uint32_t set = line % sets;
+        uint64_t tag = line + 1;
+        uint32_t victim = 0;
+        ++clock;
+        for (uint32_t way = 0; way < ways; ++way) {
+            if (tags.at(set, way) == tag) {
+                last_use.at(set, way) = clock;
+                return true;
+            }
+            if (last_use.at(set, way) < last_use.at(set, victim)) {
+                victim = way;
+            }
+        }
+        tags.at(set, victim) = tag;
+        last_use.at(set, victim) = clock;
+        return false;
+    }
+};
+
+struct SimCore {
+    SimCache<L1D_SETS, L1D_WAYS> l1d;
+    SimCache<L2_SETS, L2_WAYS> l2;
+    uint64_t accesses;
+    uint64_t l1d_misses;
+    uint64_t l2_misses;
+    void touch_line(uint64_t line) {
+        ++accesses;
+        if (!l1d.access(line)) {
+            ++l1d_misses;
+            if (!l2.access(line)) {
+                ++l2_misses;
+            }
+        }
+    }
+};
+
+// zero initialized, so no thread allocates or makes a syscall to simulate;
+// threads beyond the last core share it, which only blurs its numbers
+Sirikata::Array1d<SimCore, MAX_NUM_THREADS + 1> cores;
+std::atomic<uint32_t> num_cores_used(0);
+#if defined(__APPLE__) || (__cplusplus <= 199711L && !defined(_WIN32))
+__thread SimCore *thread_core = NULL;
+#else
+thread_local SimCore *thread_core = NULL;
+#endif
+}
+
+void cache_sim_touch(const void *address, uint32_t size) {
+    if (thread_core == NULL) {
+        uint32_t index = num_cores_used++;
+        thread_core = &cores[index < cores.size() ? index : cores.size() - 1];
+    }
+    uint64_t first = (uint64_t)(uintptr_t)address >> LINE_BITS;
+    uint64_t last = ((uint64_t)(uintptr_t)address + size - 1) >> LINE_BITS;
+    for (uint64_t line = first; line <= last; ++line) {
+        thread_core->touch_line(line);
+    }
+}
+
+void print_cache_sim(int fd, uint64_t num_blocks) {
+    uint64_t accesses = 0, l1d_misses = 0, l2_misses = 0;
+    for (size_t i = 0; i < cores.size(); ++i) {
+        accesses += cores[i].accesses;
+        l1d_misses += cores[i].l1d_misses;
+        l2_misses += cores[i].l2_misses;
+    }
+    if (num_blocks == 0) {
+        num_blocks = 1;
+    }
+    char line[256];
+    int len = snprintf(line, sizeof(line),
+                       "CACHE_SIM\tmodel line accesses/block %.2f"
+                       "\tL1D misses/block %.3f\tL2 misses/block %.3f\n",
+                       accesses / double(num_blocks),
+                       l1d_misses / double(num_blocks),
+                       l2_misses / double(num_blocks));
+    while (write(fd, line, std::min((size_t)len, sizeof(line) - 1)) < 0 && errno == EINTR) {
+    }
+}
+#else
+void print_cache_sim(int, uint64_t) {
+}
+#endif
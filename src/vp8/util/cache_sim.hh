@@ -0,0 +1,17 @@
+#ifndef CACHE_SIM_HH_
+#define CACHE_SIM_HH_
+#include <stdint.h>
+// Built with -DENABLE_CACHE_SIM, every branch the arithmetic coder reads and
+// updates goes through a model of one core's L1D and L2, so the layout of the
+// probability tables can be compared where no hardware counters are exposed
+// (VMs, containers). Only model accesses are simulated, so real miss counts
+// are higher; each thread gets its own caches, as it would on its own core.
+#ifdef ENABLE_CACHE_SIM
+void cache_sim_touch(const void *address, uint32_t size);
+#else
+inline void cache_sim_touch(const void *, uint32_t) {}
+#endif
+// writes the accesses, L1D and L2 misses per block to fd; nothing without
+// ENABLE_CACHE_SIM
+void print_cache_sim(int fd, uint64_t num_blocks);
+#endif
@@ -0,0 +1,22 @@
+#ifndef CANCELLATION_HH_
+#define CANCELLATION_HH_
+#include <atomic>
+#include "memory.hh"
+
+// Lets a request be stopped while its threads are coding. The encode,
+// decode, recode and pixel loops poll the flag once per row and return
+// early, so every thread of an expired request gives up its core within a
+// row's worth of work and is joined as usual; the step that started them
+// then fails, and process_file turns a cancelled request into TIMED_OUT.
+// Setting the flag is async-signal-safe, so the -timebound alarm can do it.
+namespace Cancellation {
+extern std::atomic<bool> requested_flag;
+
+inline bool requested() {
+    return requested_flag.load(std::memory_order_relaxed);
+}
+inline void request() {
+    requested_flag.store(true, std::memory_order_relaxed);
+}
+}
+#endif
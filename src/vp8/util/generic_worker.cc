@@ -18,10 +18,12 @@
 #include <linux/seccomp.h>
 #include <sys/prctl.h>
 #include <sys/syscall.h>
-
+#include <sched.h>
+#include <stdio.h>
 #endif
 #include <signal.h>
 #include "generic_worker.hh"
+#include "perf_counters.hh"
 #include "../../io/Seccomp.hh"
 /**
  * A Crossplatform-ish pause function.
@@ -54,6 +56,92 @@ void kill_workers(void * workers, uint64_t num_workers) {
     }
 }
 
+#ifdef __linux__
+namespace {
+// parses a sysfs cpu list such as "0-7,16-23" into a cpu set
+bool parse_cpu_list(const char *path, cpu_set_t *cpus) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return false;
+    }
+    CPU_ZERO(cpus);
+    bool any = false;
+    unsigned int first = 0, last = 0;
+    while (fscanf(fp, "%u", &first) == 1) {
+        last = first;
+        int sep = fgetc(fp);
+        if (sep == '-') {
+            if (fscanf(fp, "%u", &last) != 1) {
+                break;
+            }
+            sep = fgetc(fp);
+        }
+        for (unsigned int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+            CPU_SET(cpu, cpus);
+            any = true;
+        }
+        if (sep != ',') {
+            break;
+        }
+    }
+    fclose(fp);
+    return any;
+}
+}
+#endif
+
+int pin_to_shared_cache_domain() {
+#ifdef __linux__
+    unsigned int cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        return -1;
+    }
+    // find the last-level cache by its level rather than trusting the index:
+    // many VMs, containers and ARM parts expose no L3 at all
+    int llc_index = -1;
+    unsigned int llc_level = 0;
+    for (int index = 0; index < 16; ++index) {
+        char path[128];
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%u/cache/index%d/level", cpu, index);
+        FILE *fp = fopen(path, "r");
+        if (!fp) {
+            break;
+        }
+        unsigned int level = 0;
+        if (fscanf(fp, "%u", &level) == 1 && level > llc_level) {
+            llc_level = level;
+            llc_index = index;
+        }
+        fclose(fp);
+    }
+    cpu_set_t cpus;
+    bool found = false;
+    if (llc_level >= 3) {
+        char path[128];
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%u/cache/index%d/shared_cpu_list", cpu, llc_index);
+        found = parse_cpu_list(path, &cpus);
+    }
+    if (!found) {
+        // a private L2 would put all the threads of the image on one core,
+        // so without a shared L3 keep them on the memory node instead
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+        found = parse_cpu_list(path, &cpus);
+    }
+    if (!found || CPU_COUNT(&cpus) < 2) {
+        return -1; // pinning would only serialise the threads
+    }
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+        return -1;
+    }
+    return (int)node;
+#else
+    return -1;
+#endif
+}
+
 GenericWorker * GenericWorker::get_n_worker_threads(unsigned int num_workers) {
     GenericWorker *retval = new GenericWorker[num_workers];
     //for (unsigned int i = 0;i < num_workers; ++i) {
@@ -91,6 +179,9 @@ void GenericWorker::_generic_respond_to_main(uint8_t arg) {
 #define THREAD_PACKET_SIZE (sizeof(void*) + 1)
 
 void GenericWorker::wait_for_work() {
+    if (g_thread_perf_counters) {
+        open_thread_perf_counters();
+    }
     if (g_use_seccomp) {
         Sirikata::installStrictSyscallFilter(true);
     }
@@ -315,6 +406,10 @@ void GenericWorker::_generic_wait(uint8_t expected_arg) {
         while (read(work_done_pipe[0], &data, 1) < 0 && errno == EINTR) {
         }
         if (data != expected_arg) {
+            if (custom_exit_status() != 0) {
+                // the worker called custom_exit: keep the reason it gave
+                custom_exit((ExitCode)custom_exit_status());
+            }
             char err[] = "x: Worker thread out of memory.\n";
             err[0] = '0' + expected_arg;
             while (write(2, err, strlen(err)) <0 && errno == EINTR) {
@@ -69,6 +69,12 @@ public:
 typedef std::atomic<int> xatomic;
 #endif
 int make_pipe(int pipes[2]);
+// Restricts the calling thread, and any worker threads it spawns afterwards,
+// to the cpus that share an L3 with the cpu it currently runs on, or to the
+// cpus of its NUMA node when sysfs shows no L3. The affinity is not undone,
+// so call it in the process that codes one image (a forked child).
+// Returns the NUMA node of those cpus, or -1 if the placement was not applied.
+int pin_to_shared_cache_domain();
 struct GenericWorker {
     bool child_begun;
     xatomic new_work_exists_;
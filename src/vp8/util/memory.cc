@@ -4,6 +4,7 @@
 
 #include "options.hh"
 #include "memory.hh"
+#include "cancellation.hh"
 #ifdef _WIN32
 #include <io.h>
 #else
@@ -22,6 +23,7 @@
 #define THREAD_LOCAL_STORAGE thread_local
 #endif
 unsigned int NUM_THREADS = MAX_NUM_THREADS;
+std::atomic<bool> Cancellation::requested_flag(false);
 const char *ExitString(ExitCode ec) {
   FOREACH_EXIT_CODE(GENERATE_EXIT_CODE_RETURN)
   static char data[] = "XXXX_EXIT_CODE_BEYOND_EXIT_CODE_ARRAY";
@@ -219,19 +221,31 @@ void reset_close_thread_handle() {
     l_emergency_close_signal = -1;
 }
 
+// The process reports the status of whichever thread exits last, which is
+// usually a worker that custom_exit told to stop, so a clean worker exit
+// passes on the status custom_exit was given.
+static std::atomic<int> process_exit_code(0);
 void custom_terminate_this_thread(uint8_t exit_code) {
     close_thread_handle();
+    if (exit_code == 0) {
+        exit_code = (uint8_t)process_exit_code.load();
+    }
 #ifdef __linux__
     syscall(SYS_exit, exit_code);
 #endif
 }
+int custom_exit_status() {
+    return process_exit_code.load();
+}
 void custom_exit(ExitCode exit_code) {
+    // a worker that already exited with this status has printed it
+    bool reported = process_exit_code.exchange((int)exit_code) == (int)exit_code;
     close_thread_handle();
     if (atexit_f) {
         (*atexit_f)(atexit_arg0, atexit_arg1);
         atexit_f = nullptr;
     }
-    if (exit_code != ExitCode::SUCCESS) {
+    if (exit_code != ExitCode::SUCCESS && !reported) {
         while(write(2, ExitString(exit_code), strlen(ExitString(exit_code))) < 0
             && errno == EINTR) {
         }
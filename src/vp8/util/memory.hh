@@ -36,6 +36,7 @@ extern bool g_use_seccomp;
     CB(ROUNDTRIP_FAILURE, 41)                   \
     CB(UNSUPPORTED_JPEG, 42)                    \
     CB(UNSUPPORTED_JPEG_WITH_ZERO_IDCT_0, 43)   \
+    CB(TIMED_OUT, 44)                           \
     CB(COULD_NOT_BIND_PORT, 127)                \
 
 #define MAKE_EXIT_CODE_ENUM(ITEM, VALUE) ITEM=VALUE,
@@ -69,6 +70,8 @@ void custom_exit(ExitCode::ExitCode_ exit_code);
 #endif
 #define always_assert(EXPR) always_assert_outer((EXPR), #EXPR, __FILE__, __LINE__)
 void custom_terminate_this_thread(uint8_t exit_code);
+// the status given to a custom_exit already under way, or 0
+int custom_exit_status();
 typedef void atexit_type(void*, uint64_t);
 void custom_atexit(atexit_type* atexit, void *arg0, uint64_t arg1);
 extern "C" {
@@ -0,0 +1,194 @@
+#include <string.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+#endif
+#include <errno.h>
+#include "perf_counters.hh"
+
+#define PERF_COUNTER_NAME_CB(Name) #Name,
+static const char *perf_counter_names[] = {
+    FOREACH_PERF_COUNTER(PERF_COUNTER_NAME_CB)
+};
+#undef PERF_COUNTER_NAME_CB
+
+const char *PerfCounters::name(PerfCounter counter) {
+    return perf_counter_names[(uint32_t)counter];
+}
+
+#ifdef __linux__
+namespace {
+// perf has no generic L2 event, so this is the raw event for L2 demand data
+// read misses of the cpus we know: L2_RQSTS.DEMAND_DATA_RD_MISS on Intel since
+// Haswell (taken to be the ones with avx2) and L2CacheReqStat.LsRdBlkC on AMD
+// Zen. 0 where it is unknown.
+uint64_t raw_l2_read_miss_event() {
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    unsigned int max_leaf = eax;
+    char vendor[13] = {0};
+    memcpy(vendor, &ebx, 4);
+    memcpy(vendor + 4, &edx, 4);
+    memcpy(vendor + 8, &ecx, 4);
+    if (strcmp(vendor, "GenuineIntel") == 0 && max_leaf >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        return (ebx & (1 << 5)) ? 0x2124 : 0;
+    }
+    if (strcmp(vendor, "AuthenticAMD") == 0) {
+        __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+        unsigned int family = ((eax >> 8) & 0xf) + ((eax >> 20) & 0xff);
+        return family >= 0x17 ? 0x0864 : 0;
+    }
+#endif
+    return 0;
+}
+
+// false if this cpu has no event for the counter
+bool describe(PerfCounter counter, perf_event_attr *attr) {
+    attr->type = PERF_TYPE_HARDWARE;
+    switch (counter) {
+      case PerfCounter::CYCLES:
+        attr->config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+      case PerfCounter::INSTRUCTIONS:
+        attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+      case PerfCounter::L1D_READ_MISSES:
+        attr->type = PERF_TYPE_HW_CACHE;
+        attr->config = PERF_COUNT_HW_CACHE_L1D
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+      case PerfCounter::L2_READ_MISSES:
+        attr->type = PERF_TYPE_RAW;
+        attr->config = raw_l2_read_miss_event();
+        return attr->config != 0;
+      case PerfCounter::LLC_READ_MISSES:
+        attr->type = PERF_TYPE_HW_CACHE;
+        attr->config = PERF_COUNT_HW_CACHE_LL
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+      case PerfCounter::BRANCH_MISSES:
+      default:
+        attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    }
+    return true;
+}
+}
+#endif
+
+PerfCounters::PerfCounters(bool inherit, bool start_counting) {
+    for (size_t i = 0; i < fds_.size(); ++i) {
+        fds_[i] = -1;
+#ifdef __linux__
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        if (!describe((PerfCounter)i, &attr)) {
+            continue;
+        }
+        attr.disabled = start_counting ? 0 : 1;
+        attr.inherit = inherit ? 1 : 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        long fd = syscall(__NR_perf_event_open, &attr, 0 /*this thread*/, -1 /*any cpu*/,
+                          -1 /*no group*/, 0);
+        fds_[i] = fd < 0 ? -1 : (int)fd;
+#else
+        (void)inherit;
+        (void)start_counting;
+#endif
+    }
+}
+
+PerfCounters::~PerfCounters() {
+#ifdef __linux__
+    for (size_t i = 0; i < fds_.size(); ++i) {
+        if (fds_[i] != -1) {
+            while (close(fds_[i]) < 0 && errno == EINTR) {
+            }
+        }
+    }
+#endif
+}
+
+bool PerfCounters::any_available() const {
+    for (size_t i = 0; i < fds_.size(); ++i) {
+        if (fds_[i] != -1) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void PerfCounters::reset_and_start() {
+#ifdef __linux__
+    for (size_t i = 0; i < fds_.size(); ++i) {
+        if (fds_[i] != -1) {
+            ioctl(fds_[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds_[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+void PerfCounters::stop() {
+#ifdef __linux__
+    for (size_t i = 0; i < fds_.size(); ++i) {
+        if (fds_[i] != -1) {
+            ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+#endif
+}
+
+PerfCounterValues PerfCounters::read() const {
+    PerfCounterValues retval;
+    retval.memset(0);
+#ifdef __linux__
+    for (size_t i = 0; i < fds_.size(); ++i) {
+        uint64_t value = 0;
+        if (fds_[i] != -1) {
+            ssize_t ret;
+            do {
+                ret = ::read(fds_[i], &value, sizeof(value));
+            } while (ret < 0 && errno == EINTR);
+            if (ret == (ssize_t)sizeof(value)) {
+                retval[i] = value;
+            }
+        }
+    }
+#endif
+    return retval;
+}
+
+#if defined(__APPLE__) || (__cplusplus <= 199711L && !defined(_WIN32))
+#define THREAD_LOCAL_STORAGE __thread
+#else
+#define THREAD_LOCAL_STORAGE thread_local
+#endif
+bool g_thread_perf_counters = false;
+static THREAD_LOCAL_STORAGE PerfCounters *thread_perf_counters = NULL;
+
+void open_thread_perf_counters() {
+    if (thread_perf_counters == NULL) {
+        thread_perf_counters = new PerfCounters(false, true);
+    }
+}
+
+const PerfCounters *read_thread_perf_counters(PerfCounterValues *values) {
+    if (thread_perf_counters != NULL) {
+        *values = thread_perf_counters->read();
+    }
+    return thread_perf_counters;
+}
@@ -0,0 +1,50 @@
+#ifndef PERF_COUNTERS_HH_
+#define PERF_COUNTERS_HH_
+#include <stdint.h>
+#include "nd_array.hh"
+
+#define FOREACH_PERF_COUNTER(CB)                \
+    CB(CYCLES)                                  \
+    CB(INSTRUCTIONS)                            \
+    CB(L1D_READ_MISSES)                         \
+    CB(L2_READ_MISSES)                          \
+    CB(LLC_READ_MISSES)                         \
+    CB(BRANCH_MISSES)
+
+#define PERF_COUNTER_ENUM_CB(Name) Name,
+enum class PerfCounter {
+    FOREACH_PERF_COUNTER(PERF_COUNTER_ENUM_CB)
+    NUM_PERF_COUNTERS
+};
+#undef PERF_COUNTER_ENUM_CB
+
+typedef Sirikata::Array1d<uint64_t, (uint32_t)PerfCounter::NUM_PERF_COUNTERS> PerfCounterValues;
+
+// Hardware counters opened with perf_event_open for the calling thread.
+// With inherit set, threads and processes it creates afterwards are counted too,
+// and their totals are folded in once they exit.
+// Counters the kernel or hardware refuses read as zero; on platforms without
+// perf_event_open every counter reads as zero.
+// Counters opened already counting can be read by a jailed thread, since
+// only reset_and_start and stop need a syscall beyond read.
+class PerfCounters {
+    Sirikata::Array1d<int, (uint32_t)PerfCounter::NUM_PERF_COUNTERS> fds_;
+public:
+    explicit PerfCounters(bool inherit, bool start_counting = false);
+    ~PerfCounters();
+    bool any_available() const;
+    void reset_and_start();
+    void stop();
+    PerfCounterValues read() const;
+    static const char *name(PerfCounter counter);
+};
+
+// set by -perfcounters before any worker thread starts
+extern bool g_thread_perf_counters;
+// Opens counters for the calling thread that count from now on;
+// worker threads call this before they jail themselves.
+void open_thread_perf_counters();
+// Reads the calling thread's counters and returns them, so samples from
+// different threads can be told apart; NULL if it never opened any.
+const PerfCounters *read_thread_perf_counters(PerfCounterValues *values);
+#endif
@@ -8,6 +8,8 @@ import os
 import uuid
 import argparse
 import zlib
+import tempfile
+import shutil
 base_dir = os.path.dirname(sys.argv[0])
 parser = argparse.ArgumentParser(description='Benchmark and test socket server for compression')
 parser.add_argument('files', metavar='N', type=str, nargs='*', default=[os.path.join(base_dir,
@@ -34,13 +36,22 @@ def read_all_sock(sock):
             pass
     return b''.join(datas)
 
-def test_compression(binary_name, socket_name = None, too_short_time_bound=False, is_zlib=False):
+def test_compression(binary_name, socket_name = None, too_short_time_bound=False, is_zlib=False,
+                     stats_name=None, cache_dir=None, unjailed=False, memory_budget=None):
     global jpg_name
     custom_name = socket_name is not None
     xargs = [binary_name,
              '-socket',
              '-timebound=10ms' if too_short_time_bound else '-timebound=50000ms',
              '-preload']
+    if stats_name is not None:
+        xargs.append('-statsocket=' + stats_name)
+    if cache_dir is not None:
+        xargs.append('-resultcache=' + cache_dir)
+    if unjailed:
+        xargs.append('-unjailed')
+    if memory_budget is not None:
+        xargs.append('-admitmemory=%d' % memory_budget)
     if socket_name is not None:
         xargs[1]+= '=' + socket_name
     if parsed_args.singlethread:
@@ -112,12 +123,76 @@ def test_compression(binary_name, socket_name = None, too_short_time_bound=False
                 break
 
         print ('yay',len(ojpg),len(dat),len(dat)/float(len(ojpg)), 'parent pid is ',proc.pid)
+        num_requests = 2
+        num_encodes = 1
+        if cache_dir is not None:
+            # the same requests again must be answered from the cache
+            for request, expected_result in ((jpg, dat), (dat, jpg)):
+                lepton_socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                lepton_socket.connect(socket_name)
+                lepton_socket.sendall(request)
+                lepton_socket.shutdown(socket.SHUT_WR)
+                result = read_all_sock(lepton_socket)
+                lepton_socket.close()
+                assert (result == expected_result)
+                num_requests += 1
+            assert (len(os.listdir(cache_dir)) == 2)
+        if memory_budget is not None:
+            # a budget below one request admits them one at a time, but
+            # every queued client must still be answered
+            results = [None] * 4
+            def queued_encoder(index):
+                queued_socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                queued_socket.connect(socket_name)
+                def send():
+                    queued_socket.sendall(jpg)
+                    queued_socket.shutdown(socket.SHUT_WR)
+                sender = threading.Thread(target=send)
+                sender.start()
+                results[index] = read_all_sock(queued_socket)
+                sender.join()
+                queued_socket.close()
+            clients = [threading.Thread(target=queued_encoder, args=(i,))
+                       for i in range(len(results))]
+            for client in clients:
+                client.start()
+            for client in clients:
+                client.join()
+            assert (all(result == dat for result in results))
+            num_requests += len(results)
+            num_encodes += len(results)
+        if stats_name is not None:
+            expected = 'lepton_requests_total{result="ok"} %d\n' % num_requests
+            for attempt in range(100):
+                stats_socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                stats_socket.connect(stats_name)
+                stats = read_all_sock(stats_socket).decode()
+                stats_socket.close()
+                if expected in stats:
+                    break
+                time.sleep(0.05) # the second worker may not be reaped yet
+            print (stats)
+            assert (expected in stats)
+            if cache_dir is not None:
+                assert ('lepton_result_cache_requests_total{result="hit"} 2\n' in stats)
+                assert ('lepton_result_cache_stored_total 2\n' in stats)
+            else:
+                assert ('lepton_bytes_in_total{direction="encode"} %d\n' % (len(jpg) * num_encodes) in stats)
+                assert ('lepton_bytes_out_total{direction="decode"} %d\n' % len(jpg) in stats)
+            if memory_budget is not None:
+                assert ('lepton_memory_budget_bytes %d\n' % (memory_budget * 1024 * 1024) in stats)
+                assert ('lepton_predicted_memory_bytes ' in stats)
+            # jailed workers cannot read the clock to time their stages
+            assert (('lepton_stage_seconds_count{stage="TS_DONE"} %d\n' % num_requests in stats)
+                    == unjailed)
 
     finally:
         proc.terminate()
         proc.wait()
 
     assert (not os.path.exists(socket_name))
+    if stats_name is not None:
+        assert (not os.path.exists(stats_name))
 
 has_avx2 = False
 try:
@@ -135,6 +210,19 @@ if not parsed_args.benchmark:
     test_compression('./lepton', is_zlib=True)
     test_compression('./lepton', '/tmp/' + str(uuid.uuid4()))
     test_compression('./lepton', '/tmp/' + str(uuid.uuid4()), is_zlib=True)
+    test_compression('./lepton', '/tmp/' + str(uuid.uuid4()),
+                     stats_name='/tmp/' + str(uuid.uuid4()) + '.stats')
+    test_compression('./lepton', '/tmp/' + str(uuid.uuid4()),
+                     stats_name='/tmp/' + str(uuid.uuid4()) + '.stats', unjailed=True)
+    cache_dir = tempfile.mkdtemp()
+    try:
+        test_compression('./lepton', '/tmp/' + str(uuid.uuid4()),
+                         stats_name='/tmp/' + str(uuid.uuid4()) + '.stats',
+                         cache_dir=cache_dir)
+    finally:
+        shutil.rmtree(cache_dir)
+    test_compression('./lepton', '/tmp/' + str(uuid.uuid4()),
+                     stats_name='/tmp/' + str(uuid.uuid4()) + '.stats', memory_budget=1)
 
 
     ok = False
@@ -0,0 +1,24 @@
+#!/bin/sh
+export IMAGES="`dirname $0`"/../images
+export A=`mktemp`
+export OUT=`mktemp`
+export RT=`mktemp`
+# 333333 does not divide either file, so the last slice is a short remainder
+for f in iphone:512K slrhills:333333; do
+    cp -- "$IMAGES/${f%%:*}.jpg" "$A"
+    ./lepton -chunksize=${f#*:} "$A" "$OUT" || exit 1
+    : > "$RT"
+    for chunk in "$OUT".*; do
+        ./lepton - < "$chunk" >> "$RT" || exit 1
+    done
+    diff "$A" "$RT" || exit 1
+    rm -f -- "$OUT".*
+done
+# later slices would start inside a progressive scan
+cp -- "$IMAGES/iphoneprogressive.jpg" "$A"
+./lepton -allowprogressive -chunksize=32768 "$A" "$OUT"
+if [ $? -ne 8 ]; then
+    exit 1
+fi
+rm -f -- "$A" "$OUT" "$OUT".* "$RT"
+echo SUCCESS
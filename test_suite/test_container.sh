@@ -0,0 +1,32 @@
+#!/bin/sh
+export A=`mktemp`
+export IMAGES="`dirname $0`"/../images
+export OUT=`mktemp`
+export RT=`mktemp`
+printf 'container header\n' > "$A"
+cat "$IMAGES"/iphone.jpg >> "$A"
+head -c 5000 "$IMAGES"/slrhills.jpg >> "$A"
+cat "$IMAGES"/android.jpg >> "$A"
+printf 'container trailer\n' >> "$A"
+./lepton -container "$A" "$OUT" || exit 1
+./lepton - < "$OUT" > "$RT" || exit 1
+diff "$A" "$RT" || exit 1
+./lepton -container=3 "$A" "$RT" || exit 1
+cmp "$OUT" "$RT" || exit 1
+# a progressive jpeg after a baseline one: the decoder starts it over
+cat "$IMAGES"/iphone.jpg "$IMAGES"/iphoneprogressive.jpg > "$A"
+./lepton -container "$A" "$OUT" || exit 1
+./lepton - < "$OUT" > "$RT" || exit 1
+cmp "$A" "$RT" || exit 1
+./lepton -singlethread - < "$OUT" > "$RT" || exit 1
+cmp "$A" "$RT" || exit 1
+# a multi-picture file such as an MPO: a plain encode compresses the trailing
+# jpeg as -container does instead of keeping it in the header
+cat "$IMAGES"/iphone.jpg "$IMAGES"/android.jpg > "$A"
+./lepton "$A" "$OUT" || exit 1
+./lepton -container "$A" "$RT" || exit 1
+cmp "$OUT" "$RT" || exit 1
+./lepton "$OUT" "$RT" || exit 1
+cmp "$A" "$RT" || exit 1
+rm -f -- "$A" "$OUT" "$RT"
+echo SUCCESS
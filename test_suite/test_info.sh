@@ -0,0 +1,24 @@
+#!/bin/sh
+export IMAGES="`dirname $0`"/../images
+export OUT=`mktemp`
+export JPG=`mktemp`
+# the fields of a known file, and the size of the jpeg it decodes to
+./lepton -info "$IMAGES/iphone16.lep" > "$OUT" || exit 1
+grep -q '"version":1,' "$OUT" || exit 1
+grep -q '"jpeg_size":2236391,' "$OUT" || exit 1
+grep -q '"thread_segments":\[{"luma_y_start":0,"segment_size":132268},{"luma_y_start":20,"segment_size":144730},{"luma_y_start":42,"segment_size":132252},{"luma_y_start":60,"segment_size":138859},{"luma_y_start":78,"segment_size":134963},{"luma_y_start":94,"segment_size":144387},{"luma_y_start":110,"segment_size":137677},{"luma_y_start":128,"segment_size":130267},{"luma_y_start":146,"segment_size":142376},{"luma_y_start":164,"segment_size":142400},{"luma_y_start":182,"segment_size":134444},{"luma_y_start":202,"segment_size":145938},{"luma_y_start":224,"segment_size":141050},{"luma_y_start":244,"segment_size":135673},{"luma_y_start":264,"segment_size":136529},{"luma_y_start":284,"segment_size":145597}\],' "$OUT" || exit 1
+./lepton "$IMAGES/iphone16.lep" "$JPG" || exit 1
+[ `wc -c < "$JPG"` -eq 2236391 ] || exit 1
+# a file that is not a lepton file gets an error line and the batch goes on
+./lepton -info "$IMAGES/iphone16.lep" "$IMAGES/iphone.jpg" "$IMAGES/missing.lep" \
+    "$IMAGES/iphone16.lep" > "$OUT"
+if [ $? -eq 0 ]; then
+    exit 1
+fi
+[ `wc -l < "$OUT"` -eq 4 ] || exit 1
+[ "`sed -n 2p "$OUT"`" = "{\"file\":\"$IMAGES/iphone.jpg\",\"error\":\"VERSION_UNSUPPORTED\"}" ] || exit 1
+[ "`sed -n 3p "$OUT"`" = "{\"file\":\"$IMAGES/missing.lep\",\"error\":\"FILE_NOT_FOUND\"}" ] || exit 1
+[ "`sed -n 1p "$OUT"`" = "`sed -n 4p "$OUT"`" ] || exit 1
+grep -q '"jpeg_size":2236391,' "$OUT" || exit 1
+rm -f -- "$OUT" "$JPG"
+echo SUCCESS
@@ -0,0 +1,21 @@
+#!/bin/sh
+export A=`mktemp`
+export ASRC="`dirname $0`"/../images/iphone.jpg
+cp -- "$ASRC" "$A"
+export LEP=`mktemp`
+export STRIPPED=`mktemp`
+export RESTORED=`mktemp`
+export RT=`mktemp`
+./lepton "$A" "$LEP" || exit 1
+./lepton -stripmeta "$LEP" "$STRIPPED" || exit 1
+./lepton "$STRIPPED" "$RT" || exit 1
+if grep -q Exif "$RT"; then
+    exit 1
+fi
+./lepton -metadatafrom="$A" "$STRIPPED" "$RESTORED" || exit 1
+./lepton "$RESTORED" "$RT" || exit 1
+diff "$A" "$RT" || exit 1
+./lepton -stripmeta "$RESTORED" "$RT" || exit 1
+diff "$STRIPPED" "$RT" || exit 1
+rm -f -- "$A" "$LEP" "$STRIPPED" "$RESTORED" "$RT"
+echo SUCCESS
@@ -0,0 +1,49 @@
+#!/bin/sh
+export IMAGES="`dirname $0`"/../images
+export LEP=`mktemp`
+export OUT=`mktemp`
+export REF=`mktemp`
+export TRUNC=`mktemp`
+# checks $1 holds a $2 image of $3x$4 with $5 chroma planes, header and size
+check_pixels() {
+    if [ "$2" = rgb ]; then
+        [ "`head -n 3 "$1" | tr '\n' ' '`" = "P6 $3 $4 255 " ] || return 1
+        size=$((`head -n 3 "$1" | wc -c` + $3 * $4 * 3))
+    else
+        [ "`head -n 1 "$1"`" = "YUV4MPEG2 W$3 H$4 F1:1 Ip A1:1 C$5 XCOLORRANGE=FULL" ] || return 1
+        [ "`head -n 2 "$1" | tail -n 1 | head -c 5`" = FRAME ] || return 1
+        case $5 in
+            420jpeg) chroma=$(((($3 + 1) / 2) * (($4 + 1) / 2) * 2)) ;;
+            422) chroma=$(((($3 + 1) / 2) * $4 * 2)) ;;
+            444) chroma=$(($3 * $4 * 2)) ;;
+            mono) chroma=0 ;;
+        esac
+        size=$((`head -n 1 "$1" | wc -c` + 6 + $3 * $4 + chroma))
+    fi
+    [ `wc -c < "$1"` -eq $size ]
+}
+# 4:2:0, 2x1 and grayscale sampling, and a progressive 4:4:4 image
+for f in iphone:3264:2448:420jpeg slrhills:4608:3456:422 grayscale:3264:2448:mono \
+         iphoneprogressive:1023:663:444; do
+    name=${f%%:*}
+    dims=${f#*:}
+    w=${dims%%:*}
+    dims=${dims#*:}
+    h=${dims%%:*}
+    sampling=${dims#*:}
+    ./lepton -allowprogressive "$IMAGES/$name.jpg" "$LEP" || exit 1
+    # cut the .lep inside the coded rows; the rest of the image comes out grey
+    head -c $((`wc -c < "$LEP"` / 2)) "$LEP" > "$TRUNC"
+    for p in rgb ycbcr; do
+        ./lepton -pixels=$p "$LEP" "$OUT" || exit 1
+        check_pixels "$OUT" $p $w $h $sampling || exit 1
+        if [ -x ./lepton-scalar ]; then
+            ./lepton-scalar -pixels=$p "$LEP" "$REF" || exit 1
+            cmp "$OUT" "$REF" || exit 1
+        fi
+        ./lepton -pixels=$p "$TRUNC" "$OUT" || exit 1
+        check_pixels "$OUT" $p $w $h $sampling || exit 1
+    done
+done
+rm -f -- "$LEP" "$OUT" "$REF" "$TRUNC"
+echo SUCCESS
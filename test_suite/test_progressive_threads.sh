@@ -0,0 +1,16 @@
+#!/bin/sh
+export DIR=`mktemp -d`
+export IMAGES="`dirname $0`"/../images
+for f in iphoneprogressive iphoneprogressive2 androidprogressive; do
+    ./lepton -allowprogressive -minencodethreads=4 "$IMAGES/$f.jpg" "$DIR/$f.lep" || exit 1
+    ./lepton -allowprogressive "$DIR/$f.lep" "$DIR/$f.jpg" || exit 1
+    cmp "$IMAGES/$f.jpg" "$DIR/$f.jpg" || exit 1
+done
+# the thread count picked per image must still decode to the same bytes
+for f in iphone iphoneprogressive; do
+    ./lepton -allowprogressive -adaptivethreads "$IMAGES/$f.jpg" "$DIR/$f.lep" || exit 1
+    ./lepton -allowprogressive "$DIR/$f.lep" "$DIR/$f.jpg" || exit 1
+    cmp "$IMAGES/$f.jpg" "$DIR/$f.jpg" || exit 1
+done
+rm -rf -- "$DIR"
+echo SUCCESS
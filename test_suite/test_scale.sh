@@ -0,0 +1,31 @@
+#!/bin/sh
+export IMAGES="`dirname $0`"/../images
+export LEP=`mktemp`
+export OUT=`mktemp`
+export RELEP=`mktemp`
+export RT=`mktemp`
+# 4:2:0, 2x1 and grayscale sampling, and a progressive 4:4:4 image
+for f in iphone:3264:2448 slrhills:4608:3456 grayscale:3264:2448 iphoneprogressive:1023:663; do
+    name=${f%%:*}
+    dims=${f#*:}
+    w=${dims%%:*}
+    h=${dims#*:}
+    ./lepton -allowprogressive "$IMAGES/$name.jpg" "$LEP" || exit 1
+    components=`./lepton -info "$LEP" | grep -o '"components":[^]]*]'`
+    for d in 2 4 8; do
+        ./lepton -scale=1/$d "$LEP" "$OUT" || exit 1
+        # a valid baseline jpeg lepton can compress and restore exactly
+        ./lepton "$OUT" "$RELEP" || exit 1
+        ./lepton "$RELEP" "$RT" || exit 1
+        cmp "$OUT" "$RT" || exit 1
+        info=`./lepton -info "$RELEP"`
+        echo "$info" | grep -q "\"width\":$((($w + $d - 1) / $d)),\"height\":$((($h + $d - 1) / $d)),\"precision\":8,\"sof\":\"0xc0\",\"progressive\":false," || exit 1
+        [ "`echo "$info" | grep -o '"components":[^]]*]'`" = "$components" ] || exit 1
+    done
+done
+./lepton -scale=1/3 "$LEP" "$OUT"
+if [ $? -ne 1 ]; then
+    exit 1
+fi
+rm -f -- "$LEP" "$OUT" "$RELEP" "$RT"
+echo SUCCESS
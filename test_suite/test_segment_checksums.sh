@@ -0,0 +1,35 @@
+#!/bin/sh
+export DIR=`mktemp -d`
+export IMAGES="`dirname $0`"/../images
+for f in iphone slrhills; do
+    ./lepton -segmentchecksums "$IMAGES/$f.jpg" "$DIR/$f.lep" || exit 1
+    ./lepton -info "$DIR/$f.lep" | grep -q '"crc32c"' || exit 1
+    ./lepton "$DIR/$f.lep" "$DIR/$f.jpg" || exit 1
+    ./lepton -singlethread "$DIR/$f.lep" "$DIR/$f.1.jpg" || exit 1
+    cmp "$IMAGES/$f.jpg" "$DIR/$f.jpg" || exit 1
+    cmp "$IMAGES/$f.jpg" "$DIR/$f.1.jpg" || exit 1
+done
+# flip a bit of the first stored checksum: every decode must stop with
+# STREAM_INCONSISTENT (7), whichever thread finds the mismatch
+python3 - "$DIR/iphone.lep" "$DIR/bad.lep" <<'EOF_TAMPER' || exit 1
+import struct, sys, zlib
+data = open(sys.argv[1], 'rb').read()
+size = struct.unpack('<I', data[24:28])[0]
+header = bytearray(zlib.decompress(data[28:28 + size]))
+crc = header.find(b'CRC', 7 + struct.unpack('<I', header[3:7])[0])
+assert crc > 0
+header[crc + 7] ^= 1
+packed = zlib.compress(bytes(header))
+out = data[:24] + struct.pack('<I', len(packed)) + packed + data[28 + size:-4]
+open(sys.argv[2], 'wb').write(out + struct.pack('<I', len(out) + 4))
+EOF_TAMPER
+./lepton "$DIR/bad.lep" "$DIR/bad.jpg"
+if [ $? -ne 7 ]; then
+    exit 1
+fi
+./lepton -singlethread "$DIR/bad.lep" "$DIR/bad.1.jpg"
+if [ $? -ne 7 ]; then
+    exit 1
+fi
+rm -rf -- "$DIR"
+echo SUCCESS
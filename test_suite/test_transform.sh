@@ -0,0 +1,41 @@
+#!/bin/sh
+export IMAGES="`dirname $0`"/../images
+export LEP=`mktemp`
+export A=`mktemp`
+export B=`mktemp`
+export REF=`mktemp`
+export OUT=`mktemp`
+# 4:2:0, 2x1 and grayscale sampling; the huffman coding is rebuilt, so
+# only the pixels have to come back
+for f in iphone:3264:2448 slrhills:4608:3456 grayscale:3264:2448; do
+    name=${f%%:*}
+    dims=${f#*:}
+    w=${dims%%:*}
+    h=${dims#*:}
+    ./lepton "$IMAGES/$name.jpg" "$LEP" || exit 1
+    ./lepton -pixels=rgb "$LEP" "$REF" || exit 1
+    # rot90 four times
+    cp -- "$LEP" "$A"
+    for i in 1 2 3 4; do
+        ./lepton -transform=rot90 "$A" "$B" || exit 1
+        if [ $i -eq 1 ]; then
+            ./lepton -info "$B" | grep -q "\"width\":$h,\"height\":$w," || exit 1
+        fi
+        mv -- "$B" "$A"
+    done
+    ./lepton -pixels=rgb "$A" "$OUT" || exit 1
+    cmp "$REF" "$OUT" || exit 1
+    # rot90 then rot270
+    ./lepton -transform=rot90 "$LEP" "$A" || exit 1
+    ./lepton -transform=rot270 "$A" "$B" || exit 1
+    ./lepton -pixels=rgb "$B" "$OUT" || exit 1
+    cmp "$REF" "$OUT" || exit 1
+done
+# 1023x663 leaves partial MCUs on the right and bottom edges: UNSUPPORTED_JPEG
+./lepton -allowprogressive "$IMAGES/iphoneprogressive.jpg" "$LEP" || exit 1
+./lepton -transform=rot90 "$LEP" "$A"
+if [ $? -ne 42 ]; then
+    exit 1
+fi
+rm -f -- "$LEP" "$A" "$B" "$REF" "$OUT"
+echo SUCCESS
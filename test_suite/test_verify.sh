@@ -0,0 +1,25 @@
+#!/bin/sh
+export DIR=`mktemp -d`
+export IMAGES="`dirname $0`"/../images
+cp -- "$IMAGES"/iphone.jpg "$IMAGES"/iphoneprogressive.jpg "$IMAGES"/gray2sf.jpg "$DIR" || exit 1
+for f in iphone iphoneprogressive gray2sf; do
+    ./lepton "$DIR/$f.jpg" "$DIR/$f.lep" || exit 1
+done
+./lepton "$DIR/iphone.jpg" "$DIR/iphone.jpg.lep" || exit 1
+# the sums of the jpegs check both x.lep and x.jpg.lep
+(cd "$DIR" && md5sum *.jpg) > "$DIR/sums" || exit 1
+(cd "$DIR" && "$OLDPWD"/lepton -verifybatch=2 -verifysums=sums iphone.lep iphoneprogressive.lep gray2sf.lep iphone.jpg.lep) || exit 1
+(cd "$DIR" && "$OLDPWD"/lepton -verifybatch -verifysums=sums iphone.lep) || exit 1
+# a file decoding to other bytes than its sum says must fail
+cp -- "$IMAGES"/iphone.jpg "$DIR/gray2sf.jpg" || exit 1
+(cd "$DIR" && md5sum gray2sf.jpg) > "$DIR/sums" || exit 1
+if (cd "$DIR" && "$OLDPWD"/lepton -verifybatch -verifysums=sums gray2sf.lep); then
+    exit 1
+fi
+# -verify stays the -validate alias: it encodes a jpeg and decodes a .lep
+./lepton -verify "$IMAGES/iphone.jpg" "$DIR/validated.lep" || exit 1
+cmp "$DIR/iphone.lep" "$DIR/validated.lep" || exit 1
+./lepton -verify "$DIR/validated.lep" "$DIR/validated.jpg" || exit 1
+cmp "$IMAGES/iphone.jpg" "$DIR/validated.jpg" || exit 1
+rm -rf -- "$DIR"
+echo SUCCESS